@@ -0,0 +1,150 @@
+/*
+** Lua host running the fs-extra benchmark drivers.
+** usage: eli_fs_extra_bench script.lua [args...]
+**
+** eli.fs.extra is preloaded and a `bench` table is provided with
+**   now_ns() - monotonic clock in nanoseconds,
+**   alloc() - { bytes, count, current, peak } of the Lua allocator,
+** so drivers can report latencies and bytes allocated without
+** depending on os.clock() resolution.
+*/
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+int luaopen_eli_fs_extra(lua_State *L);
+
+typedef struct bench_alloc {
+	size_t bytes; /* allocated in total */
+	size_t count;
+	size_t current;
+	size_t peak;
+} bench_alloc;
+
+static bench_alloc allocs;
+
+static void *_counting_alloc(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+	(void)ud;
+	if (ptr == NULL) {
+		osize = 0; /* osize encodes object type for new blocks */
+	}
+	if (nsize == 0) {
+		free(ptr);
+		allocs.current -= osize;
+		return NULL;
+	}
+	void *res = realloc(ptr, nsize);
+	if (res == NULL) {
+		return NULL;
+	}
+	if (nsize > osize) {
+		allocs.bytes += nsize - osize;
+	}
+	allocs.count++;
+	allocs.current += nsize - osize;
+	if (allocs.current > allocs.peak) {
+		allocs.peak = allocs.current;
+	}
+	return res;
+}
+
+static int bench_now_ns(lua_State *L)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	lua_pushinteger(L, (lua_Integer)ts.tv_sec * 1000000000 + ts.tv_nsec);
+	return 1;
+}
+
+static int bench_alloc_info(lua_State *L)
+{
+	lua_createtable(L, 0, 4);
+	lua_pushinteger(L, (lua_Integer)allocs.bytes);
+	lua_setfield(L, -2, "bytes");
+	lua_pushinteger(L, (lua_Integer)allocs.count);
+	lua_setfield(L, -2, "count");
+	lua_pushinteger(L, (lua_Integer)allocs.current);
+	lua_setfield(L, -2, "current");
+	lua_pushinteger(L, (lua_Integer)allocs.peak);
+	lua_setfield(L, -2, "peak");
+	return 1;
+}
+
+static const struct luaL_Reg bench_funcs[] = {
+	{ "now_ns", bench_now_ns },
+	{ "alloc", bench_alloc_info },
+	{ NULL, NULL },
+};
+
+static int _traceback(lua_State *L)
+{
+	luaL_traceback(L, L, lua_tostring(L, 1), 1);
+	return 1;
+}
+
+/*
+** Makes modules next to the script (bench/common.lua) requirable.
+*/
+static void _add_script_dir(lua_State *L, const char *script)
+{
+	const char *slash = strrchr(script, '/');
+	lua_getglobal(L, "package");
+	if (slash == NULL) {
+		lua_pushliteral(L, "./?.lua;");
+	} else {
+		lua_pushlstring(L, script, (size_t)(slash - script));
+		lua_pushliteral(L, "/?.lua;");
+		lua_concat(L, 2);
+	}
+	lua_getfield(L, -2, "path");
+	lua_concat(L, 2);
+	lua_setfield(L, -2, "path");
+	lua_pop(L, 1);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s script.lua [args...]\n", argv[0]);
+		return 2;
+	}
+	lua_State *L = lua_newstate(_counting_alloc, NULL);
+	if (L == NULL) {
+		fprintf(stderr, "%s: cannot create Lua state\n", argv[0]);
+		return 1;
+	}
+	luaL_openlibs(L);
+	/* preloaded rather than required, so scripts can open it again */
+	luaL_getsubtable(L, LUA_REGISTRYINDEX, LUA_PRELOAD_TABLE);
+	lua_pushcfunction(L, luaopen_eli_fs_extra);
+	lua_setfield(L, -2, "eli.fs.extra");
+	lua_pop(L, 1);
+	luaL_newlib(L, bench_funcs);
+	lua_setglobal(L, "bench");
+	_add_script_dir(L, argv[1]);
+
+	lua_createtable(L, argc - 2, 1);
+	for (int i = 1; i < argc; i++) {
+		lua_pushstring(L, argv[i]);
+		lua_rawseti(L, -2, i - 1);
+	}
+	lua_setglobal(L, "arg");
+
+	int status = luaL_loadfile(L, argv[1]);
+	if (status == LUA_OK) {
+		lua_pushcfunction(L, _traceback);
+		lua_insert(L, -2);
+		status = lua_pcall(L, 0, 0, -2);
+	}
+	if (status != LUA_OK) {
+		fprintf(stderr, "%s\n", lua_tostring(L, -1));
+	}
+	lua_close(L);
+	return status == LUA_OK ? 0 : 1;
+}
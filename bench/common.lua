@@ -0,0 +1,142 @@
+-- Helpers shared by the benchmark drivers: clock, latency statistics,
+-- JSON lines output and synthetic tree generation.
+-- Run drivers through eli_fs_extra_bench to get nanosecond timing and
+-- allocation counts, other hosts fall back to os.clock() and report
+-- alloc_bytes as null.
+local fs = require "eli.fs.extra"
+
+local common = {}
+
+local host = rawget(_G, "bench")
+
+function common.now_ns()
+	if host then return host.now_ns() end
+	return math.floor(os.clock() * 1e9)
+end
+
+local function alloc_bytes()
+	if host then return host.alloc().bytes end
+end
+
+local function json_value(v)
+	if v == nil then return "null" end
+	if type(v) == "string" then return string.format("%q", v) end
+	if math.type(v) == "float" then return string.format("%.3f", v) end
+	return tostring(v)
+end
+
+-- prints fields as one JSON object, keys in the given order
+function common.emit(fields, order)
+	local parts = {}
+	for _, key in ipairs(order) do
+		parts[#parts + 1] = string.format("%q:%s", key, json_value(fields[key]))
+	end
+	print("{" .. table.concat(parts, ",") .. "}")
+	io.stdout:flush()
+end
+
+local function percentile(sorted, p)
+	if #sorted == 0 then return 0 end
+	local idx = math.max(1, math.ceil(#sorted * p))
+	return sorted[idx]
+end
+
+local result_order = { "case", "ops", "ops_s", "p50_us", "p99_us", "max_us", "alloc_bytes", "alloc_per_op" }
+
+-- Calls fn(i) for i = 1..ops timing every call and prints
+-- { case, ops, ops_s, p50_us, p99_us, max_us, alloc_bytes, alloc_per_op }
+-- followed by extra fields.
+function common.measure(case, ops, fn, extra)
+	-- filled up front so growing it does not show up in alloc_bytes
+	local latencies = {}
+	for i = 1, ops do latencies[i] = 0 end
+	collectgarbage("collect")
+	local alloc_before = alloc_bytes()
+	local started = common.now_ns()
+	for i = 1, ops do
+		local t = common.now_ns()
+		fn(i)
+		latencies[i] = common.now_ns() - t
+	end
+	local elapsed = math.max(common.now_ns() - started, 1)
+	local alloc_after = alloc_bytes()
+	table.sort(latencies)
+	local fields = {
+		case = case,
+		ops = ops,
+		ops_s = ops / (elapsed / 1e9),
+		p50_us = percentile(latencies, 0.5) / 1e3,
+		p99_us = percentile(latencies, 0.99) / 1e3,
+		max_us = latencies[#latencies] / 1e3,
+	}
+	if alloc_before then
+		fields.alloc_bytes = alloc_after - alloc_before
+		fields.alloc_per_op = fields.alloc_bytes / ops
+	end
+	local order = { table.unpack(result_order) }
+	for key, value in pairs(extra or {}) do
+		fields[key] = value
+		order[#order + 1] = key
+	end
+	common.emit(fields, order)
+	return fields
+end
+
+function common.remove_tree(dir)
+	os.execute("rm -rf '" .. dir:gsub("'", "'\\''") .. "'")
+end
+
+-- n empty files f1..fn directly in dir, created in batches
+function common.flat_tree(dir, n)
+	assert(fs.mkdir(dir))
+	local batch = {}
+	for i = 1, n do
+		batch[#batch + 1] = dir .. "/f" .. i
+		if #batch == 10000 or i == n then
+			assert(fs.touch_many(batch, nil, { create = true }))
+			batch = {}
+		end
+	end
+end
+
+-- chain of depth directories, every level holding width files
+function common.deep_tree(dir, depth, width)
+	local paths = {}
+	local current = dir
+	for level = 1, depth do
+		assert(fs.mkdir(current))
+		for i = 1, width do
+			paths[#paths + 1] = current .. "/f" .. i
+		end
+		current = current .. "/d" .. level
+	end
+	assert(fs.touch_many(paths, nil, { create = true }))
+	return paths
+end
+
+-- n files of size bytes spread over subdirectories of 1000 files
+function common.small_files(dir, n, size)
+	assert(fs.mkdir(dir))
+	local data = string.rep("x", size)
+	local paths = {}
+	for i = 1, n do
+		local sub = dir .. "/s" .. (i // 1000)
+		if i == 1 or i % 1000 == 0 then fs.mkdir(sub) end
+		local path = sub .. "/f" .. i
+		local f = assert(io.open(path, "wb"))
+		f:write(data)
+		f:close()
+		paths[#paths + 1] = path
+	end
+	return paths
+end
+
+-- file of size bytes with a single written byte at its end
+function common.sparse_file(path, size)
+	local f = assert(io.open(path, "wb"))
+	f:seek("set", size - 1)
+	f:write("\0")
+	f:close()
+end
+
+return common
@@ -0,0 +1,60 @@
+-- Compares O_DIRECT streaming (open_direct) with buffered io for large files.
+-- usage: eli_fs_extra_bench direct_io.lua [dir] [size_mb] [chunk_kb]
+local fs = require "eli.fs.extra"
+local common = require "common"
+
+local dir = arg[1] or "."
+local size_mb = tonumber(arg[2]) or 256
+local chunk = (tonumber(arg[3]) or 1024) * 1024
+
+local chunk_data = string.rep("x", chunk)
+local chunks = size_mb * 1024 * 1024 // chunk
+
+local function measure(name, fn)
+	local started, wall = os.clock(), common.now_ns()
+	fn()
+	local cpu = os.clock() - started
+	local elapsed = math.max((common.now_ns() - wall) / 1e9, cpu, 1e-9)
+	common.emit({ case = name, size_mb = size_mb, chunk = chunk, mb_s = size_mb / elapsed, cpu_s = cpu },
+		{ "case", "size_mb", "chunk", "mb_s", "cpu_s" })
+end
+
+local buffered_path = dir .. "/direct_io.buffered"
+local direct_path = dir .. "/direct_io.direct"
+
+measure("buffered_write", function()
+	local f = assert(io.open(buffered_path, "wb"))
+	for _ = 1, chunks do f:write(chunk_data) end
+	f:close()
+end)
+
+measure("direct_write", function()
+	local f = assert(fs.open_direct(direct_path, "w", { chunk_size = chunk }))
+	if not f:is_direct() then io.stderr:write("O_DIRECT not supported here, fell back to buffered\n") end
+	for _ = 1, chunks do f:write(chunk_data) end
+	f:close()
+end)
+
+measure("buffered_read", function()
+	local f = assert(io.open(buffered_path, "rb"))
+	while f:read(chunk) do end
+	f:close()
+end)
+
+measure("direct_read", function()
+	local f = assert(fs.open_direct(direct_path, "r", { chunk_size = chunk }))
+	while f:read() do end
+	f:close()
+end)
+
+measure("direct_copy", function()
+	local src = assert(fs.open_direct(direct_path, "r", { chunk_size = chunk }))
+	local dst = assert(fs.open_direct(direct_path .. ".copy", "w", { chunk_size = chunk }))
+	src:read_into(dst)
+	src:close()
+	dst:close()
+end)
+
+os.remove(buffered_path)
+os.remove(direct_path)
+os.remove(direct_path .. ".copy")
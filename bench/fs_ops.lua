@@ -0,0 +1,84 @@
+-- Baselines of the per-call fs-extra hot paths.
+-- usage: eli_fs_extra_bench fs_ops.lua [dir] [flat_entries] [ops]
+--   dir - where the synthetic trees are generated (default $TMPDIR or /tmp)
+--   flat_entries - entries of the flat directory (default 1000000)
+--   ops - calls measured per single-path case (default 100000)
+-- Prints one JSON object per case.
+local fs = require "eli.fs.extra"
+local common = require "common"
+
+local base = (arg[1] or os.getenv("TMPDIR") or "/tmp") .. "/eli_fs_extra_bench." .. os.time()
+local flat_entries = tonumber(arg[2]) or 1000000
+local ops = tonumber(arg[3]) or 100000
+
+assert(fs.mkdir(base))
+local ok, err = pcall(function()
+	local flat = base .. "/flat"
+	local started = common.now_ns()
+	common.flat_tree(flat, flat_entries)
+	common.emit({ case = "setup_flat", entries = flat_entries, seconds = (common.now_ns() - started) / 1e9 },
+		{ "case", "entries", "seconds" })
+	local deep = common.deep_tree(base .. "/deep", 64, 16)
+	local small = common.small_files(base .. "/small", math.min(ops, 10000), 512)
+	local sparse = base .. "/sparse"
+	common.sparse_file(sparse, 16 * 1024 * 1024 * 1024)
+
+	local dir_rounds = math.max(1, 10000000 // math.max(flat_entries, 1))
+	common.measure("read_dir", dir_rounds, function()
+		fs.read_dir(flat)
+	end, { entries = flat_entries })
+	common.measure("read_dir_entries", dir_rounds, function()
+		fs.read_dir(flat, true)
+	end, { entries = flat_entries })
+	common.measure("iter_dir", dir_rounds, function()
+		for _ in fs.iter_dir(flat) do end
+	end, { entries = flat_entries })
+	common.measure("iter_dir_entries", dir_rounds, function()
+		for _ in fs.iter_dir(flat, true) do end
+	end, { entries = flat_entries })
+
+	common.measure("file_info_small", ops, function(i)
+		fs.file_info(small[(i - 1) % #small + 1])
+	end)
+	common.measure("file_info_deep", ops, function(i)
+		fs.file_info(deep[(i - 1) % #deep + 1])
+	end, { depth = 64 })
+	common.measure("file_info_sparse", ops, function()
+		fs.file_info(sparse)
+	end)
+
+	local links = {}
+	for i = 1, math.min(ops, 1000) do
+		links[i] = base .. "/link" .. i
+		local _, link_err = fs.link(small[(i - 1) % #small + 1], links[i], true)
+		assert(link_err == nil, link_err)
+	end
+	common.measure("link_info", ops, function(i)
+		fs.link_info(links[(i - 1) % #links + 1])
+	end)
+
+	local lock_path = base .. "/lockfile"
+	local f = assert(io.open(lock_path, "w"))
+	common.measure("lock_file_handle", ops, function()
+		fs.unlock_file(assert(fs.lock_file(f, "w")))
+	end)
+	f:close()
+	common.measure("lock_file_path", ops, function()
+		fs.unlock_file(assert(fs.lock_file(lock_path, "w")))
+	end)
+	common.measure("lock_file_range", ops, function(i)
+		fs.unlock_file(assert(fs.lock_file(lock_path, "r", (i % 1024) * 4096, 4096)))
+	end)
+
+	local lock_dir = base .. "/lockdir"
+	assert(fs.mkdir(lock_dir))
+	common.measure("lock_dir", ops // 10, function()
+		fs.unlock_dir(assert(fs.lock_dir(lock_dir)))
+	end)
+
+	common.measure("chmod", ops, function(i)
+		fs.chmod(small[(i - 1) % #small + 1], i % 2 == 0 and 420 or 384)
+	end)
+end)
+common.remove_tree(base)
+assert(ok, err)
@@ -0,0 +1,477 @@
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "lerror.h"
+#include "lappend.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define APPEND_LOG_METATABLE "ELI_APPEND_LOG"
+
+#ifdef _WIN32
+
+int eli_open_append_log(lua_State *L)
+{
+	errno = ENOSYS; /* = "Function not implemented" */
+	return push_result(L, -1, "open_append_log is not supported on Windows");
+}
+
+int append_log_create_meta(lua_State *L)
+{
+	return 0;
+}
+
+#else
+
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/uio.h>
+
+#ifndef PIPE_BUF
+#define PIPE_BUF 4096
+#endif
+
+/*
+** Records are buffered in C and appended with one write per batch.
+** Batches up to PIPE_BUF bytes are written by a single O_APPEND write
+** and never interleave with other writers. Larger batches are written
+** under a short exclusive lock on the whole file, so cooperating
+** writers using the same log can not interleave either. If that lock
+** can not be taken nothing is written and the batch stays buffered.
+** A write failing halfway drops the rest of its batch: appended later
+** it would land after other writers' data. The error tells how much of
+** the batch was written.
+*/
+typedef struct efs_append_log {
+	int fd;
+	char *buf;
+	size_t len;
+	size_t cap;
+	size_t flush_bytes;
+	long flush_ms; /* 0 disables time based flushing */
+	int newline;
+	int sync;
+	double first_at; /* when the oldest buffered record arrived */
+	unsigned long long records;
+	unsigned long long bytes;
+	unsigned long long flushes;
+	unsigned long long locked_flushes;
+	unsigned long long short_writes;
+	size_t torn_written; /* of the last batch failing halfway */
+	size_t torn_total;
+} efs_append_log;
+
+static double _now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e3 + (double)ts.tv_nsec / 1e6;
+}
+
+static int _log_lock(int fd, short type)
+{
+#ifdef F_OFD_SETLKW
+	struct flock f;
+	memset(&f, 0, sizeof(f));
+	f.l_type = type;
+	f.l_whence = SEEK_SET;
+	int res;
+	while ((res = fcntl(fd, F_OFD_SETLKW, &f)) == -1 && errno == EINTR)
+		;
+	return res;
+#else
+	int res;
+	while ((res = flock(fd, type == F_UNLCK ? LOCK_UN : LOCK_EX)) == -1 &&
+	       errno == EINTR)
+		;
+	return res;
+#endif
+}
+
+/*
+** Writes iovecs completely. Returns bytes written, -1 with errno set if
+** nothing could be written.
+*/
+static ssize_t _writev_all(int fd, struct iovec *iov, int iovcnt)
+{
+	size_t done = 0;
+	while (iovcnt > 0) {
+		ssize_t n = writev(fd, iov, iovcnt > IOV_MAX ? IOV_MAX : iovcnt);
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return done > 0 ? (ssize_t)done : -1;
+		}
+		done += (size_t)n;
+		while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= (ssize_t)iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= (size_t)n;
+		}
+	}
+	return (ssize_t)done;
+}
+
+static int _log_reserve(efs_append_log *log, size_t len)
+{
+	if (log->len + len <= log->cap) {
+		return 0;
+	}
+	size_t cap = log->cap ? log->cap : 4096;
+	while (cap < log->len + len) {
+		cap *= 2;
+	}
+	char *buf = realloc(log->buf, cap);
+	if (buf == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	log->buf = buf;
+	log->cap = cap;
+	return 0;
+}
+
+/*
+** Flushes buffer followed by extra (a record too large to buffer).
+*/
+static int _log_flush(efs_append_log *log, const char *extra, size_t extra_len,
+		      int extra_newline)
+{
+	size_t total = log->len + extra_len + (extra_newline ? 1 : 0);
+	if (total == 0) {
+		return 0;
+	}
+	struct iovec iov[3];
+	int iovcnt = 0;
+	if (log->len > 0) {
+		iov[iovcnt].iov_base = log->buf;
+		iov[iovcnt++].iov_len = log->len;
+	}
+	if (extra_len > 0) {
+		iov[iovcnt].iov_base = (void *)extra;
+		iov[iovcnt++].iov_len = extra_len;
+	}
+	if (extra_newline) {
+		iov[iovcnt].iov_base = "\n";
+		iov[iovcnt++].iov_len = 1;
+	}
+	int locked = total > PIPE_BUF;
+	ssize_t n = -1;
+	if (!locked || _log_lock(log->fd, F_WRLCK) == 0) {
+		n = _writev_all(log->fd, iov, iovcnt);
+		if (locked) {
+			int err = errno;
+			_log_lock(log->fd, F_UNLCK);
+			log->locked_flushes++;
+			errno = err;
+		}
+	}
+	if (n == -1) {
+		/* nothing written, keep everything for later */
+		int err = errno;
+		if ((extra_len > 0 || extra_newline) &&
+		    _log_reserve(log, extra_len + 1) == 0) {
+			if (log->len == 0) {
+				log->first_at = _now_ms();
+			}
+			memcpy(log->buf + log->len, extra, extra_len);
+			log->len += extra_len;
+			if (extra_newline) {
+				log->buf[log->len++] = '\n';
+			}
+		}
+		errno = err;
+		return -1;
+	}
+	log->flushes++;
+	log->bytes += (unsigned long long)n;
+	log->len = 0;
+	if ((size_t)n < total) {
+		/* torn, the rest must not be appended after other writers */
+		int err = errno;
+		log->short_writes++;
+		log->torn_written = (size_t)n;
+		log->torn_total = total;
+		errno = err != 0 ? err : EIO;
+		return -1;
+	}
+	if (log->sync && fdatasync(log->fd) == -1) {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+** Pushes error of a failed flush, saying how much of a torn batch was
+** written.
+*/
+static int _log_error(lua_State *L, efs_append_log *log, const char *what)
+{
+	if (log->torn_total == 0) {
+		return push_error(L, what);
+	}
+	int err = errno;
+	lua_pushfstring(L, "%s (%I of %I bytes written)", what,
+			(lua_Integer)log->torn_written,
+			(lua_Integer)log->torn_total);
+	log->torn_written = log->torn_total = 0;
+	errno = err;
+	return push_error(L, lua_tostring(L, -1));
+}
+
+/* flushes when the oldest buffered record is flush_ms old */
+static int _log_flush_due(efs_append_log *log)
+{
+	if (log->len > 0 && log->flush_ms > 0 &&
+	    _now_ms() - log->first_at >= (double)log->flush_ms) {
+		return _log_flush(log, NULL, 0, 0);
+	}
+	return 0;
+}
+
+static efs_append_log *_check_log(lua_State *L)
+{
+	efs_append_log *log =
+		(efs_append_log *)luaL_checkudata(L, 1, APPEND_LOG_METATABLE);
+	luaL_argcheck(L, log->fd != -1, 1, "closed " APPEND_LOG_METATABLE);
+	return log;
+}
+
+/*
+** Opens log file for appending records.
+** @param #1 Path.
+** @param #2 Options table (optional):
+**   flush_bytes = PIPE_BUF - batch size, bigger batches are written
+**                 under a lock,
+**   flush_ms = 0 - flush on write or poll() once oldest record is
+**              this old,
+**   newline = true - terminate records missing a trailing newline,
+**   sync = false - fdatasync after every flush,
+**   mode = 420 (0644) - permissions of created file.
+*/
+int eli_open_append_log(lua_State *L)
+{
+	const char *path = luaL_checkstring(L, 1);
+	lua_Integer flush_bytes = PIPE_BUF;
+	lua_Integer flush_ms = 0;
+	lua_Integer mode = 0644;
+	int newline = 1, sync = 0;
+	if (lua_istable(L, 2)) {
+		lua_getfield(L, 2, "flush_bytes");
+		flush_bytes = luaL_optinteger(L, -1, PIPE_BUF);
+		lua_getfield(L, 2, "flush_ms");
+		flush_ms = luaL_optinteger(L, -1, 0);
+		lua_getfield(L, 2, "mode");
+		mode = luaL_optinteger(L, -1, 0644);
+		lua_getfield(L, 2, "newline");
+		newline = lua_isnil(L, -1) || lua_toboolean(L, -1);
+		lua_getfield(L, 2, "sync");
+		sync = lua_toboolean(L, -1);
+		lua_pop(L, 5);
+	}
+	luaL_argcheck(L, flush_bytes > 0, 2, "flush_bytes must be positive");
+	int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+		      (mode_t)mode);
+	if (fd == -1) {
+		return push_error(L, path);
+	}
+	efs_append_log *log =
+		(efs_append_log *)lua_newuserdata(L, sizeof(efs_append_log));
+	memset(log, 0, sizeof(efs_append_log));
+	log->fd = fd;
+	log->flush_bytes = (size_t)flush_bytes;
+	log->flush_ms = (long)flush_ms;
+	log->newline = newline;
+	log->sync = sync;
+	luaL_getmetatable(L, APPEND_LOG_METATABLE);
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+/*
+** Buffers records, flushing batches as the policy requires.
+** @param #2... Records.
+*/
+static int append_log_write(lua_State *L)
+{
+	efs_append_log *log = _check_log(L);
+	int top = lua_gettop(L);
+	for (int i = 2; i <= top; i++) {
+		size_t len;
+		const char *record = luaL_checklstring(L, i, &len);
+		int add_newline = log->newline &&
+				  (len == 0 || record[len - 1] != '\n');
+		size_t size = len + (add_newline ? 1 : 0);
+		if (log->len > 0 && log->len + size > log->flush_bytes &&
+		    _log_flush(log, NULL, 0, 0) == -1) {
+			return _log_error(L, log, "write");
+		}
+		log->records++;
+		if (size > log->flush_bytes) {
+			/* written straight from the Lua string */
+			if (_log_flush(log, record, len, add_newline) == -1) {
+				return _log_error(L, log, "write");
+			}
+			continue;
+		}
+		if (_log_reserve(log, size) == -1) {
+			return _log_error(L, log, "write");
+		}
+		if (log->len == 0) {
+			log->first_at = log->flush_ms > 0 ? _now_ms() : 0;
+		}
+		memcpy(log->buf + log->len, record, len);
+		log->len += len;
+		if (add_newline) {
+			log->buf[log->len++] = '\n';
+		}
+	}
+	if (log->len > 0 && log->len >= log->flush_bytes &&
+	    _log_flush(log, NULL, 0, 0) == -1) {
+		return _log_error(L, log, "write");
+	}
+	if (_log_flush_due(log) == -1) {
+		return _log_error(L, log, "write");
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+** Flushes the buffer if flush_ms has passed since its oldest record.
+** A log that is not written to only flushes on time through this, call
+** it from the event loop or a timer.
+** Returns milliseconds until the next flush is due, nil if nothing is
+** waiting for a time based flush.
+*/
+static int append_log_poll(lua_State *L)
+{
+	efs_append_log *log = _check_log(L);
+	if (_log_flush_due(log) == -1) {
+		return _log_error(L, log, "poll");
+	}
+	if (log->len == 0 || log->flush_ms <= 0) {
+		lua_pushnil(L);
+		return 1;
+	}
+	double left = log->first_at + (double)log->flush_ms - _now_ms();
+	lua_pushinteger(L, left > 0 ? (lua_Integer)left + 1 : 0);
+	return 1;
+}
+
+static int append_log_flush(lua_State *L)
+{
+	efs_append_log *log = _check_log(L);
+	if (_log_flush(log, NULL, 0, 0) == -1) {
+		return _log_error(L, log, "flush");
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int append_log_buffered(lua_State *L)
+{
+	efs_append_log *log = _check_log(L);
+	lua_pushinteger(L, (lua_Integer)log->len);
+	return 1;
+}
+
+static int append_log_fd(lua_State *L)
+{
+	efs_append_log *log = _check_log(L);
+	lua_pushinteger(L, log->fd);
+	return 1;
+}
+
+/*
+** Returns { records, bytes, flushes, locked_flushes, short_writes }.
+*/
+static int append_log_stats(lua_State *L)
+{
+	efs_append_log *log = _check_log(L);
+	lua_createtable(L, 0, 5);
+	lua_pushinteger(L, (lua_Integer)log->records);
+	lua_setfield(L, -2, "records");
+	lua_pushinteger(L, (lua_Integer)log->bytes);
+	lua_setfield(L, -2, "bytes");
+	lua_pushinteger(L, (lua_Integer)log->flushes);
+	lua_setfield(L, -2, "flushes");
+	lua_pushinteger(L, (lua_Integer)log->locked_flushes);
+	lua_setfield(L, -2, "locked_flushes");
+	lua_pushinteger(L, (lua_Integer)log->short_writes);
+	lua_setfield(L, -2, "short_writes");
+	return 1;
+}
+
+static int append_log_close(lua_State *L)
+{
+	efs_append_log *log =
+		(efs_append_log *)luaL_checkudata(L, 1, APPEND_LOG_METATABLE);
+	if (log->fd == -1) {
+		lua_pushboolean(L, 1);
+		return 1;
+	}
+	int res = _log_flush(log, NULL, 0, 0);
+	int err = errno;
+	if (close(log->fd) == -1 && res == 0) {
+		res = -1;
+		err = errno;
+	}
+	log->fd = -1;
+	free(log->buf);
+	log->buf = NULL;
+	log->len = log->cap = 0;
+	if (res == -1) {
+		errno = err;
+		return _log_error(L, log, "close");
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+** Creates append log metatable.
+*/
+int append_log_create_meta(lua_State *L)
+{
+	luaL_newmetatable(L, APPEND_LOG_METATABLE);
+	/* Method table */
+	lua_newtable(L);
+	lua_pushcfunction(L, append_log_write);
+	lua_setfield(L, -2, "write");
+	lua_pushcfunction(L, append_log_flush);
+	lua_setfield(L, -2, "flush");
+	lua_pushcfunction(L, append_log_poll);
+	lua_setfield(L, -2, "poll");
+	lua_pushcfunction(L, append_log_buffered);
+	lua_setfield(L, -2, "buffered");
+	lua_pushcfunction(L, append_log_fd);
+	lua_setfield(L, -2, "fd");
+	lua_pushcfunction(L, append_log_stats);
+	lua_setfield(L, -2, "stats");
+	lua_pushcfunction(L, append_log_close);
+	lua_setfield(L, -2, "close");
+	/* type */
+	lua_pushstring(L, APPEND_LOG_METATABLE);
+	lua_setfield(L, -2, "__type");
+
+	/* Metamethods */
+	lua_setfield(L, -2, "__index");
+	lua_pushcfunction(L, append_log_close);
+	lua_setfield(L, -2, "__gc");
+	lua_pushcfunction(L, append_log_close);
+	lua_setfield(L, -2, "__close");
+	return 1;
+}
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef ELI_EXTRA_FS_APPEND_H__
+#define ELI_EXTRA_FS_APPEND_H__
+
+#include "lua.h"
+
+int eli_open_append_log(lua_State *L);
+
+int append_log_create_meta(lua_State *L);
+
+#endif /* ELI_EXTRA_FS_APPEND_H__ */
@@ -0,0 +1,1179 @@
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "lerror.h"
+#include "lfsutil.h"
+#include "lasync.h"
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+
+int eli_async(lua_State *L)
+{
+	errno = ENOSYS; /* = "Function not implemented" */
+	return push_result(L, -1, "async is not supported on Windows");
+}
+
+int async_create_meta(lua_State *L)
+{
+	return 0;
+}
+
+#else
+
+#include "lpool.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define ELI_FS_EXTRA_IO_URING
+#endif
+#endif
+
+#ifdef __linux__
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <sys/sysmacros.h>
+#endif
+
+#ifdef ELI_FS_EXTRA_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#define ASYNC_METATABLE "ELI_ASYNC"
+#define ASYNC_REGISTRY_KEY "ELI_ASYNC_ENGINE"
+#define ASYNC_DEFAULT_ENTRIES 256
+
+enum efs_async_op {
+	ASYNC_READ,
+	ASYNC_WRITE,
+	ASYNC_STAT,
+	ASYNC_OPEN,
+	ASYNC_CLOSE,
+	ASYNC_UNLINK,
+	ASYNC_RENAME,
+	ASYNC_MKDIR,
+	ASYNC_FSYNC,
+	ASYNC_OP_COUNT
+};
+
+/*
+** Reads and writes are split into chunks of at most this size, the most
+** Linux moves in one call. It also fits the 32 bit length of ring entries.
+*/
+#define ASYNC_RW_CHUNK ((size_t)0x7ffff000)
+
+struct efs_async_engine;
+
+typedef struct efs_async_req {
+	enum efs_async_op op;
+	struct efs_async_engine *engine;
+	lua_State *co;
+	int co_ref;
+	long res; /* syscall result, -errno on failure */
+	int fd;
+	int flags;
+	mode_t mode;
+	off_t offset;
+	char *buf;
+	size_t len;
+	size_t done; /* moved by earlier chunks of a read or write */
+	char *path;
+	char *path2;
+#ifdef __linux__
+	struct statx stx;
+#else
+	struct stat st;
+#endif
+	struct efs_async_req *next;
+} efs_async_req;
+
+/*
+** Engine state lives outside of Lua memory. Thread pool completions
+** may still arrive after the userdata is collected; the last of them
+** releases the engine.
+*/
+typedef struct efs_async_engine {
+	int efd; /* signaled on every completion */
+	int signal_fd; /* write end, same as efd with eventfd */
+	int inflight;
+	int closed;
+	int force_threads;
+	pthread_mutex_t lock;
+	efs_async_req *done_head;
+	efs_async_req *done_tail;
+	int pool_inflight; /* guarded by lock */
+#ifdef ELI_FS_EXTRA_IO_URING
+	int ring_fd;
+	int ring_inflight;
+	unsigned char supported[ASYNC_OP_COUNT];
+	unsigned to_submit;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_entries;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr;
+	size_t sq_size;
+	void *cq_ptr;
+	size_t cq_size;
+	size_t sqes_size;
+#endif
+} efs_async_engine;
+
+typedef struct efs_async {
+	efs_async_engine *engine;
+} efs_async;
+
+static void _req_free(efs_async_req *req)
+{
+	free(req->buf);
+	free(req->path);
+	free(req->path2);
+	free(req);
+}
+
+static void _engine_signal(efs_async_engine *engine)
+{
+#ifdef __linux__
+	uint64_t one = 1;
+	(void)!write(engine->signal_fd, &one, sizeof(one));
+#else
+	char one = 1;
+	(void)!write(engine->signal_fd, &one, sizeof(one));
+#endif
+}
+
+static void _engine_drain_signal(efs_async_engine *engine)
+{
+	char buf[64];
+	while (read(engine->efd, buf, sizeof(buf)) > 0)
+		;
+}
+
+static void _engine_free(efs_async_engine *engine)
+{
+	efs_async_req *req = engine->done_head;
+	while (req != NULL) {
+		efs_async_req *next = req->next;
+		_req_free(req);
+		req = next;
+	}
+	if (engine->signal_fd != engine->efd) {
+		close(engine->signal_fd);
+	}
+	close(engine->efd);
+	pthread_mutex_destroy(&engine->lock);
+	free(engine);
+}
+
+static size_t _req_chunk(const efs_async_req *req)
+{
+	size_t left = req->len - req->done;
+	return left < ASYNC_RW_CHUNK ? left : ASYNC_RW_CHUNK;
+}
+
+/*
+** Accounts result of a read or write chunk in req->res. Returns 1 when
+** the chunk moved all it could and another one is due. An error after
+** earlier chunks reports the bytes moved, like a short read or write.
+*/
+static int _req_advance(efs_async_req *req, long res)
+{
+	if (res < 0) {
+		req->res = req->done > 0 ? (long)req->done : res;
+		return 0;
+	}
+	size_t chunk = _req_chunk(req);
+	req->done += (size_t)res;
+	req->res = (long)req->done;
+	return (size_t)res == chunk && req->done < req->len;
+}
+
+/*
+** Thread pool backend
+*/
+static long _run_sync(efs_async_req *req)
+{
+	long res;
+	switch (req->op) {
+	case ASYNC_READ:
+	case ASYNC_WRITE:
+		do {
+			char *buf = req->buf + req->done;
+			size_t chunk = _req_chunk(req);
+			off_t offset = req->offset + (off_t)req->done;
+			if (req->op == ASYNC_READ) {
+				res = req->offset < 0 ?
+					      read(req->fd, buf, chunk) :
+					      pread(req->fd, buf, chunk, offset);
+			} else {
+				res = req->offset < 0 ?
+					      write(req->fd, buf, chunk) :
+					      pwrite(req->fd, buf, chunk, offset);
+			}
+		} while (_req_advance(req, res == -1 ? -errno : res));
+		return req->res;
+	case ASYNC_STAT:
+#ifdef __linux__
+		res = statx(AT_FDCWD, req->path, req->flags,
+			    STATX_BASIC_STATS, &req->stx);
+#else
+		res = fstatat(AT_FDCWD, req->path, &req->st, req->flags);
+#endif
+		break;
+	case ASYNC_OPEN:
+		res = openat(AT_FDCWD, req->path, req->flags, req->mode);
+		break;
+	case ASYNC_CLOSE:
+		res = close(req->fd);
+		break;
+	case ASYNC_UNLINK:
+		res = unlinkat(AT_FDCWD, req->path, req->flags);
+		break;
+	case ASYNC_RENAME:
+		res = renameat(AT_FDCWD, req->path, AT_FDCWD, req->path2);
+		break;
+	case ASYNC_MKDIR:
+		res = mkdirat(AT_FDCWD, req->path, req->mode);
+		break;
+	case ASYNC_FSYNC:
+		res = fsync(req->fd);
+		break;
+	default:
+		errno = EINVAL;
+		res = -1;
+	}
+	return res == -1 ? -errno : res;
+}
+
+static void _pool_task(void *arg)
+{
+	efs_async_req *req = (efs_async_req *)arg;
+	efs_async_engine *engine = req->engine;
+	req->res = _run_sync(req);
+
+	pthread_mutex_lock(&engine->lock);
+	engine->pool_inflight--;
+	if (engine->closed) {
+		int last = engine->pool_inflight == 0;
+		pthread_mutex_unlock(&engine->lock);
+		_req_free(req);
+		if (last) {
+			_engine_free(engine);
+		}
+		return;
+	}
+	req->next = NULL;
+	if (engine->done_tail != NULL) {
+		engine->done_tail->next = req;
+	} else {
+		engine->done_head = req;
+	}
+	engine->done_tail = req;
+	pthread_mutex_unlock(&engine->lock);
+	_engine_signal(engine);
+}
+
+static int _pool_enqueue(efs_async_engine *engine, efs_async_req *req)
+{
+	pthread_mutex_lock(&engine->lock);
+	engine->pool_inflight++;
+	pthread_mutex_unlock(&engine->lock);
+	if (efs_pool_submit(_pool_task, req) == -1) {
+		pthread_mutex_lock(&engine->lock);
+		engine->pool_inflight--;
+		pthread_mutex_unlock(&engine->lock);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+** io_uring backend
+*/
+#ifdef ELI_FS_EXTRA_IO_URING
+
+static int _uring_setup(efs_async_engine *engine, unsigned entries)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	int fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+	if (fd < 0) {
+		return -1;
+	}
+	engine->sq_size =
+		params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	engine->cq_size = params.cq_off.cqes +
+			  params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (engine->cq_size > engine->sq_size) {
+			engine->sq_size = engine->cq_size;
+		}
+		engine->cq_size = engine->sq_size;
+	}
+	engine->sq_ptr = mmap(NULL, engine->sq_size, PROT_READ | PROT_WRITE,
+			      MAP_SHARED | MAP_POPULATE, fd,
+			      IORING_OFF_SQ_RING);
+	if (engine->sq_ptr == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		engine->cq_ptr = engine->sq_ptr;
+	} else {
+		engine->cq_ptr = mmap(NULL, engine->cq_size,
+				      PROT_READ | PROT_WRITE,
+				      MAP_SHARED | MAP_POPULATE, fd,
+				      IORING_OFF_CQ_RING);
+		if (engine->cq_ptr == MAP_FAILED) {
+			munmap(engine->sq_ptr, engine->sq_size);
+			close(fd);
+			return -1;
+		}
+	}
+	engine->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	engine->sqes = mmap(NULL, engine->sqes_size, PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (engine->sqes == MAP_FAILED) {
+		if (engine->cq_ptr != engine->sq_ptr) {
+			munmap(engine->cq_ptr, engine->cq_size);
+		}
+		munmap(engine->sq_ptr, engine->sq_size);
+		close(fd);
+		return -1;
+	}
+
+	char *sq = (char *)engine->sq_ptr;
+	char *cq = (char *)engine->cq_ptr;
+	engine->sq_head = (unsigned *)(sq + params.sq_off.head);
+	engine->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+	engine->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+	engine->sq_entries = (unsigned *)(sq + params.sq_off.ring_entries);
+	engine->sq_array = (unsigned *)(sq + params.sq_off.array);
+	engine->cq_head = (unsigned *)(cq + params.cq_off.head);
+	engine->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+	engine->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+	engine->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+	engine->ring_fd = fd;
+	engine->to_submit = 0;
+
+	/* find out which operations this kernel can do on the ring */
+	static const int opcodes[ASYNC_OP_COUNT] = {
+		[ASYNC_READ] = IORING_OP_READ,
+		[ASYNC_WRITE] = IORING_OP_WRITE,
+		[ASYNC_STAT] = IORING_OP_STATX,
+		[ASYNC_OPEN] = IORING_OP_OPENAT,
+		[ASYNC_CLOSE] = IORING_OP_CLOSE,
+		[ASYNC_UNLINK] = IORING_OP_UNLINKAT,
+		[ASYNC_RENAME] = IORING_OP_RENAMEAT,
+		[ASYNC_MKDIR] = IORING_OP_MKDIRAT,
+		[ASYNC_FSYNC] = IORING_OP_FSYNC,
+	};
+	size_t probe_size = sizeof(struct io_uring_probe) +
+			    256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = calloc(1, probe_size);
+	memset(engine->supported, 0, sizeof(engine->supported));
+	if (probe != NULL &&
+	    syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe,
+		    256) == 0) {
+		for (int i = 0; i < ASYNC_OP_COUNT; i++) {
+			int code = opcodes[i];
+			engine->supported[i] =
+				code <= probe->last_op &&
+				(probe->ops[code].flags & IO_URING_OP_SUPPORTED);
+		}
+	}
+	free(probe);
+
+	if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_EVENTFD,
+		    &engine->efd, 1) != 0) {
+		/* completions would go unnoticed by wait(), use threads */
+		memset(engine->supported, 0, sizeof(engine->supported));
+	}
+	return 0;
+}
+
+static void _uring_close(efs_async_engine *engine)
+{
+	munmap(engine->sqes, engine->sqes_size);
+	if (engine->cq_ptr != engine->sq_ptr) {
+		munmap(engine->cq_ptr, engine->cq_size);
+	}
+	munmap(engine->sq_ptr, engine->sq_size);
+	close(engine->ring_fd);
+	engine->ring_fd = -1;
+}
+
+static int _uring_submit(efs_async_engine *engine, unsigned wait_for)
+{
+	while (engine->to_submit > 0 || wait_for > 0) {
+		int res = (int)syscall(__NR_io_uring_enter, engine->ring_fd,
+				       engine->to_submit, wait_for,
+				       wait_for > 0 ? IORING_ENTER_GETEVENTS :
+						      0,
+				       NULL, 0);
+		if (res < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		if (res == 0 && wait_for == 0) {
+			break;
+		}
+		engine->to_submit -= (unsigned)res;
+		wait_for = 0;
+	}
+	return 0;
+}
+
+static struct io_uring_sqe *_uring_get_sqe(efs_async_engine *engine)
+{
+	unsigned tail = *engine->sq_tail;
+	unsigned head = __atomic_load_n(engine->sq_head, __ATOMIC_ACQUIRE);
+	if (tail - head >= *engine->sq_entries) {
+		/* ring is full, hand the batch over to the kernel first */
+		if (_uring_submit(engine, 0) == -1) {
+			return NULL;
+		}
+		head = __atomic_load_n(engine->sq_head, __ATOMIC_ACQUIRE);
+		if (tail - head >= *engine->sq_entries) {
+			errno = EBUSY;
+			return NULL;
+		}
+	}
+	unsigned index = tail & *engine->sq_mask;
+	struct io_uring_sqe *sqe = &engine->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	engine->sq_array[index] = index;
+	return sqe;
+}
+
+static void _uring_commit_sqe(efs_async_engine *engine)
+{
+	__atomic_store_n(engine->sq_tail, *engine->sq_tail + 1,
+			 __ATOMIC_RELEASE);
+	engine->to_submit++;
+}
+
+static int _uring_enqueue(efs_async_engine *engine, efs_async_req *req)
+{
+	struct io_uring_sqe *sqe = _uring_get_sqe(engine);
+	if (sqe == NULL) {
+		return -1;
+	}
+	sqe->user_data = (uint64_t)(uintptr_t)req;
+	switch (req->op) {
+	case ASYNC_READ:
+	case ASYNC_WRITE:
+		sqe->opcode = req->op == ASYNC_READ ? IORING_OP_READ :
+						      IORING_OP_WRITE;
+		sqe->fd = req->fd;
+		sqe->addr = (uint64_t)(uintptr_t)(req->buf + req->done);
+		sqe->len = (unsigned)_req_chunk(req);
+		/* -1 means current file position */
+		sqe->off = req->offset < 0 ?
+				   (uint64_t)-1 :
+				   (uint64_t)(req->offset + (off_t)req->done);
+		break;
+	case ASYNC_STAT:
+		sqe->opcode = IORING_OP_STATX;
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (uint64_t)(uintptr_t)req->path;
+		sqe->len = STATX_BASIC_STATS;
+		sqe->off = (uint64_t)(uintptr_t)&req->stx;
+		sqe->statx_flags = (unsigned)req->flags;
+		break;
+	case ASYNC_OPEN:
+		sqe->opcode = IORING_OP_OPENAT;
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (uint64_t)(uintptr_t)req->path;
+		sqe->len = req->mode;
+		sqe->open_flags = (unsigned)req->flags;
+		break;
+	case ASYNC_CLOSE:
+		sqe->opcode = IORING_OP_CLOSE;
+		sqe->fd = req->fd;
+		break;
+	case ASYNC_UNLINK:
+		sqe->opcode = IORING_OP_UNLINKAT;
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (uint64_t)(uintptr_t)req->path;
+		sqe->unlink_flags = (unsigned)req->flags;
+		break;
+	case ASYNC_RENAME:
+		sqe->opcode = IORING_OP_RENAMEAT;
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (uint64_t)(uintptr_t)req->path;
+		sqe->len = (unsigned)AT_FDCWD;
+		sqe->addr2 = (uint64_t)(uintptr_t)req->path2;
+		break;
+	case ASYNC_MKDIR:
+		sqe->opcode = IORING_OP_MKDIRAT;
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (uint64_t)(uintptr_t)req->path;
+		sqe->len = req->mode;
+		break;
+	case ASYNC_FSYNC:
+		sqe->opcode = IORING_OP_FSYNC;
+		sqe->fd = req->fd;
+		break;
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+	_uring_commit_sqe(engine);
+	engine->ring_inflight++;
+	return 0;
+}
+
+/* moves ring completions to the done list */
+static void _uring_reap(efs_async_engine *engine)
+{
+	unsigned head = *engine->cq_head;
+	unsigned tail = __atomic_load_n(engine->cq_tail, __ATOMIC_ACQUIRE);
+	if (head == tail) {
+		return;
+	}
+	pthread_mutex_lock(&engine->lock);
+	for (; head != tail; head++) {
+		struct io_uring_cqe *cqe = &engine->cqes[head & *engine->cq_mask];
+		efs_async_req *req = (efs_async_req *)(uintptr_t)cqe->user_data;
+		engine->ring_inflight--;
+		if (req->op == ASYNC_READ || req->op == ASYNC_WRITE) {
+			/* a failed resubmit completes with the bytes so far */
+			if (_req_advance(req, cqe->res) &&
+			    _uring_enqueue(engine, req) == 0) {
+				continue;
+			}
+		} else {
+			req->res = cqe->res;
+		}
+		req->next = NULL;
+		if (engine->done_tail != NULL) {
+			engine->done_tail->next = req;
+		} else {
+			engine->done_head = req;
+		}
+		engine->done_tail = req;
+	}
+	pthread_mutex_unlock(&engine->lock);
+	__atomic_store_n(engine->cq_head, head, __ATOMIC_RELEASE);
+}
+
+#endif
+
+static int _engine_uses_uring(efs_async_engine *engine, enum efs_async_op op)
+{
+#ifdef ELI_FS_EXTRA_IO_URING
+	return engine->ring_fd != -1 && engine->supported[op];
+#else
+	(void)engine;
+	(void)op;
+	return 0;
+#endif
+}
+
+static efs_async_engine *_engine_new(unsigned entries, int force_threads)
+{
+	efs_async_engine *engine = calloc(1, sizeof(efs_async_engine));
+	if (engine == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+#ifdef __linux__
+	engine->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	engine->signal_fd = engine->efd;
+	if (engine->efd == -1) {
+		free(engine);
+		return NULL;
+	}
+#else
+	int fds[2];
+	if (pipe(fds) == -1) {
+		free(engine);
+		return NULL;
+	}
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+	fcntl(fds[1], F_SETFL, O_NONBLOCK);
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+	engine->efd = fds[0];
+	engine->signal_fd = fds[1];
+#endif
+	pthread_mutex_init(&engine->lock, NULL);
+	engine->force_threads = force_threads;
+#ifdef ELI_FS_EXTRA_IO_URING
+	engine->ring_fd = -1;
+	if (!force_threads && _uring_setup(engine, entries) == -1) {
+		/* ENOSYS, EPERM under seccomp, ... */
+		engine->ring_fd = -1;
+	}
+#else
+	(void)entries;
+#endif
+	return engine;
+}
+
+static void _engine_close(efs_async_engine *engine)
+{
+#ifdef ELI_FS_EXTRA_IO_URING
+	if (engine->ring_fd != -1) {
+		/* the kernel may still write into request buffers */
+		while (engine->ring_inflight > 0) {
+			if (_uring_submit(engine, 1) == -1) {
+				break;
+			}
+			_uring_reap(engine);
+		}
+		_uring_close(engine);
+	}
+#endif
+	pthread_mutex_lock(&engine->lock);
+	engine->closed = 1;
+	int last = engine->pool_inflight == 0;
+	pthread_mutex_unlock(&engine->lock);
+	if (last) {
+		_engine_free(engine);
+	}
+}
+
+static efs_async_engine *_check_engine(lua_State *L, int idx)
+{
+	efs_async *a = (efs_async *)luaL_checkudata(L, idx, ASYNC_METATABLE);
+	luaL_argcheck(L, a->engine != NULL, idx, "closed " ASYNC_METATABLE);
+	return a->engine;
+}
+
+static efs_async_req *_new_req(lua_State *L, efs_async_engine *engine,
+			       enum efs_async_op op)
+{
+	if (!lua_isyieldable(L)) {
+		luaL_error(L, "async operations have to be called from a coroutine");
+		return NULL;
+	}
+	efs_async_req *req = calloc(1, sizeof(efs_async_req));
+	if (req == NULL) {
+		luaL_error(L, "out of memory");
+		return NULL;
+	}
+	req->op = op;
+	req->engine = engine;
+	req->fd = -1;
+	req->offset = -1;
+	req->co_ref = LUA_NOREF;
+	return req;
+}
+
+static char *_req_strdup(lua_State *L, efs_async_req *req, int idx)
+{
+	const char *str = luaL_checkstring(L, idx);
+	char *copy = strdup(str);
+	if (copy == NULL) {
+		_req_free(req);
+		luaL_error(L, "out of memory");
+	}
+	return copy;
+}
+
+/*
+** Queues request and suspends calling coroutine until poll() or wait()
+** picks up its completion.
+*/
+static int _submit(lua_State *L, efs_async_engine *engine, efs_async_req *req)
+{
+	int res = _engine_uses_uring(engine, req->op) ?
+#ifdef ELI_FS_EXTRA_IO_URING
+			  _uring_enqueue(engine, req)
+#else
+			  -1
+#endif
+			  :
+			  _pool_enqueue(engine, req);
+	if (res == -1) {
+		_req_free(req);
+		return push_error(L, NULL);
+	}
+	engine->inflight++;
+	req->co = L;
+	lua_pushthread(L);
+	req->co_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	return lua_yield(L, 0);
+}
+
+static int _fd_arg(lua_State *L, int idx)
+{
+	if (lua_type(L, idx) == LUA_TNUMBER) {
+		return (int)luaL_checkinteger(L, idx);
+	}
+	FILE *f = check_file(L, idx, "async");
+	fflush(f);
+	return fileno(f);
+}
+
+static int async_read(lua_State *L)
+{
+	efs_async_engine *engine = _check_engine(L, 1);
+	int fd = _fd_arg(L, 2);
+	lua_Integer len = luaL_checkinteger(L, 3);
+	luaL_argcheck(L, len >= 0, 3, "length must not be negative");
+	off_t offset = (off_t)luaL_optinteger(L, 4, -1);
+	efs_async_req *req = _new_req(L, engine, ASYNC_READ);
+	req->fd = fd;
+	req->len = (size_t)len;
+	req->offset = offset;
+	req->buf = malloc(req->len > 0 ? req->len : 1);
+	if (req->buf == NULL) {
+		_req_free(req);
+		return luaL_error(L, "out of memory");
+	}
+	return _submit(L, engine, req);
+}
+
+static int async_write(lua_State *L)
+{
+	efs_async_engine *engine = _check_engine(L, 1);
+	int fd = _fd_arg(L, 2);
+	size_t len;
+	const char *data = luaL_checklstring(L, 3, &len);
+	off_t offset = (off_t)luaL_optinteger(L, 4, -1);
+	efs_async_req *req = _new_req(L, engine, ASYNC_WRITE);
+	req->fd = fd;
+	req->len = len;
+	req->offset = offset;
+	req->buf = malloc(req->len > 0 ? req->len : 1);
+	if (req->buf == NULL) {
+		_req_free(req);
+		return luaL_error(L, "out of memory");
+	}
+	memcpy(req->buf, data, req->len);
+	return _submit(L, engine, req);
+}
+
+static int async_stat(lua_State *L)
+{
+	efs_async_engine *engine = _check_engine(L, 1);
+	luaL_checkstring(L, 2);
+	efs_async_req *req = _new_req(L, engine, ASYNC_STAT);
+	req->path = _req_strdup(L, req, 2);
+	req->flags = lua_toboolean(L, 3) ? AT_SYMLINK_NOFOLLOW : 0;
+	return _submit(L, engine, req);
+}
+
+static int async_open(lua_State *L)
+{
+	static const char *const modenames[] = { "r", "w", "a", "r+", "w+",
+						 "a+", NULL };
+	static const int modeflags[] = {
+		O_RDONLY,
+		O_WRONLY | O_CREAT | O_TRUNC,
+		O_WRONLY | O_CREAT | O_APPEND,
+		O_RDWR,
+		O_RDWR | O_CREAT | O_TRUNC,
+		O_RDWR | O_CREAT | O_APPEND,
+	};
+	efs_async_engine *engine = _check_engine(L, 1);
+	luaL_checkstring(L, 2);
+	int mode = luaL_checkoption(L, 3, "r", modenames);
+	efs_async_req *req = _new_req(L, engine, ASYNC_OPEN);
+	req->flags = modeflags[mode] | O_CLOEXEC;
+	req->mode = (mode_t)luaL_optinteger(L, 4, 0666);
+	req->path = _req_strdup(L, req, 2);
+	return _submit(L, engine, req);
+}
+
+static int async_close(lua_State *L)
+{
+	efs_async_engine *engine = _check_engine(L, 1);
+	int fd = (int)luaL_checkinteger(L, 2);
+	efs_async_req *req = _new_req(L, engine, ASYNC_CLOSE);
+	req->fd = fd;
+	return _submit(L, engine, req);
+}
+
+static int async_unlink(lua_State *L)
+{
+	efs_async_engine *engine = _check_engine(L, 1);
+	luaL_checkstring(L, 2);
+	efs_async_req *req = _new_req(L, engine, ASYNC_UNLINK);
+	req->flags = lua_toboolean(L, 3) ? AT_REMOVEDIR : 0;
+	req->path = _req_strdup(L, req, 2);
+	return _submit(L, engine, req);
+}
+
+static int async_rename(lua_State *L)
+{
+	efs_async_engine *engine = _check_engine(L, 1);
+	luaL_checkstring(L, 2);
+	luaL_checkstring(L, 3);
+	efs_async_req *req = _new_req(L, engine, ASYNC_RENAME);
+	req->path = _req_strdup(L, req, 2);
+	req->path2 = _req_strdup(L, req, 3);
+	return _submit(L, engine, req);
+}
+
+static int async_mkdir(lua_State *L)
+{
+	efs_async_engine *engine = _check_engine(L, 1);
+	luaL_checkstring(L, 2);
+	mode_t mode = (mode_t)luaL_optinteger(L, 3, 0777);
+	efs_async_req *req = _new_req(L, engine, ASYNC_MKDIR);
+	req->mode = mode;
+	req->path = _req_strdup(L, req, 2);
+	return _submit(L, engine, req);
+}
+
+static int async_fsync(lua_State *L)
+{
+	efs_async_engine *engine = _check_engine(L, 1);
+	int fd = _fd_arg(L, 2);
+	efs_async_req *req = _new_req(L, engine, ASYNC_FSYNC);
+	req->fd = fd;
+	return _submit(L, engine, req);
+}
+
+#ifdef __linux__
+static void _push_stat(lua_State *L, struct statx *stx)
+{
+	lua_createtable(L, 0, 14);
+	lua_pushstring(L, mode2string(stx->stx_mode));
+	lua_setfield(L, -2, "mode");
+	lua_pushstring(L, mode2string(stx->stx_mode));
+	lua_setfield(L, -2, "type");
+	const char *perms = perm2string(stx->stx_mode);
+	if (perms != NULL) {
+		lua_pushstring(L, perms);
+		lua_setfield(L, -2, "permissions");
+		free((void *)perms);
+	}
+	lua_pushinteger(L, (lua_Integer)makedev(stx->stx_dev_major,
+						stx->stx_dev_minor));
+	lua_setfield(L, -2, "dev");
+	lua_pushinteger(L, (lua_Integer)stx->stx_ino);
+	lua_setfield(L, -2, "ino");
+	lua_pushinteger(L, (lua_Integer)stx->stx_nlink);
+	lua_setfield(L, -2, "nlink");
+	lua_pushinteger(L, (lua_Integer)stx->stx_uid);
+	lua_setfield(L, -2, "uid");
+	lua_pushinteger(L, (lua_Integer)stx->stx_gid);
+	lua_setfield(L, -2, "gid");
+	lua_pushinteger(L, (lua_Integer)makedev(stx->stx_rdev_major,
+						stx->stx_rdev_minor));
+	lua_setfield(L, -2, "rdev");
+	lua_pushinteger(L, (lua_Integer)stx->stx_atime.tv_sec);
+	lua_setfield(L, -2, "access");
+	lua_pushinteger(L, (lua_Integer)stx->stx_mtime.tv_sec);
+	lua_setfield(L, -2, "modification");
+	lua_pushinteger(L, (lua_Integer)stx->stx_ctime.tv_sec);
+	lua_setfield(L, -2, "change");
+	lua_pushinteger(L, (lua_Integer)stx->stx_size);
+	lua_setfield(L, -2, "size");
+	lua_pushinteger(L, (lua_Integer)stx->stx_blocks);
+	lua_setfield(L, -2, "blocks");
+	lua_pushinteger(L, (lua_Integer)stx->stx_blksize);
+	lua_setfield(L, -2, "blksize");
+}
+#else
+static void _push_stat(lua_State *L, struct stat *st)
+{
+	lua_createtable(L, 0, 14);
+	lua_pushstring(L, mode2string(st->st_mode));
+	lua_setfield(L, -2, "mode");
+	lua_pushstring(L, mode2string(st->st_mode));
+	lua_setfield(L, -2, "type");
+	const char *perms = perm2string(st->st_mode);
+	if (perms != NULL) {
+		lua_pushstring(L, perms);
+		lua_setfield(L, -2, "permissions");
+		free((void *)perms);
+	}
+	lua_pushinteger(L, (lua_Integer)st->st_dev);
+	lua_setfield(L, -2, "dev");
+	lua_pushinteger(L, (lua_Integer)st->st_ino);
+	lua_setfield(L, -2, "ino");
+	lua_pushinteger(L, (lua_Integer)st->st_nlink);
+	lua_setfield(L, -2, "nlink");
+	lua_pushinteger(L, (lua_Integer)st->st_uid);
+	lua_setfield(L, -2, "uid");
+	lua_pushinteger(L, (lua_Integer)st->st_gid);
+	lua_setfield(L, -2, "gid");
+	lua_pushinteger(L, (lua_Integer)st->st_rdev);
+	lua_setfield(L, -2, "rdev");
+	lua_pushinteger(L, (lua_Integer)st->st_atime);
+	lua_setfield(L, -2, "access");
+	lua_pushinteger(L, (lua_Integer)st->st_mtime);
+	lua_setfield(L, -2, "modification");
+	lua_pushinteger(L, (lua_Integer)st->st_ctime);
+	lua_setfield(L, -2, "change");
+	lua_pushinteger(L, (lua_Integer)st->st_size);
+	lua_setfield(L, -2, "size");
+	lua_pushinteger(L, (lua_Integer)st->st_blocks);
+	lua_setfield(L, -2, "blocks");
+	lua_pushinteger(L, (lua_Integer)st->st_blksize);
+	lua_setfield(L, -2, "blksize");
+}
+#endif
+
+/* pushes results of finished request onto its coroutine */
+static int _push_req_result(lua_State *co, efs_async_req *req)
+{
+	if (req->res < 0) {
+		errno = (int)-req->res;
+		return push_error(co, NULL);
+	}
+	switch (req->op) {
+	case ASYNC_READ:
+		if (req->res == 0 && req->len > 0) {
+			lua_pushnil(co); /* EOF */
+		} else {
+			lua_pushlstring(co, req->buf, (size_t)req->res);
+		}
+		return 1;
+	case ASYNC_WRITE:
+	case ASYNC_OPEN:
+		lua_pushinteger(co, (lua_Integer)req->res);
+		return 1;
+	case ASYNC_STAT:
+#ifdef __linux__
+		_push_stat(co, &req->stx);
+#else
+		_push_stat(co, &req->st);
+#endif
+		return 1;
+	default:
+		lua_pushboolean(co, 1);
+		return 1;
+	}
+}
+
+/*
+** Resumes coroutines of all finished requests.
+** Returns number of resumed coroutines and table of errors raised by
+** them (if any).
+*/
+static int _dispatch(lua_State *L, efs_async_engine *engine)
+{
+	_engine_drain_signal(engine);
+#ifdef ELI_FS_EXTRA_IO_URING
+	if (engine->ring_fd != -1) {
+		_uring_reap(engine);
+	}
+#endif
+	pthread_mutex_lock(&engine->lock);
+	efs_async_req *req = engine->done_head;
+	engine->done_head = engine->done_tail = NULL;
+	pthread_mutex_unlock(&engine->lock);
+
+	int resumed = 0;
+	int errors = 0;
+	while (req != NULL) {
+		efs_async_req *next = req->next;
+		engine->inflight--;
+		lua_State *co = req->co;
+		lua_rawgeti(L, LUA_REGISTRYINDEX, req->co_ref);
+		luaL_unref(L, LUA_REGISTRYINDEX, req->co_ref);
+		if (lua_status(co) == LUA_YIELD) {
+			int nargs = _push_req_result(co, req);
+			int nres;
+			int status = lua_resume(co, L, nargs, &nres);
+			resumed++;
+			if (status == LUA_OK || status == LUA_YIELD) {
+				lua_pop(co, nres);
+			} else {
+				if (errors++ == 0) {
+					lua_newtable(L);
+					lua_insert(L, -2);
+				}
+				lua_xmove(co, L, 1);
+				lua_rawseti(L, -3, errors);
+			}
+		}
+		lua_pop(L, 1); /* coroutine */
+		_req_free(req);
+		req = next;
+	}
+	lua_pushinteger(L, resumed);
+	if (errors > 0) {
+		lua_insert(L, -2);
+		return 2;
+	}
+	return 1;
+}
+
+/*
+** Submits queued requests and resumes coroutines of completed ones
+** without blocking.
+*/
+static int async_poll(lua_State *L)
+{
+	efs_async_engine *engine = _check_engine(L, 1);
+	lua_settop(L, 1);
+#ifdef ELI_FS_EXTRA_IO_URING
+	if (engine->ring_fd != -1 && _uring_submit(engine, 0) == -1) {
+		return push_error(L, NULL);
+	}
+#endif
+	return _dispatch(L, engine);
+}
+
+/*
+** Submits queued requests and waits until at least one completes.
+** @param #2 Timeout in milliseconds (optional, waits forever if missing).
+*/
+static int async_wait(lua_State *L)
+{
+	efs_async_engine *engine = _check_engine(L, 1);
+	int timeout = (int)luaL_optinteger(L, 2, -1);
+	lua_settop(L, 1);
+#ifdef ELI_FS_EXTRA_IO_URING
+	if (engine->ring_fd != -1 && _uring_submit(engine, 0) == -1) {
+		return push_error(L, NULL);
+	}
+#endif
+	if (engine->inflight > 0) {
+		struct pollfd pfd = { .fd = engine->efd, .events = POLLIN };
+		int res;
+		do {
+			res = poll(&pfd, 1, timeout);
+		} while (res == -1 && errno == EINTR);
+		if (res == -1) {
+			return push_error(L, NULL);
+		}
+	}
+	return _dispatch(L, engine);
+}
+
+static int async_fd(lua_State *L)
+{
+	efs_async_engine *engine = _check_engine(L, 1);
+	lua_pushinteger(L, engine->efd);
+	return 1;
+}
+
+static int async_pending(lua_State *L)
+{
+	efs_async_engine *engine = _check_engine(L, 1);
+	lua_pushinteger(L, engine->inflight);
+	return 1;
+}
+
+static int async_backend(lua_State *L)
+{
+	efs_async_engine *engine = _check_engine(L, 1);
+	lua_pushstring(L, _engine_uses_uring(engine, ASYNC_READ) ? "io_uring" :
+								   "threads");
+	return 1;
+}
+
+static int async_gc(lua_State *L)
+{
+	efs_async *a = (efs_async *)luaL_checkudata(L, 1, ASYNC_METATABLE);
+	if (a->engine != NULL) {
+		_engine_close(a->engine);
+		a->engine = NULL;
+	}
+	return 0;
+}
+
+/*
+** Returns async engine of the calling Lua state, creates it on first use.
+** @param #1 Options table { entries = ring size, backend = "threads" }
+**           (optional, used only when the engine is created).
+*/
+int eli_async(lua_State *L)
+{
+	lua_getfield(L, LUA_REGISTRYINDEX, ASYNC_REGISTRY_KEY);
+	if (!lua_isnil(L, -1)) {
+		return 1;
+	}
+	lua_pop(L, 1);
+
+	unsigned entries = ASYNC_DEFAULT_ENTRIES;
+	int force_threads = 0;
+	if (lua_istable(L, 1)) {
+		lua_getfield(L, 1, "entries");
+		entries = (unsigned)luaL_optinteger(L, -1, entries);
+		lua_getfield(L, 1, "backend");
+		const char *backend = luaL_optstring(L, -1, "io_uring");
+		force_threads = strcmp(backend, "threads") == 0;
+		lua_pop(L, 2);
+	}
+
+	efs_async *a = (efs_async *)lua_newuserdata(L, sizeof(efs_async));
+	a->engine = NULL;
+	luaL_getmetatable(L, ASYNC_METATABLE);
+	lua_setmetatable(L, -2);
+	a->engine = _engine_new(entries, force_threads);
+	if (a->engine == NULL) {
+		return push_error(L, NULL);
+	}
+	lua_pushvalue(L, -1);
+	lua_setfield(L, LUA_REGISTRYINDEX, ASYNC_REGISTRY_KEY);
+	return 1;
+}
+
+/*
+** Creates async engine metatable.
+*/
+int async_create_meta(lua_State *L)
+{
+	luaL_newmetatable(L, ASYNC_METATABLE);
+	/* Method table */
+	lua_newtable(L);
+	lua_pushcfunction(L, async_read);
+	lua_setfield(L, -2, "read");
+	lua_pushcfunction(L, async_write);
+	lua_setfield(L, -2, "write");
+	lua_pushcfunction(L, async_stat);
+	lua_setfield(L, -2, "stat");
+	lua_pushcfunction(L, async_open);
+	lua_setfield(L, -2, "open");
+	lua_pushcfunction(L, async_close);
+	lua_setfield(L, -2, "close");
+	lua_pushcfunction(L, async_unlink);
+	lua_setfield(L, -2, "unlink");
+	lua_pushcfunction(L, async_rename);
+	lua_setfield(L, -2, "rename");
+	lua_pushcfunction(L, async_mkdir);
+	lua_setfield(L, -2, "mkdir");
+	lua_pushcfunction(L, async_fsync);
+	lua_setfield(L, -2, "fsync");
+	lua_pushcfunction(L, async_poll);
+	lua_setfield(L, -2, "poll");
+	lua_pushcfunction(L, async_wait);
+	lua_setfield(L, -2, "wait");
+	lua_pushcfunction(L, async_fd);
+	lua_setfield(L, -2, "fd");
+	lua_pushcfunction(L, async_pending);
+	lua_setfield(L, -2, "pending");
+	lua_pushcfunction(L, async_backend);
+	lua_setfield(L, -2, "backend");
+	/* type */
+	lua_pushstring(L, ASYNC_METATABLE);
+	lua_setfield(L, -2, "__type");
+
+	/* Metamethods */
+	lua_setfield(L, -2, "__index");
+	lua_pushcfunction(L, async_gc);
+	lua_setfield(L, -2, "__gc");
+	return 1;
+}
+
+#endif
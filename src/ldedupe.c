@@ -0,0 +1,618 @@
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "lerror.h"
+#include "ldedupe.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+
+int eli_find_duplicates(lua_State *L)
+{
+	errno = ENOSYS; /* = "Function not implemented" */
+	return push_result(L, -1, "find_duplicates is not supported on Windows");
+}
+
+#else
+
+#include "lhash.h"
+#include "llink.h"
+#include "lpool.h"
+#include "lwalk.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define EDGE_SIZE 4096 /* bytes hashed at both ends in partial stage */
+#define HASH_BATCH 32 /* files per pool task */
+#define VERIFY_BUF_SIZE (64 * 1024) /* per file when comparing bytes */
+
+typedef struct efs_dup_file {
+	char *path;
+	dev_t dev;
+	ino_t ino;
+	uint64_t size;
+	int64_t mtime_ns;
+	int64_t ctime_ns;
+	mode_t mode;
+	uid_t uid;
+	gid_t gid;
+	int state; /* 0 pending, 1 hashed, -1 failed */
+	int complete; /* partial hash covered the whole file */
+	unsigned char partial[EFS_SHA256_SIZE];
+	unsigned char full[EFS_SHA256_SIZE];
+} efs_dup_file;
+
+typedef struct efs_dup_scan {
+	pthread_mutex_t lock;
+	efs_dup_file *files;
+	size_t count;
+	size_t cap;
+	uint64_t min_size;
+	int failed;
+} efs_dup_scan;
+
+typedef struct efs_dup_stats {
+	uint64_t bytes_read;
+	uint64_t errors;
+} efs_dup_stats;
+
+typedef struct efs_hash_task {
+	efs_dup_file **files;
+	size_t count;
+	int full;
+	efs_dup_stats *stats;
+} efs_hash_task;
+
+static int64_t _mtime_ns(const struct stat *st)
+{
+#ifdef __APPLE__
+	return (int64_t)st->st_mtimespec.tv_sec * 1000000000 +
+	       st->st_mtimespec.tv_nsec;
+#else
+	return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+#endif
+}
+
+static int64_t _ctime_ns(const struct stat *st)
+{
+#ifdef __APPLE__
+	return (int64_t)st->st_ctimespec.tv_sec * 1000000000 +
+	       st->st_ctimespec.tv_nsec;
+#else
+	return (int64_t)st->st_ctim.tv_sec * 1000000000 + st->st_ctim.tv_nsec;
+#endif
+}
+
+static int _collect(efs_walk_entry *entry, void *ud)
+{
+	efs_dup_scan *scan = (efs_dup_scan *)ud;
+	const struct stat *st = entry->st;
+	if (!S_ISREG(st->st_mode) || (uint64_t)st->st_size < scan->min_size) {
+		return EFS_WALK_CONTINUE;
+	}
+	char *path = strdup(entry->path);
+	pthread_mutex_lock(&scan->lock);
+	if (path != NULL && scan->count == scan->cap) {
+		size_t cap = scan->cap ? scan->cap * 2 : 1024;
+		efs_dup_file *files =
+			realloc(scan->files, cap * sizeof(efs_dup_file));
+		if (files == NULL) {
+			free(path);
+			path = NULL;
+		} else {
+			scan->files = files;
+			scan->cap = cap;
+		}
+	}
+	if (path == NULL) {
+		scan->failed = 1;
+		pthread_mutex_unlock(&scan->lock);
+		return EFS_WALK_STOP;
+	}
+	efs_dup_file *file = &scan->files[scan->count++];
+	memset(file, 0, sizeof(efs_dup_file));
+	file->path = path;
+	file->dev = st->st_dev;
+	file->ino = st->st_ino;
+	file->size = (uint64_t)st->st_size;
+	file->mtime_ns = _mtime_ns(st);
+	file->ctime_ns = _ctime_ns(st);
+	file->mode = st->st_mode;
+	file->uid = st->st_uid;
+	file->gid = st->st_gid;
+	pthread_mutex_unlock(&scan->lock);
+	return EFS_WALK_CONTINUE;
+}
+
+static int _read_full(int fd, unsigned char *buf, size_t len, uint64_t offset)
+{
+	size_t done = 0;
+	while (done < len) {
+		ssize_t n = pread(fd, buf + done, len - done,
+				  (off_t)(offset + done));
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -1; /* shrunk while we were looking */
+		}
+		done += (size_t)n;
+	}
+	return 0;
+}
+
+/*
+** Partial stage hashes first and last EDGE_SIZE bytes, which is the
+** whole file for small ones. Full stage hashes everything.
+*/
+static int _hash_file(efs_dup_file *file, int full, unsigned char *buf,
+		      size_t buf_len, uint64_t *bytes_read)
+{
+	int fd = open(file->path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+	if (fd == -1) {
+		return -1;
+	}
+#ifdef POSIX_FADV_SEQUENTIAL
+	if (full) {
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	}
+#endif
+	efs_sha256 ctx;
+	efs_sha256_init(&ctx);
+	int res = 0;
+	if (!full) {
+		uint64_t head = file->size < EDGE_SIZE ? file->size : EDGE_SIZE;
+		res = _read_full(fd, buf, (size_t)head, 0);
+		if (res == 0) {
+			efs_sha256_update(&ctx, buf, (size_t)head);
+			*bytes_read += head;
+		}
+		if (res == 0 && file->size > EDGE_SIZE) {
+			uint64_t tail_start = file->size > 2 * EDGE_SIZE ?
+						      file->size - EDGE_SIZE :
+						      EDGE_SIZE;
+			size_t tail = (size_t)(file->size - tail_start);
+			res = _read_full(fd, buf, tail, tail_start);
+			if (res == 0) {
+				efs_sha256_update(&ctx, buf, tail);
+				*bytes_read += tail;
+			}
+		}
+		efs_sha256_final(&ctx, file->partial);
+		file->complete = file->size <= 2 * EDGE_SIZE;
+	} else {
+		uint64_t offset = 0;
+		while (res == 0 && offset < file->size) {
+			uint64_t left = file->size - offset;
+			size_t chunk = left < buf_len ? (size_t)left : buf_len;
+			res = _read_full(fd, buf, chunk, offset);
+			efs_sha256_update(&ctx, buf, chunk);
+			offset += chunk;
+		}
+		*bytes_read += offset;
+		efs_sha256_final(&ctx, file->full);
+	}
+	close(fd);
+	return res;
+}
+
+static void _hash_task(void *arg)
+{
+	efs_hash_task *task = (efs_hash_task *)arg;
+	size_t buf_len = task->full ? 256 * 1024 : 2 * EDGE_SIZE;
+	unsigned char *buf = malloc(buf_len);
+	uint64_t bytes = 0, errors = 0;
+	for (size_t i = 0; i < task->count; i++) {
+		efs_dup_file *file = task->files[i];
+		if (buf == NULL ||
+		    _hash_file(file, task->full, buf, buf_len, &bytes) == -1) {
+			file->state = -1;
+			errors++;
+		} else {
+			file->state = 1;
+			if (file->complete) {
+				memcpy(file->full, file->partial, EFS_SHA256_SIZE);
+			}
+		}
+	}
+	free(buf);
+	__atomic_add_fetch(&task->stats->bytes_read, bytes, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&task->stats->errors, errors, __ATOMIC_RELAXED);
+	free(task);
+}
+
+/* hashes files in batches on the pool and waits for all of them */
+static void _hash_files(efs_dup_file **files, size_t count, int full,
+			efs_dup_stats *stats)
+{
+	efs_task_group group;
+	efs_group_init(&group);
+	for (size_t i = 0; i < count; i += HASH_BATCH) {
+		efs_hash_task *task = malloc(sizeof(efs_hash_task));
+		size_t n = count - i < HASH_BATCH ? count - i : HASH_BATCH;
+		if (task == NULL) {
+			for (size_t k = i; k < i + n; k++) {
+				files[k]->state = -1;
+			}
+			__atomic_add_fetch(&stats->errors, n, __ATOMIC_RELAXED);
+			continue;
+		}
+		task->files = files + i;
+		task->count = n;
+		task->full = full;
+		task->stats = stats;
+		efs_group_submit(&group, _hash_task, task);
+	}
+	efs_group_wait(&group);
+	efs_group_destroy(&group);
+}
+
+static int _compare_inode(const void *a, const void *b)
+{
+	const efs_dup_file *x = (const efs_dup_file *)a;
+	const efs_dup_file *y = (const efs_dup_file *)b;
+	if (x->dev != y->dev) {
+		return x->dev < y->dev ? -1 : 1;
+	}
+	if (x->ino != y->ino) {
+		return x->ino < y->ino ? -1 : 1;
+	}
+	return strcmp(x->path, y->path);
+}
+
+static int _compare_size(const void *a, const void *b)
+{
+	const efs_dup_file *x = *(efs_dup_file *const *)a;
+	const efs_dup_file *y = *(efs_dup_file *const *)b;
+	if (x->size != y->size) {
+		return x->size < y->size ? -1 : 1;
+	}
+	return 0;
+}
+
+static int _compare_partial(const void *a, const void *b)
+{
+	const efs_dup_file *x = *(efs_dup_file *const *)a;
+	const efs_dup_file *y = *(efs_dup_file *const *)b;
+	int res = _compare_size(a, b);
+	return res != 0 ? res : memcmp(x->partial, y->partial, EFS_SHA256_SIZE);
+}
+
+static int _compare_full(const void *a, const void *b)
+{
+	const efs_dup_file *x = *(efs_dup_file *const *)a;
+	const efs_dup_file *y = *(efs_dup_file *const *)b;
+	int res = _compare_size(a, b);
+	if (res == 0) {
+		res = memcmp(x->full, y->full, EFS_SHA256_SIZE);
+	}
+	return res != 0 ? res : strcmp(x->path, y->path);
+}
+
+static int _same_content(const void *a, const void *b)
+{
+	const efs_dup_file *x = *(efs_dup_file *const *)a;
+	const efs_dup_file *y = *(efs_dup_file *const *)b;
+	return x->size == y->size &&
+	       memcmp(x->full, y->full, EFS_SHA256_SIZE) == 0;
+}
+
+static int _different_content(const void *a, const void *b)
+{
+	return !_same_content(a, b);
+}
+
+/*
+** Sorts list by order and keeps runs of at least two files that group
+** compares equal, drops the rest. Returns new length.
+*/
+static size_t _keep_groups(efs_dup_file **list, size_t count,
+			   int (*order)(const void *, const void *),
+			   int (*group)(const void *, const void *))
+{
+	qsort(list, count, sizeof(efs_dup_file *), order);
+	size_t out = 0;
+	for (size_t i = 0; i < count;) {
+		size_t j = i + 1;
+		while (j < count && group(&list[i], &list[j]) == 0) {
+			j++;
+		}
+		if (j - i >= 2) {
+			memmove(list + out, list + i,
+				(j - i) * sizeof(efs_dup_file *));
+			out += j - i;
+		}
+		i = j;
+	}
+	return out;
+}
+
+/* drops files that failed hashing */
+static size_t _drop_failed(efs_dup_file **list, size_t count)
+{
+	size_t out = 0;
+	for (size_t i = 0; i < count; i++) {
+		if (list[i]->state == 1) {
+			list[out++] = list[i];
+		}
+	}
+	return out;
+}
+
+static void _set_stat(lua_State *L, const char *name, uint64_t value)
+{
+	lua_pushinteger(L, (lua_Integer)value);
+	lua_setfield(L, -2, name);
+}
+
+/* file is still the inode that was hashed, untouched since */
+static int _unchanged(const efs_dup_file *file, const struct stat *st)
+{
+	return st->st_dev == file->dev && st->st_ino == file->ino &&
+	       (uint64_t)st->st_size == file->size &&
+	       _mtime_ns(st) == file->mtime_ns &&
+	       _ctime_ns(st) == file->ctime_ns;
+}
+
+static int _same_bytes(int a, int b, uint64_t size, unsigned char *buf,
+		       uint64_t *bytes_read)
+{
+	unsigned char *other = buf + VERIFY_BUF_SIZE;
+	for (uint64_t offset = 0; offset < size;) {
+		size_t len = size - offset < VERIFY_BUF_SIZE ?
+				     (size_t)(size - offset) :
+				     VERIFY_BUF_SIZE;
+		if (_read_full(a, buf, len, offset) == -1 ||
+		    _read_full(b, other, len, offset) == -1 ||
+		    memcmp(buf, other, len) != 0) {
+			return 0;
+		}
+		*bytes_read += 2 * (uint64_t)len;
+		offset += len;
+	}
+	return 1;
+}
+
+/*
+** Rechecks a duplicate right before it is replaced. Both files have to
+** be the inodes that were hashed, unchanged since, and byte for byte
+** equal. The replaced path takes over owner and mode of the kept file,
+** so files differing there are left alone as well.
+*/
+static int _verify_duplicate(const efs_dup_file *keep,
+			     const efs_dup_file *dup, unsigned char *buf,
+			     uint64_t *bytes_read)
+{
+	int kfd = open(keep->path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+	if (kfd == -1) {
+		return 0;
+	}
+	int dfd = open(dup->path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+	if (dfd == -1) {
+		close(kfd);
+		return 0;
+	}
+	struct stat kst, dst;
+	int same = fstat(kfd, &kst) == 0 && fstat(dfd, &dst) == 0 &&
+		   _unchanged(keep, &kst) && _unchanged(dup, &dst) &&
+		   kst.st_uid == dst.st_uid && kst.st_gid == dst.st_gid &&
+		   (kst.st_mode & 07777) == (dst.st_mode & 07777) &&
+		   _same_bytes(kfd, dfd, keep->size, buf, bytes_read);
+	close(kfd);
+	close(dfd);
+	return same;
+}
+
+/* a new hardlink to the kept file changed its ctime, not its content */
+static void _relinked(efs_dup_file *keep)
+{
+	struct stat st;
+	if (lstat(keep->path, &st) == 0 && st.st_dev == keep->dev &&
+	    st.st_ino == keep->ino) {
+		keep->ctime_ns = _ctime_ns(&st);
+	}
+}
+
+static void _free_scan(efs_dup_scan *scan)
+{
+	for (size_t i = 0; i < scan->count; i++) {
+		free(scan->files[i].path);
+	}
+	free(scan->files);
+	pthread_mutex_destroy(&scan->lock);
+}
+
+/*
+** Finds files with identical content.
+** @param #1 Root directory or array of them.
+** @param #2 Options table (optional):
+**   min_size = 1, one_file_system = false,
+**   link = "hard"|"reflink" to replace duplicates by links to the
+**   first path of their group. Each duplicate is compared byte for
+**   byte right before; ones that changed since hashing or differ in
+**   owner or mode are counted in link_skipped and left in place.
+** Returns array of { size, hash, paths } and statistics table.
+*/
+int eli_find_duplicates(lua_State *L)
+{
+	luaL_argcheck(L, lua_isstring(L, 1) || lua_istable(L, 1), 1,
+		      "path or array of paths expected");
+	efs_dup_scan scan;
+	memset(&scan, 0, sizeof(scan));
+	scan.min_size = 1;
+	int flags = 0;
+	int link_kind = -1;
+	if (lua_istable(L, 2)) {
+		lua_getfield(L, 2, "min_size");
+		scan.min_size = (uint64_t)luaL_optinteger(L, -1, 1);
+		lua_getfield(L, 2, "one_file_system");
+		flags |= lua_toboolean(L, -1) ? EFS_WALK_XDEV : 0;
+		lua_getfield(L, 2, "link");
+		const char *link = luaL_optstring(L, -1, NULL);
+		if (link != NULL) {
+			if (strcmp(link, "hard") == 0) {
+				link_kind = EFS_LINK_HARD;
+			} else if (strcmp(link, "reflink") == 0) {
+				link_kind = EFS_LINK_REFLINK;
+			} else {
+				return luaL_argerror(
+					L, 2, "link must be 'hard' or 'reflink'");
+			}
+		}
+		lua_pop(L, 3);
+	}
+	int root_count = lua_istable(L, 1) ? (int)luaL_len(L, 1) : 1;
+	for (int r = 1; r <= root_count; r++) {
+		if (lua_istable(L, 1)) {
+			lua_rawgeti(L, 1, r);
+		} else {
+			lua_pushvalue(L, 1);
+		}
+		luaL_argcheck(L, lua_type(L, -1) == LUA_TSTRING, 1,
+			      "array of paths expected");
+		lua_pop(L, 1);
+	}
+
+	pthread_mutex_init(&scan.lock, NULL);
+	efs_walker walker = { _collect, NULL, &scan, flags, 0, 0 };
+	uint64_t walk_errors = 0;
+	for (int r = 1; r <= root_count && !scan.failed; r++) {
+		if (lua_istable(L, 1)) {
+			lua_rawgeti(L, 1, r);
+		} else {
+			lua_pushvalue(L, 1);
+		}
+		const char *root = lua_tostring(L, -1);
+		if (efs_walk_parallel(&walker, root) == -1) {
+			int err = errno;
+			_free_scan(&scan);
+			errno = err;
+			return push_error(L, root);
+		}
+		walk_errors += (uint64_t)walker.errors;
+		lua_pop(L, 1);
+	}
+	if (scan.failed) {
+		_free_scan(&scan);
+		return luaL_error(L, "find_duplicates: out of memory");
+	}
+
+	/* the same inode reached through several hardlinks is one file */
+	qsort(scan.files, scan.count, sizeof(efs_dup_file), _compare_inode);
+	efs_dup_file **list = malloc((scan.count + 1) * sizeof(efs_dup_file *));
+	if (list == NULL) {
+		_free_scan(&scan);
+		return luaL_error(L, "find_duplicates: out of memory");
+	}
+	size_t count = 0;
+	uint64_t same_inode = 0;
+	for (size_t i = 0; i < scan.count; i++) {
+		if (i > 0 && scan.files[i].dev == scan.files[i - 1].dev &&
+		    scan.files[i].ino == scan.files[i - 1].ino) {
+			same_inode++;
+			continue;
+		}
+		list[count++] = &scan.files[i];
+	}
+
+	efs_dup_stats stats = { 0, 0 };
+	count = _keep_groups(list, count, _compare_size, _compare_size);
+	uint64_t size_candidates = count;
+	_hash_files(list, count, 0, &stats);
+	count = _keep_groups(list, _drop_failed(list, count), _compare_partial,
+			     _compare_partial);
+	uint64_t partial_candidates = count;
+	/* small files were hashed completely in the partial stage */
+	size_t full_count = 0;
+	for (size_t i = 0; i < count; i++) {
+		if (!list[i]->complete) {
+			efs_dup_file *tmp = list[full_count];
+			list[full_count++] = list[i];
+			list[i] = tmp;
+		}
+	}
+	_hash_files(list, full_count, 1, &stats);
+	count = _keep_groups(list, _drop_failed(list, count), _compare_full,
+			     _different_content);
+
+	uint64_t groups = 0, duplicates = 0, wasted = 0, linked = 0;
+	uint64_t link_errors = 0, link_skipped = 0;
+	unsigned char *verify = NULL;
+	if (link_kind >= 0 && count > 0 &&
+	    (verify = malloc(2 * VERIFY_BUF_SIZE)) == NULL) {
+		free(list);
+		_free_scan(&scan);
+		return luaL_error(L, "find_duplicates: out of memory");
+	}
+	lua_newtable(L);
+	for (size_t i = 0; i < count;) {
+		size_t j = i + 1;
+		while (j < count && _same_content(&list[i], &list[j])) {
+			j++;
+		}
+		lua_createtable(L, 0, 3);
+		lua_pushinteger(L, (lua_Integer)list[i]->size);
+		lua_setfield(L, -2, "size");
+		char hex[EFS_SHA256_SIZE * 2 + 1];
+		efs_hex(list[i]->full, EFS_SHA256_SIZE, hex);
+		lua_pushstring(L, hex);
+		lua_setfield(L, -2, "hash");
+		lua_createtable(L, (int)(j - i), 0);
+		for (size_t k = i; k < j; k++) {
+			lua_pushstring(L, list[k]->path);
+			lua_rawseti(L, -2, (lua_Integer)(k - i + 1));
+			if (k == i || link_kind < 0) {
+				continue;
+			}
+			if (link_kind == EFS_LINK_HARD &&
+			    list[k]->dev != list[i]->dev) {
+				link_errors++;
+			} else if (!_verify_duplicate(list[i], list[k], verify,
+						      &stats.bytes_read)) {
+				link_skipped++;
+			} else if (efs_replace_with_link(list[i]->path,
+							 list[k]->path,
+							 link_kind) == -1) {
+				link_errors++;
+			} else {
+				linked++;
+				_relinked(list[i]);
+			}
+		}
+		lua_setfield(L, -2, "paths");
+		lua_rawseti(L, -2, (lua_Integer)++groups);
+		duplicates += j - i - 1;
+		wasted += (j - i - 1) * list[i]->size;
+		i = j;
+	}
+	free(list);
+	free(verify);
+
+	lua_createtable(L, 0, 13);
+	_set_stat(L, "files", scan.count);
+	_set_stat(L, "same_inode", same_inode);
+	_set_stat(L, "size_candidates", size_candidates);
+	_set_stat(L, "partial_candidates", partial_candidates);
+	_set_stat(L, "full_hashed", full_count);
+	_set_stat(L, "bytes_read", stats.bytes_read);
+	_set_stat(L, "errors", stats.errors + walk_errors);
+	_set_stat(L, "groups", groups);
+	_set_stat(L, "duplicates", duplicates);
+	_set_stat(L, "wasted_bytes", wasted);
+	if (link_kind >= 0) {
+		_set_stat(L, "linked", linked);
+		_set_stat(L, "link_errors", link_errors);
+		_set_stat(L, "link_skipped", link_skipped);
+	}
+	_free_scan(&scan);
+	return 2;
+}
+
+#endif
@@ -0,0 +1,8 @@
+#ifndef ELI_EXTRA_FS_DEDUPE_H__
+#define ELI_EXTRA_FS_DEDUPE_H__
+
+#include "lua.h"
+
+int eli_find_duplicates(lua_State *L);
+
+#endif /* ELI_EXTRA_FS_DEDUPE_H__ */
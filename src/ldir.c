@@ -63,10 +63,12 @@ typedef struct dir_data {
 #ifdef _WIN32
 	intptr_t hFile;
 	char pattern[LMAXPATHLEN + 1];
+	struct _finddata_t c_file; /* last entry read by _dir_next_name */
 #else
 	DIR *dir;
 #endif
 	int as_dir_entries;
+	int batch_size; /* entries per iter_dir_batched step */
 } dir_data;
 
 typedef struct dir_entry_data {
@@ -351,18 +353,139 @@ static int lclosedir(lua_State *L)
 #ifdef _WIN32
 	if (!d->closed && d->hFile) {
 		_findclose(d->hFile);
-		free(d->path);
 	}
 #else
 	if (!d->closed && d->dir) {
 		closedir(d->dir);
-		free(d->path);
 	}
 #endif
+	/* also after iteration ran to its end and closed the handle */
+	free(d->path);
+	d->path = NULL;
 	d->closed = 1;
 	return 0;
 }
 
+/*
+** Returns name of next entry skipping dot files, NULL once there are no
+** more (the directory is closed then).
+*/
+static const char *_dir_next_name(dir_data *d)
+{
+	if (d->closed) {
+		return NULL;
+	}
+#ifdef _WIN32
+	long found;
+	if (d->hFile == 0L) {
+		d->hFile = _findfirst(d->pattern, &d->c_file);
+		found = d->hFile == -1L ? -1L : 0;
+		if (found == -1L) {
+			d->hFile = 0L;
+		}
+	} else {
+		found = _findnext(d->hFile, &d->c_file);
+	}
+	while (found != -1L && isdotfile(d->c_file.name)) {
+		found = _findnext(d->hFile, &d->c_file);
+	}
+	if (found == -1L) {
+		if (d->hFile) {
+			_findclose(d->hFile);
+		}
+		d->closed = 1;
+		return NULL;
+	}
+	return d->c_file.name;
+#else
+	struct dirent *entry;
+	if (d->dir == NULL) {
+		return NULL;
+	}
+	while ((entry = readdir(d->dir)) != NULL && isdotfile(entry->d_name))
+		continue;
+	if (entry == NULL) {
+		closedir(d->dir);
+		d->closed = 1;
+		return NULL;
+	}
+	return entry->d_name;
+#endif
+}
+
+/*
+** Fills table at tidx with up to n entries and clears what is left of
+** a previous batch after them. Pushes the table and the entry count.
+*/
+static int _fill_batch(lua_State *L, dir_data *d, lua_Integer n, int tidx,
+		       int as_dir_entries)
+{
+	lua_Integer count = 0;
+	const char *name;
+	while (count < n && (name = _dir_next_name(d)) != NULL) {
+		if (as_dir_entries) {
+			struct dir_entry_data *result = lua_newuserdata(
+				L, sizeof(struct dir_entry_data));
+			result->name = clone_string(name);
+			result->folder = clone_string(d->path);
+			result->closed = 0;
+			luaL_getmetatable(L, DIR_ENTRY_METATABLE);
+			lua_setmetatable(L, -2);
+		} else {
+			lua_pushstring(L, name);
+		}
+		lua_rawseti(L, tidx, ++count);
+	}
+	lua_Integer len = (lua_Integer)lua_rawlen(L, tidx);
+	for (lua_Integer i = count + 1; i <= len; i++) {
+		lua_pushnil(L);
+		lua_rawseti(L, tidx, i);
+	}
+	lua_pushvalue(L, tidx);
+	lua_pushinteger(L, count);
+	return 2;
+}
+
+/*
+** Reads next batch of entries.
+** @param #1 Directory.
+** @param #2 Maximum number of entries.
+** @param #3 Table to fill and reuse (optional), entries after the batch
+**           are cleared.
+** Returns the table and number of entries, 0 once the directory is
+** exhausted.
+*/
+static int dir_next_batch(lua_State *L)
+{
+	dir_data *d = (dir_data *)luaL_checkudata(L, 1, DIR_METATABLE);
+	lua_Integer n = luaL_checkinteger(L, 2);
+	luaL_argcheck(L, n > 0, 2, "batch size must be positive");
+	if (lua_isnoneornil(L, 3)) {
+		lua_settop(L, 2);
+		lua_createtable(L, (int)(n < 1024 ? n : 1024), 0);
+	} else {
+		luaL_checktype(L, 3, LUA_TTABLE);
+		lua_settop(L, 3);
+	}
+	return _fill_batch(L, d, n, 3, d->as_dir_entries == 1);
+}
+
+/*
+** Step of iter_dir_batched, the batch table lives in the user value of
+** the directory.
+*/
+static int dir_batch_iter(lua_State *L)
+{
+	dir_data *d = (dir_data *)luaL_checkudata(L, 1, DIR_METATABLE);
+	lua_settop(L, 1);
+	lua_getiuservalue(L, 1, 1);
+	_fill_batch(L, d, d->batch_size, 2, d->as_dir_entries == 1);
+	if (lua_tointeger(L, -1) == 0) {
+		return 0; /* ends the loop */
+	}
+	return 2;
+}
+
 static int dir_path(lua_State *L)
 {
 	dir_data *d = (dir_data *)luaL_checkudata(L, 1, DIR_METATABLE);
@@ -371,6 +494,60 @@ static int dir_path(lua_State *L)
 	return 1;
 }
 
+/*
+** Iterates directory in batches, every step yields the same table
+** refilled with up to batch_size entries and the number of entries:
+**   for batch, n in fs.iter_dir_batched(path, 1024) do ... end
+** @param #1 Directory path.
+** @param #2 Batch size (optional, defaults to 256).
+** @param #3 Options table { entries = false } (optional), entries yields
+**           dir entries instead of names.
+*/
+int eli_iter_dir_batched(lua_State *L)
+{
+	const char *path = luaL_checkstring(L, 1);
+	lua_Integer batch_size = luaL_optinteger(L, 2, 256);
+	luaL_argcheck(L, batch_size > 0 && batch_size <= 0x7fffffff, 2,
+		      "batch size must be positive");
+	int as_dir_entries = 0;
+	if (lua_istable(L, 3)) {
+		lua_getfield(L, 3, "entries");
+		as_dir_entries = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+	}
+	dir_data *d;
+
+	lua_pushcfunction(L, dir_batch_iter);
+	d = (dir_data *)lua_newuserdatauv(L, sizeof(dir_data), 1);
+	luaL_getmetatable(L, DIR_METATABLE);
+	lua_setmetatable(L, -2);
+	d->closed = 0;
+	d->as_dir_entries = as_dir_entries;
+	d->batch_size = (int)batch_size;
+	d->path = clone_string(path);
+	lua_createtable(L, (int)(batch_size < 1024 ? batch_size : 1024), 0);
+	lua_setiuservalue(L, -2, 1);
+#ifdef _WIN32
+	d->hFile = 0L;
+	if (strlen(path) > LMAXPATHLEN - 2)
+		return luaL_error(L, "path too long: %s", path);
+	else
+		sprintf(d->pattern, "%s/*", path);
+#else
+	d->dir = opendir(path);
+	if (d->dir == NULL) {
+		char error_msg[1024];
+		snprintf(error_msg, sizeof(error_msg), "cannot open %s: %s",
+			 path, strerror(errno));
+		d->closed = 1;
+		return push_error(L, error_msg);
+	}
+#endif
+	lua_pushnil(L);
+	lua_pushvalue(L, -2);
+	return 4;
+}
+
 /*
 ** Creates directory metatable.
 */
@@ -382,6 +559,8 @@ int dir_create_meta(lua_State *L)
 	lua_newtable(L);
 	lua_pushcfunction(L, dir_iter);
 	lua_setfield(L, -2, "next");
+	lua_pushcfunction(L, dir_next_batch);
+	lua_setfield(L, -2, "next_batch");
 	lua_pushcfunction(L, lclosedir);
 	lua_setfield(L, -2, "close");
 	lua_pushcfunction(L, dir_path);
@@ -406,16 +585,18 @@ int dir_entry_type(lua_State *L)
 	char *path = joinpath(ded->folder, ded->name);
 
 	if (!path) {
-		push_error(L, "Out of memory");
+		return push_error(L, "Out of memory");
 	}
 
 	STAT_STRUCT info;
 	if (STAT_FUNC(path, &info)) {
+		int err = errno;
 		lua_pushnil(L);
 		lua_pushfstring(L,
 				"cannot obtain information from path '%s': %s",
-				path, strerror(errno));
-		lua_pushinteger(L, errno);
+				path, strerror(err));
+		lua_pushinteger(L, err);
+		free(path);
 		return 3;
 	}
 	free(path);
@@ -441,7 +622,7 @@ static int dir_entry_fullpath(lua_State *L)
 
 	char *res = joinpath(ded->folder, ded->name);
 	if (!res) {
-		push_error(L, "Out of memory");
+		return push_error(L, "Out of memory");
 	}
 
 	lua_pushstring(L, res);
@@ -8,6 +8,7 @@ int eli_rmdir(lua_State *L);
 int eli_read_dir(lua_State *L);
 int eli_open_dir(lua_State *L);
 int eli_iter_dir(lua_State *L);
+int eli_iter_dir_batched(lua_State *L);
 
 int dir_entry_type(lua_State *L);
 int dir_create_meta(lua_State *L);
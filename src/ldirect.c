@@ -0,0 +1,636 @@
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "lerror.h"
+#include "lfsutil.h"
+#include "ldirect.h"
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+
+#ifndef _WIN32
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#endif
+
+#define DIRECT_FILE_METATABLE "ELI_DIRECT_FILE"
+
+#define DIRECT_DEFAULT_ALIGN 4096
+#define DIRECT_MIN_ALIGN 512
+#define DIRECT_DEFAULT_CHUNK (1024 * 1024)
+#define DIRECT_POOL_SIZE 8
+
+#ifdef _WIN32
+
+int eli_open_direct(lua_State *L)
+{
+	errno = ENOSYS; /* = "Function not implemented" */
+	return push_result(L, -1, "open_direct is not supported on Windows");
+}
+
+int direct_file_create_meta(lua_State *L)
+{
+	return 0;
+}
+
+#else
+
+/*
+** Pool of aligned buffers shared by all direct file handles.
+** Buffers are kept around after a handle is closed so streams opened
+** one after another do not hit posix_memalign on every open.
+*/
+typedef struct efs_aligned_buffer {
+	void *data;
+	size_t size;
+	size_t align;
+} efs_aligned_buffer;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static efs_aligned_buffer pool[DIRECT_POOL_SIZE];
+static int pool_count = 0;
+
+static void *_pool_acquire(size_t size, size_t align)
+{
+	void *data = NULL;
+	pthread_mutex_lock(&pool_lock);
+	for (int i = 0; i < pool_count; i++) {
+		if (pool[i].size == size && pool[i].align % align == 0) {
+			data = pool[i].data;
+			pool[i] = pool[--pool_count];
+			break;
+		}
+	}
+	pthread_mutex_unlock(&pool_lock);
+	if (data == NULL && posix_memalign(&data, align, size) != 0) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	return data;
+}
+
+static void _pool_release(void *data, size_t size, size_t align)
+{
+	if (data == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&pool_lock);
+	if (pool_count < DIRECT_POOL_SIZE) {
+		pool[pool_count].data = data;
+		pool[pool_count].size = size;
+		pool[pool_count].align = align;
+		pool_count++;
+		data = NULL;
+	}
+	pthread_mutex_unlock(&pool_lock);
+	free(data);
+}
+
+typedef struct efs_direct_file {
+	int fd;
+	int direct; /* O_DIRECT (or F_NOCACHE) is in effect */
+	int writable;
+	size_t align;
+	size_t chunk;
+	char *buf; /* aligned staging buffer of `chunk` bytes */
+	size_t buffered; /* pending bytes in buf (unconsumed in read mode) */
+	size_t head; /* first unconsumed byte in buf (read mode) */
+	int eof; /* last read came back short (read mode) */
+	off_t offset; /* kept aligned until the final short read */
+} efs_direct_file;
+
+static int _set_direct(int fd, int enable)
+{
+#if defined(O_DIRECT)
+	int flags = fcntl(fd, F_GETFL);
+	if (flags == -1) {
+		return -1;
+	}
+	flags = enable ? (flags | O_DIRECT) : (flags & ~O_DIRECT);
+	return fcntl(fd, F_SETFL, flags);
+#elif defined(F_NOCACHE)
+	return fcntl(fd, F_NOCACHE, enable ? 1 : 0);
+#else
+	(void)fd;
+	(void)enable;
+	errno = EINVAL;
+	return -1;
+#endif
+}
+
+static size_t _round_up(size_t value, size_t align)
+{
+	return (value + align - 1) / align * align;
+}
+
+/*
+** Writes `len` bytes from the staging buffer at the current offset.
+** If the filesystem refuses the direct write we drop O_DIRECT and
+** retry buffered, same as when the open itself is rejected.
+*/
+static int _direct_pwrite(efs_direct_file *df, const char *data, size_t len)
+{
+	size_t done = 0;
+	while (done < len) {
+		ssize_t n = pwrite(df->fd, data + done, len - done,
+				   df->offset + done);
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EINVAL && df->direct) {
+				if (_set_direct(df->fd, 0) == -1) {
+					return -1;
+				}
+				df->direct = 0;
+				continue;
+			}
+			return -1;
+		}
+		done += (size_t)n;
+	}
+	df->offset += (off_t)len;
+	return 0;
+}
+
+static ssize_t _direct_pread(efs_direct_file *df, char *data, size_t len)
+{
+	size_t done = 0;
+	while (done < len) {
+		ssize_t n = pread(df->fd, data + done, len - done,
+				  df->offset + done);
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EINVAL && df->direct) {
+				if (_set_direct(df->fd, 0) == -1) {
+					return -1;
+				}
+				df->direct = 0;
+				continue;
+			}
+			return -1;
+		}
+		if (n == 0) {
+			break;
+		}
+		done += (size_t)n;
+		/* direct reads past EOF come back short and unaligned */
+		if (df->direct && done % df->align != 0) {
+			break;
+		}
+	}
+	df->offset += (off_t)done;
+	if (done < len) {
+		df->eof = 1;
+	}
+	return (ssize_t)done;
+}
+
+/*
+** Returns the number of unconsumed bytes at df->buf + df->head,
+** reading the next chunk when the staging buffer is drained.
+** Callers that need less than a chunk leave the rest in the buffer
+** instead of moving the file offset back, which would leave it
+** unaligned and make every later O_DIRECT read fail.
+*/
+static ssize_t _direct_fill(efs_direct_file *df)
+{
+	if (df->buffered == 0 && !df->eof) {
+		ssize_t n = _direct_pread(df, df->buf, df->chunk);
+		if (n == -1) {
+			return -1;
+		}
+		df->head = 0;
+		df->buffered = (size_t)n;
+	}
+	return (ssize_t)df->buffered;
+}
+
+static void _direct_consume(efs_direct_file *df, size_t len)
+{
+	df->head += len;
+	df->buffered -= len;
+}
+
+/*
+** Writes out the aligned part of the staging buffer. With `final` set
+** the unaligned tail is written as well, with O_DIRECT switched off
+** because no further aligned writes can follow it.
+*/
+static int _direct_flush(efs_direct_file *df, int final)
+{
+	size_t aligned = df->buffered / df->align * df->align;
+	if (aligned > 0) {
+		if (_direct_pwrite(df, df->buf, aligned) == -1) {
+			return -1;
+		}
+		memmove(df->buf, df->buf + aligned, df->buffered - aligned);
+		df->buffered -= aligned;
+	}
+	if (final && df->buffered > 0) {
+		if (df->direct) {
+			if (_set_direct(df->fd, 0) == -1) {
+				return -1;
+			}
+			df->direct = 0;
+		}
+		if (_direct_pwrite(df, df->buf, df->buffered) == -1) {
+			return -1;
+		}
+		df->buffered = 0;
+	}
+	return 0;
+}
+
+static int _direct_write(efs_direct_file *df, const char *data, size_t len)
+{
+	while (len > 0) {
+		size_t room = df->chunk - df->buffered;
+		size_t n = len < room ? len : room;
+		memcpy(df->buf + df->buffered, data, n);
+		df->buffered += n;
+		data += n;
+		len -= n;
+		if (df->buffered == df->chunk && _direct_flush(df, 0) == -1) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int _direct_close(efs_direct_file *df)
+{
+	int res = 0;
+	if (df->fd == -1) {
+		return 0;
+	}
+	if (df->writable && _direct_flush(df, 1) == -1) {
+		res = -1;
+	}
+	if (close(df->fd) == -1) {
+		res = -1;
+	}
+	df->fd = -1;
+	_pool_release(df->buf, df->chunk, df->align);
+	df->buf = NULL;
+	return res;
+}
+
+static efs_direct_file *_check_direct_file(lua_State *L, int idx)
+{
+	efs_direct_file *df = (efs_direct_file *)luaL_checkudata(
+		L, idx, DIRECT_FILE_METATABLE);
+	luaL_argcheck(L, df->fd != -1, idx,
+		      "closed " DIRECT_FILE_METATABLE);
+	return df;
+}
+
+/*
+** Opens file for cache-bypassing I/O.
+** @param #1 File path.
+** @param #2 Mode 'r' (read) or 'w' (write, truncates) (optional).
+** @param #3 Options table { chunk_size = bytes } (optional).
+*/
+int eli_open_direct(lua_State *L)
+{
+	const char *path = luaL_checkstring(L, 1);
+	const char *mode = luaL_optstring(L, 2, "r");
+	int flags;
+	switch (*mode) {
+	case 'r':
+		flags = O_RDONLY;
+		break;
+	case 'w':
+		flags = O_WRONLY | O_CREAT | O_TRUNC;
+		break;
+	default:
+		return luaL_argerror(L, 2, "invalid mode");
+	}
+	size_t chunk = DIRECT_DEFAULT_CHUNK;
+	if (lua_istable(L, 3)) {
+		lua_getfield(L, 3, "chunk_size");
+		chunk = (size_t)luaL_optinteger(L, -1, DIRECT_DEFAULT_CHUNK);
+		lua_pop(L, 1);
+		luaL_argcheck(L, chunk > 0, 3, "chunk_size must be positive");
+	}
+
+	int direct = 1;
+#ifdef O_DIRECT
+	int fd = open(path, flags | O_DIRECT | O_CLOEXEC, 0666);
+	if (fd == -1 && errno == EINVAL) {
+		/* tmpfs and friends reject O_DIRECT */
+		direct = 0;
+		fd = open(path, flags | O_CLOEXEC, 0666);
+	}
+#else
+	int fd = open(path, flags | O_CLOEXEC, 0666);
+	if (fd != -1 && _set_direct(fd, 1) == -1) {
+		direct = 0;
+	}
+#endif
+	if (fd == -1) {
+		return push_error(L, NULL);
+	}
+
+	struct stat info;
+	if (fstat(fd, &info) == -1) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return push_error(L, NULL);
+	}
+	size_t align = (size_t)info.st_blksize;
+	if (align < DIRECT_MIN_ALIGN || (align & (align - 1)) != 0) {
+		align = DIRECT_DEFAULT_ALIGN;
+	}
+	chunk = _round_up(chunk, align);
+
+	efs_direct_file *df = (efs_direct_file *)lua_newuserdata(
+		L, sizeof(efs_direct_file));
+	df->fd = fd;
+	df->direct = direct;
+	df->writable = *mode == 'w';
+	df->align = align;
+	df->chunk = chunk;
+	df->buffered = 0;
+	df->head = 0;
+	df->eof = 0;
+	df->offset = 0;
+	df->buf = _pool_acquire(chunk, align);
+	luaL_getmetatable(L, DIRECT_FILE_METATABLE);
+	lua_setmetatable(L, -2);
+	if (df->buf == NULL) {
+		_direct_close(df);
+		return push_error(L, NULL);
+	}
+#ifdef POSIX_FADV_SEQUENTIAL
+	if (!direct) {
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	}
+#endif
+	return 1;
+}
+
+/*
+** Reads up to n bytes (rounded up to alignment) and returns them.
+** Returns nil at end of file.
+*/
+static int direct_file_read(lua_State *L)
+{
+	efs_direct_file *df = _check_direct_file(L, 1);
+	luaL_argcheck(L, !df->writable, 1, "file is not open for reading");
+	size_t len = (size_t)luaL_optinteger(L, 2, (lua_Integer)df->chunk);
+	luaL_argcheck(L, len > 0, 2, "length must be positive");
+	len = _round_up(len, df->align);
+
+	if (df->buffered > 0) {
+		/* tail left over from a limited read_into/write_from */
+		size_t n = len < df->buffered ? len : df->buffered;
+		lua_pushlstring(L, df->buf + df->head, n);
+		_direct_consume(df, n);
+		return 1;
+	}
+	if (df->eof) {
+		lua_pushnil(L);
+		return 1;
+	}
+	char *data = df->buf;
+	int pooled = len != df->chunk;
+	if (pooled && (data = _pool_acquire(len, df->align)) == NULL) {
+		return push_error(L, NULL);
+	}
+	ssize_t n = _direct_pread(df, data, len);
+	int err = errno;
+	if (n > 0) {
+		lua_pushlstring(L, data, (size_t)n);
+	}
+	if (pooled) {
+		_pool_release(data, len, df->align);
+	}
+	if (n == -1) {
+		errno = err;
+		return push_error(L, NULL);
+	}
+	if (n == 0) {
+		lua_pushnil(L);
+	}
+	return 1;
+}
+
+static int direct_file_write(lua_State *L)
+{
+	efs_direct_file *df = _check_direct_file(L, 1);
+	luaL_argcheck(L, df->writable, 1, "file is not open for writing");
+	int top = lua_gettop(L);
+	for (int i = 2; i <= top; i++) {
+		size_t len;
+		const char *data = luaL_checklstring(L, i, &len);
+		if (_direct_write(df, data, len) == -1) {
+			return push_error(L, NULL);
+		}
+	}
+	lua_settop(L, 1);
+	return 1;
+}
+
+/*
+** Copies the rest of this file into the target, chunk by chunk.
+** @param #2 Target FILE* or direct file opened for writing.
+** @param #3 Maximum number of bytes to copy (optional).
+** Returns number of bytes copied.
+*/
+static int direct_file_read_into(lua_State *L)
+{
+	efs_direct_file *df = _check_direct_file(L, 1);
+	luaL_argcheck(L, !df->writable, 1, "file is not open for reading");
+	efs_direct_file *target = (efs_direct_file *)luaL_testudata(
+		L, 2, DIRECT_FILE_METATABLE);
+	FILE *fh = NULL;
+	if (target == NULL) {
+		fh = check_file(L, 2, "read_into");
+	} else {
+		luaL_argcheck(L, target->fd != -1 && target->writable, 2,
+			      "target is not open for writing");
+	}
+	lua_Integer limit = luaL_optinteger(L, 3, -1);
+
+	lua_Integer total = 0;
+	while (limit < 0 || total < limit) {
+		ssize_t n = _direct_fill(df);
+		if (n == -1) {
+			return push_error(L, NULL);
+		}
+		if (n == 0) {
+			break;
+		}
+		if (limit >= 0 && total + n > limit) {
+			n = (ssize_t)(limit - total);
+		}
+		const char *data = df->buf + df->head;
+		int res = target != NULL ?
+				  _direct_write(target, data, (size_t)n) :
+				  (fwrite(data, 1, (size_t)n, fh) ==
+							   (size_t)n ?
+						   0 :
+						   -1);
+		if (res == -1) {
+			return push_error(L, NULL);
+		}
+		_direct_consume(df, (size_t)n);
+		total += n;
+	}
+	lua_pushinteger(L, total);
+	return 1;
+}
+
+/*
+** Copies source into this file, chunk by chunk.
+** @param #2 Source FILE* or direct file opened for reading.
+** @param #3 Maximum number of bytes to copy (optional).
+** Returns number of bytes copied.
+*/
+static int direct_file_write_from(lua_State *L)
+{
+	efs_direct_file *df = _check_direct_file(L, 1);
+	luaL_argcheck(L, df->writable, 1, "file is not open for writing");
+	efs_direct_file *source = (efs_direct_file *)luaL_testudata(
+		L, 2, DIRECT_FILE_METATABLE);
+	FILE *fh = NULL;
+	if (source == NULL) {
+		fh = check_file(L, 2, "write_from");
+	} else {
+		luaL_argcheck(L, source->fd != -1 && !source->writable, 2,
+			      "source is not open for reading");
+	}
+	lua_Integer limit = luaL_optinteger(L, 3, -1);
+
+	lua_Integer total = 0;
+	while (limit < 0 || total < limit) {
+		size_t want = df->chunk;
+		if (limit >= 0 && (lua_Integer)want > limit - total) {
+			want = (size_t)(limit - total);
+		}
+		ssize_t n;
+		if (source != NULL) {
+			n = _direct_fill(source);
+			if (n > 0 && (size_t)n > want) {
+				n = (ssize_t)want;
+			}
+			if (n > 0) {
+				const char *data = source->buf + source->head;
+				if (_direct_write(df, data, (size_t)n) == -1) {
+					return push_error(L, NULL);
+				}
+				_direct_consume(source, (size_t)n);
+			}
+		} else {
+			/* fill the staging buffer directly to skip a copy */
+			size_t room = df->chunk - df->buffered;
+			n = (ssize_t)fread(df->buf + df->buffered, 1,
+					   want < room ? want : room, fh);
+			if (n == 0 && ferror(fh)) {
+				return push_error(L, NULL);
+			}
+			df->buffered += (size_t)n;
+			if (df->buffered == df->chunk &&
+			    _direct_flush(df, 0) == -1) {
+				return push_error(L, NULL);
+			}
+		}
+		if (n == -1) {
+			return push_error(L, NULL);
+		}
+		if (n == 0) {
+			break;
+		}
+		total += n;
+	}
+	lua_pushinteger(L, total);
+	return 1;
+}
+
+static int direct_file_flush(lua_State *L)
+{
+	efs_direct_file *df = _check_direct_file(L, 1);
+	if (df->writable && _direct_flush(df, 0) == -1) {
+		return push_error(L, NULL);
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int direct_file_close(lua_State *L)
+{
+	efs_direct_file *df = (efs_direct_file *)luaL_checkudata(
+		L, 1, DIRECT_FILE_METATABLE);
+	return push_result(L, _direct_close(df), NULL);
+}
+
+static int direct_file_gc(lua_State *L)
+{
+	efs_direct_file *df = (efs_direct_file *)luaL_checkudata(
+		L, 1, DIRECT_FILE_METATABLE);
+	_direct_close(df);
+	return 0;
+}
+
+static int direct_file_alignment(lua_State *L)
+{
+	efs_direct_file *df = _check_direct_file(L, 1);
+	lua_pushinteger(L, (lua_Integer)df->align);
+	return 1;
+}
+
+static int direct_file_is_direct(lua_State *L)
+{
+	efs_direct_file *df = _check_direct_file(L, 1);
+	lua_pushboolean(L, df->direct);
+	return 1;
+}
+
+/*
+** Creates direct file metatable.
+*/
+int direct_file_create_meta(lua_State *L)
+{
+	luaL_newmetatable(L, DIRECT_FILE_METATABLE);
+	/* Method table */
+	lua_newtable(L);
+	lua_pushcfunction(L, direct_file_read);
+	lua_setfield(L, -2, "read");
+	lua_pushcfunction(L, direct_file_write);
+	lua_setfield(L, -2, "write");
+	lua_pushcfunction(L, direct_file_read_into);
+	lua_setfield(L, -2, "read_into");
+	lua_pushcfunction(L, direct_file_write_from);
+	lua_setfield(L, -2, "write_from");
+	lua_pushcfunction(L, direct_file_flush);
+	lua_setfield(L, -2, "flush");
+	lua_pushcfunction(L, direct_file_close);
+	lua_setfield(L, -2, "close");
+	lua_pushcfunction(L, direct_file_alignment);
+	lua_setfield(L, -2, "alignment");
+	lua_pushcfunction(L, direct_file_is_direct);
+	lua_setfield(L, -2, "is_direct");
+	/* type */
+	lua_pushstring(L, DIRECT_FILE_METATABLE);
+	lua_setfield(L, -2, "__type");
+
+	/* Metamethods */
+	lua_setfield(L, -2, "__index");
+	lua_pushcfunction(L, direct_file_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_pushcfunction(L, direct_file_gc);
+	lua_setfield(L, -2, "__close");
+	return 1;
+}
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef ELI_EXTRA_FS_DIRECT_H__
+#define ELI_EXTRA_FS_DIRECT_H__
+
+#include "lua.h"
+
+int eli_open_direct(lua_State *L);
+
+int direct_file_create_meta(lua_State *L);
+
+#endif /* ELI_EXTRA_FS_DIRECT_H__ */
\ No newline at end of file
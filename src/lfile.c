@@ -268,8 +268,13 @@ static int push_link_target(lua_State *L)
 	return 1;
 #else
 	const char *file = luaL_checkstring(L, 1);
+	struct stat st;
+	if (lstat(file, &st) == -1) {
+		return 0;
+	}
+	/* size from lstat, links reporting no size (procfs) start at 256 */
+	ssize_t tsize, size = st.st_size > 0 ? st.st_size + 1 : 256;
 	char *target = NULL;
-	int tsize, size = 256; /* size = initial buffer capacity */
 	while (1) {
 		char *target2 = realloc(target, size);
 		if (!target2) { /* failed to allocate */
@@ -284,7 +289,7 @@ static int push_link_target(lua_State *L)
 		}
 		if (tsize < size)
 			break;
-		/* possibly truncated readlink() result, double size and retry */
+		/* link grew since lstat, double size and retry */
 		size *= 2;
 	}
 	target[tsize] = '\0';
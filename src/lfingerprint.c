@@ -0,0 +1,600 @@
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "lerror.h"
+#include "lfingerprint.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+
+int eli_tree_fingerprint(lua_State *L)
+{
+	errno = ENOSYS; /* = "Function not implemented" */
+	return push_result(L, -1, "tree_fingerprint is not supported on Windows");
+}
+
+#else
+
+#include "lhash.h"
+#include "lpool.h"
+#include "lwalk.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define HASH_BATCH 32 /* files per pool task */
+#define HASH_BUF_SIZE (256 * 1024)
+
+enum { FP_PENDING, FP_HASHED, FP_REUSED, FP_FAILED };
+
+typedef struct efs_fp_entry {
+	char *path; /* relative part starts at efs_fp_scan.rel_offset */
+	char *target; /* symlinks only */
+	mode_t mode;
+	uint64_t size;
+	int64_t mtime_ns;
+	int state;
+	int err;
+	unsigned char digest[EFS_SHA256_SIZE];
+} efs_fp_entry;
+
+typedef struct efs_fp_scan {
+	pthread_mutex_t lock;
+	efs_fp_entry *entries;
+	size_t count;
+	size_t cap;
+	size_t rel_offset;
+	int failed; /* out of memory */
+	int err; /* first directory or link that could not be read */
+	char *err_path;
+} efs_fp_scan;
+
+typedef struct efs_fp_task {
+	efs_fp_entry **files;
+	size_t count;
+	uint64_t *bytes;
+} efs_fp_task;
+
+/*
+** Frame of a directory whose children are being folded into its digest.
+*/
+typedef struct efs_fp_frame {
+	efs_fp_entry *dir; /* NULL for root */
+	efs_sha256 ctx;
+} efs_fp_frame;
+
+static int64_t _mtime_ns(const struct stat *st)
+{
+#ifdef __APPLE__
+	return (int64_t)st->st_mtimespec.tv_sec * 1000000000 +
+	       st->st_mtimespec.tv_nsec;
+#else
+	return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+#endif
+}
+
+/*
+** Reads symlink target sized from lstat like push_link_target does,
+** growing the buffer if the link grew since. Returns NULL with errno set
+** on failure.
+*/
+static char *_read_target(int dirfd, const char *name, const struct stat *st)
+{
+	size_t size = st->st_size > 0 ? (size_t)st->st_size + 1 : 256;
+	char *target = NULL;
+	for (;;) {
+		char *grown = realloc(target, size);
+		if (grown == NULL) {
+			free(target);
+			errno = ENOMEM;
+			return NULL;
+		}
+		target = grown;
+		ssize_t len = readlinkat(dirfd, name, target, size);
+		if (len == -1) {
+			int err = errno;
+			free(target);
+			errno = err;
+			return NULL;
+		}
+		if ((size_t)len < size) {
+			target[len] = '\0';
+			return target;
+		}
+		size *= 2;
+	}
+}
+
+/* keeps the first error, a digest missing part of the tree is no use */
+static int _scan_error(efs_fp_scan *scan, const char *path, int err)
+{
+	pthread_mutex_lock(&scan->lock);
+	if (scan->err == 0) {
+		scan->err = err;
+		scan->err_path = strdup(path);
+	}
+	pthread_mutex_unlock(&scan->lock);
+	return EFS_WALK_STOP;
+}
+
+static int _collect(efs_walk_entry *entry, void *ud)
+{
+	efs_fp_scan *scan = (efs_fp_scan *)ud;
+	const struct stat *st = entry->st;
+	char *path = strdup(entry->path);
+	char *target = NULL;
+	if (path != NULL && S_ISLNK(st->st_mode) &&
+	    (target = _read_target(entry->dirfd, entry->name, st)) == NULL) {
+		int err = errno;
+		free(path);
+		if (err != ENOMEM) {
+			return _scan_error(scan, entry->path, err);
+		}
+		path = NULL;
+	}
+	pthread_mutex_lock(&scan->lock);
+	if (path != NULL && scan->count == scan->cap) {
+		size_t cap = scan->cap ? scan->cap * 2 : 1024;
+		efs_fp_entry *entries =
+			realloc(scan->entries, cap * sizeof(efs_fp_entry));
+		if (entries == NULL) {
+			free(path);
+			free(target);
+			path = NULL;
+		} else {
+			scan->entries = entries;
+			scan->cap = cap;
+		}
+	}
+	if (path == NULL) {
+		scan->failed = 1;
+		pthread_mutex_unlock(&scan->lock);
+		return EFS_WALK_STOP;
+	}
+	scan->rel_offset = entry->rel_offset; /* the same for all entries */
+	efs_fp_entry *e = &scan->entries[scan->count++];
+	memset(e, 0, sizeof(efs_fp_entry));
+	e->path = path;
+	e->target = target;
+	e->mode = st->st_mode;
+	e->size = (uint64_t)st->st_size;
+	e->mtime_ns = _mtime_ns(st);
+	pthread_mutex_unlock(&scan->lock);
+	return EFS_WALK_CONTINUE;
+}
+
+static int _collect_leave(efs_walk_entry *entry, void *ud)
+{
+	efs_fp_scan *scan = (efs_fp_scan *)ud;
+	if (entry->error == 0) {
+		return EFS_WALK_CONTINUE;
+	}
+	return _scan_error(scan, entry->path, entry->error);
+}
+
+static int _hash_file(efs_fp_entry *file, unsigned char *buf,
+		      uint64_t *bytes)
+{
+	int fd = open(file->path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+	if (fd == -1) {
+		return -1;
+	}
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+	efs_sha256 ctx;
+	efs_sha256_init(&ctx);
+	int res = 0;
+	for (;;) {
+		ssize_t n = read(fd, buf, HASH_BUF_SIZE);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			res = n == 0 ? 0 : -1;
+			break;
+		}
+		efs_sha256_update(&ctx, buf, (size_t)n);
+		*bytes += (uint64_t)n;
+	}
+	int err = errno;
+	close(fd);
+	efs_sha256_final(&ctx, file->digest);
+	errno = err;
+	return res;
+}
+
+static void _hash_task(void *arg)
+{
+	efs_fp_task *task = (efs_fp_task *)arg;
+	unsigned char *buf = malloc(HASH_BUF_SIZE);
+	uint64_t bytes = 0;
+	for (size_t i = 0; i < task->count; i++) {
+		efs_fp_entry *file = task->files[i];
+		if (buf == NULL || _hash_file(file, buf, &bytes) == -1) {
+			file->state = FP_FAILED;
+			file->err = buf == NULL ? ENOMEM : errno;
+		} else {
+			file->state = FP_HASHED;
+		}
+	}
+	free(buf);
+	__atomic_add_fetch(task->bytes, bytes, __ATOMIC_RELAXED);
+	free(task);
+}
+
+/* hashes files in batches on the pool and waits for all of them */
+static void _hash_files(efs_fp_entry **files, size_t count, uint64_t *bytes)
+{
+	efs_task_group group;
+	efs_group_init(&group);
+	for (size_t i = 0; i < count; i += HASH_BATCH) {
+		efs_fp_task *task = malloc(sizeof(efs_fp_task));
+		size_t n = count - i < HASH_BATCH ? count - i : HASH_BATCH;
+		if (task == NULL) {
+			for (size_t k = i; k < i + n; k++) {
+				files[k]->state = FP_FAILED;
+				files[k]->err = ENOMEM;
+			}
+			continue;
+		}
+		task->files = files + i;
+		task->count = n;
+		task->bytes = bytes;
+		efs_group_submit(&group, _hash_task, task);
+	}
+	efs_group_wait(&group);
+	efs_group_destroy(&group);
+}
+
+/*
+** Orders paths component by component, so every directory is directly
+** followed by everything below it and siblings come sorted by name.
+*/
+static int _compare_path(const void *a, const void *b)
+{
+	const unsigned char *x =
+		(const unsigned char *)((const efs_fp_entry *)a)->path;
+	const unsigned char *y =
+		(const unsigned char *)((const efs_fp_entry *)b)->path;
+	while (*x != '\0' && *x == *y) {
+		x++;
+		y++;
+	}
+	int cx = *x == '/' ? 1 : *x == '\0' ? 0 : *x + 1;
+	int cy = *y == '/' ? 1 : *y == '\0' ? 0 : *y + 1;
+	return cx - cy;
+}
+
+static int _from_hex(const char *hex, size_t len, unsigned char *out)
+{
+	if (len != EFS_SHA256_SIZE * 2) {
+		return -1;
+	}
+	for (size_t i = 0; i < len; i++) {
+		char c = hex[i];
+		int v = c >= '0' && c <= '9' ? c - '0' :
+			c >= 'a' && c <= 'f' ? c - 'a' + 10 :
+			c >= 'A' && c <= 'F' ? c - 'A' + 10 :
+					       -1;
+		if (v == -1) {
+			return -1;
+		}
+		out[i / 2] = (unsigned char)(i % 2 ? out[i / 2] | v : v << 4);
+	}
+	return 0;
+}
+
+/*
+** Takes digest of file from previous map if its size and mtime_ns did
+** not change. Expects the map on top of the stack.
+*/
+static int _reuse_digest(lua_State *L, efs_fp_entry *file, const char *rel)
+{
+	if (lua_getfield(L, -1, rel) != LUA_TTABLE) {
+		lua_pop(L, 1);
+		return 0;
+	}
+	lua_getfield(L, -1, "size");
+	lua_getfield(L, -2, "mtime_ns");
+	lua_getfield(L, -3, "hash");
+	int reused = 0;
+	size_t len;
+	const char *hex = lua_tolstring(L, -1, &len);
+	if (hex != NULL && lua_isinteger(L, -3) && lua_isinteger(L, -2) &&
+	    (uint64_t)lua_tointeger(L, -3) == file->size &&
+	    (int64_t)lua_tointeger(L, -2) == file->mtime_ns &&
+	    _from_hex(hex, len, file->digest) == 0) {
+		file->state = FP_REUSED;
+		reused = 1;
+	}
+	lua_pop(L, 4);
+	return reused;
+}
+
+/*
+** Adds record of child to digest of its directory: type, permission
+** bits, name and digest of content (file data, symlink target or
+** directory records).
+*/
+static void _fold_child(efs_fp_frame *frame, efs_fp_entry *e,
+			const char *name)
+{
+	unsigned char zero[EFS_SHA256_SIZE];
+	const unsigned char *digest = e->digest;
+	char type = S_ISDIR(e->mode) ? 'd' :
+		    S_ISREG(e->mode) ? 'f' :
+		    S_ISLNK(e->mode) ? 'l' :
+				       'o';
+	if (type == 'l') {
+		efs_sha256 ctx;
+		efs_sha256_init(&ctx);
+		efs_sha256_update(&ctx, e->target, strlen(e->target));
+		efs_sha256_final(&ctx, e->digest);
+	} else if (type == 'o') {
+		memset(zero, 0, sizeof(zero));
+		digest = zero;
+	}
+	unsigned char head[5];
+	head[0] = (unsigned char)type;
+	head[1] = 0;
+	head[2] = 0;
+	head[3] = (unsigned char)((e->mode & 07777) >> 8);
+	head[4] = (unsigned char)(e->mode & 0xff);
+	efs_sha256_update(&frame->ctx, head, sizeof(head));
+	efs_sha256_update(&frame->ctx, name, strlen(name) + 1);
+	efs_sha256_update(&frame->ctx, digest, EFS_SHA256_SIZE);
+}
+
+/* relative path of frame's directory, "" for root */
+static const char *_frame_rel(efs_fp_frame *frame, size_t off)
+{
+	return frame->dir != NULL ? frame->dir->path + off : "";
+}
+
+/* name of entry at rel inside directory of frame */
+static const char *_child_name(efs_fp_frame *frame, size_t off,
+			       const char *rel)
+{
+	size_t len = strlen(_frame_rel(frame, off));
+	return rel + len + (len > 0 ? 1 : 0);
+}
+
+/*
+** Folds sorted entries into directory digests bottom up. Leaves digest
+** of root in root.
+*/
+static int _fold_tree(efs_fp_scan *scan, unsigned char root[EFS_SHA256_SIZE])
+{
+	size_t cap = 64, depth = 1;
+	efs_fp_frame *stack = malloc(cap * sizeof(efs_fp_frame));
+	if (stack == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	stack[0].dir = NULL;
+	efs_sha256_init(&stack[0].ctx);
+	size_t off = scan->rel_offset;
+	for (size_t i = 0; i <= scan->count; i++) {
+		efs_fp_entry *e = i < scan->count ? &scan->entries[i] : NULL;
+		const char *rel = e != NULL ? e->path + off : NULL;
+		/* close directories which are not ancestors of e */
+		while (depth > 1) {
+			efs_fp_frame *top = &stack[depth - 1];
+			const char *dir = _frame_rel(top, off);
+			size_t len = strlen(dir);
+			if (rel != NULL && strncmp(rel, dir, len) == 0 &&
+			    rel[len] == '/') {
+				break;
+			}
+			efs_sha256_final(&top->ctx, top->dir->digest);
+			depth--;
+			efs_fp_frame *parent = &stack[depth - 1];
+			_fold_child(parent, top->dir,
+				    _child_name(parent, off, dir));
+		}
+		if (e == NULL) {
+			break;
+		}
+		efs_fp_frame *parent = &stack[depth - 1];
+		if (!S_ISDIR(e->mode)) {
+			_fold_child(parent, e, _child_name(parent, off, rel));
+			continue;
+		}
+		if (depth == cap) {
+			efs_fp_frame *grown =
+				realloc(stack, cap * 2 * sizeof(efs_fp_frame));
+			if (grown == NULL) {
+				free(stack);
+				errno = ENOMEM;
+				return -1;
+			}
+			stack = grown;
+			cap *= 2;
+		}
+		stack[depth].dir = e;
+		efs_sha256_init(&stack[depth].ctx);
+		depth++;
+	}
+	efs_sha256_final(&stack[0].ctx, root);
+	free(stack);
+	return 0;
+}
+
+static void _free_scan(efs_fp_scan *scan)
+{
+	for (size_t i = 0; i < scan->count; i++) {
+		free(scan->entries[i].path);
+		free(scan->entries[i].target);
+	}
+	free(scan->entries);
+	free(scan->err_path);
+	pthread_mutex_destroy(&scan->lock);
+}
+
+static void _push_hex(lua_State *L, const unsigned char *digest)
+{
+	char hex[EFS_SHA256_SIZE * 2 + 1];
+	efs_hex(digest, EFS_SHA256_SIZE, hex);
+	lua_pushstring(L, hex);
+}
+
+/*
+** Computes Merkle digest of directory tree. Digest of a directory covers
+** names, types and permission bits of its children sorted by name plus
+** digests of their content, symlinks are hashed by target. Owners and
+** times are left out, so equal trees have equal digests wherever they
+** are. Files are hashed in parallel.
+** @param #1 Root directory.
+** @param #2 Options table (optional):
+**   dirs = false - return digests of all directories,
+**   files = false - return map of files usable as previous,
+**   previous = nil - { [relative path] = { hash, size, mtime_ns } } from
+**                    an earlier run, files with unchanged size and
+**                    mtime_ns are not hashed again,
+**   one_file_system = false.
+** Returns hex digest and { hashed, reused, bytes, dirs, files }, where
+** dirs maps relative paths ("." for root) to digests.
+*/
+int eli_tree_fingerprint(lua_State *L)
+{
+	const char *root = luaL_checkstring(L, 1);
+	int want_dirs = 0, want_files = 0, flags = 0;
+	if (lua_istable(L, 2)) {
+		lua_getfield(L, 2, "dirs");
+		want_dirs = lua_toboolean(L, -1);
+		lua_getfield(L, 2, "files");
+		want_files = lua_toboolean(L, -1);
+		lua_getfield(L, 2, "one_file_system");
+		flags |= lua_toboolean(L, -1) ? EFS_WALK_XDEV : 0;
+		lua_pop(L, 3);
+	}
+	lua_settop(L, 2);
+	if (lua_istable(L, 2)) {
+		lua_getfield(L, 2, "previous");
+		luaL_argcheck(L, lua_isnil(L, -1) || lua_istable(L, -1), 2,
+			      "previous must be a table");
+	} else {
+		lua_pushnil(L);
+	}
+	/* previous map stays at index 3 */
+
+	struct stat st;
+	if (stat(root, &st) == -1) {
+		return push_error(L, root);
+	}
+	if (!S_ISDIR(st.st_mode)) {
+		errno = ENOTDIR;
+		return push_error(L, root);
+	}
+	efs_fp_scan scan;
+	memset(&scan, 0, sizeof(scan));
+	pthread_mutex_init(&scan.lock, NULL);
+	efs_walker walker = { _collect, _collect_leave, &scan, flags, 0, 0 };
+	if (efs_walk_parallel(&walker, root) == -1) {
+		int err = errno;
+		_free_scan(&scan);
+		errno = err;
+		return push_error(L, root);
+	}
+	if (scan.failed) {
+		_free_scan(&scan);
+		return luaL_error(L, "tree_fingerprint: out of memory");
+	}
+	if (scan.err != 0) {
+		lua_pushstring(L, scan.err_path != NULL ? scan.err_path : root);
+		_free_scan(&scan);
+		errno = scan.err;
+		return push_error(L, lua_tostring(L, -1));
+	}
+	if (scan.count > 1) {
+		qsort(scan.entries, scan.count, sizeof(efs_fp_entry),
+		      _compare_path);
+	}
+	efs_fp_entry **pending =
+		malloc((scan.count + 1) * sizeof(efs_fp_entry *));
+	if (pending == NULL) {
+		_free_scan(&scan);
+		return luaL_error(L, "tree_fingerprint: out of memory");
+	}
+	size_t pending_count = 0;
+	uint64_t reused = 0, bytes = 0;
+	for (size_t i = 0; i < scan.count; i++) {
+		efs_fp_entry *e = &scan.entries[i];
+		if (!S_ISREG(e->mode)) {
+			continue;
+		}
+		if (lua_istable(L, 3) &&
+		    _reuse_digest(L, e, e->path + scan.rel_offset)) {
+			reused++;
+			continue;
+		}
+		pending[pending_count++] = e;
+	}
+	_hash_files(pending, pending_count, &bytes);
+	free(pending);
+	for (size_t i = 0; i < scan.count; i++) {
+		if (scan.entries[i].state == FP_FAILED) {
+			int err = scan.entries[i].err;
+			lua_pushstring(L, scan.entries[i].path);
+			_free_scan(&scan);
+			errno = err;
+			return push_error(L, lua_tostring(L, -1));
+		}
+	}
+
+	unsigned char digest[EFS_SHA256_SIZE];
+	if (_fold_tree(&scan, digest) == -1) {
+		_free_scan(&scan);
+		return luaL_error(L, "tree_fingerprint: out of memory");
+	}
+	_push_hex(L, digest);
+	lua_createtable(L, 0, 5);
+	lua_pushinteger(L, (lua_Integer)pending_count);
+	lua_setfield(L, -2, "hashed");
+	lua_pushinteger(L, (lua_Integer)reused);
+	lua_setfield(L, -2, "reused");
+	lua_pushinteger(L, (lua_Integer)bytes);
+	lua_setfield(L, -2, "bytes");
+	if (want_dirs) {
+		lua_newtable(L);
+		_push_hex(L, digest);
+		lua_setfield(L, -2, ".");
+		for (size_t i = 0; i < scan.count; i++) {
+			efs_fp_entry *e = &scan.entries[i];
+			if (S_ISDIR(e->mode)) {
+				_push_hex(L, e->digest);
+				lua_setfield(L, -2, e->path + scan.rel_offset);
+			}
+		}
+		lua_setfield(L, -2, "dirs");
+	}
+	if (want_files) {
+		lua_newtable(L);
+		for (size_t i = 0; i < scan.count; i++) {
+			efs_fp_entry *e = &scan.entries[i];
+			if (!S_ISREG(e->mode)) {
+				continue;
+			}
+			lua_createtable(L, 0, 3);
+			_push_hex(L, e->digest);
+			lua_setfield(L, -2, "hash");
+			lua_pushinteger(L, (lua_Integer)e->size);
+			lua_setfield(L, -2, "size");
+			lua_pushinteger(L, (lua_Integer)e->mtime_ns);
+			lua_setfield(L, -2, "mtime_ns");
+			lua_setfield(L, -2, e->path + scan.rel_offset);
+		}
+		lua_setfield(L, -2, "files");
+	}
+	_free_scan(&scan);
+	return 2;
+}
+
+#endif
@@ -0,0 +1,8 @@
+#ifndef ELI_EXTRA_FS_FINGERPRINT_H__
+#define ELI_EXTRA_FS_FINGERPRINT_H__
+
+#include "lua.h"
+
+int eli_tree_fingerprint(lua_State *L);
+
+#endif /* ELI_EXTRA_FS_FINGERPRINT_H__ */
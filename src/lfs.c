@@ -6,6 +6,20 @@
 #include "ldir.h"
 #include "llink.h"
 #include "lperm.h"
+#include "ldirect.h"
+#include "lasync.h"
+#include "lwatch.h"
+#include "lsnapshot.h"
+#include "lindex.h"
+#include "ldedupe.h"
+#include "lappend.h"
+#include "lresolve.h"
+#include "ltouch.h"
+#include "lstats.h"
+#include "lpath.h"
+#include "ljob.h"
+#include "lfingerprint.h"
+#include "ltar.h"
 
 static const struct luaL_Reg eliFsExtra[] = {
 	{ "file_info", eli_file_info },
@@ -13,7 +27,11 @@ static const struct luaL_Reg eliFsExtra[] = {
 	{ "open_dir", eli_open_dir },
 	{ "read_dir", eli_read_dir },
 	{ "iter_dir", eli_iter_dir },
+	{ "iter_dir_batched", eli_iter_dir_batched },
 	{ "link", eli_mklink },
+	{ "link_tree", eli_link_tree },
+	{ "resolve_path", eli_resolve_path },
+	{ "touch_many", eli_touch_many },
 	{ "mkdir", eli_mkdir },
 	{ "rmdir", eli_rmdir },
 	{ "link_info", eli_link_info },
@@ -25,10 +43,41 @@ static const struct luaL_Reg eliFsExtra[] = {
 	{ "unlock_file", eli_file_unlock },
 	{ "chmod", eli_chmod },
 	{ "chown", eli_chown },
+	{ "chmod_tree", eli_chmod_tree },
+	{ "chown_tree", eli_chown_tree },
+	{ "user_name", eli_user_name },
+	{ "group_name", eli_group_name },
+	{ "resolve_owners", eli_resolve_owners },
+	{ "owner_cache", eli_owner_cache },
 	{ "getuid", eli_getuid },
 	{ "getgid", eli_getgid },
 	{ "lock_dir", eli_lock_dir },
 	{ "unlock_dir", eli_unlock_dir },
+	{ "lock_dir_owner", eli_dir_lock_owner },
+	{ "lock_stats", eli_lock_stats },
+	{ "open_direct", eli_open_direct },
+	{ "async", eli_async },
+	{ "watch", eli_watch },
+	{ "snapshot", eli_snapshot },
+	{ "load_snapshot", eli_load_snapshot },
+	{ "diff", eli_snapshot_diff },
+	{ "build_index", eli_build_index },
+	{ "open_index", eli_open_index },
+	{ "find_duplicates", eli_find_duplicates },
+	{ "tree_fingerprint", eli_tree_fingerprint },
+	{ "open_append_log", eli_open_append_log },
+	{ "start_job", eli_start_job },
+	{ "tar_pack", eli_tar_pack },
+	{ "tar_unpack", eli_tar_unpack },
+	{ NULL, NULL },
+};
+
+/* not instrumented themselves */
+static const struct luaL_Reg eliFsExtraStats[] = {
+	{ "stats", eli_stats },
+	{ "reset_stats", eli_reset_stats },
+	{ "trace_slow_ops", eli_trace_slow_ops },
+	{ "drain_slow_ops", eli_drain_slow_ops },
 	{ NULL, NULL },
 };
 
@@ -38,7 +87,18 @@ int luaopen_eli_fs_extra(lua_State *L)
 	direntry_create_meta(L);
 	lock_create_meta(L);
 	dir_lock_create_meta(L);
+	direct_file_create_meta(L);
+	async_create_meta(L);
+	watcher_create_meta(L);
+	snapshot_create_meta(L);
+	index_create_meta(L);
+	append_log_create_meta(L);
+	resolve_create_meta(L);
+	job_create_meta(L);
 	lua_newtable(L);
-	luaL_setfuncs(L, eliFsExtra, 0);
+	stats_setfuncs(L, eliFsExtra);
+	luaL_setfuncs(L, eliFsExtraStats, 0);
+	path_create_module(L);
+	lua_setfield(L, -2, "path");
 	return 1;
 }
@@ -8,40 +8,58 @@
 #include <stdio.h>
 #include <stdlib.h>
 
-char *joinpath(char *pth1, char *pth2)
-{
-	if (pth1 == NULL && pth2 == NULL) {
-		return "";
-	} else if (pth2 == NULL || strlen(pth2) == 0) {
-		return pth1;
-	} else if (pth1 == NULL || strlen(pth1) == 0) {
-		return pth2;
-	} else {
-#ifdef _WIN32
-		char directory_separator[] = "\\";
-#else
-		char directory_separator[] = "/";
+#include "lpath.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#ifdef SYS_openat2
+#include <linux/openat2.h>
+#endif
+#endif
 #endif
-		int append_directory_separator = 0;
 
-		if (pth1[strlen(pth1) - 1] == directory_separator[0]) {
-			pth1[strlen(pth1) - 1] = '\0';
+/*
+** Joins two paths with a single separator. Returns new malloc'ed string
+** (inputs are never modified) or NULL when out of memory.
+*/
+char *joinpath(const char *pth1, const char *pth2)
+{
+	size_t l1 = pth1 != NULL ? strlen(pth1) : 0;
+	size_t l2 = pth2 != NULL ? strlen(pth2) : 0;
+	int sep = 0;
+	if (l1 > 0 && l2 > 0) {
+		if (EFS_IS_SEP(pth1[l1 - 1])) {
+			l1--;
 		}
-		if (pth2[0] == directory_separator[0]) {
-			pth2 = pth2 + 1;
+		if (EFS_IS_SEP(pth2[0])) {
+			pth2++;
+			l2--;
 		}
-
-		size_t l = strlen(pth1) + strlen(pth2) +
-			   strlen(directory_separator) + 1;
-		char *dst = malloc(l * sizeof(char));
-		if (!dst)
-			return NULL;
-		strcpy(dst, pth1);
-		strcat(dst, directory_separator);
-		strcat(dst, pth2);
-		return dst;
+		sep = 1;
+	}
+	char *dst = malloc(l1 + sep + l2 + 1);
+	if (!dst) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	if (l1 > 0) {
+		memcpy(dst, pth1, l1);
+	}
+	if (sep) {
+		dst[l1] = EFS_PATH_SEP;
+	}
+	if (l2 > 0) {
+		memcpy(dst + l1 + sep, pth2, l2);
 	}
+	dst[l1 + sep + l2] = '\0';
+	return dst;
 }
+
 /*
 ** Check if the given element on the stack is a file and returns it.
 */
@@ -167,4 +185,125 @@ char *clone_string(const char *str)
 	char *result = malloc(strlen(str) + 1);
 	strcpy(result, str);
 	return result;
-}
\ No newline at end of file
+}
+
+#ifndef _WIN32
+
+/*
+** Opens directory path below dirfd a component at a time, refusing
+** symlinks, and creates missing ones with create. Returns dirfd itself
+** when path has no components.
+*/
+int efs_open_dirs(int dirfd, char *path, int create)
+{
+	int fd = dirfd;
+	for (char *p = path; *p != '\0';) {
+		size_t len = strcspn(p, "/");
+		char c = p[len];
+		p[len] = '\0';
+		int skip = len == 0 || strcmp(p, ".") == 0;
+		int sub = -1;
+		if (!skip &&
+		    (!create || mkdirat(fd, p, 0755) == 0 || errno == EEXIST)) {
+			sub = openat(fd, p,
+				     O_RDONLY | O_DIRECTORY | O_NOFOLLOW |
+					     O_CLOEXEC);
+		}
+		int err = errno;
+		p[len] = c;
+		if (!skip) {
+			if (fd != dirfd) {
+				close(fd);
+			}
+			if (sub == -1) {
+				errno = err;
+				return -1;
+			}
+			fd = sub;
+		}
+		p += len;
+		while (*p == '/') {
+			p++;
+		}
+	}
+	return fd;
+}
+
+/*
+** Opens path below dirfd without following any symlink, so nothing can
+** be written or linked outside of dirfd through one. Uses openat2 where
+** available, else walks path with efs_open_dirs.
+*/
+int efs_open_beneath(int dirfd, const char *path, int flags, mode_t mode)
+{
+#if defined(__linux__) && defined(SYS_openat2)
+	struct open_how how;
+	memset(&how, 0, sizeof(how));
+	how.flags = (uint64_t)(flags | O_CLOEXEC);
+	how.mode = (flags & O_CREAT) ? (uint64_t)mode : 0;
+	how.resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS;
+	int fd = (int)syscall(SYS_openat2, dirfd, path, &how, sizeof(how));
+	if (fd != -1 || errno != ENOSYS) {
+		return fd;
+	}
+#endif
+	char *copy = strdup(path);
+	if (copy == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	const char *name = copy;
+	int dir = dirfd;
+	char *slash = strrchr(copy, '/');
+	if (slash != NULL) {
+		*slash = '\0';
+		name = slash + 1;
+		dir = efs_open_dirs(dirfd, copy, 0);
+	}
+	int res = dir == -1 ? -1 :
+			      openat(dir, name, flags | O_NOFOLLOW | O_CLOEXEC,
+				     mode);
+	int err = errno;
+	if (dir != -1 && dir != dirfd) {
+		close(dir);
+	}
+	free(copy);
+	errno = err;
+	return res;
+}
+
+/*
+** Opens the directory holding path below dirfd, *name is its last
+** component. Returns dirfd itself for a single component path.
+*/
+int efs_open_parent(int dirfd, const char *path, const char **name)
+{
+	const char *slash = strrchr(path, '/');
+	if (slash == NULL) {
+		*name = path;
+		return dirfd;
+	}
+	char *parent = strndup(path, (size_t)(slash - path));
+	if (parent == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	*name = slash + 1;
+	int fd = efs_open_beneath(dirfd, parent, O_RDONLY | O_DIRECTORY, 0);
+	int err = errno;
+	free(parent);
+	errno = err;
+	return fd;
+}
+
+/* closes fd from efs_open_parent, keeping errno */
+void efs_close_parent(int dirfd, int fd)
+{
+	int err = errno;
+	if (fd != -1 && fd != dirfd) {
+		close(fd);
+	}
+	errno = err;
+}
+
+#endif
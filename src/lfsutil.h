@@ -19,4 +19,11 @@ const char *perm2string(mode_t mode);
 
 char *clone_string(const char *str);
 
+#ifndef _WIN32
+int efs_open_dirs(int dirfd, char *path, int create);
+int efs_open_beneath(int dirfd, const char *path, int flags, mode_t mode);
+int efs_open_parent(int dirfd, const char *path, const char **name);
+void efs_close_parent(int dirfd, int fd);
+#endif
+
 #endif /* ELI_EXTRA_FS_UTIL_H__ */
\ No newline at end of file
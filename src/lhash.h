@@ -0,0 +1,22 @@
+#ifndef ELI_EXTRA_FS_HASH_H__
+#define ELI_EXTRA_FS_HASH_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define EFS_SHA256_SIZE 32
+
+typedef struct efs_sha256 {
+	uint32_t state[8];
+	uint64_t len;
+	unsigned char block[64];
+	size_t block_len;
+} efs_sha256;
+
+void efs_sha256_init(efs_sha256 *ctx);
+void efs_sha256_update(efs_sha256 *ctx, const void *data, size_t len);
+void efs_sha256_final(efs_sha256 *ctx, unsigned char digest[EFS_SHA256_SIZE]);
+
+void efs_hex(const unsigned char *data, size_t len, char *out);
+
+#endif /* ELI_EXTRA_FS_HASH_H__ */
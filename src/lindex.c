@@ -0,0 +1,1163 @@
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "lerror.h"
+#include "lfsutil.h"
+#include "lindex.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INDEX_METATABLE "ELI_FS_INDEX"
+
+#ifdef _WIN32
+
+int eli_build_index(lua_State *L)
+{
+	errno = ENOSYS; /* = "Function not implemented" */
+	return push_result(L, -1, "index is not supported on Windows");
+}
+
+int eli_open_index(lua_State *L)
+{
+	errno = ENOSYS; /* = "Function not implemented" */
+	return push_result(L, -1, "index is not supported on Windows");
+}
+
+int index_create_meta(lua_State *L)
+{
+	return 0;
+}
+
+#else
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define INDEX_MAGIC "EFSIDX01"
+#define INDEX_NONE UINT32_MAX
+
+/*
+** On-disk layout, native endianness:
+**   header, then 8 byte aligned columns indexed by entry number:
+**   size u64, mtime_ns i64, uid u32, type u8 (st_mode >> 12),
+**   parent u32, first_child u32, child_count u32, name offset u64,
+**   followed by the NUL separated name blob and the root path.
+** Entry 0 is the root. Entries are laid out breadth first, children of
+** every directory are contiguous and sorted by name, so the parent and
+** child columns form a trie of path components.
+*/
+typedef struct efs_index_header {
+	char magic[8];
+	uint64_t count;
+	uint64_t names_len;
+	uint64_t root_len;
+	uint64_t off_size;
+	uint64_t off_mtime;
+	uint64_t off_uid;
+	uint64_t off_type;
+	uint64_t off_parent;
+	uint64_t off_first_child;
+	uint64_t off_child_count;
+	uint64_t off_name;
+	uint64_t off_names;
+	uint64_t off_root;
+	uint64_t total_len;
+} efs_index_header;
+
+typedef struct efs_index_view {
+	const efs_index_header *header;
+	uint64_t count;
+	const uint64_t *size;
+	const int64_t *mtime;
+	const uint32_t *uid;
+	const uint8_t *type;
+	const uint32_t *parent;
+	const uint32_t *first_child;
+	const uint32_t *child_count;
+	const uint64_t *name;
+	const char *names;
+	const char *root;
+} efs_index_view;
+
+typedef struct efs_index {
+	void *map;
+	size_t map_len;
+	char *file;
+	efs_index_view view;
+} efs_index;
+
+/* columns of an index under construction */
+typedef struct efs_index_builder {
+	uint64_t count;
+	uint64_t cap;
+	uint64_t *size;
+	int64_t *mtime;
+	uint32_t *uid;
+	uint8_t *type;
+	uint32_t *parent;
+	uint32_t *first_child;
+	uint32_t *child_count;
+	uint64_t *name;
+	char *names;
+	uint64_t names_len;
+	uint64_t names_cap;
+	int xdev;
+	dev_t dev;
+	uint64_t scanned_dirs;
+	uint64_t reused_dirs;
+} efs_index_builder;
+
+static int64_t _mtime_ns(const struct stat *st)
+{
+#ifdef __APPLE__
+	return (int64_t)st->st_mtimespec.tv_sec * 1000000000 +
+	       st->st_mtimespec.tv_nsec;
+#else
+	return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+#endif
+}
+
+#define GROW_COLUMN(col, cap)                                         \
+	do {                                                          \
+		void *grown = realloc((col), (cap) * sizeof(*(col))); \
+		if (grown == NULL) {                                  \
+			errno = ENOMEM;                               \
+			return -1;                                    \
+		}                                                     \
+		(col) = grown;                                        \
+	} while (0)
+
+static int64_t _builder_add(efs_index_builder *b, const char *name,
+			    size_t name_len, uint32_t parent, uint64_t size,
+			    int64_t mtime, uint32_t uid, uint8_t type)
+{
+	if (b->count >= INDEX_NONE) {
+		/* entries are referenced by 32 bit index */
+		errno = EOVERFLOW;
+		return -1;
+	}
+	if (b->count == b->cap) {
+		uint64_t cap = b->cap ? b->cap * 2 : 4096;
+		GROW_COLUMN(b->size, cap);
+		GROW_COLUMN(b->mtime, cap);
+		GROW_COLUMN(b->uid, cap);
+		GROW_COLUMN(b->type, cap);
+		GROW_COLUMN(b->parent, cap);
+		GROW_COLUMN(b->first_child, cap);
+		GROW_COLUMN(b->child_count, cap);
+		GROW_COLUMN(b->name, cap);
+		b->cap = cap;
+	}
+	if (b->names_len + name_len + 1 > b->names_cap) {
+		uint64_t cap = b->names_cap ? b->names_cap : 64 * 1024;
+		while (cap < b->names_len + name_len + 1) {
+			cap *= 2;
+		}
+		GROW_COLUMN(b->names, cap);
+		b->names_cap = cap;
+	}
+	uint64_t i = b->count++;
+	b->size[i] = size;
+	b->mtime[i] = mtime;
+	b->uid[i] = uid;
+	b->type[i] = type;
+	b->parent[i] = parent;
+	b->first_child[i] = INDEX_NONE;
+	b->child_count[i] = 0;
+	b->name[i] = b->names_len;
+	memcpy(b->names + b->names_len, name, name_len);
+	b->names[b->names_len + name_len] = '\0';
+	b->names_len += name_len + 1;
+	return (int64_t)i;
+}
+
+static int64_t _builder_add_stat(efs_index_builder *b, const char *name,
+				 uint32_t parent, const struct stat *st)
+{
+	return _builder_add(b, name, strlen(name), parent,
+			    (uint64_t)st->st_size, _mtime_ns(st),
+			    (uint32_t)st->st_uid,
+			    (uint8_t)((st->st_mode & S_IFMT) >> 12));
+}
+
+static void _builder_free(efs_index_builder *b)
+{
+	free(b->size);
+	free(b->mtime);
+	free(b->uid);
+	free(b->type);
+	free(b->parent);
+	free(b->first_child);
+	free(b->child_count);
+	free(b->name);
+	free(b->names);
+}
+
+#define TYPE_DIR ((uint8_t)(S_IFDIR >> 12))
+
+static const char *_view_name(const efs_index_view *v, uint64_t i)
+{
+	return v->names + v->name[i];
+}
+
+/* finds child of dir by name, children are sorted */
+static uint32_t _view_child(const efs_index_view *v, uint32_t dir,
+			    const char *name, size_t name_len)
+{
+	if (v->type[dir] != TYPE_DIR || v->first_child[dir] == INDEX_NONE) {
+		return INDEX_NONE;
+	}
+	uint32_t lo = v->first_child[dir];
+	uint32_t hi = lo + v->child_count[dir];
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		const char *mid_name = _view_name(v, mid);
+		int cmp = strncmp(mid_name, name, name_len);
+		if (cmp == 0 && mid_name[name_len] != '\0') {
+			cmp = 1;
+		}
+		if (cmp == 0) {
+			return mid;
+		}
+		if (cmp < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return INDEX_NONE;
+}
+
+/* resolves path relative to index root */
+static uint32_t _view_lookup(const efs_index_view *v, const char *path)
+{
+	uint32_t current = 0;
+	while (*path != '\0' && current != INDEX_NONE) {
+		while (*path == '/') {
+			path++;
+		}
+		if (*path == '\0') {
+			break;
+		}
+		const char *end = strchr(path, '/');
+		size_t len = end ? (size_t)(end - path) : strlen(path);
+		if (!(len == 1 && path[0] == '.')) {
+			current = _view_child(v, current, path, len);
+		}
+		path += len;
+	}
+	return current;
+}
+
+typedef struct efs_dir_job {
+	uint32_t entry;
+	uint32_t old; /* same directory in previous index or INDEX_NONE */
+	char *path;
+} efs_dir_job;
+
+typedef struct efs_dir_queue {
+	efs_dir_job *jobs;
+	size_t head;
+	size_t tail;
+	size_t cap;
+} efs_dir_queue;
+
+static int _queue_push(efs_dir_queue *q, uint32_t entry, uint32_t old,
+		       const char *dir, const char *name)
+{
+	if (q->tail == q->cap) {
+		if (q->head > 0) {
+			memmove(q->jobs, q->jobs + q->head,
+				(q->tail - q->head) * sizeof(efs_dir_job));
+			q->tail -= q->head;
+			q->head = 0;
+		}
+		if (q->tail == q->cap) {
+			size_t cap = q->cap ? q->cap * 2 : 1024;
+			efs_dir_job *jobs =
+				realloc(q->jobs, cap * sizeof(efs_dir_job));
+			if (jobs == NULL) {
+				errno = ENOMEM;
+				return -1;
+			}
+			q->jobs = jobs;
+			q->cap = cap;
+		}
+	}
+	size_t dir_len = strlen(dir);
+	size_t name_len = strlen(name);
+	char *path = malloc(dir_len + name_len + 2);
+	if (path == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	memcpy(path, dir, dir_len);
+	size_t pos = dir_len;
+	if (name_len > 0) {
+		if (pos == 0 || path[pos - 1] != '/') {
+			path[pos++] = '/';
+		}
+		memcpy(path + pos, name, name_len);
+		pos += name_len;
+	}
+	path[pos] = '\0';
+	q->jobs[q->tail].entry = entry;
+	q->jobs[q->tail].old = old;
+	q->jobs[q->tail].path = path;
+	q->tail++;
+	return 0;
+}
+
+static int _compare_names(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static int _descend(efs_index_builder *b, const struct stat *st)
+{
+	return S_ISDIR(st->st_mode) && (!b->xdev || st->st_dev == b->dev);
+}
+
+/*
+** Lists directory job->path into builder. Directories whose mtime did
+** not change since previous index are copied from it without readdir,
+** only their subdirectories are stat'ed to decide about descending.
+*/
+static int _index_dir(efs_index_builder *b, efs_dir_queue *q, efs_dir_job *job,
+		      const efs_index_view *old)
+{
+	int fd = open(job->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1) {
+		return 0; /* unreadable, keep it as leaf */
+	}
+	uint32_t first = (uint32_t)b->count;
+	int reuse = old != NULL && job->old != INDEX_NONE &&
+		    old->type[job->old] == TYPE_DIR &&
+		    old->mtime[job->old] == b->mtime[job->entry] &&
+		    old->first_child[job->old] != INDEX_NONE;
+	if (reuse) {
+		b->reused_dirs++;
+		uint32_t start = old->first_child[job->old];
+		uint32_t end = start + old->child_count[job->old];
+		for (uint32_t c = start; c < end; c++) {
+			const char *name = _view_name(old, c);
+			int64_t i;
+			if (old->type[c] == TYPE_DIR) {
+				struct stat st;
+				if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) ==
+				    -1) {
+					continue;
+				}
+				i = _builder_add_stat(b, name, job->entry, &st);
+				if (i >= 0 && _descend(b, &st) &&
+				    _queue_push(q, (uint32_t)i, c, job->path,
+						name) == -1) {
+					i = -1;
+				}
+			} else {
+				i = _builder_add(b, name, strlen(name),
+						 job->entry, old->size[c],
+						 old->mtime[c], old->uid[c],
+						 old->type[c]);
+			}
+			if (i < 0) {
+				int err = errno;
+				close(fd);
+				errno = err;
+				return -1;
+			}
+		}
+	} else {
+		b->scanned_dirs++;
+		DIR *dir = fdopendir(fd);
+		if (dir == NULL) {
+			close(fd);
+			return 0;
+		}
+		char **names = NULL;
+		size_t count = 0, cap = 0;
+		struct dirent *d;
+		int failed = 0; /* errno of the failure */
+		while ((d = readdir(dir)) != NULL) {
+			const char *name = d->d_name;
+			if (name[0] == '.' &&
+			    (name[1] == '\0' ||
+			     (name[1] == '.' && name[2] == '\0'))) {
+				continue;
+			}
+			if (count == cap) {
+				cap = cap ? cap * 2 : 64;
+				char **grown = realloc(names, cap * sizeof(char *));
+				if (grown == NULL) {
+					failed = ENOMEM;
+					break;
+				}
+				names = grown;
+			}
+			if ((names[count] = strdup(name)) == NULL) {
+				failed = ENOMEM;
+				break;
+			}
+			count++;
+		}
+		qsort(names, count, sizeof(char *), _compare_names);
+		for (size_t n = 0; n < count && !failed; n++) {
+			struct stat st;
+			if (fstatat(dirfd(dir), names[n], &st,
+				    AT_SYMLINK_NOFOLLOW) == -1) {
+				continue;
+			}
+			int64_t i = _builder_add_stat(b, names[n], job->entry,
+						      &st);
+			if (i < 0) {
+				failed = errno;
+				break;
+			}
+			if (_descend(b, &st)) {
+				uint32_t prev = INDEX_NONE;
+				if (old != NULL && job->old != INDEX_NONE) {
+					prev = _view_child(old, job->old,
+							   names[n],
+							   strlen(names[n]));
+				}
+				if (_queue_push(q, (uint32_t)i, prev, job->path,
+						names[n]) == -1) {
+					failed = errno;
+				}
+			}
+		}
+		for (size_t n = 0; n < count; n++) {
+			free(names[n]);
+		}
+		free(names);
+		closedir(dir);
+		fd = -1;
+		if (failed) {
+			errno = failed;
+			return -1;
+		}
+	}
+	if (fd != -1) {
+		close(fd);
+	}
+	b->first_child[job->entry] = first;
+	b->child_count[job->entry] = (uint32_t)b->count - first;
+	return 0;
+}
+
+static int _index_tree(efs_index_builder *b, const char *root,
+		       const efs_index_view *old)
+{
+	struct stat st;
+	if (stat(root, &st) == -1) {
+		return -1;
+	}
+	if (!S_ISDIR(st.st_mode)) {
+		errno = ENOTDIR;
+		return -1;
+	}
+	b->dev = st.st_dev;
+	if (_builder_add_stat(b, "", 0, &st) < 0) {
+		return -1;
+	}
+	efs_dir_queue q = { NULL, 0, 0, 0 };
+	int res = _queue_push(&q, 0, old != NULL ? 0 : INDEX_NONE, root, "");
+	while (res == 0 && q.head < q.tail) {
+		efs_dir_job job = q.jobs[q.head++];
+		res = _index_dir(b, &q, &job, old);
+		free(job.path);
+	}
+	int err = errno;
+	for (size_t i = q.head; i < q.tail; i++) {
+		free(q.jobs[i].path);
+	}
+	free(q.jobs);
+	errno = err;
+	return res;
+}
+
+static uint64_t _align8(uint64_t value)
+{
+	return (value + 7) & ~(uint64_t)7;
+}
+
+static int _write_column(FILE *f, const void *data, uint64_t len)
+{
+	static const char zeros[8] = { 0 };
+	if (len > 0 && fwrite(data, 1, len, f) != len) {
+		return -1;
+	}
+	uint64_t pad = _align8(len) - len;
+	return pad > 0 && fwrite(zeros, 1, pad, f) != pad ? -1 : 0;
+}
+
+/* writes builder to file through a temporary file and rename */
+static int _write_index(efs_index_builder *b, const char *root, const char *file)
+{
+	efs_index_header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, INDEX_MAGIC, sizeof(h.magic));
+	h.count = b->count;
+	h.names_len = b->names_len;
+	h.root_len = strlen(root);
+	uint64_t off = _align8(sizeof(h));
+	h.off_size = off;
+	off += _align8(b->count * sizeof(uint64_t));
+	h.off_mtime = off;
+	off += _align8(b->count * sizeof(int64_t));
+	h.off_uid = off;
+	off += _align8(b->count * sizeof(uint32_t));
+	h.off_type = off;
+	off += _align8(b->count * sizeof(uint8_t));
+	h.off_parent = off;
+	off += _align8(b->count * sizeof(uint32_t));
+	h.off_first_child = off;
+	off += _align8(b->count * sizeof(uint32_t));
+	h.off_child_count = off;
+	off += _align8(b->count * sizeof(uint32_t));
+	h.off_name = off;
+	off += _align8(b->count * sizeof(uint64_t));
+	h.off_names = off;
+	off += _align8(b->names_len);
+	h.off_root = off;
+	off += _align8(h.root_len + 1);
+	h.total_len = off;
+
+	size_t file_len = strlen(file);
+	char *tmp = malloc(file_len + 5);
+	if (tmp == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	memcpy(tmp, file, file_len);
+	memcpy(tmp + file_len, ".tmp", 5);
+	FILE *f = fopen(tmp, "wb");
+	if (f == NULL) {
+		free(tmp);
+		return -1;
+	}
+	int failed = _write_column(f, &h, sizeof(h)) ||
+		     _write_column(f, b->size, b->count * sizeof(uint64_t)) ||
+		     _write_column(f, b->mtime, b->count * sizeof(int64_t)) ||
+		     _write_column(f, b->uid, b->count * sizeof(uint32_t)) ||
+		     _write_column(f, b->type, b->count * sizeof(uint8_t)) ||
+		     _write_column(f, b->parent, b->count * sizeof(uint32_t)) ||
+		     _write_column(f, b->first_child,
+				   b->count * sizeof(uint32_t)) ||
+		     _write_column(f, b->child_count,
+				   b->count * sizeof(uint32_t)) ||
+		     _write_column(f, b->name, b->count * sizeof(uint64_t)) ||
+		     _write_column(f, b->names, b->names_len) ||
+		     _write_column(f, root, h.root_len + 1);
+	failed = failed || fflush(f) != 0 || fsync(fileno(f)) != 0;
+	int err = errno;
+	failed = fclose(f) != 0 || failed;
+	if (!failed && rename(tmp, file) != 0) {
+		err = errno;
+		failed = 1;
+	}
+	if (failed) {
+		unlink(tmp);
+		errno = err;
+	}
+	free(tmp);
+	return failed ? -1 : 0;
+}
+
+/* column of `count` items of `width` bytes fits in the file */
+static int _column_ok(const efs_index_header *h, uint64_t off, uint64_t width)
+{
+	return off % 8 == 0 && off <= h->total_len &&
+	       h->count <= (h->total_len - off) / width;
+}
+
+/*
+** Checks every offset before anything is read through it, a truncated
+** or corrupt file must not make lookups read outside the mapping.
+** Parents precede their children (breadth first), which also rules out
+** cycles in the parent column.
+*/
+static int _index_ok(const efs_index_header *h, const char *base)
+{
+	if (memcmp(h->magic, INDEX_MAGIC, sizeof(h->magic)) != 0 ||
+	    h->count == 0 || h->count > INDEX_NONE ||
+	    !_column_ok(h, h->off_size, sizeof(uint64_t)) ||
+	    !_column_ok(h, h->off_mtime, sizeof(int64_t)) ||
+	    !_column_ok(h, h->off_uid, sizeof(uint32_t)) ||
+	    !_column_ok(h, h->off_type, sizeof(uint8_t)) ||
+	    !_column_ok(h, h->off_parent, sizeof(uint32_t)) ||
+	    !_column_ok(h, h->off_first_child, sizeof(uint32_t)) ||
+	    !_column_ok(h, h->off_child_count, sizeof(uint32_t)) ||
+	    !_column_ok(h, h->off_name, sizeof(uint64_t)) ||
+	    h->off_names > h->total_len ||
+	    h->names_len > h->total_len - h->off_names ||
+	    h->off_root > h->total_len ||
+	    h->root_len >= h->total_len - h->off_root ||
+	    base[h->off_root + h->root_len] != '\0' ||
+	    (h->names_len > 0 && base[h->off_names + h->names_len - 1] != '\0')) {
+		return 0;
+	}
+	const uint32_t *parent = (const uint32_t *)(base + h->off_parent);
+	const uint32_t *first = (const uint32_t *)(base + h->off_first_child);
+	const uint32_t *children =
+		(const uint32_t *)(base + h->off_child_count);
+	const uint64_t *name = (const uint64_t *)(base + h->off_name);
+	for (uint64_t i = 0; i < h->count; i++) {
+		/* names_len > 0 here, the blob ends with a NUL */
+		if (name[i] >= h->names_len || (i > 0 && parent[i] >= i)) {
+			return 0;
+		}
+		if (first[i] != INDEX_NONE &&
+		    (first[i] <= i ||
+		     (uint64_t)first[i] + children[i] > h->count)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int _map_index(efs_index *idx, const char *file)
+{
+	int fd = open(file, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return -1;
+	}
+	struct stat st;
+	if (fstat(fd, &st) == -1) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	if ((size_t)st.st_size < sizeof(efs_index_header)) {
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+	void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return -1;
+	}
+	const efs_index_header *h = (const efs_index_header *)map;
+	if (h->total_len != (uint64_t)st.st_size ||
+	    !_index_ok(h, (const char *)map)) {
+		munmap(map, (size_t)st.st_size);
+		errno = EINVAL;
+		return -1;
+	}
+	const char *base = (const char *)map;
+	efs_index_view *v = &idx->view;
+	v->header = h;
+	v->count = h->count;
+	v->size = (const uint64_t *)(base + h->off_size);
+	v->mtime = (const int64_t *)(base + h->off_mtime);
+	v->uid = (const uint32_t *)(base + h->off_uid);
+	v->type = (const uint8_t *)(base + h->off_type);
+	v->parent = (const uint32_t *)(base + h->off_parent);
+	v->first_child = (const uint32_t *)(base + h->off_first_child);
+	v->child_count = (const uint32_t *)(base + h->off_child_count);
+	v->name = (const uint64_t *)(base + h->off_name);
+	v->names = base + h->off_names;
+	v->root = base + h->off_root;
+	idx->map = map;
+	idx->map_len = (size_t)st.st_size;
+	return 0;
+}
+
+static void _unmap_index(efs_index *idx)
+{
+	if (idx->map != NULL) {
+		munmap(idx->map, idx->map_len);
+		idx->map = NULL;
+	}
+}
+
+static efs_index *_new_index(lua_State *L, const char *file)
+{
+	efs_index *idx = (efs_index *)lua_newuserdata(L, sizeof(efs_index));
+	memset(idx, 0, sizeof(efs_index));
+	luaL_getmetatable(L, INDEX_METATABLE);
+	lua_setmetatable(L, -2);
+	idx->file = strdup(file);
+	return idx;
+}
+
+static efs_index *_check_index(lua_State *L, int idx)
+{
+	efs_index *index = (efs_index *)luaL_checkudata(L, idx, INDEX_METATABLE);
+	luaL_argcheck(L, index->map != NULL, idx, "closed " INDEX_METATABLE);
+	return index;
+}
+
+/*
+** Scans tree and writes its index.
+** @param #1 Root directory.
+** @param #2 Index file path.
+** @param #3 Options table { one_file_system = false } (optional).
+** Returns opened index.
+*/
+int eli_build_index(lua_State *L)
+{
+	const char *root = luaL_checkstring(L, 1);
+	const char *file = luaL_checkstring(L, 2);
+	efs_index_builder b;
+	memset(&b, 0, sizeof(b));
+	if (lua_istable(L, 3)) {
+		lua_getfield(L, 3, "one_file_system");
+		b.xdev = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+	}
+	int res = _index_tree(&b, root, NULL);
+	if (res == 0) {
+		res = _write_index(&b, root, file);
+	}
+	_builder_free(&b);
+	if (res == -1) {
+		return push_error(L, root);
+	}
+	efs_index *idx = _new_index(L, file);
+	if (idx->file == NULL || _map_index(idx, file) == -1) {
+		return push_error(L, file);
+	}
+	return 1;
+}
+
+/*
+** Opens index written by build_index.
+** @param #1 Index file path.
+*/
+int eli_open_index(lua_State *L)
+{
+	const char *file = luaL_checkstring(L, 1);
+	efs_index *idx = _new_index(L, file);
+	if (idx->file == NULL || _map_index(idx, file) == -1) {
+		return push_error(L, file);
+	}
+	return 1;
+}
+
+/*
+** Rescans directories whose mtime changed and rewrites the index.
+** Files in unchanged directories keep their recorded size and mtime.
+** Returns table { scanned_dirs, reused_dirs }.
+*/
+static int index_refresh(lua_State *L)
+{
+	efs_index *idx = _check_index(L, 1);
+	efs_index_builder b;
+	memset(&b, 0, sizeof(b));
+	if (lua_istable(L, 2)) {
+		lua_getfield(L, 2, "one_file_system");
+		b.xdev = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+	}
+	char *root = strdup(idx->view.root);
+	if (root == NULL) {
+		return luaL_error(L, "refresh: out of memory");
+	}
+	int res = _index_tree(&b, root, &idx->view);
+	if (res == 0) {
+		res = _write_index(&b, root, idx->file);
+	}
+	int err = errno;
+	free(root);
+	if (res == -1) {
+		_builder_free(&b);
+		errno = err;
+		return push_error(L, idx->file);
+	}
+	_unmap_index(idx);
+	res = _map_index(idx, idx->file);
+	err = errno;
+	lua_createtable(L, 0, 2);
+	lua_pushinteger(L, (lua_Integer)b.scanned_dirs);
+	lua_setfield(L, -2, "scanned_dirs");
+	lua_pushinteger(L, (lua_Integer)b.reused_dirs);
+	lua_setfield(L, -2, "reused_dirs");
+	_builder_free(&b);
+	if (res == -1) {
+		errno = err;
+		return push_error(L, idx->file);
+	}
+	return 1;
+}
+
+/* builds path relative to root by walking the parent column */
+static char *_entry_path(const efs_index_view *v, uint32_t i)
+{
+	size_t len = 0;
+	for (uint32_t p = i; p != 0; p = v->parent[p]) {
+		len += strlen(_view_name(v, p)) + 1;
+	}
+	char *path = malloc(len > 0 ? len : 1);
+	if (path == NULL) {
+		return NULL;
+	}
+	path[len > 0 ? len - 1 : 0] = '\0';
+	size_t end = len > 0 ? len - 1 : 0;
+	for (uint32_t p = i; p != 0; p = v->parent[p]) {
+		const char *name = _view_name(v, p);
+		size_t name_len = strlen(name);
+		end -= name_len;
+		memcpy(path + end, name, name_len);
+		if (end > 0) {
+			path[--end] = '/';
+		}
+	}
+	return path;
+}
+
+typedef struct efs_path_hit {
+	char *path;
+	uint32_t entry;
+} efs_path_hit;
+
+static int _compare_paths(const void *a, const void *b)
+{
+	return strcmp(((const efs_path_hit *)a)->path,
+		      ((const efs_path_hit *)b)->path);
+}
+
+static int _compare_paths_desc(const void *a, const void *b)
+{
+	return _compare_paths(b, a);
+}
+
+static void _push_entry(lua_State *L, const efs_index_view *v, uint32_t i)
+{
+	char *path = _entry_path(v, i);
+	if (path == NULL) {
+		luaL_error(L, "out of memory");
+		return;
+	}
+	lua_createtable(L, 0, 5);
+	lua_pushstring(L, path);
+	free(path);
+	lua_setfield(L, -2, "path");
+	lua_pushinteger(L, (lua_Integer)v->size[i]);
+	lua_setfield(L, -2, "size");
+	lua_pushinteger(L, (lua_Integer)(v->mtime[i] / 1000000000));
+	lua_setfield(L, -2, "modification");
+	lua_pushinteger(L, (lua_Integer)v->uid[i]);
+	lua_setfield(L, -2, "uid");
+	lua_pushstring(L, mode2string((mode_t)v->type[i] << 12));
+	lua_setfield(L, -2, "type");
+}
+
+typedef struct efs_index_query {
+	int type; /* -1 for any */
+	uint64_t min_size;
+	uint64_t max_size;
+	int64_t mtime_after;
+	int64_t mtime_before;
+	int64_t uid; /* -1 for any */
+} efs_index_query;
+
+static int _matches(const efs_index_view *v, const efs_index_query *q,
+		    uint32_t i)
+{
+	return (q->type < 0 || v->type[i] == q->type) &&
+	       v->size[i] >= q->min_size && v->size[i] <= q->max_size &&
+	       v->mtime[i] >= q->mtime_after && v->mtime[i] < q->mtime_before &&
+	       (q->uid < 0 || v->uid[i] == (uint32_t)q->uid);
+}
+
+typedef struct efs_index_hit {
+	int64_t key;
+	uint32_t entry;
+} efs_index_hit;
+
+static int _compare_hits(const void *a, const void *b)
+{
+	const efs_index_hit *x = (const efs_index_hit *)a;
+	const efs_index_hit *y = (const efs_index_hit *)b;
+	if (x->key != y->key) {
+		return x->key < y->key ? -1 : 1;
+	}
+	return x->entry < y->entry ? -1 : x->entry > y->entry;
+}
+
+static lua_Integer _opt_field(lua_State *L, int idx, const char *name,
+			      lua_Integer def)
+{
+	lua_getfield(L, idx, name);
+	lua_Integer value = luaL_optinteger(L, -1, def);
+	lua_pop(L, 1);
+	return value;
+}
+
+/*
+** Queries index.
+** @param #2 Options table (optional):
+**   type = "file"|"directory"|..., min_size, max_size,
+**   modified_after, modified_before (seconds), uid,
+**   prefix = path below root, order_by = "size"|"modification"|"path",
+**   desc = false, limit
+** Returns array of { path, size, modification, uid, type }.
+*/
+static int index_query(lua_State *L)
+{
+	efs_index *idx = _check_index(L, 1);
+	const efs_index_view *v = &idx->view;
+	efs_index_query q = { -1, 0, UINT64_MAX, INT64_MIN, INT64_MAX, -1 };
+	const char *prefix = NULL;
+	const char *order_by = NULL;
+	int desc = 0;
+	lua_Integer limit = -1;
+	if (lua_istable(L, 2)) {
+		lua_getfield(L, 2, "type");
+		const char *type = luaL_optstring(L, -1, NULL);
+		if (type != NULL) {
+			static const mode_t types[] = { S_IFREG, S_IFDIR, S_IFLNK,
+							S_IFSOCK, S_IFIFO, S_IFCHR,
+							S_IFBLK };
+			q.type = 0;
+			for (size_t t = 0; t < sizeof(types) / sizeof(types[0]);
+			     t++) {
+				if (strcmp(mode2string(types[t]), type) == 0) {
+					q.type = (int)(types[t] >> 12);
+				}
+			}
+			if (q.type == 0) {
+				return luaL_argerror(L, 2, "invalid type");
+			}
+		}
+		lua_getfield(L, 2, "prefix");
+		prefix = luaL_optstring(L, -1, NULL);
+		lua_getfield(L, 2, "order_by");
+		order_by = luaL_optstring(L, -1, NULL);
+		lua_getfield(L, 2, "desc");
+		desc = lua_toboolean(L, -1);
+		lua_pop(L, 1); /* type, prefix and order_by stay on stack */
+		q.min_size = (uint64_t)_opt_field(L, 2, "min_size", 0);
+		q.max_size = (uint64_t)_opt_field(L, 2, "max_size", -1);
+		lua_Integer after = _opt_field(L, 2, "modified_after", INT64_MIN);
+		lua_Integer before =
+			_opt_field(L, 2, "modified_before", INT64_MAX);
+		if (after != INT64_MIN) {
+			q.mtime_after = (int64_t)after * 1000000000 + 1000000000;
+		}
+		if (before != INT64_MAX) {
+			q.mtime_before = (int64_t)before * 1000000000;
+		}
+		q.uid = _opt_field(L, 2, "uid", -1);
+		limit = _opt_field(L, 2, "limit", -1);
+	}
+
+	int key_column = 0;
+	if (order_by != NULL) {
+		key_column = strcmp(order_by, "size") == 0	   ? 1 :
+			     strcmp(order_by, "modification") == 0 ? 2 :
+			     strcmp(order_by, "path") == 0	   ? 3 :
+								     -1;
+		luaL_argcheck(L, key_column > 0, 2, "invalid order_by");
+	}
+	uint32_t start = 0;
+	if (prefix != NULL) {
+		start = _view_lookup(v, prefix);
+		if (start == INDEX_NONE) {
+			lua_newtable(L);
+			return 1;
+		}
+	}
+
+	size_t hit_count = 0, hit_cap = 1024;
+	efs_index_hit *hits = malloc(hit_cap * sizeof(efs_index_hit));
+	uint32_t *stack = NULL;
+	size_t stack_len = 0, stack_cap = 0;
+	int failed = hits == NULL;
+	/* without prefix the columns are scanned linearly */
+	uint32_t i = start == 0 ? 1 : start;
+	uint32_t end = start == 0 ? (uint32_t)v->count : start;
+	if (start != 0) {
+		stack_cap = 64;
+		stack = malloc(stack_cap * sizeof(uint32_t));
+		failed = failed || stack == NULL;
+		if (!failed) {
+			stack[stack_len++] = start;
+		}
+	}
+	for (;;) {
+		if (failed) {
+			break;
+		}
+		if (stack != NULL) {
+			if (stack_len == 0) {
+				break;
+			}
+			i = stack[--stack_len];
+			if (v->type[i] == TYPE_DIR &&
+			    v->first_child[i] != INDEX_NONE) {
+				uint32_t c = v->first_child[i];
+				uint32_t n = v->child_count[i];
+				if (stack_len + n > stack_cap) {
+					while (stack_len + n > stack_cap) {
+						stack_cap *= 2;
+					}
+					uint32_t *grown = realloc(
+						stack, stack_cap * sizeof(uint32_t));
+					if (grown == NULL) {
+						failed = 1;
+						break;
+					}
+					stack = grown;
+				}
+				for (uint32_t k = 0; k < n; k++) {
+					stack[stack_len++] = c + n - 1 - k;
+				}
+			}
+			if (i == start) {
+				continue;
+			}
+		} else if (i >= end) {
+			break;
+		}
+		if (_matches(v, &q, i)) {
+			if (hit_count == hit_cap) {
+				hit_cap *= 2;
+				efs_index_hit *grown =
+					realloc(hits, hit_cap * sizeof(efs_index_hit));
+				if (grown == NULL) {
+					failed = 1;
+					break;
+				}
+				hits = grown;
+			}
+			int64_t key = key_column == 1 ? (int64_t)v->size[i] :
+				      key_column == 2 ? v->mtime[i] :
+							(int64_t)i;
+			hits[hit_count].key = desc && key_column ? -key : key;
+			hits[hit_count].entry = i;
+			hit_count++;
+		}
+		if (stack == NULL) {
+			i++;
+		}
+	}
+	free(stack);
+	if (failed) {
+		free(hits);
+		return luaL_error(L, "query: out of memory");
+	}
+	if (key_column == 3) {
+		/* order by path, paths are only materialized for hits */
+		efs_path_hit *paths = malloc(hit_count * sizeof(efs_path_hit) + 1);
+		failed = paths == NULL;
+		for (size_t k = 0; k < hit_count && !failed; k++) {
+			paths[k].path = _entry_path(v, hits[k].entry);
+			paths[k].entry = hits[k].entry;
+			if (paths[k].path == NULL) {
+				hit_count = k;
+				failed = 1;
+			}
+		}
+		if (!failed) {
+			qsort(paths, hit_count, sizeof(efs_path_hit),
+			      desc ? _compare_paths_desc : _compare_paths);
+		}
+		for (size_t k = 0; paths != NULL && k < hit_count; k++) {
+			hits[k].entry = paths[k].entry;
+			free(paths[k].path);
+		}
+		free(paths);
+		if (failed) {
+			free(hits);
+			return luaL_error(L, "query: out of memory");
+		}
+	} else if (key_column != 0) {
+		qsort(hits, hit_count, sizeof(efs_index_hit), _compare_hits);
+	}
+	size_t n = hit_count;
+	if (limit >= 0 && (size_t)limit < n) {
+		n = (size_t)limit;
+	}
+	lua_createtable(L, (int)n, 0);
+	for (size_t k = 0; k < n; k++) {
+		_push_entry(L, v, hits[k].entry);
+		lua_rawseti(L, -2, (lua_Integer)k + 1);
+	}
+	free(hits);
+	return 1;
+}
+
+/*
+** Returns entry recorded for path (relative to root) or nil.
+*/
+static int index_lookup(lua_State *L)
+{
+	efs_index *idx = _check_index(L, 1);
+	const char *path = luaL_checkstring(L, 2);
+	uint32_t i = _view_lookup(&idx->view, path);
+	if (i == INDEX_NONE) {
+		lua_pushnil(L);
+		return 1;
+	}
+	_push_entry(L, &idx->view, i);
+	return 1;
+}
+
+static int index_count(lua_State *L)
+{
+	efs_index *idx = _check_index(L, 1);
+	lua_pushinteger(L, (lua_Integer)idx->view.count - 1);
+	return 1;
+}
+
+static int index_root(lua_State *L)
+{
+	efs_index *idx = _check_index(L, 1);
+	lua_pushstring(L, idx->view.root);
+	return 1;
+}
+
+static int index_close(lua_State *L)
+{
+	efs_index *idx = (efs_index *)luaL_checkudata(L, 1, INDEX_METATABLE);
+	_unmap_index(idx);
+	free(idx->file);
+	idx->file = NULL;
+	return 0;
+}
+
+/*
+** Creates index metatable.
+*/
+int index_create_meta(lua_State *L)
+{
+	luaL_newmetatable(L, INDEX_METATABLE);
+	/* Method table */
+	lua_newtable(L);
+	lua_pushcfunction(L, index_query);
+	lua_setfield(L, -2, "query");
+	lua_pushcfunction(L, index_lookup);
+	lua_setfield(L, -2, "lookup");
+	lua_pushcfunction(L, index_refresh);
+	lua_setfield(L, -2, "refresh");
+	lua_pushcfunction(L, index_count);
+	lua_setfield(L, -2, "count");
+	lua_pushcfunction(L, index_root);
+	lua_setfield(L, -2, "root");
+	lua_pushcfunction(L, index_close);
+	lua_setfield(L, -2, "close");
+	/* type */
+	lua_pushstring(L, INDEX_METATABLE);
+	lua_setfield(L, -2, "__type");
+
+	/* Metamethods */
+	lua_setfield(L, -2, "__index");
+	lua_pushcfunction(L, index_close);
+	lua_setfield(L, -2, "__gc");
+	lua_pushcfunction(L, index_close);
+	lua_setfield(L, -2, "__close");
+	return 1;
+}
+
+#endif
@@ -0,0 +1,11 @@
+#ifndef ELI_EXTRA_FS_INDEX_H__
+#define ELI_EXTRA_FS_INDEX_H__
+
+#include "lua.h"
+
+int eli_build_index(lua_State *L);
+int eli_open_index(lua_State *L);
+
+int index_create_meta(lua_State *L);
+
+#endif /* ELI_EXTRA_FS_INDEX_H__ */
@@ -0,0 +1,798 @@
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "lerror.h"
+#include "ljob.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+
+int eli_start_job(lua_State *L)
+{
+	errno = ENOSYS; /* = "Function not implemented" */
+	return push_result(L, -1, "start_job is not supported on Windows");
+}
+
+int job_create_meta(lua_State *L)
+{
+	return 0;
+}
+
+#else
+
+#include "lfsutil.h"
+#include "lhash.h"
+#include "llink.h"
+#include "lpool.h"
+#include "lwalk.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#ifdef __linux__
+#include <stdint.h>
+#include <sys/eventfd.h>
+#endif
+
+#define JOB_METATABLE "ELI_JOB"
+
+enum efs_job_kind { JOB_COPY, JOB_REMOVE, JOB_HASH, JOB_SCAN };
+
+static const char *const job_kinds[] = { "copy", "remove", "hash", "scan",
+					 NULL };
+
+enum efs_job_state { JOB_RUNNING, JOB_DONE, JOB_FAILED, JOB_CANCELLED };
+
+static const char *const job_states[] = { "running", "done", "failed",
+					  "cancelled" };
+
+/*
+** Job state lives outside of Lua memory and is shared by the handle and
+** the pool task running the job; whichever of them lets go last frees
+** it. Counters are updated by walker threads while the job runs, result
+** fields are written before state leaves JOB_RUNNING.
+*/
+typedef struct efs_job {
+	enum efs_job_kind kind;
+	char *path;
+	char *dst; /* copy only */
+	int walk_flags;
+	int refs;
+	int cancel;
+	int state;
+	int err; /* errno of a failed job */
+	int efd; /* readable once the job finished */
+	int signal_fd; /* write end, same as efd with eventfd */
+	unsigned long long bytes;
+	unsigned long long files;
+	unsigned long long dirs;
+	unsigned long long errors;
+	long long total_bytes; /* -1 if not known upfront */
+	int dst_fd; /* copy of a tree */
+	dev_t dst_dev; /* dst itself is skipped when it lies inside path */
+	ino_t dst_ino;
+	char digest[EFS_SHA256_SIZE * 2 + 1];
+} efs_job;
+
+typedef struct efs_job_handle {
+	efs_job *job;
+} efs_job_handle;
+
+static void _job_count(unsigned long long *counter, unsigned long long n)
+{
+	__atomic_add_fetch(counter, n, __ATOMIC_RELAXED);
+}
+
+static int _job_cancelled(efs_job *job)
+{
+	return __atomic_load_n(&job->cancel, __ATOMIC_RELAXED);
+}
+
+static void _job_release(efs_job *job)
+{
+	if (__atomic_sub_fetch(&job->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+		return;
+	}
+	if (job->signal_fd != job->efd) {
+		close(job->signal_fd);
+	}
+	close(job->efd);
+	free(job->path);
+	free(job->dst);
+	free(job);
+}
+
+static int _job_progress(long long bytes, void *ud)
+{
+	efs_job *job = (efs_job *)ud;
+	_job_count(&job->bytes, (unsigned long long)bytes);
+	if (_job_cancelled(job)) {
+		errno = ECANCELED;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+** Opens ddir/dname for writing. Below a tree's dst_fd no symlink is
+** followed, one in place of dname is replaced; dst itself (ddir is
+** AT_FDCWD) is opened as given.
+*/
+static int _job_open_dst(int ddir, const char *dname, mode_t mode)
+{
+	int flags = O_WRONLY | O_CREAT | O_TRUNC;
+	if (ddir == AT_FDCWD) {
+		return open(dname, flags | O_CLOEXEC, mode);
+	}
+	int fd = efs_open_beneath(ddir, dname, flags, mode);
+	if (fd == -1 && errno == ELOOP) {
+		const char *name;
+		int dir = efs_open_parent(ddir, dname, &name);
+		if (dir != -1 && unlinkat(dir, name, 0) == 0) {
+			fd = openat(dir, name, flags | O_NOFOLLOW | O_CLOEXEC,
+				    mode);
+		}
+		efs_close_parent(ddir, dir);
+	}
+	return fd;
+}
+
+/*
+** Copies regular file at sdir/sname to ddir/dname, replacing it.
+*/
+static int _job_copy_file(efs_job *job, int sdir, const char *sname,
+			  const struct stat *st, int ddir, const char *dname)
+{
+	int src = openat(sdir, sname, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (src == -1) {
+		return -1;
+	}
+	int dst = _job_open_dst(ddir, dname, st->st_mode & 07777);
+	if (dst == -1) {
+		int err = errno;
+		close(src);
+		errno = err;
+		return -1;
+	}
+	int res = efs_copy_fd_progress(src, dst, _job_progress, job) == -1 ?
+			  -1 :
+			  0;
+	int err = errno;
+	close(src);
+	if (close(dst) == -1 && res != -1) {
+		res = -1;
+		err = errno;
+	}
+	errno = err;
+	return res;
+}
+
+static int _job_copy_symlink(int sdir, const char *sname, const struct stat *st,
+			     int ddir, const char *dname)
+{
+	size_t size = st->st_size > 0 ? (size_t)st->st_size + 1 : 256;
+	char *target = malloc(size);
+	if (target == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	ssize_t len = readlinkat(sdir, sname, target, size);
+	if (len == -1 || (size_t)len == size) {
+		free(target);
+		if (len != -1) {
+			errno = ENAMETOOLONG;
+		}
+		return -1;
+	}
+	target[len] = '\0';
+	const char *name = dname;
+	int dir = ddir == AT_FDCWD ? ddir : efs_open_parent(ddir, dname, &name);
+	int res = -1;
+	if (dir != -1) {
+		/* replaces what is there, as for files */
+		unlinkat(dir, name, 0);
+		res = symlinkat(target, dir, name);
+	}
+	efs_close_parent(ddir, dir);
+	int err = errno;
+	free(target);
+	errno = err;
+	return res;
+}
+
+/* creates directory rel below dst_fd, or accepts one already there */
+static int _job_mkdir(efs_job *job, const char *rel, mode_t mode)
+{
+	const char *name;
+	int dir = efs_open_parent(job->dst_fd, rel, &name);
+	if (dir == -1) {
+		return -1;
+	}
+	int res = mkdirat(dir, name, mode);
+	if (res == -1 && errno == EEXIST) {
+		struct stat st;
+		if (fstatat(dir, name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+			res = S_ISDIR(st.st_mode) ? 0 : -1;
+		}
+		errno = EEXIST;
+	}
+	efs_close_parent(job->dst_fd, dir);
+	return res;
+}
+
+static int _job_copy_enter(efs_walk_entry *entry, void *ud)
+{
+	efs_job *job = (efs_job *)ud;
+	const char *rel = entry->path + entry->rel_offset;
+	const struct stat *st = entry->st;
+	if (_job_cancelled(job)) {
+		return EFS_WALK_STOP;
+	}
+	if (S_ISDIR(st->st_mode)) {
+		if (st->st_dev == job->dst_dev && st->st_ino == job->dst_ino) {
+			/* do not copy the tree being built into itself */
+			return EFS_WALK_SKIP;
+		}
+		/* writable until its children are in place */
+		if (_job_mkdir(job, rel, (st->st_mode & 07777) | S_IRWXU) ==
+		    -1) {
+			_job_count(&job->errors, 1);
+			return EFS_WALK_SKIP;
+		}
+		_job_count(&job->dirs, 1);
+		return EFS_WALK_CONTINUE;
+	}
+	int res = 0;
+	if (S_ISREG(st->st_mode)) {
+		res = _job_copy_file(job, entry->dirfd, entry->name, st,
+				     job->dst_fd, rel);
+	} else if (S_ISLNK(st->st_mode)) {
+		res = _job_copy_symlink(entry->dirfd, entry->name, st,
+					job->dst_fd, rel);
+	} else {
+		return EFS_WALK_CONTINUE; /* devices, fifos and sockets */
+	}
+	if (res == -1) {
+		if (errno == ECANCELED) {
+			const char *name;
+			int dir = efs_open_parent(job->dst_fd, rel, &name);
+			if (dir != -1) {
+				unlinkat(dir, name, 0);
+			}
+			efs_close_parent(job->dst_fd, dir);
+			return EFS_WALK_STOP;
+		}
+		_job_count(&job->errors, 1);
+	} else {
+		_job_count(&job->files, 1);
+	}
+	return EFS_WALK_CONTINUE;
+}
+
+static int _job_copy_leave(efs_walk_entry *entry, void *ud)
+{
+	efs_job *job = (efs_job *)ud;
+	mode_t mode = entry->st->st_mode & 07777;
+	if ((mode & S_IRWXU) == S_IRWXU) {
+		return EFS_WALK_CONTINUE;
+	}
+	int fd = efs_open_beneath(job->dst_fd, entry->path + entry->rel_offset,
+				  O_RDONLY | O_DIRECTORY, 0);
+	if (fd == -1 || fchmod(fd, mode) == -1) {
+		_job_count(&job->errors, 1);
+	}
+	if (fd != -1) {
+		close(fd);
+	}
+	return EFS_WALK_CONTINUE;
+}
+
+static int _job_copy(efs_job *job)
+{
+	struct stat st;
+	if (lstat(job->path, &st) == -1) {
+		return -1;
+	}
+	if (S_ISLNK(st.st_mode)) {
+		/* copied as a link, like the ones inside a tree */
+		if (_job_copy_symlink(AT_FDCWD, job->path, &st, AT_FDCWD,
+				      job->dst) == -1) {
+			return -1;
+		}
+		_job_count(&job->files, 1);
+		return 0;
+	}
+	if (!S_ISDIR(st.st_mode)) {
+		struct stat dst_st;
+		if (stat(job->dst, &dst_st) == 0 &&
+		    dst_st.st_dev == st.st_dev && dst_st.st_ino == st.st_ino) {
+			errno = EINVAL; /* would truncate the source */
+			return -1;
+		}
+		__atomic_store_n(&job->total_bytes, (long long)st.st_size,
+				 __ATOMIC_RELAXED);
+		if (_job_copy_file(job, AT_FDCWD, job->path, &st, AT_FDCWD,
+				   job->dst) == -1) {
+			return -1;
+		}
+		_job_count(&job->files, 1);
+		return 0;
+	}
+	int created = mkdir(job->dst, (st.st_mode & 07777) | S_IRWXU) == 0;
+	if (!created && errno != EEXIST) {
+		return -1;
+	}
+	job->dst_fd = open(job->dst, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	struct stat dst_st;
+	if (job->dst_fd == -1 || fstat(job->dst_fd, &dst_st) == -1) {
+		int err = errno;
+		if (job->dst_fd != -1) {
+			close(job->dst_fd);
+		}
+		errno = err;
+		return -1;
+	}
+	if (dst_st.st_dev == st.st_dev && dst_st.st_ino == st.st_ino) {
+		close(job->dst_fd);
+		errno = EINVAL;
+		return -1;
+	}
+	job->dst_dev = dst_st.st_dev;
+	job->dst_ino = dst_st.st_ino;
+	efs_walker walker = { _job_copy_enter, _job_copy_leave, job,
+			      job->walk_flags, 0, 0 };
+	int res = efs_walk_parallel(&walker, job->path);
+	int err = errno;
+	if (created && (st.st_mode & S_IRWXU) != S_IRWXU) {
+		fchmod(job->dst_fd, st.st_mode & 07777);
+	}
+	close(job->dst_fd);
+	_job_count(&job->errors, (unsigned long long)walker.errors);
+	errno = err;
+	return res;
+}
+
+static int _job_remove_enter(efs_walk_entry *entry, void *ud)
+{
+	efs_job *job = (efs_job *)ud;
+	if (_job_cancelled(job)) {
+		return EFS_WALK_STOP;
+	}
+	if (S_ISDIR(entry->st->st_mode)) {
+		return EFS_WALK_CONTINUE;
+	}
+	if (unlinkat(entry->dirfd, entry->name, 0) == -1) {
+		_job_count(&job->errors, 1);
+	} else {
+		_job_count(&job->files, 1);
+		_job_count(&job->bytes, (unsigned long long)entry->st->st_size);
+	}
+	return EFS_WALK_CONTINUE;
+}
+
+static int _job_remove_leave(efs_walk_entry *entry, void *ud)
+{
+	efs_job *job = (efs_job *)ud;
+	if (unlinkat(entry->dirfd, entry->name, AT_REMOVEDIR) == -1) {
+		_job_count(&job->errors, 1);
+	} else {
+		_job_count(&job->dirs, 1);
+	}
+	return EFS_WALK_CONTINUE;
+}
+
+static int _job_remove(efs_job *job)
+{
+	struct stat st;
+	if (lstat(job->path, &st) == -1) {
+		return -1;
+	}
+	if (!S_ISDIR(st.st_mode)) {
+		if (unlink(job->path) == -1) {
+			return -1;
+		}
+		_job_count(&job->files, 1);
+		_job_count(&job->bytes, (unsigned long long)st.st_size);
+		return 0;
+	}
+	efs_walker walker = { _job_remove_enter, _job_remove_leave, job,
+			      job->walk_flags, 0, 0 };
+	if (efs_walk_parallel(&walker, job->path) == -1) {
+		return -1;
+	}
+	_job_count(&job->errors, (unsigned long long)walker.errors);
+	if (walker.stopped) {
+		return 0;
+	}
+	if (rmdir(job->path) == -1) {
+		_job_count(&job->errors, 1);
+	} else {
+		_job_count(&job->dirs, 1);
+	}
+	return 0;
+}
+
+static int _job_hash(efs_job *job)
+{
+	int fd = open(job->path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return -1;
+	}
+	struct stat st;
+	if (fstat(fd, &st) == 0) {
+		__atomic_store_n(&job->total_bytes, (long long)st.st_size,
+				 __ATOMIC_RELAXED);
+	}
+	char *buf = malloc(1 << 20);
+	if (buf == NULL) {
+		close(fd);
+		errno = ENOMEM;
+		return -1;
+	}
+	efs_sha256 ctx;
+	efs_sha256_init(&ctx);
+	int res = 0;
+	for (;;) {
+		ssize_t n = read(fd, buf, 1 << 20);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			res = n == 0 ? 0 : -1;
+			break;
+		}
+		efs_sha256_update(&ctx, buf, (size_t)n);
+		if (_job_progress(n, job) == -1) {
+			res = -1;
+			break;
+		}
+	}
+	int err = errno;
+	free(buf);
+	close(fd);
+	if (res == 0) {
+		unsigned char digest[EFS_SHA256_SIZE];
+		efs_sha256_final(&ctx, digest);
+		efs_hex(digest, EFS_SHA256_SIZE, job->digest);
+		_job_count(&job->files, 1);
+	}
+	errno = err;
+	return res;
+}
+
+static int _job_scan_enter(efs_walk_entry *entry, void *ud)
+{
+	efs_job *job = (efs_job *)ud;
+	if (_job_cancelled(job)) {
+		return EFS_WALK_STOP;
+	}
+	if (S_ISDIR(entry->st->st_mode)) {
+		_job_count(&job->dirs, 1);
+	} else {
+		_job_count(&job->files, 1);
+		_job_count(&job->bytes, (unsigned long long)entry->st->st_size);
+	}
+	return EFS_WALK_CONTINUE;
+}
+
+static int _job_scan(efs_job *job)
+{
+	efs_walker walker = { _job_scan_enter, NULL, job, job->walk_flags, 0,
+			      0 };
+	if (efs_walk_parallel(&walker, job->path) == -1) {
+		return -1;
+	}
+	_job_count(&job->errors, (unsigned long long)walker.errors);
+	return 0;
+}
+
+static void _job_task(void *arg)
+{
+	efs_job *job = (efs_job *)arg;
+	int res = -1;
+	if (!_job_cancelled(job)) {
+		switch (job->kind) {
+		case JOB_COPY:
+			res = _job_copy(job);
+			break;
+		case JOB_REMOVE:
+			res = _job_remove(job);
+			break;
+		case JOB_HASH:
+			res = _job_hash(job);
+			break;
+		case JOB_SCAN:
+			res = _job_scan(job);
+			break;
+		}
+	}
+	job->err = res == -1 ? errno : 0;
+	int state = _job_cancelled(job) ? JOB_CANCELLED :
+		    res == -1		 ? JOB_FAILED :
+					   JOB_DONE;
+	__atomic_store_n(&job->state, state, __ATOMIC_RELEASE);
+#ifdef __linux__
+	uint64_t one = 1;
+	(void)!write(job->signal_fd, &one, sizeof(one));
+#else
+	char one = 1;
+	(void)!write(job->signal_fd, &one, sizeof(one));
+#endif
+	_job_release(job);
+}
+
+static efs_job *_check_job(lua_State *L)
+{
+	efs_job_handle *h =
+		(efs_job_handle *)luaL_checkudata(L, 1, JOB_METATABLE);
+	luaL_argcheck(L, h->job != NULL, 1, "closed " JOB_METATABLE);
+	return h->job;
+}
+
+static int _job_state(efs_job *job)
+{
+	return __atomic_load_n(&job->state, __ATOMIC_ACQUIRE);
+}
+
+static char *_job_arg(lua_State *L, const char *field)
+{
+	lua_getfield(L, 2, field);
+	const char *value = lua_tostring(L, -1);
+	if (value == NULL) {
+		luaL_argerror(L, 2, lua_pushfstring(L, "%s must be a string",
+						    field));
+	}
+	char *copy = strdup(value);
+	if (copy == NULL) {
+		luaL_error(L, "out of memory");
+	}
+	lua_pop(L, 1);
+	return copy;
+}
+
+/*
+** Starts long running operation on the shared worker pool.
+** @param #1 Kind of job:
+**   "copy" - copies file or directory tree src to dst, directories are
+**            processed in parallel, existing files are replaced, dst
+**            may lie inside src and is left out of the copy then,
+**   "remove" - removes file or directory tree path,
+**   "hash" - computes SHA-256 of file path,
+**   "scan" - counts files, directories and bytes below path.
+** @param #2 Arguments table { path, src, dst, one_file_system = false },
+**           or just the path for remove, hash and scan.
+** Returns job handle; its fd becomes readable once the job finished and
+** stays so. Dropping the handle cancels the job.
+*/
+int eli_start_job(lua_State *L)
+{
+	int kind = luaL_checkoption(L, 1, NULL, job_kinds);
+	if (lua_isstring(L, 2) && kind != JOB_COPY) {
+		lua_createtable(L, 0, 1);
+		lua_pushvalue(L, 2);
+		lua_setfield(L, -2, "path");
+		lua_replace(L, 2);
+	}
+	luaL_checktype(L, 2, LUA_TTABLE);
+	lua_settop(L, 2);
+
+	efs_job_handle *h =
+		(efs_job_handle *)lua_newuserdata(L, sizeof(efs_job_handle));
+	h->job = NULL;
+	luaL_getmetatable(L, JOB_METATABLE);
+	lua_setmetatable(L, -2);
+	efs_job *job = calloc(1, sizeof(efs_job));
+	if (job == NULL) {
+		errno = ENOMEM;
+		return push_error(L, NULL);
+	}
+	job->kind = (enum efs_job_kind)kind;
+	job->refs = 1;
+	job->total_bytes = -1;
+	job->dst_fd = -1;
+#ifdef __linux__
+	job->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	job->signal_fd = job->efd;
+	if (job->efd == -1) {
+		free(job);
+		return push_error(L, NULL);
+	}
+#else
+	int fds[2];
+	if (pipe(fds) == -1) {
+		free(job);
+		return push_error(L, NULL);
+	}
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+	fcntl(fds[1], F_SETFL, O_NONBLOCK);
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+	job->efd = fds[0];
+	job->signal_fd = fds[1];
+#endif
+	/* owned by the handle from here on, argument errors release it */
+	h->job = job;
+	if (kind == JOB_COPY) {
+		job->path = _job_arg(L, "src");
+		job->dst = _job_arg(L, "dst");
+	} else {
+		job->path = _job_arg(L, "path");
+	}
+	lua_getfield(L, 2, "one_file_system");
+	job->walk_flags = lua_toboolean(L, -1) ? EFS_WALK_XDEV : 0;
+	lua_pop(L, 1);
+
+	job->refs = 2;
+	if (efs_pool_submit(_job_task, job) == -1) {
+		job->refs = 1;
+		return push_error(L, "start_job");
+	}
+	return 1;
+}
+
+/*
+** Returns { state, bytes, files, dirs, errors, total_bytes }, state is
+** one of "running", "done", "failed" or "cancelled", total_bytes is set
+** only when known upfront (single file copy and hash).
+*/
+static int job_progress(lua_State *L)
+{
+	efs_job *job = _check_job(L);
+	int state = _job_state(job);
+	lua_createtable(L, 0, 6);
+	lua_pushstring(L, job_states[state]);
+	lua_setfield(L, -2, "state");
+	lua_pushinteger(L, (lua_Integer)__atomic_load_n(&job->bytes,
+							__ATOMIC_RELAXED));
+	lua_setfield(L, -2, "bytes");
+	lua_pushinteger(L, (lua_Integer)__atomic_load_n(&job->files,
+							__ATOMIC_RELAXED));
+	lua_setfield(L, -2, "files");
+	lua_pushinteger(L, (lua_Integer)__atomic_load_n(&job->dirs,
+							__ATOMIC_RELAXED));
+	lua_setfield(L, -2, "dirs");
+	lua_pushinteger(L, (lua_Integer)__atomic_load_n(&job->errors,
+							__ATOMIC_RELAXED));
+	lua_setfield(L, -2, "errors");
+	long long total = __atomic_load_n(&job->total_bytes, __ATOMIC_RELAXED);
+	if (total >= 0) {
+		lua_pushinteger(L, (lua_Integer)total);
+		lua_setfield(L, -2, "total_bytes");
+	}
+	return 1;
+}
+
+/*
+** Asks job to stop, work already done is not undone.
+*/
+static int job_cancel(lua_State *L)
+{
+	efs_job *job = _check_job(L);
+	__atomic_store_n(&job->cancel, 1, __ATOMIC_RELAXED);
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+** Waits until job finishes.
+** @param #2 Timeout in milliseconds (optional, waits forever if missing).
+** Returns true once finished, false on timeout.
+*/
+static int job_wait(lua_State *L)
+{
+	efs_job *job = _check_job(L);
+	int timeout = (int)luaL_optinteger(L, 2, -1);
+	if (_job_state(job) == JOB_RUNNING) {
+		struct pollfd pfd = { .fd = job->efd, .events = POLLIN };
+		int res;
+		do {
+			res = poll(&pfd, 1, timeout);
+		} while (res == -1 && errno == EINTR);
+		if (res == -1) {
+			return push_error(L, NULL);
+		}
+	}
+	lua_pushboolean(L, _job_state(job) != JOB_RUNNING);
+	return 1;
+}
+
+/*
+** Returns result of finished job: { bytes, files, dirs, errors } plus
+** digest for hash jobs. Failed and cancelled jobs return nil, error.
+*/
+static int job_result(lua_State *L)
+{
+	efs_job *job = _check_job(L);
+	switch (_job_state(job)) {
+	case JOB_RUNNING:
+		errno = EBUSY;
+		return push_result(L, -1, "job is still running");
+	case JOB_CANCELLED:
+		errno = ECANCELED;
+		return push_result(L, -1, "job was cancelled");
+	case JOB_FAILED:
+		errno = job->err;
+		return push_error(L, job->path);
+	}
+	lua_createtable(L, 0, 5);
+	lua_pushinteger(L, (lua_Integer)job->bytes);
+	lua_setfield(L, -2, "bytes");
+	lua_pushinteger(L, (lua_Integer)job->files);
+	lua_setfield(L, -2, "files");
+	lua_pushinteger(L, (lua_Integer)job->dirs);
+	lua_setfield(L, -2, "dirs");
+	lua_pushinteger(L, (lua_Integer)job->errors);
+	lua_setfield(L, -2, "errors");
+	if (job->kind == JOB_HASH) {
+		lua_pushstring(L, job->digest);
+		lua_setfield(L, -2, "digest");
+	}
+	return 1;
+}
+
+static int job_fd(lua_State *L)
+{
+	efs_job *job = _check_job(L);
+	lua_pushinteger(L, job->efd);
+	return 1;
+}
+
+static int job_kind(lua_State *L)
+{
+	efs_job *job = _check_job(L);
+	lua_pushstring(L, job_kinds[job->kind]);
+	return 1;
+}
+
+static int job_gc(lua_State *L)
+{
+	efs_job_handle *h =
+		(efs_job_handle *)luaL_checkudata(L, 1, JOB_METATABLE);
+	if (h->job != NULL) {
+		__atomic_store_n(&h->job->cancel, 1, __ATOMIC_RELAXED);
+		_job_release(h->job);
+		h->job = NULL;
+	}
+	return 0;
+}
+
+/*
+** Creates job metatable.
+*/
+int job_create_meta(lua_State *L)
+{
+	luaL_newmetatable(L, JOB_METATABLE);
+	/* Method table */
+	lua_newtable(L);
+	lua_pushcfunction(L, job_progress);
+	lua_setfield(L, -2, "progress");
+	lua_pushcfunction(L, job_cancel);
+	lua_setfield(L, -2, "cancel");
+	lua_pushcfunction(L, job_wait);
+	lua_setfield(L, -2, "wait");
+	lua_pushcfunction(L, job_result);
+	lua_setfield(L, -2, "result");
+	lua_pushcfunction(L, job_fd);
+	lua_setfield(L, -2, "fd");
+	lua_pushcfunction(L, job_kind);
+	lua_setfield(L, -2, "kind");
+	/* type */
+	lua_pushstring(L, JOB_METATABLE);
+	lua_setfield(L, -2, "__type");
+
+	/* Metamethods */
+	lua_setfield(L, -2, "__index");
+	lua_pushcfunction(L, job_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_pushcfunction(L, job_gc);
+	lua_setfield(L, -2, "__close");
+	return 1;
+}
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef ELI_EXTRA_FS_JOB_H__
+#define ELI_EXTRA_FS_JOB_H__
+
+#include "lua.h"
+
+int eli_start_job(lua_State *L);
+
+int job_create_meta(lua_State *L);
+
+#endif /* ELI_EXTRA_FS_JOB_H__ */
@@ -4,6 +4,8 @@
 #include "lerror.h"
 #include "lfsutil.h"
 #include "lfile.h"
+#include "llink.h"
+#include "lwalk.h"
 
 #ifdef _WIN32
 
@@ -11,9 +13,492 @@
 
 #else // unix
 
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
 
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/syscall.h>
 #endif
+#ifdef __APPLE__
+#include <sys/clonefile.h>
+#endif
+
+static int _reflink(const char *origin, const char *target)
+{
+#if defined(__APPLE__)
+	return clonefile(origin, target, 0);
+#elif defined(FICLONE)
+	int src = open(origin, O_RDONLY | O_CLOEXEC);
+	if (src == -1) {
+		return -1;
+	}
+	struct stat st;
+	if (fstat(src, &st) == -1) {
+		int err = errno;
+		close(src);
+		errno = err;
+		return -1;
+	}
+	int dst = open(target, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+		       st.st_mode & 07777);
+	if (dst == -1) {
+		int err = errno;
+		close(src);
+		errno = err;
+		return -1;
+	}
+	int res = ioctl(dst, FICLONE, src);
+	int err = errno;
+	close(src);
+	close(dst);
+	if (res == -1) {
+		unlink(target);
+		errno = err;
+	}
+	return res;
+#else
+	(void)origin;
+	(void)target;
+	errno = ENOTSUP;
+	return -1;
+#endif
+}
+
+/*
+** Copies content of src to dst from their current offsets until end of
+** src. Uses copy_file_range where available, so filesystems can share
+** or offload the data, and plain read/write otherwise.
+** Returns bytes copied or -1 with errno set.
+*/
+long long efs_copy_fd(int src, int dst)
+{
+	return efs_copy_fd_progress(src, dst, NULL, NULL);
+}
+
+/*
+** Same as efs_copy_fd, but copies in chunks of EFS_COPY_CHUNK bytes and
+** reports each of them to progress (if given). Copying stops with -1
+** once progress returns -1.
+*/
+long long efs_copy_fd_progress(int src, int dst, efs_copy_progress progress,
+			       void *ud)
+{
+	long long total = 0;
+#if defined(__linux__) && defined(SYS_copy_file_range)
+	size_t chunk = progress != NULL ? EFS_COPY_CHUNK : (size_t)1 << 30;
+	for (;;) {
+		ssize_t n = syscall(SYS_copy_file_range, src, NULL, dst, NULL,
+				    chunk, 0);
+		if (n > 0) {
+			total += n;
+			if (progress != NULL && progress(n, ud) == -1) {
+				return -1;
+			}
+			continue;
+		}
+		if (n == 0) {
+			return total;
+		}
+		if (errno == EINTR) {
+			continue;
+		}
+		if (total > 0 || (errno != EXDEV && errno != EINVAL &&
+				  errno != ENOSYS && errno != EOPNOTSUPP)) {
+			return -1;
+		}
+		break;
+	}
+#endif
+	char *buf = malloc(1 << 17);
+	if (buf == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	long long reported = total;
+	for (;;) {
+		ssize_t n = read(src, buf, 1 << 17);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			int err = errno;
+			free(buf);
+			if (n == 0 && progress != NULL && total > reported &&
+			    progress(total - reported, ud) == -1) {
+				return -1;
+			}
+			errno = err;
+			return n == 0 ? total : -1;
+		}
+		for (ssize_t off = 0; off < n;) {
+			ssize_t w = write(dst, buf + off, (size_t)(n - off));
+			if (w == -1) {
+				if (errno == EINTR) {
+					continue;
+				}
+				int err = errno;
+				free(buf);
+				errno = err;
+				return -1;
+			}
+			off += w;
+		}
+		total += n;
+		if (progress != NULL && total - reported >= (long long)EFS_COPY_CHUNK) {
+			if (progress(total - reported, ud) == -1) {
+				free(buf);
+				return -1;
+			}
+			reported = total;
+		}
+	}
+}
+
+/*
+** Creates target as link of given kind to origin.
+*/
+int efs_link(const char *origin, const char *target, int kind)
+{
+	switch (kind) {
+	case EFS_LINK_SYMBOLIC:
+		return symlink(origin, target);
+	case EFS_LINK_REFLINK:
+		return _reflink(origin, target);
+	default:
+		return link(origin, target);
+	}
+}
+
+/*
+** Atomically replaces existing target with link to origin. The link is
+** created next to target and renamed over it, so target never goes
+** missing.
+*/
+int efs_replace_with_link(const char *origin, const char *target, int kind)
+{
+	size_t len = strlen(target);
+	char *tmp = malloc(len + 32);
+	if (tmp == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	snprintf(tmp, len + 32, "%s.efs-link.%ld", target, (long)getpid());
+	int res = efs_link(origin, tmp, kind);
+	if (res == 0 && (res = rename(tmp, target)) == -1) {
+		int err = errno;
+		unlink(tmp);
+		errno = err;
+	}
+	free(tmp);
+	return res;
+}
+
+/*
+** Creates dname in ddir as a copy of sname in sdir, cloning the data
+** when reflink is set and the filesystem supports it. Without copy only
+** a clone is acceptable.
+** Returns 1 if cloned, 0 if copied, -1 with errno set.
+*/
+static int _clone_at(int sdir, const char *sname, const struct stat *st,
+		     int ddir, const char *dname, int reflink, int copy)
+{
+#ifdef __APPLE__
+	if (reflink && clonefileat(sdir, sname, ddir, dname, 0) == 0) {
+		return 1;
+	}
+#endif
+	int src = openat(sdir, sname, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (src == -1) {
+		return -1;
+	}
+	int dst = openat(ddir, dname, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+			 st->st_mode & 07777);
+	if (dst == -1) {
+		int err = errno;
+		close(src);
+		errno = err;
+		return -1;
+	}
+	int res = -1;
+	errno = EOPNOTSUPP;
+#ifdef FICLONE
+	if (reflink && ioctl(dst, FICLONE, src) == 0) {
+		res = 1;
+	}
+#endif
+	if (res == -1 && copy) {
+		res = efs_copy_fd(src, dst) == -1 ? -1 : 0;
+	}
+	int err = errno;
+	close(src);
+	if (close(dst) == -1 && res != -1) {
+		res = -1;
+		err = errno;
+	}
+	if (res == -1) {
+		unlinkat(ddir, dname, 0);
+	}
+	errno = err;
+	return res;
+}
+
+static int _copy_symlink_at(int sdir, const char *sname, const struct stat *st,
+			    int ddir, const char *dname)
+{
+	size_t size = st->st_size > 0 ? (size_t)st->st_size + 1 : 256;
+	char *target = malloc(size);
+	if (target == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	ssize_t len = readlinkat(sdir, sname, target, size);
+	if (len == -1 || (size_t)len >= size) {
+		free(target);
+		if (len != -1) {
+			errno = ENAMETOOLONG; /* grew since stat */
+		}
+		return -1;
+	}
+	target[len] = '\0';
+	int res = symlinkat(target, ddir, dname);
+	int err = errno;
+	free(target);
+	errno = err;
+	return res;
+}
+
+typedef struct efs_link_tree {
+	int kind;
+	int copy; /* copy when linking is not possible */
+	int dst_fd;
+	dev_t dst_dev; /* dst itself is skipped when it lies inside src */
+	ino_t dst_ino;
+	const char *src_abs; /* absolute source root for symbolic links */
+	size_t src_abs_len;
+	unsigned long dirs;
+	unsigned long links;
+	unsigned long copied;
+	unsigned long skipped;
+	unsigned long errors;
+} efs_link_tree;
+
+static void _tree_count(unsigned long *counter)
+{
+	__atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+}
+
+/*
+** Links regular file, symlink or special file; directories are created
+** by the caller. rel is relative to both roots.
+*/
+static void _link_tree_entry(efs_link_tree *tree, int sdir, const char *sname,
+			     const struct stat *st, const char *rel)
+{
+	int res;
+	if (tree->kind == EFS_LINK_SYMBOLIC) {
+		size_t len = tree->src_abs_len + strlen(rel) + 2;
+		char *target = malloc(len);
+		if (target == NULL) {
+			_tree_count(&tree->errors);
+			return;
+		}
+		snprintf(target, len, "%s/%s", tree->src_abs, rel);
+		res = symlinkat(target, tree->dst_fd, rel);
+		free(target);
+		_tree_count(res == 0 ? &tree->links : &tree->errors);
+		return;
+	}
+	if (tree->kind == EFS_LINK_HARD ||
+	    !(S_ISREG(st->st_mode) || S_ISLNK(st->st_mode))) {
+		res = linkat(sdir, sname, tree->dst_fd, rel, 0);
+		if (res == 0) {
+			_tree_count(&tree->links);
+			return;
+		}
+		if (errno != EXDEV || !tree->copy) {
+			_tree_count(&tree->errors);
+			return;
+		}
+	}
+	if (S_ISLNK(st->st_mode)) {
+		res = _copy_symlink_at(sdir, sname, st, tree->dst_fd, rel);
+		_tree_count(res == 0 ? &tree->copied : &tree->errors);
+		return;
+	}
+	if (!S_ISREG(st->st_mode)) {
+		_tree_count(&tree->skipped);
+		return;
+	}
+	res = _clone_at(sdir, sname, st, tree->dst_fd, rel,
+			tree->kind == EFS_LINK_REFLINK, tree->copy);
+	_tree_count(res == 1 ? &tree->links :
+		    res == 0 ? &tree->copied :
+			       &tree->errors);
+}
+
+static int _link_tree_enter(efs_walk_entry *entry, void *ud)
+{
+	efs_link_tree *tree = (efs_link_tree *)ud;
+	const char *rel = entry->path + entry->rel_offset;
+	const struct stat *st = entry->st;
+	if (!S_ISDIR(st->st_mode)) {
+		_link_tree_entry(tree, entry->dirfd, entry->name, st, rel);
+		return EFS_WALK_CONTINUE;
+	}
+	if (st->st_dev == tree->dst_dev && st->st_ino == tree->dst_ino) {
+		/* do not mirror the tree being built into itself */
+		_tree_count(&tree->skipped);
+		return EFS_WALK_SKIP;
+	}
+	/* writable until its children are in place, see _link_tree_leave */
+	if (mkdirat(tree->dst_fd, rel, (st->st_mode & 07777) | S_IRWXU) == -1) {
+		struct stat dst;
+		if (errno != EEXIST || fstatat(tree->dst_fd, rel, &dst,
+					       AT_SYMLINK_NOFOLLOW) == -1 ||
+		    !S_ISDIR(dst.st_mode)) {
+			_tree_count(&tree->errors);
+			return EFS_WALK_SKIP;
+		}
+	}
+	_tree_count(&tree->dirs);
+	return EFS_WALK_CONTINUE;
+}
+
+static int _link_tree_leave(efs_walk_entry *entry, void *ud)
+{
+	efs_link_tree *tree = (efs_link_tree *)ud;
+	mode_t mode = entry->st->st_mode & 07777;
+	const char *rel = entry->path + entry->rel_offset;
+	if ((mode & S_IRWXU) != S_IRWXU &&
+	    fchmodat(tree->dst_fd, rel, mode, 0) == -1) {
+		_tree_count(&tree->errors);
+	}
+	return EFS_WALK_CONTINUE;
+}
+
+#endif
+
+/*
+** Mirrors directory tree. Directories are created, everything else is
+** linked to the source. Subdirectories of src are processed in parallel.
+** @param #1 Source directory.
+** @param #2 Destination directory, created if missing. It may lie
+**           inside src, it is left out of the mirror then; src itself
+**           is refused.
+** @param #3 Options table (optional):
+**   mode = "hard" | "symbolic" | "reflink" - kind of links to create,
+**          symbolic links point to absolute source paths,
+**   copy = true - copy files which can not be linked (hard links across
+**          devices, reflinks on filesystems without clone support),
+**   one_file_system = false - do not descend into other filesystems.
+** Returns { dirs, links, copied, skipped, errors }.
+*/
+int eli_link_tree(lua_State *L)
+{
+#ifdef _WIN32
+	errno = ENOSYS; /* = "Function not implemented" */
+	return push_result(L, -1, "link_tree is not supported on Windows");
+#else
+	static const char *const kinds[] = { "hard", "symbolic", "reflink",
+					     NULL };
+	const char *src = luaL_checkstring(L, 1);
+	const char *dst = luaL_checkstring(L, 2);
+	efs_link_tree tree;
+	memset(&tree, 0, sizeof(tree));
+	tree.copy = 1;
+	int flags = 0;
+	if (lua_istable(L, 3)) {
+		lua_getfield(L, 3, "mode");
+		const char *kind = luaL_optstring(L, -1, "hard");
+		for (tree.kind = 0; kinds[tree.kind] != NULL; tree.kind++) {
+			if (strcmp(kinds[tree.kind], kind) == 0) {
+				break;
+			}
+		}
+		luaL_argcheck(L, kinds[tree.kind] != NULL, 3,
+			      "mode must be 'hard', 'symbolic' or 'reflink'");
+		lua_getfield(L, 3, "copy");
+		tree.copy = lua_isnil(L, -1) || lua_toboolean(L, -1);
+		lua_getfield(L, 3, "one_file_system");
+		flags |= lua_toboolean(L, -1) ? EFS_WALK_XDEV : 0;
+		lua_pop(L, 3);
+	}
+
+	struct stat st;
+	if (stat(src, &st) == -1) {
+		return push_error(L, src);
+	}
+	if (!S_ISDIR(st.st_mode)) {
+		errno = ENOTDIR;
+		return push_error(L, src);
+	}
+	char *src_abs = NULL;
+	if (tree.kind == EFS_LINK_SYMBOLIC) {
+		if ((src_abs = realpath(src, NULL)) == NULL) {
+			return push_error(L, src);
+		}
+		tree.src_abs = src_abs;
+		tree.src_abs_len = strlen(src_abs);
+	}
+	int created = mkdir(dst, (st.st_mode & 07777) | S_IRWXU) == 0;
+	if (!created && errno != EEXIST) {
+		free(src_abs);
+		return push_error(L, dst);
+	}
+	tree.dst_fd = open(dst, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	struct stat dst_st;
+	if (tree.dst_fd == -1 || fstat(tree.dst_fd, &dst_st) == -1) {
+		int err = errno;
+		if (tree.dst_fd != -1) {
+			close(tree.dst_fd);
+		}
+		free(src_abs);
+		errno = err;
+		return push_error(L, dst);
+	}
+	if (dst_st.st_dev == st.st_dev && dst_st.st_ino == st.st_ino) {
+		close(tree.dst_fd);
+		free(src_abs);
+		errno = EINVAL;
+		return push_error(L, dst);
+	}
+	tree.dst_dev = dst_st.st_dev;
+	tree.dst_ino = dst_st.st_ino;
+
+	efs_walker walker = { _link_tree_enter, _link_tree_leave, &tree, flags,
+			      0, 0 };
+	int res = efs_walk_parallel(&walker, src);
+	int err = errno;
+	if (created && (st.st_mode & S_IRWXU) != S_IRWXU) {
+		fchmod(tree.dst_fd, st.st_mode & 07777);
+	}
+	close(tree.dst_fd);
+	free(src_abs);
+	if (res == -1) {
+		errno = err;
+		return push_error(L, src);
+	}
+	lua_createtable(L, 0, 5);
+	lua_pushinteger(L, (lua_Integer)tree.dirs);
+	lua_setfield(L, -2, "dirs");
+	lua_pushinteger(L, (lua_Integer)tree.links);
+	lua_setfield(L, -2, "links");
+	lua_pushinteger(L, (lua_Integer)tree.copied);
+	lua_setfield(L, -2, "copied");
+	lua_pushinteger(L, (lua_Integer)tree.skipped);
+	lua_setfield(L, -2, "skipped");
+	lua_pushinteger(L, (lua_Integer)tree.errors + walker.errors);
+	lua_setfield(L, -2, "errors");
+	return 1;
+#endif
+}
 
 /*
 ** Creates a link.
@@ -27,7 +512,8 @@ int eli_mklink(lua_State *L)
 	const char *target = luaL_checkstring(L, 2);
 #ifndef _WIN32
 
-	int res = (lua_toboolean(L, 3) ? symlink : link)(origin, target);
+	int res = efs_link(origin, target,
+			   lua_toboolean(L, 3) ? EFS_LINK_SYMBOLIC : EFS_LINK_HARD);
 	if (res == -1) {
 		return push_error(L, NULL);
 	} else {
@@ -4,5 +4,24 @@
 #include "lua.h"
 
 int eli_mklink(lua_State *L);
+int eli_link_tree(lua_State *L);
+
+#define EFS_LINK_HARD 0
+#define EFS_LINK_SYMBOLIC 1
+#define EFS_LINK_REFLINK 2
+
+#ifndef _WIN32
+int efs_link(const char *origin, const char *target, int kind);
+int efs_replace_with_link(const char *origin, const char *target, int kind);
+long long efs_copy_fd(int src, int dst);
+
+#define EFS_COPY_CHUNK ((size_t)8 << 20)
+
+/* called with bytes copied since the last call, -1 aborts the copy */
+typedef int (*efs_copy_progress)(long long bytes, void *ud);
+
+long long efs_copy_fd_progress(int src, int dst, efs_copy_progress progress,
+			       void *ud);
+#endif
 
 #endif /* ELI_EXTRA_FS_LINK_H__ */
\ No newline at end of file
@@ -4,6 +4,7 @@
 #include "lfsutil.h"
 
 #include <errno.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
 
@@ -15,16 +16,786 @@
 
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/file.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 
 #endif
 
 #define LOCK_METATABLE "ELI_FILE_LOCK"
 #define LOCK_DIR_METATABLE "ELI_DIR_LOCK"
 
+/*
+** posix - fcntl record locks, owned by the process, dropped when any fd
+**         of the file is closed
+** ofd   - open file description locks, owned by the handle, conflict
+**         between threads and Lua states of one process
+** flock - whole file BSD locks, owned by the handle
+*/
+#define LOCK_KIND_POSIX 0
+#define LOCK_KIND_OFD 1
+#define LOCK_KIND_FLOCK 2
+
+typedef struct efs_lock_opts {
+	int wait;
+	long timeout_ms; /* negative waits forever */
+	int kind;
+} efs_lock_opts;
+
+#ifndef _WIN32
+
+typedef struct efs_lock_req {
+	int fd;
+	int kind;
+	short type; /* F_RDLCK, F_WRLCK or F_UNLCK */
+	off_t start;
+	off_t len;
+} efs_lock_req;
+
+/*
+** Single lock attempt, block selects the waiting variant.
+*/
+static int _lock_try(const efs_lock_req *req, int block)
+{
+	if (req->kind == LOCK_KIND_FLOCK) {
+		int op = req->type == F_UNLCK ? LOCK_UN :
+			 req->type == F_RDLCK ? LOCK_SH :
+						LOCK_EX;
+		return flock(req->fd, block ? op : op | LOCK_NB);
+	}
+	struct flock f;
+	memset(&f, 0, sizeof(f)); /* OFD locks require l_pid == 0 */
+	f.l_type = req->type;
+	f.l_whence = SEEK_SET;
+	f.l_start = req->start;
+	f.l_len = req->len;
+	if (req->kind == LOCK_KIND_OFD) {
+#ifdef F_OFD_SETLK
+		return fcntl(req->fd, block ? F_OFD_SETLKW : F_OFD_SETLK, &f);
+#else
+		errno = ENOTSUP;
+		return -1;
+#endif
+	}
+	return fcntl(req->fd, block ? F_SETLKW : F_SETLK, &f);
+}
+
+/*
+** Blocking waits with a timeout are interrupted by a per-thread timer
+** signal. The handler is installed only if the signal is unused.
+*/
+#ifndef ELI_FS_EXTRA_LOCK_SIGNAL
+#define ELI_FS_EXTRA_LOCK_SIGNAL (SIGRTMAX - 2)
+#endif
+
+#if defined(__linux__) && defined(SIGEV_THREAD_ID)
+#define LOCK_TIMER 1
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+#endif
+
+static double _now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e3 + (double)ts.tv_nsec / 1e6;
+}
+
+#ifdef LOCK_TIMER
+static int lock_signal_ready = 0;
+static pthread_once_t lock_signal_once = PTHREAD_ONCE_INIT;
+
+static void _lock_signal_handler(int sig)
+{
+	(void)sig;
+}
+
+static void _lock_signal_install(void)
+{
+	struct sigaction current;
+	if (sigaction(ELI_FS_EXTRA_LOCK_SIGNAL, NULL, &current) == -1 ||
+	    current.sa_handler != SIG_DFL) {
+		return;
+	}
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = _lock_signal_handler;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = 0; /* no SA_RESTART, F_SETLKW has to return EINTR */
+	lock_signal_ready = sigaction(ELI_FS_EXTRA_LOCK_SIGNAL, &sa, NULL) == 0;
+}
+
+/*
+** Arms a timer signalling this thread after timeout_ms and then every
+** millisecond, so a signal delivered just before fcntl blocks can not
+** leave us waiting forever.
+*/
+static int _lock_timer_start(timer_t *timer, long timeout_ms)
+{
+	pthread_once(&lock_signal_once, _lock_signal_install);
+	if (!lock_signal_ready) {
+		return -1;
+	}
+	struct sigevent sev;
+	memset(&sev, 0, sizeof(sev));
+	sev.sigev_notify = SIGEV_THREAD_ID;
+	sev.sigev_signo = ELI_FS_EXTRA_LOCK_SIGNAL;
+	sev.sigev_notify_thread_id = (pid_t)syscall(SYS_gettid);
+	if (timer_create(CLOCK_MONOTONIC, &sev, timer) == -1) {
+		return -1;
+	}
+	struct itimerspec its;
+	its.it_value.tv_sec = timeout_ms / 1000;
+	its.it_value.tv_nsec = (timeout_ms % 1000) * 1000000;
+	if (timeout_ms == 0) {
+		its.it_value.tv_nsec = 1;
+	}
+	its.it_interval.tv_sec = 0;
+	its.it_interval.tv_nsec = 1000000;
+	if (timer_settime(*timer, 0, &its, NULL) == -1) {
+		timer_delete(*timer);
+		return -1;
+	}
+	return 0;
+}
+#endif
+
+/*
+** Waits for lock described by req. Returns 0 on success, -1 with errno
+** set otherwise (ETIMEDOUT once timeout_ms elapsed).
+*/
+static int _lock_blocking(const efs_lock_req *req, long timeout_ms)
+{
+	double deadline = _now_ms() + (double)timeout_ms;
+	if (timeout_ms < 0) {
+		int res;
+		while ((res = _lock_try(req, 1)) == -1 && errno == EINTR)
+			;
+		return res;
+	}
+#ifdef LOCK_TIMER
+	timer_t timer;
+	if (_lock_timer_start(&timer, timeout_ms) == 0) {
+		int res, err;
+		for (;;) {
+			res = _lock_try(req, 1);
+			err = errno;
+			if (res == 0 || err != EINTR) {
+				break;
+			}
+			if (_now_ms() >= deadline) {
+				err = ETIMEDOUT;
+				break;
+			}
+		}
+		timer_delete(timer);
+		errno = err;
+		return res;
+	}
+#endif
+	/* no usable timer signal, poll with backoff */
+	long sleep_us = 100;
+	for (;;) {
+		if (_lock_try(req, 0) == 0) {
+			return 0;
+		}
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EACCES &&
+		    errno != EINTR) {
+			return -1;
+		}
+		double left = deadline - _now_ms();
+		if (left <= 0) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+		long left_us = (long)(left * 1000);
+		usleep((useconds_t)(sleep_us < left_us ? sleep_us : left_us));
+		sleep_us = sleep_us < 50000 ? sleep_us * 2 : sleep_us;
+	}
+}
+
+/*
+** Process wide registry of locks taken by path. Every locked file is
+** opened once and its fd is kept for reuse. Only the first holder of a
+** range takes the kernel lock, further readers of the same range share
+** it and conflicting holders in this process queue on a condition
+** variable, so contention between threads and Lua states of one
+** process never reaches the kernel. Every bucket has its own mutex,
+** locks on unrelated files do not serialize on each other, and the
+** path is resolved before any mutex is taken.
+*/
+#define LOCK_REGISTRY_BUCKETS 256
+#define LOCK_REGISTRY_IDLE_MAX 64 /* idle files whose fd stays cached */
+#define LOCK_OFF_MAX ((off_t)(~(unsigned long long)0 >> 1))
+
+typedef struct efs_lock_range {
+	off_t start;
+	off_t end; /* exclusive, LOCK_OFF_MAX up to end of file */
+	short type;
+	int holders;
+	int pending; /* kernel lock being acquired */
+	struct efs_lock_range *next;
+} efs_lock_range;
+
+typedef struct efs_lock_file {
+	dev_t dev;
+	ino_t ino;
+	int kind;
+	int fd;
+	pthread_mutex_t *mutex; /* of the bucket holding this file */
+	int waiters;
+	pthread_cond_t released;
+	efs_lock_range *ranges;
+	struct efs_lock_file *next;
+} efs_lock_file;
+
+typedef struct efs_lock_bucket {
+	pthread_mutex_t mutex;
+	efs_lock_file *files;
+} efs_lock_bucket;
+
+static efs_lock_bucket lock_registry[LOCK_REGISTRY_BUCKETS];
+static pthread_once_t lock_registry_once = PTHREAD_ONCE_INIT;
+static int lock_registry_idle = 0;
+
+static void _registry_init(void)
+{
+	for (int i = 0; i < LOCK_REGISTRY_BUCKETS; i++) {
+		pthread_mutex_init(&lock_registry[i].mutex, NULL);
+	}
+}
+
+static efs_lock_bucket *_registry_bucket(dev_t dev, ino_t ino, int kind)
+{
+	size_t h = ((size_t)dev * 31 + (size_t)ino) * 31 + (size_t)kind;
+	return &lock_registry[h % LOCK_REGISTRY_BUCKETS];
+}
+
+/* called with the bucket mutex held */
+static efs_lock_file **_registry_slot(efs_lock_bucket *bucket, dev_t dev,
+				      ino_t ino, int kind)
+{
+	efs_lock_file **slot = &bucket->files;
+	while (*slot != NULL && ((*slot)->dev != dev || (*slot)->ino != ino ||
+				 (*slot)->kind != kind)) {
+		slot = &(*slot)->next;
+	}
+	return slot;
+}
+
+/* called with the bucket mutex of file held */
+static void _registry_release_file(efs_lock_file *file)
+{
+	if (file->ranges != NULL || file->waiters > 0) {
+		return;
+	}
+	if (__atomic_add_fetch(&lock_registry_idle, 1, __ATOMIC_RELAXED) <=
+	    LOCK_REGISTRY_IDLE_MAX) {
+		return;
+	}
+	__atomic_sub_fetch(&lock_registry_idle, 1, __ATOMIC_RELAXED);
+	efs_lock_bucket *bucket =
+		_registry_bucket(file->dev, file->ino, file->kind);
+	efs_lock_file **slot =
+		_registry_slot(bucket, file->dev, file->ino, file->kind);
+	*slot = file->next;
+	close(file->fd);
+	pthread_cond_destroy(&file->released);
+	free(file);
+}
+
+/* called with the bucket mutex held, takes a cached file out of idle */
+static efs_lock_file *_registry_use(efs_lock_file *file)
+{
+	if (file->ranges == NULL && file->waiters == 0) {
+		__atomic_sub_fetch(&lock_registry_idle, 1, __ATOMIC_RELAXED);
+	}
+	return file;
+}
+
+/*
+** Finds or registers file at path, opening it only on first use.
+** Returns with the bucket mutex of the file held. The key of a new
+** entry always comes from fstat of the fd stored with it, so a path
+** replaced between the lookup and the open can not pair one inode's
+** key with another inode's fd.
+*/
+static efs_lock_file *_registry_file(const char *path, int kind)
+{
+	pthread_once(&lock_registry_once, _registry_init);
+	struct stat st;
+	int fd = -1;
+	if (stat(path, &st) == 0) {
+		efs_lock_bucket *bucket =
+			_registry_bucket(st.st_dev, st.st_ino, kind);
+		pthread_mutex_lock(&bucket->mutex);
+		efs_lock_file **slot =
+			_registry_slot(bucket, st.st_dev, st.st_ino, kind);
+		if (*slot != NULL) {
+			return _registry_use(*slot);
+		}
+		pthread_mutex_unlock(&bucket->mutex);
+	} else if (errno != ENOENT) {
+		return NULL;
+	}
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		int err = errno;
+		if (fd != -1) {
+			close(fd);
+		}
+		errno = err;
+		return NULL;
+	}
+	efs_lock_bucket *bucket = _registry_bucket(st.st_dev, st.st_ino, kind);
+	pthread_mutex_lock(&bucket->mutex);
+	efs_lock_file **slot =
+		_registry_slot(bucket, st.st_dev, st.st_ino, kind);
+	if (*slot != NULL) {
+		/* registered by another thread in the meantime */
+		close(fd);
+		return _registry_use(*slot);
+	}
+	efs_lock_file *file = calloc(1, sizeof(efs_lock_file));
+	if (file == NULL) {
+		pthread_mutex_unlock(&bucket->mutex);
+		close(fd);
+		errno = ENOMEM;
+		return NULL;
+	}
+	file->dev = st.st_dev;
+	file->ino = st.st_ino;
+	file->kind = kind;
+	file->fd = fd;
+	file->mutex = &bucket->mutex;
+	pthread_cond_init(&file->released, NULL);
+	*slot = file;
+	return file;
+}
+
+static int _ranges_overlap(const efs_lock_range *r, off_t start, off_t end)
+{
+	return r->start < end && start < r->end;
+}
+
+/*
+** Drops kernel lock on parts of unlinked range that no other registered
+** range covers, the kernel sees all of them as a single owner.
+*/
+static void _registry_kernel_unlock(efs_lock_file *file, efs_lock_range *range)
+{
+	off_t cur = range->start;
+	while (cur < range->end) {
+		int moved = 1;
+		while (moved) {
+			moved = 0;
+			for (efs_lock_range *r = file->ranges; r != NULL;
+			     r = r->next) {
+				if (r->start <= cur && cur < r->end) {
+					cur = r->end;
+					moved = 1;
+				}
+			}
+		}
+		if (cur >= range->end) {
+			break;
+		}
+		off_t gap_end = range->end;
+		for (efs_lock_range *r = file->ranges; r != NULL; r = r->next) {
+			if (r->start > cur && r->start < gap_end) {
+				gap_end = r->start;
+			}
+		}
+		efs_lock_req req = { file->fd, file->kind, F_UNLCK, cur,
+				     gap_end == LOCK_OFF_MAX ? 0 : gap_end - cur };
+		_lock_try(&req, 0);
+		cur = gap_end;
+	}
+}
+
+static void _registry_unlink(efs_lock_file *file, efs_lock_range *range)
+{
+	efs_lock_range **link = &file->ranges;
+	while (*link != range) {
+		link = &(*link)->next;
+	}
+	*link = range->next;
+}
+
+static void _registry_drop(efs_lock_file *file, efs_lock_range *range)
+{
+	free(range);
+	if (file->waiters > 0) {
+		pthread_cond_broadcast(&file->released);
+	}
+	_registry_release_file(file);
+}
+
+static int _registry_wait(efs_lock_file *file, const efs_lock_opts *opts,
+			  const struct timespec *deadline)
+{
+	int res = 0;
+	file->waiters++;
+	if (opts->timeout_ms < 0) {
+		pthread_cond_wait(&file->released, file->mutex);
+	} else {
+		res = pthread_cond_timedwait(&file->released,
+					     file->mutex, deadline);
+	}
+	file->waiters--;
+	return res == ETIMEDOUT ? -1 : 0;
+}
+
+/*
+** Locks range of file at path through the registry.
+*/
+static int _registry_lock(const char *path, short type, off_t start, off_t len,
+			  const efs_lock_opts *opts, efs_lock_file **out_file,
+			  efs_lock_range **out_range, double *waited_ms)
+{
+	int waited = 0;
+	*waited_ms = 0;
+	off_t end = len == 0 ? LOCK_OFF_MAX : start + len;
+	double started = _now_ms();
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	if (opts->timeout_ms > 0) {
+		deadline.tv_sec += opts->timeout_ms / 1000;
+		deadline.tv_nsec += (opts->timeout_ms % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+	}
+	int wait = opts->wait && opts->timeout_ms != 0;
+
+	efs_lock_file *file = _registry_file(path, opts->kind);
+	if (file == NULL) {
+		return -1;
+	}
+	/* file may be freed by the release below */
+	pthread_mutex_t *mutex = file->mutex;
+	for (;;) {
+		int conflict = 0;
+		for (efs_lock_range *r = file->ranges; r != NULL; r = r->next) {
+			if (!_ranges_overlap(r, start, end)) {
+				continue;
+			}
+			if (type == F_RDLCK && r->type == F_RDLCK && !r->pending) {
+				if (r->start == start && r->end == end) {
+					/* share kernel lock of this reader */
+					r->holders++;
+					*out_file = file;
+					*out_range = r;
+					pthread_mutex_unlock(mutex);
+					*waited_ms = waited ? _now_ms() - started : 0;
+					return 0;
+				}
+				continue;
+			}
+			conflict = 1;
+		}
+		if (!conflict) {
+			break;
+		}
+		if (!wait) {
+			_registry_release_file(file);
+			pthread_mutex_unlock(mutex);
+			errno = EAGAIN;
+			return -1;
+		}
+		waited = 1;
+		if (_registry_wait(file, opts, &deadline) == -1) {
+			_registry_release_file(file);
+			pthread_mutex_unlock(mutex);
+			*waited_ms = _now_ms() - started;
+			errno = ETIMEDOUT;
+			return -1;
+		}
+	}
+	efs_lock_range *range = calloc(1, sizeof(efs_lock_range));
+	if (range == NULL) {
+		_registry_release_file(file);
+		pthread_mutex_unlock(mutex);
+		errno = ENOMEM;
+		return -1;
+	}
+	range->start = start;
+	range->end = end;
+	range->type = type;
+	range->holders = 1;
+	range->pending = 1;
+	range->next = file->ranges;
+	file->ranges = range;
+	pthread_mutex_unlock(mutex);
+
+	/* kernel lock is taken without holding the registry */
+	efs_lock_req req = { file->fd, file->kind, type, start, len };
+	int res = _lock_try(&req, 0);
+	if (res == -1 &&
+	    (errno == EAGAIN || errno == EWOULDBLOCK || errno == EACCES) &&
+	    wait) {
+		long timeout = opts->timeout_ms;
+		if (timeout > 0) {
+			double left = started + (double)timeout - _now_ms();
+			timeout = left > 1 ? (long)left : 1;
+		}
+		res = _lock_blocking(&req, timeout);
+		waited = 1;
+	}
+	int err = errno;
+	*waited_ms = waited ? _now_ms() - started : 0;
+
+	pthread_mutex_lock(mutex);
+	if (res == -1) {
+		_registry_unlink(file, range);
+		_registry_drop(file, range);
+	} else {
+		range->pending = 0;
+		if (file->waiters > 0) {
+			pthread_cond_broadcast(&file->released);
+		}
+		*out_file = file;
+		*out_range = range;
+	}
+	pthread_mutex_unlock(mutex);
+	errno = err;
+	return res;
+}
+
+static void _registry_unlock(efs_lock_file *file, efs_lock_range *range)
+{
+	pthread_mutex_t *mutex = file->mutex;
+	pthread_mutex_lock(mutex);
+	if (--range->holders == 0) {
+		_registry_unlink(file, range);
+		_registry_kernel_unlock(file, range);
+		_registry_drop(file, range);
+	}
+	pthread_mutex_unlock(mutex);
+}
+
+/*
+** Per path lock statistics. Entries live in a fixed open addressing
+** table and are never removed, so recording is a lock-free lookup plus
+** a few relaxed atomic updates. Locks on caller-supplied handles are
+** accounted under "(file handle)", paths that do not fit the table
+** under "(other)".
+*/
+#define LOCK_STATS_SLOTS 1024
+#define LOCK_STATS_BUCKETS 24 /* log2 microsecond buckets */
+
+typedef struct efs_lock_stat {
+	const char *path;
+	uint64_t acquired;
+	uint64_t failed;
+	uint64_t timeouts;
+	int64_t holders;
+	uint64_t wait_ns;
+	uint64_t wait_max_ns;
+	uint64_t hold_ns;
+	uint64_t hold_max_ns;
+	uint64_t wait_hist[LOCK_STATS_BUCKETS];
+	uint64_t hold_hist[LOCK_STATS_BUCKETS];
+} efs_lock_stat;
+
+static efs_lock_stat *lock_stats[LOCK_STATS_SLOTS];
+static efs_lock_stat lock_stats_handle = { .path = "(file handle)" };
+static efs_lock_stat lock_stats_other = { .path = "(other)" };
+
+static efs_lock_stat *_lock_stat(const char *path)
+{
+	if (path == NULL) {
+		return &lock_stats_handle;
+	}
+	uint64_t h = 1469598103934665603ULL;
+	for (const char *c = path; *c; c++) {
+		h = (h ^ (unsigned char)*c) * 1099511628211ULL;
+	}
+	efs_lock_stat *created = NULL;
+	for (size_t i = 0; i < LOCK_STATS_SLOTS; i++) {
+		efs_lock_stat **slot = &lock_stats[(h + i) % LOCK_STATS_SLOTS];
+		efs_lock_stat *entry = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+		if (entry == NULL) {
+			if (created == NULL) {
+				created = calloc(1, sizeof(efs_lock_stat));
+				char *copy = created ? strdup(path) : NULL;
+				if (copy == NULL) {
+					free(created);
+					return &lock_stats_other;
+				}
+				created->path = copy;
+			}
+			if (__atomic_compare_exchange_n(slot, &entry, created, 0,
+							__ATOMIC_ACQ_REL,
+							__ATOMIC_ACQUIRE)) {
+				return created;
+			}
+			/* lost the race, entry now holds the winner */
+		}
+		if (strcmp(entry->path, path) == 0) {
+			if (created != NULL) {
+				free((char *)created->path);
+				free(created);
+			}
+			return entry;
+		}
+	}
+	if (created != NULL) {
+		free((char *)created->path);
+		free(created);
+	}
+	return &lock_stats_other;
+}
+
+static void _lock_stat_time(uint64_t *total, uint64_t *max, uint64_t *hist,
+			    double ms)
+{
+	uint64_t ns = ms > 0 ? (uint64_t)(ms * 1e6) : 0;
+	__atomic_add_fetch(total, ns, __ATOMIC_RELAXED);
+	uint64_t prev = __atomic_load_n(max, __ATOMIC_RELAXED);
+	while (ns > prev && !__atomic_compare_exchange_n(max, &prev, ns, 1,
+							__ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+		;
+	uint64_t us = ns / 1000;
+	int bucket = 0;
+	while (us > 0 && bucket < LOCK_STATS_BUCKETS - 1) {
+		us >>= 1;
+		bucket++;
+	}
+	__atomic_add_fetch(&hist[bucket], 1, __ATOMIC_RELAXED);
+}
+
+static void _lock_stat_acquired(efs_lock_stat *st, double waited_ms)
+{
+	__atomic_add_fetch(&st->acquired, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&st->holders, 1, __ATOMIC_RELAXED);
+	_lock_stat_time(&st->wait_ns, &st->wait_max_ns, st->wait_hist,
+			waited_ms);
+}
+
+static void _lock_stat_failed(efs_lock_stat *st, int err, double waited_ms)
+{
+	__atomic_add_fetch(err == ETIMEDOUT ? &st->timeouts : &st->failed, 1,
+			   __ATOMIC_RELAXED);
+	if (waited_ms > 0) {
+		_lock_stat_time(&st->wait_ns, &st->wait_max_ns, st->wait_hist,
+				waited_ms);
+	}
+}
+
+static void _lock_stat_released(efs_lock_stat *st, double held_ms)
+{
+	__atomic_sub_fetch(&st->holders, 1, __ATOMIC_RELAXED);
+	_lock_stat_time(&st->hold_ns, &st->hold_max_ns, st->hold_hist,
+			held_ms);
+}
+
+static void _push_lock_times(lua_State *L, uint64_t *total, uint64_t *max,
+			     uint64_t *hist, int reset)
+{
+	int op = reset ? 1 : 0;
+	lua_createtable(L, 0, 3);
+	uint64_t value = op ? __atomic_exchange_n(total, 0, __ATOMIC_RELAXED) :
+			      __atomic_load_n(total, __ATOMIC_RELAXED);
+	lua_pushnumber(L, (lua_Number)value / 1e6);
+	lua_setfield(L, -2, "total_ms");
+	value = op ? __atomic_exchange_n(max, 0, __ATOMIC_RELAXED) :
+		     __atomic_load_n(max, __ATOMIC_RELAXED);
+	lua_pushnumber(L, (lua_Number)value / 1e6);
+	lua_setfield(L, -2, "max_ms");
+	/* { [upper bound in us] = count } for non empty buckets */
+	lua_newtable(L);
+	for (int b = 0; b < LOCK_STATS_BUCKETS; b++) {
+		value = op ? __atomic_exchange_n(&hist[b], 0, __ATOMIC_RELAXED) :
+			     __atomic_load_n(&hist[b], __ATOMIC_RELAXED);
+		if (value > 0) {
+			lua_pushinteger(L, (lua_Integer)value);
+			lua_rawseti(L, -2, (lua_Integer)1 << b);
+		}
+	}
+	lua_setfield(L, -2, "histogram");
+}
+
+static uint64_t _take(uint64_t *counter, int reset)
+{
+	return reset ? __atomic_exchange_n(counter, 0, __ATOMIC_RELAXED) :
+		       __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static void _push_lock_stat(lua_State *L, efs_lock_stat *st, int reset)
+{
+	uint64_t acquired = _take(&st->acquired, reset);
+	uint64_t failed = _take(&st->failed, reset);
+	uint64_t timeouts = _take(&st->timeouts, reset);
+	if (acquired == 0 && failed == 0 && timeouts == 0 &&
+	    __atomic_load_n(&st->holders, __ATOMIC_RELAXED) == 0) {
+		return;
+	}
+	lua_createtable(L, 0, 6);
+	lua_pushinteger(L, (lua_Integer)acquired);
+	lua_setfield(L, -2, "acquired");
+	lua_pushinteger(L, (lua_Integer)failed);
+	lua_setfield(L, -2, "failed");
+	lua_pushinteger(L, (lua_Integer)timeouts);
+	lua_setfield(L, -2, "timeouts");
+	lua_pushinteger(L, (lua_Integer)__atomic_load_n(&st->holders,
+							__ATOMIC_RELAXED));
+	lua_setfield(L, -2, "holders");
+	_push_lock_times(L, &st->wait_ns, &st->wait_max_ns, st->wait_hist,
+			 reset);
+	lua_setfield(L, -2, "wait");
+	_push_lock_times(L, &st->hold_ns, &st->hold_max_ns, st->hold_hist,
+			 reset);
+	lua_setfield(L, -2, "hold");
+	lua_setfield(L, -2, st->path);
+}
+
+/*
+** Returns lock statistics keyed by path:
+**   { acquired, failed, timeouts, holders,
+**     wait = { total_ms, max_ms, histogram }, hold = { ... } }
+** Histograms map bucket upper bound in microseconds to count.
+** @param #1 True to reset counters after reading (optional).
+*/
+int eli_lock_stats(lua_State *L)
+{
+	int reset = lua_toboolean(L, 1);
+	lua_newtable(L);
+	for (size_t i = 0; i < LOCK_STATS_SLOTS; i++) {
+		efs_lock_stat *st =
+			__atomic_load_n(&lock_stats[i], __ATOMIC_ACQUIRE);
+		if (st != NULL) {
+			_push_lock_stat(L, st, reset);
+		}
+	}
+	_push_lock_stat(L, &lock_stats_handle, reset);
+	_push_lock_stat(L, &lock_stats_other, reset);
+	return 1;
+}
+
+#endif
+
+/*
+** Applies lock. With opts->wait the call blocks until the lock is
+** granted or opts->timeout_ms passes, time spent waiting is stored in
+** waited_ms.
+*/
 static int _file_lock(lua_State *L, FILE *fh, const char *mode,
-		      const long start, long len, const char *funcname)
+		      const long start, long len, const efs_lock_opts *opts,
+		      double *waited_ms, const char *funcname)
 {
 	int code;
+	if (waited_ms != NULL) {
+		*waited_ms = 0;
+	}
 #ifdef _WIN32
 	/* lkmode valid values are:
          LK_LOCK    Locks the specified bytes. If the bytes cannot be locked,
@@ -44,7 +815,7 @@ static int _file_lock(lua_State *L, FILE *fh, const char *mode,
 	switch (*mode) {
 	case 'r':
 	case 'w':
-		lkmode = _LK_NBLCK;
+		lkmode = opts->wait ? _LK_LOCK : _LK_NBLCK;
 		break;
 	case 'u':
 		lkmode = _LK_UNLCK;
@@ -59,24 +830,34 @@ static int _file_lock(lua_State *L, FILE *fh, const char *mode,
 	fseek(fh, start, SEEK_SET);
 	code = _locking(fileno(fh), lkmode, len);
 #else
-	struct flock f;
+	efs_lock_req req;
 	switch (*mode) {
 	case 'w':
-		f.l_type = F_WRLCK;
+		req.type = F_WRLCK;
 		break;
 	case 'r':
-		f.l_type = F_RDLCK;
+		req.type = F_RDLCK;
 		break;
 	case 'u':
-		f.l_type = F_UNLCK;
+		req.type = F_UNLCK;
 		break;
 	default:
 		return luaL_error(L, "%s: invalid mode", funcname);
 	}
-	f.l_whence = SEEK_SET;
-	f.l_start = (off_t)start;
-	f.l_len = (off_t)len;
-	code = fcntl(fileno(fh), F_SETLK, &f);
+	req.fd = fileno(fh);
+	req.kind = opts->kind;
+	req.start = (off_t)start;
+	req.len = (off_t)len;
+	code = _lock_try(&req, 0);
+	if (code == -1 &&
+	    (errno == EAGAIN || errno == EWOULDBLOCK || errno == EACCES) &&
+	    opts->wait && opts->timeout_ms != 0) {
+		double started = _now_ms();
+		code = _lock_blocking(&req, opts->timeout_ms);
+		if (waited_ms != NULL) {
+			*waited_ms = _now_ms() - started;
+		}
+	}
 #endif
 	return (code != -1);
 }
@@ -86,20 +867,100 @@ typedef struct efs_lock {
 	int ownsFile;
 	long start;
 	long len;
+	double waited_ms;
+	int kind;
+#ifndef _WIN32
+	efs_lock_file *reg_file; /* set for locks taken by path */
+	efs_lock_range *reg_range;
+	efs_lock_stat *stat;
+	double acquired_at;
+#endif
 } efs_lock;
 
+static void _check_lock_opts(lua_State *L, int idx, efs_lock_opts *opts)
+{
+	static const char *const kinds[] = { "posix", "ofd", "flock", NULL };
+	opts->wait = 0;
+	opts->timeout_ms = -1;
+	opts->kind = LOCK_KIND_POSIX;
+	if (lua_isnoneornil(L, idx)) {
+		return;
+	}
+	luaL_checktype(L, idx, LUA_TTABLE);
+	lua_getfield(L, idx, "wait");
+	opts->wait = lua_toboolean(L, -1);
+	lua_getfield(L, idx, "timeout_ms");
+	opts->timeout_ms = (long)luaL_optinteger(L, -1, -1);
+	lua_getfield(L, idx, "kind");
+	const char *kind = luaL_optstring(L, -1, "posix");
+	for (opts->kind = 0; kinds[opts->kind] != NULL; opts->kind++) {
+		if (strcmp(kinds[opts->kind], kind) == 0) {
+			break;
+		}
+	}
+	luaL_argcheck(L, kinds[opts->kind] != NULL, idx,
+		      "kind must be 'posix', 'ofd' or 'flock'");
+	lua_pop(L, 3);
+}
+
+#ifndef _WIN32
+static int _lock_by_path(lua_State *L, const char *path, const char *mode,
+			 long start, long len, const efs_lock_opts *opts)
+{
+	/* allocated first, raising after the lock is taken would leak it */
+	efs_lock *lock = (efs_lock *)lua_newuserdata(L, sizeof(efs_lock));
+	memset(lock, 0, sizeof(efs_lock));
+	luaL_getmetatable(L, LOCK_METATABLE);
+	lua_setmetatable(L, -2);
+
+	efs_lock_file *file;
+	efs_lock_range *range;
+	double waited_ms;
+	efs_lock_stat *stat = _lock_stat(path);
+	if (_registry_lock(path, *mode == 'w' ? F_WRLCK : F_RDLCK, (off_t)start,
+			   (off_t)len, opts, &file, &range, &waited_ms) == -1) {
+		_lock_stat_failed(stat, errno, waited_ms);
+		return push_error(L, "lock");
+	}
+	_lock_stat_acquired(stat, waited_ms);
+	lock->start = start;
+	lock->len = len;
+	lock->waited_ms = waited_ms;
+	lock->kind = opts->kind;
+	lock->reg_file = file;
+	lock->reg_range = range;
+	lock->stat = stat;
+	lock->acquired_at = _now_ms();
+	return 1;
+}
+#endif
+
 /*
 ** Locks a file.
+** Locks taken by path go through the process wide registry, so they
+** also exclude other threads and Lua states of this process.
 ** @param #1 File handle.
 ** @param #2 String with lock mode ('w'rite, 'r'ead).
 ** @param #3 Number with start position (optional).
 ** @param #4 Number with length (optional).
+** @param #5 Options table (optional):
+**   wait = false, timeout_ms,
+**   kind = "posix"|"ofd"|"flock" - ofd and flock locks belong to the
+**   handle, so they also exclude other threads and states of this
+**   process. flock locks always cover the whole file.
 */
 int eli_file_lock(lua_State *L)
 {
 	FILE *fh;
 	const int argt = lua_type(L, 1);
 	int ownsFile = 0;
+	const long start = (long)luaL_optinteger(L, 3, 0);
+	const long len = (long)luaL_optinteger(L, 4, 0);
+	const char *mode = luaL_checkstring(L, 2);
+	efs_lock_opts opts;
+	_check_lock_opts(L, 5, &opts);
+	luaL_argcheck(L, opts.kind != LOCK_KIND_FLOCK || (start == 0 && len == 0),
+		      3, "flock locks cover the whole file");
 	switch (argt) {
 	case LUA_TUSERDATA: {
 		fh = check_file(L, 1, "lock");
@@ -107,7 +968,12 @@ int eli_file_lock(lua_State *L)
 	}
 	case LUA_TSTRING: {
 		const char *path = luaL_checkstring(L, 1);
-		fh = fopen(path, "ab");
+#ifndef _WIN32
+		if (*mode == 'r' || *mode == 'w') {
+			return _lock_by_path(L, path, mode, start, len, &opts);
+		}
+#endif
+		fh = fopen(path, "a+b");
 		if (fh == 0) {
 			return push_error(L, "lock");
 		}
@@ -121,17 +987,32 @@ int eli_file_lock(lua_State *L)
 		return 0;
 	}
 	}
-	const long start = (long)luaL_optinteger(L, 3, 0);
-	const long len = (long)luaL_optinteger(L, 4, 0);
-	const char *mode = luaL_checkstring(L, 2);
+	double waited_ms;
 
-	if (_file_lock(L, fh, mode, start, len, "lock")) {
+	int locked = _file_lock(L, fh, mode, start, len, &opts, &waited_ms, "lock");
+#ifndef _WIN32
+	efs_lock_stat *stat = _lock_stat(ownsFile ? lua_tostring(L, 1) : NULL);
+	if (locked) {
+		_lock_stat_acquired(stat, waited_ms);
+	} else {
+		_lock_stat_failed(stat, errno, waited_ms);
+	}
+#endif
+	if (locked) {
 		efs_lock *lock =
 			(efs_lock *)lua_newuserdata(L, sizeof(efs_lock));
 		lock->ownsFile = ownsFile;
 		lock->file = fh;
 		lock->start = start;
 		lock->len = len;
+		lock->waited_ms = waited_ms;
+		lock->kind = opts.kind;
+#ifndef _WIN32
+		lock->reg_file = NULL;
+		lock->reg_range = NULL;
+		lock->stat = stat;
+		lock->acquired_at = _now_ms();
+#endif
 		luaL_getmetatable(L, LOCK_METATABLE);
 		lua_setmetatable(L, -2);
 		return 1;
@@ -153,6 +1034,18 @@ int eli_file_lock(lua_State *L)
 int eli_file_unlock(lua_State *L)
 {
 	efs_lock *lock = (efs_lock *)luaL_checkudata(L, 1, LOCK_METATABLE);
+#ifndef _WIN32
+	if (lock->stat != NULL &&
+	    (lock->reg_range != NULL || lock->file != NULL)) {
+		_lock_stat_released(lock->stat, _now_ms() - lock->acquired_at);
+		lock->stat = NULL;
+	}
+	if (lock->reg_range != NULL) {
+		_registry_unlock(lock->reg_file, lock->reg_range);
+		lock->reg_file = NULL;
+		lock->reg_range = NULL;
+	}
+#endif
 	if (lock->file != NULL) {
 		if (lock->ownsFile) {
 			if (fclose(lock->file) != 0) {
@@ -161,8 +1054,9 @@ int eli_file_unlock(lua_State *L)
 			lock->file = NULL;
 			lock->ownsFile = 0;
 		} else {
+			efs_lock_opts opts = { 0, -1, lock->kind };
 			if (!_file_lock(L, lock->file, "u", lock->start,
-					lock->len, "unlock")) {
+					lock->len, &opts, NULL, "unlock")) {
 				return push_error(L, NULL);
 			}
 			lock->file = NULL;
@@ -175,10 +1069,26 @@ int eli_file_unlock(lua_State *L)
 int eli_is_lock_active(lua_State *L)
 {
 	efs_lock *lock = (efs_lock *)luaL_checkudata(L, 1, LOCK_METATABLE);
+#ifndef _WIN32
+	if (lock->reg_range != NULL) {
+		lua_pushboolean(L, 1);
+		return 1;
+	}
+#endif
 	lua_pushboolean(L, lock->file != NULL);
 	return 1;
 }
 
+/*
+** Returns milliseconds spent waiting for the lock to be granted.
+*/
+static int lock_waited(lua_State *L)
+{
+	efs_lock *lock = (efs_lock *)luaL_checkudata(L, 1, LOCK_METATABLE);
+	lua_pushnumber(L, lock->waited_ms);
+	return 1;
+}
+
 #ifdef _WIN32
 typedef struct efs_dir_lock {
 	HANDLE fd;
@@ -229,33 +1139,228 @@ int eli_is_dir_lock_active(lua_State *L)
 	lua_pushboolean(L, lock->fd != INVALID_HANDLE_VALUE);
 	return 1;
 }
+
+int eli_dir_lock_owner(lua_State *L)
+{
+	errno = ENOSYS; /* = "Function not implemented" */
+	return push_result(L, -1, "lock_dir_owner is not supported on Windows");
+}
+
+int eli_lock_stats(lua_State *L)
+{
+	errno = ENOSYS; /* = "Function not implemented" */
+	return push_result(L, -1, "lock_stats is not supported on Windows");
+}
 #else
+/*
+** Directory locks are flock (or OFD) locks on a lockfile that is never
+** removed, so a crashed holder can not leave the directory locked and
+** waiters are woken by the kernel as soon as the lock is released.
+** Exclusive holders record their pid, host and start time in the file.
+*/
 typedef struct efs_dir_lock {
-	char *ln;
+	int fd;
+	int shared;
+	double waited_ms;
+	efs_lock_stat *stat;
+	double acquired_at;
 } efs_dir_lock;
 
+#define DIR_LOCK_OWNER_MAX 512
+
+/*
+** Pushes owner recorded in lockfile { pid, host, started, alive } or
+** nil if there is none. alive is only set for owners on this host,
+** an exclusive lock held by a dead pid is reported as stale.
+*/
+static void _push_dir_lock_owner(lua_State *L, int fd)
+{
+	char data[DIR_LOCK_OWNER_MAX + 1];
+	ssize_t n = pread(fd, data, DIR_LOCK_OWNER_MAX, 0);
+	if (n <= 0) {
+		lua_pushnil(L);
+		return;
+	}
+	data[n] = '\0';
+	long pid = 0;
+	long long started = 0;
+	char host[256] = "";
+	for (char *line = strtok(data, "\n"); line != NULL;
+	     line = strtok(NULL, "\n")) {
+		if (strncmp(line, "pid=", 4) == 0) {
+			pid = strtol(line + 4, NULL, 10);
+		} else if (strncmp(line, "started=", 8) == 0) {
+			started = strtoll(line + 8, NULL, 10);
+		} else if (strncmp(line, "host=", 5) == 0) {
+			strncpy(host, line + 5, sizeof(host) - 1);
+			host[sizeof(host) - 1] = '\0';
+		}
+	}
+	if (pid <= 0) {
+		lua_pushnil(L);
+		return;
+	}
+	lua_createtable(L, 0, 4);
+	lua_pushinteger(L, pid);
+	lua_setfield(L, -2, "pid");
+	lua_pushstring(L, host);
+	lua_setfield(L, -2, "host");
+	lua_pushinteger(L, (lua_Integer)started);
+	lua_setfield(L, -2, "started");
+	char self[256];
+	if (gethostname(self, sizeof(self)) == 0 &&
+	    strncmp(self, host, sizeof(self)) == 0) {
+		int alive = kill((pid_t)pid, 0) == 0 || errno == EPERM;
+		lua_pushboolean(L, alive);
+		lua_setfield(L, -2, "alive");
+	}
+}
+
+static int _write_dir_lock_owner(int fd)
+{
+	char host[256];
+	if (gethostname(host, sizeof(host)) != 0) {
+		host[0] = '\0';
+	}
+	host[sizeof(host) - 1] = '\0';
+	char data[DIR_LOCK_OWNER_MAX];
+	int len = snprintf(data, sizeof(data), "pid=%ld\nhost=%s\nstarted=%lld\n",
+			   (long)getpid(), host, (long long)time(NULL));
+	if (len < 0 || len >= (int)sizeof(data)) {
+		len = (int)sizeof(data) - 1;
+	}
+	if (pwrite(fd, data, (size_t)len, 0) != len) {
+		return -1;
+	}
+	return ftruncate(fd, len);
+}
+
+/*
+** Opens lockfile. A legacy lockfile is a symlink created by older
+** versions, it is treated as held and can only be polled.
+*/
+static int _open_dir_lock(const char *ln, const efs_lock_opts *opts,
+			  double deadline)
+{
+	long sleep_us = 100;
+	for (;;) {
+		int fd = open(ln, O_RDWR | O_CREAT | O_CLOEXEC | O_NOFOLLOW,
+			      0644);
+		if (fd != -1 || errno != ELOOP) {
+			return fd;
+		}
+		if (!opts->wait) {
+			errno = EAGAIN;
+			return -1;
+		}
+		double left_ms = deadline - _now_ms();
+		if (opts->timeout_ms >= 0 && left_ms <= 0) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+		long sleep = sleep_us;
+		if (opts->timeout_ms >= 0 && (double)sleep > left_ms * 1000) {
+			sleep = (long)(left_ms * 1000) + 1;
+		}
+		usleep((useconds_t)sleep);
+		sleep_us = sleep_us < 50000 ? sleep_us * 2 : sleep_us;
+	}
+}
+
+/*
+** Locks a directory.
+** @param #1 Directory path.
+** @param #2 Lockfile name (optional, defaults to "lockfile").
+** @param #3 Options table (optional, may be passed as #2):
+**   mode = "exclusive"|"shared", wait = false, timeout_ms,
+**   kind = "flock"|"ofd"
+** On failure returns nil, message, errno and the recorded owner.
+*/
 int eli_lock_dir(lua_State *L)
 {
-	efs_dir_lock *lock;
-	size_t pathl;
-	char *ln;
-	const char *path = luaL_checklstring(L, 1, &pathl);
-	const char *lockfile = luaL_optstring(L, 2, "lockfile");
-	ln = joinpath(path, lockfile);
+	const char *path = luaL_checkstring(L, 1);
+	int opts_idx = lua_istable(L, 2) ? 2 : 3;
+	const char *lockfile =
+		opts_idx == 2 ? "lockfile" : luaL_optstring(L, 2, "lockfile");
+	efs_lock_opts opts;
+	_check_lock_opts(L, opts_idx, &opts);
+	if (opts.kind != LOCK_KIND_OFD) {
+		opts.kind = LOCK_KIND_FLOCK;
+	}
+	int shared = 0;
+	if (lua_istable(L, opts_idx)) {
+		lua_getfield(L, opts_idx, "mode");
+		const char *mode = luaL_optstring(L, -1, "exclusive");
+		shared = strcmp(mode, "shared") == 0;
+		luaL_argcheck(L, shared || strcmp(mode, "exclusive") == 0,
+			      opts_idx, "mode must be 'exclusive' or 'shared'");
+		lua_pop(L, 1);
+	}
+	char *ln = joinpath(path, lockfile);
 	if (!ln) {
 		lua_pushnil(L);
 		lua_pushstring(L, strerror(errno));
 		return 2;
 	}
-	if (symlink("lock", ln) == -1) {
-		free(ln);
+	double started = _now_ms();
+	double deadline = started + (double)opts.timeout_ms;
+	int fd = _open_dir_lock(ln, &opts, deadline);
+	efs_lock_stat *stat = _lock_stat(ln);
+	free(ln);
+	if (fd == -1) {
+		_lock_stat_failed(stat, errno, _now_ms() - started);
+		return push_error(L, "lock_dir");
+	}
+	efs_lock_req req = { fd, opts.kind, shared ? F_RDLCK : F_WRLCK, 0, 0 };
+	int res = _lock_try(&req, 0);
+	if (res == -1 &&
+	    (errno == EAGAIN || errno == EWOULDBLOCK || errno == EACCES) &&
+	    opts.wait && opts.timeout_ms != 0) {
+		long timeout = opts.timeout_ms;
+		if (timeout > 0) {
+			double left = deadline - _now_ms();
+			timeout = left > 1 ? (long)left : 1;
+		}
+		res = _lock_blocking(&req, timeout);
+	}
+	if (res == -1) {
+		int err = errno;
+		_lock_stat_failed(stat, err, _now_ms() - started);
 		lua_pushnil(L);
-		lua_pushstring(L, strerror(errno));
-		return 2;
+		_push_dir_lock_owner(L, fd);
+		close(fd);
+		int owner = lua_gettop(L);
+		if (lua_istable(L, owner)) {
+			lua_getfield(L, owner, "pid");
+			lua_getfield(L, owner, "host");
+			lua_pushfstring(L, "lock_dir: %s (held by pid %s on %s)",
+					strerror(err), lua_tostring(L, -2),
+					lua_tostring(L, -1));
+			lua_replace(L, owner + 1);
+			lua_pop(L, 1);
+		} else {
+			lua_pushfstring(L, "lock_dir: %s", strerror(err));
+		}
+		lua_pushinteger(L, err);
+		/* nil, owner, message, errno -> nil, message, errno, owner */
+		lua_rotate(L, owner, -1);
+		return 4;
 	}
-	lock = (efs_dir_lock *)lua_newuserdata(L, sizeof(efs_dir_lock));
-	lock->ln = ln;
-
+	if (!shared && _write_dir_lock_owner(fd) == -1) {
+		int err = errno;
+		close(fd);
+		_lock_stat_failed(stat, err, 0);
+		errno = err;
+		return push_error(L, "lock_dir");
+	}
+	efs_dir_lock *lock =
+		(efs_dir_lock *)lua_newuserdata(L, sizeof(efs_dir_lock));
+	lock->fd = fd;
+	lock->shared = shared;
+	lock->acquired_at = _now_ms();
+	lock->waited_ms = lock->acquired_at - started;
+	lock->stat = stat;
+	_lock_stat_acquired(stat, lock->waited_ms);
 	luaL_getmetatable(L, LOCK_DIR_METATABLE);
 	lua_setmetatable(L, -2);
 	return 1;
@@ -265,14 +1370,17 @@ int eli_unlock_dir(lua_State *L)
 {
 	efs_dir_lock *lock =
 		(efs_dir_lock *)luaL_checkudata(L, 1, LOCK_DIR_METATABLE);
-	if (lock->ln) {
-		if (unlink(lock->ln) != 0) {
+	if (lock->fd != -1) {
+		_lock_stat_released(lock->stat, _now_ms() - lock->acquired_at);
+		/* owner record goes away before the lock does */
+		int res = lock->shared ? 0 : ftruncate(lock->fd, 0);
+		res = close(lock->fd) | res;
+		lock->fd = -1;
+		if (res != 0) {
 			lua_pushnil(L);
 			lua_pushstring(L, strerror(errno));
 			return 2;
 		}
-		free(lock->ln);
-		lock->ln = NULL;
 	}
 	lua_pushboolean(L, 1);
 	return 1;
@@ -282,7 +1390,61 @@ int eli_is_dir_lock_active(lua_State *L)
 {
 	efs_dir_lock *lock =
 		(efs_dir_lock *)luaL_checkudata(L, 1, LOCK_DIR_METATABLE);
-	lua_pushboolean(L, lock->ln != NULL);
+	lua_pushboolean(L, lock->fd != -1);
+	return 1;
+}
+
+static int dir_lock_owner(lua_State *L)
+{
+	efs_dir_lock *lock =
+		(efs_dir_lock *)luaL_checkudata(L, 1, LOCK_DIR_METATABLE);
+	if (lock->fd == -1) {
+		lua_pushnil(L);
+	} else {
+		_push_dir_lock_owner(L, lock->fd);
+	}
+	return 1;
+}
+
+static int dir_lock_waited(lua_State *L)
+{
+	efs_dir_lock *lock =
+		(efs_dir_lock *)luaL_checkudata(L, 1, LOCK_DIR_METATABLE);
+	lua_pushnumber(L, lock->waited_ms);
+	return 1;
+}
+
+/*
+** Returns owner recorded for directory lock or nil.
+** @param #1 Directory path.
+** @param #2 Lockfile name (optional, defaults to "lockfile").
+** A legacy symlink lockfile is reported as { legacy = true }.
+*/
+int eli_dir_lock_owner(lua_State *L)
+{
+	const char *path = luaL_checkstring(L, 1);
+	const char *lockfile = luaL_optstring(L, 2, "lockfile");
+	char *ln = joinpath(path, lockfile);
+	if (!ln) {
+		return push_error(L, NULL);
+	}
+	int fd = open(ln, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+	free(ln);
+	if (fd == -1) {
+		if (errno == ELOOP) {
+			lua_createtable(L, 0, 1);
+			lua_pushboolean(L, 1);
+			lua_setfield(L, -2, "legacy");
+			return 1;
+		}
+		if (errno == ENOENT) {
+			lua_pushnil(L);
+			return 1;
+		}
+		return push_error(L, "lock_dir_owner");
+	}
+	_push_dir_lock_owner(L, fd);
+	close(fd);
 	return 1;
 }
 #endif
@@ -301,6 +1463,12 @@ int dir_lock_create_meta(lua_State *L)
 	lua_setfield(L, -2, "unlock");
 	lua_pushcfunction(L, eli_is_dir_lock_active);
 	lua_setfield(L, -2, "is_active");
+#ifndef _WIN32
+	lua_pushcfunction(L, dir_lock_owner);
+	lua_setfield(L, -2, "owner");
+	lua_pushcfunction(L, dir_lock_waited);
+	lua_setfield(L, -2, "waited");
+#endif
 	/* type */
 	lua_pushstring(L, LOCK_DIR_METATABLE);
 	lua_setfield(L, -2, "__type");
@@ -324,6 +1492,8 @@ int lock_create_meta(lua_State *L)
 	lua_setfield(L, -2, "unlock");
 	lua_pushcfunction(L, eli_is_lock_active);
 	lua_setfield(L, -2, "is_active");
+	lua_pushcfunction(L, lock_waited);
+	lua_setfield(L, -2, "waited");
 	/* type */
 	lua_pushstring(L, LOCK_METATABLE);
 	lua_setfield(L, -2, "__type");
@@ -10,6 +10,9 @@ int eli_is_lock_active(lua_State *L);
 int eli_lock_dir(lua_State *L);
 int eli_unlock_dir(lua_State *L);
 int eli_is_dir_lock_active(lua_State *L);
+int eli_dir_lock_owner(lua_State *L);
+
+int eli_lock_stats(lua_State *L);
 
 int lock_create_meta(lua_State *L);
 int dir_lock_create_meta(lua_State *L);
@@ -0,0 +1,338 @@
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "lpath.h"
+
+#include <string.h>
+
+/*
+** Lexical path manipulation, nothing here touches the filesystem.
+** Results are built in luaL_Buffer (on the C stack for common lengths)
+** and pushed as a single Lua string.
+*/
+
+static int _is_dot(const char *c, size_t len)
+{
+	return len == 1 && c[0] == '.';
+}
+
+static int _is_dotdot(const char *c, size_t len)
+{
+	return len == 2 && c[0] == '.' && c[1] == '.';
+}
+
+/*
+** Returns start of next component at or after pos and stores its length,
+** NULL when there are no more components.
+*/
+static const char *_next_component(const char *path, size_t len, size_t *pos,
+				   size_t *clen)
+{
+	size_t i = *pos;
+	while (i < len && EFS_IS_SEP(path[i])) {
+		i++;
+	}
+	if (i == len) {
+		*pos = i;
+		return NULL;
+	}
+	size_t start = i;
+	while (i < len && !EFS_IS_SEP(path[i])) {
+		i++;
+	}
+	*pos = i;
+	*clen = i - start;
+	return path + start;
+}
+
+size_t efs_path_normalize(const char *path, size_t len, char *out)
+{
+	int absolute = len > 0 && EFS_IS_SEP(path[0]);
+	size_t n = 0, root = 0;
+	if (absolute) {
+		out[n++] = EFS_PATH_SEP;
+		root = 1;
+	}
+	/* out[root..n) holds components, up to `fixed` only ".." ones */
+	size_t fixed = root;
+	size_t pos = 0, clen;
+	const char *c;
+	while ((c = _next_component(path, len, &pos, &clen)) != NULL) {
+		if (_is_dot(c, clen)) {
+			continue;
+		}
+		if (_is_dotdot(c, clen)) {
+			if (n > fixed) {
+				/* drop last component with its separator */
+				while (n > fixed && !EFS_IS_SEP(out[n - 1])) {
+					n--;
+				}
+				if (n > root) {
+					n--;
+				}
+				continue;
+			}
+			if (absolute) {
+				continue; /* "/.." is "/" */
+			}
+		}
+		if (n > root) {
+			out[n++] = EFS_PATH_SEP;
+		}
+		memmove(out + n, c, clen);
+		n += clen;
+		if (_is_dotdot(c, clen)) {
+			fixed = n;
+		}
+	}
+	if (n == 0) {
+		out[n++] = '.';
+	}
+	out[n] = '\0';
+	return n;
+}
+
+/* length of path without trailing separators, root kept */
+static size_t _trim_trailing(const char *path, size_t len)
+{
+	while (len > 1 && EFS_IS_SEP(path[len - 1])) {
+		len--;
+	}
+	return len;
+}
+
+/* offset of the last component of already trimmed path */
+static size_t _base_offset(const char *path, size_t len)
+{
+	size_t i = len;
+	while (i > 0 && !EFS_IS_SEP(path[i - 1])) {
+		i--;
+	}
+	return i;
+}
+
+/*
+** Joins path parts with exactly one separator between them. Empty parts
+** are skipped, separators at the joints are collapsed.
+** @param #1... Path parts.
+*/
+static int path_join(lua_State *L)
+{
+	int top = lua_gettop(L);
+	luaL_Buffer b;
+	luaL_buffinit(L, &b);
+	int written = 0;
+	for (int i = 1; i <= top; i++) {
+		size_t len;
+		const char *part = luaL_checklstring(L, i, &len);
+		if (len == 0) {
+			continue;
+		}
+		if (written) {
+			size_t skip = 0;
+			while (skip < len && EFS_IS_SEP(part[skip])) {
+				skip++;
+			}
+			part += skip;
+			len -= skip;
+			/* only a root part still ends with a separator */
+			if (luaL_bufflen(&b) > 0 &&
+			    !EFS_IS_SEP(luaL_buffaddr(&b)[luaL_bufflen(&b) - 1])) {
+				luaL_addchar(&b, EFS_PATH_SEP);
+			}
+		}
+		luaL_addlstring(&b, part, i < top ? _trim_trailing(part, len) : len);
+		written = 1;
+	}
+	luaL_pushresult(&b);
+	return 1;
+}
+
+/*
+** Collapses duplicate separators and "." components and resolves ".."
+** lexically. Leading ".." of relative paths are kept, empty result is
+** ".".
+** @param #1 Path.
+*/
+static int path_normalize(lua_State *L)
+{
+	size_t len;
+	const char *path = luaL_checklstring(L, 1, &len);
+	luaL_Buffer b;
+	char *out = luaL_buffinitsize(L, &b, len + 2);
+	luaL_pushresultsize(&b, efs_path_normalize(path, len, out));
+	return 1;
+}
+
+/*
+** Returns path without its last component like dirname(1):
+** "a/b/" -> "a", "a" -> ".", "/a" -> "/".
+** @param #1 Path.
+*/
+static int path_dirname(lua_State *L)
+{
+	size_t len;
+	const char *path = luaL_checklstring(L, 1, &len);
+	len = _trim_trailing(path, len);
+	size_t base = _base_offset(path, len);
+	if (base == 0) {
+		lua_pushstring(L, len > 0 && EFS_IS_SEP(path[0]) ? "/" : ".");
+		return 1;
+	}
+	size_t dir = _trim_trailing(path, base);
+	lua_pushlstring(L, path, dir);
+	return 1;
+}
+
+/*
+** Returns last component like basename(1): "a/b/" -> "b", "/" -> "/".
+** @param #1 Path.
+*/
+static int path_basename(lua_State *L)
+{
+	size_t len;
+	const char *path = luaL_checklstring(L, 1, &len);
+	len = _trim_trailing(path, len);
+	if (len == 1 && EFS_IS_SEP(path[0])) {
+		lua_pushlstring(L, path, 1);
+		return 1;
+	}
+	size_t base = _base_offset(path, len);
+	lua_pushlstring(L, path + base, len - base);
+	return 1;
+}
+
+/*
+** Returns extension of the last component including the dot, "" when
+** there is none. Leading dots do not start an extension (".bashrc").
+** @param #1 Path.
+*/
+static int path_ext(lua_State *L)
+{
+	size_t len;
+	const char *path = luaL_checklstring(L, 1, &len);
+	len = _trim_trailing(path, len);
+	size_t base = _base_offset(path, len);
+	size_t start = base;
+	while (start < len && path[start] == '.') {
+		start++;
+	}
+	for (size_t i = len; i > start; i--) {
+		if (path[i - 1] == '.') {
+			lua_pushlstring(L, path + i - 1, len - i + 1);
+			return 1;
+		}
+	}
+	lua_pushliteral(L, "");
+	return 1;
+}
+
+/*
+** Returns path leading from `from` to `to`, both normalized first. Both
+** must be absolute or both relative.
+** @param #1 From path (directory).
+** @param #2 To path.
+*/
+static int path_relative(lua_State *L)
+{
+	size_t from_len, to_len;
+	const char *from = luaL_checklstring(L, 1, &from_len);
+	const char *to = luaL_checklstring(L, 2, &to_len);
+	luaL_argcheck(L,
+		      (from_len > 0 && EFS_IS_SEP(from[0])) ==
+			      (to_len > 0 && EFS_IS_SEP(to[0])),
+		      2, "paths must be both absolute or both relative");
+	char local[1024];
+	size_t size = from_len + to_len + 4;
+	char *nfrom = size <= sizeof(local) ?
+			      local :
+			      (char *)lua_newuserdatauv(L, size, 0);
+	char *nto = nfrom + from_len + 2;
+	from_len = efs_path_normalize(from, from_len, nfrom);
+	to_len = efs_path_normalize(to, to_len, nto);
+
+	/* skip common components */
+	size_t fpos = 0, tpos = 0, fclen = 0, tclen = 0;
+	for (;;) {
+		size_t fsave = fpos, tsave = tpos;
+		const char *fc = _next_component(nfrom, from_len, &fpos, &fclen);
+		const char *tc = _next_component(nto, to_len, &tpos, &tclen);
+		if (fc == NULL || tc == NULL || fclen != tclen ||
+		    memcmp(fc, tc, fclen) != 0 || _is_dot(fc, fclen)) {
+			fpos = fsave;
+			tpos = tsave;
+			break;
+		}
+	}
+	luaL_Buffer b;
+	luaL_buffinit(L, &b);
+	const char *c;
+	while ((c = _next_component(nfrom, from_len, &fpos, &fclen)) != NULL) {
+		if (_is_dot(c, fclen)) {
+			continue;
+		}
+		if (_is_dotdot(c, fclen)) {
+			/* would need to know the name of the parent */
+			return luaL_argerror(L, 1, "can not leave '..' of from path");
+		}
+		luaL_addlstring(&b, "..", 2);
+		luaL_addchar(&b, EFS_PATH_SEP);
+	}
+	while ((c = _next_component(nto, to_len, &tpos, &tclen)) != NULL) {
+		if (!_is_dot(c, tclen)) {
+			luaL_addlstring(&b, c, tclen);
+			luaL_addchar(&b, EFS_PATH_SEP);
+		}
+	}
+	if (luaL_bufflen(&b) == 0) {
+		luaL_addchar(&b, '.');
+	} else {
+		luaL_buffsub(&b, 1); /* trailing separator */
+	}
+	luaL_pushresult(&b);
+	return 1;
+}
+
+/*
+** Splits path into its components. Absolute paths start with the root
+** separator as first element.
+** @param #1 Path.
+*/
+static int path_split(lua_State *L)
+{
+	size_t len;
+	const char *path = luaL_checklstring(L, 1, &len);
+	lua_newtable(L);
+	int i = 0;
+	if (len > 0 && EFS_IS_SEP(path[0])) {
+		lua_pushlstring(L, path, 1);
+		lua_rawseti(L, -2, ++i);
+	}
+	size_t pos = 0, clen;
+	const char *c;
+	while ((c = _next_component(path, len, &pos, &clen)) != NULL) {
+		lua_pushlstring(L, c, clen);
+		lua_rawseti(L, -2, ++i);
+	}
+	return 1;
+}
+
+static const struct luaL_Reg path_funcs[] = {
+	{ "join", path_join },
+	{ "normalize", path_normalize },
+	{ "dirname", path_dirname },
+	{ "basename", path_basename },
+	{ "ext", path_ext },
+	{ "relative", path_relative },
+	{ "split", path_split },
+	{ NULL, NULL },
+};
+
+/*
+** Pushes table of path functions.
+*/
+int path_create_module(lua_State *L)
+{
+	luaL_newlib(L, path_funcs);
+	return 1;
+}
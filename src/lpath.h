@@ -0,0 +1,24 @@
+#ifndef ELI_EXTRA_FS_PATH_H__
+#define ELI_EXTRA_FS_PATH_H__
+
+#include "lua.h"
+
+#include <stddef.h>
+
+#ifdef _WIN32
+#define EFS_PATH_SEP '\\'
+#define EFS_IS_SEP(c) ((c) == '\\' || (c) == '/')
+#else
+#define EFS_PATH_SEP '/'
+#define EFS_IS_SEP(c) ((c) == '/')
+#endif
+
+/*
+** Normalizes path of len bytes into out, which must hold len + 2 bytes.
+** Returns length of the result.
+*/
+size_t efs_path_normalize(const char *path, size_t len, char *out);
+
+int path_create_module(lua_State *L);
+
+#endif /* ELI_EXTRA_FS_PATH_H__ */
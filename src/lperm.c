@@ -19,8 +19,16 @@
 #else // unix
 
 #include <unistd.h>
+#include <fcntl.h>
 #include <pwd.h>
 #include <grp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "lwalk.h"
+#include "lperm.h"
 
 #define LMODE_T mode_t
 
@@ -93,6 +101,255 @@ int eli_chown(lua_State *L)
 #endif
 }
 
+#ifndef _WIN32
+
+/*
+** Cache of NSS user and group lookups. Both name -> id and id -> name
+** results, including misses, are kept for ttl seconds. Lookups go
+** through the reentrant getpwnam_r/getpwuid_r family so the cache can
+** be used from pool threads.
+*/
+#define OWNER_CACHE_BUCKETS 256
+#define OWNER_CACHE_MAX 4096
+#define OWNER_CACHE_TTL 60
+
+typedef struct efs_owner_entry {
+	struct efs_owner_entry *next;
+	int group;
+	int by_name;
+	int found;
+	long id;
+	double expires;
+	char name[];
+} efs_owner_entry;
+
+static pthread_mutex_t owner_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static efs_owner_entry *owner_cache[OWNER_CACHE_BUCKETS];
+static size_t owner_cache_count;
+static long owner_cache_ttl = OWNER_CACHE_TTL;
+static unsigned long owner_cache_hits;
+static unsigned long owner_cache_misses;
+
+static double _owner_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static size_t _owner_bucket(int group, int by_name, const char *name, long id)
+{
+	size_t h = (size_t)(group * 2 + by_name) * 0x9e3779b9u;
+	if (by_name) {
+		for (; *name; name++) {
+			h = (h ^ (unsigned char)*name) * 16777619u;
+		}
+	} else {
+		h ^= (size_t)id * 2654435761u;
+	}
+	return h % OWNER_CACHE_BUCKETS;
+}
+
+static void _owner_cache_clear(void)
+{
+	for (int i = 0; i < OWNER_CACHE_BUCKETS; i++) {
+		while (owner_cache[i] != NULL) {
+			efs_owner_entry *e = owner_cache[i];
+			owner_cache[i] = e->next;
+			free(e);
+		}
+	}
+	owner_cache_count = 0;
+}
+
+/*
+** Finds live entry. Called with cache mutex held.
+*/
+static efs_owner_entry *_owner_find(int group, int by_name, const char *name,
+				    long id, double now)
+{
+	efs_owner_entry **slot =
+		&owner_cache[_owner_bucket(group, by_name, name, id)];
+	while (*slot != NULL) {
+		efs_owner_entry *e = *slot;
+		if (e->expires <= now) {
+			*slot = e->next;
+			free(e);
+			owner_cache_count--;
+			continue;
+		}
+		if (e->group == group && e->by_name == by_name &&
+		    (by_name ? strcmp(e->name, name) == 0 : e->id == id)) {
+			return e;
+		}
+		slot = &e->next;
+	}
+	return NULL;
+}
+
+/*
+** Queries NSS. name is looked up if not NULL, id otherwise. On success
+** fills id and copies name (malloc'ed). Returns 0, or -1 with errno set
+** (ENOENT if there is no such user or group).
+*/
+static int _owner_query(int group, const char *name, long *id, char **out)
+{
+	long size = sysconf(group ? _SC_GETGR_R_SIZE_MAX : _SC_GETPW_R_SIZE_MAX);
+	size_t len = size > 0 ? (size_t)size : 1024;
+	for (;;) {
+		char *buf = malloc(len);
+		if (buf == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+		int res;
+		const char *found = NULL;
+		if (group) {
+			struct group g, *r = NULL;
+			res = name ? getgrnam_r(name, &g, buf, len, &r) :
+				     getgrgid_r((gid_t)*id, &g, buf, len, &r);
+			if (res == 0 && r != NULL) {
+				*id = (long)g.gr_gid;
+				found = g.gr_name;
+			}
+		} else {
+			struct passwd p, *r = NULL;
+			res = name ? getpwnam_r(name, &p, buf, len, &r) :
+				     getpwuid_r((uid_t)*id, &p, buf, len, &r);
+			if (res == 0 && r != NULL) {
+				*id = (long)p.pw_uid;
+				found = p.pw_name;
+			}
+		}
+		if (res == ERANGE && len < (1 << 20)) {
+			free(buf);
+			len *= 2;
+			continue;
+		}
+		*out = found ? strdup(found) : NULL;
+		free(buf);
+		if (found == NULL || *out == NULL) {
+			errno = found ? ENOMEM : res ? res : ENOENT;
+			return -1;
+		}
+		return 0;
+	}
+}
+
+static void _owner_store(int group, int by_name, const char *key, long id,
+			 const char *name, int found, double now)
+{
+	if (owner_cache_ttl <= 0) {
+		return;
+	}
+	if (owner_cache_count >= OWNER_CACHE_MAX) {
+		_owner_cache_clear();
+	}
+	const char *stored = by_name ? key : found ? name : "";
+	size_t len = strlen(stored);
+	efs_owner_entry *e = malloc(sizeof(efs_owner_entry) + len + 1);
+	if (e == NULL) {
+		return;
+	}
+	e->group = group;
+	e->by_name = by_name;
+	e->found = found;
+	e->id = id;
+	e->expires = now + (double)owner_cache_ttl;
+	memcpy(e->name, stored, len + 1);
+	size_t b = _owner_bucket(group, by_name, key, id);
+	e->next = owner_cache[b];
+	owner_cache[b] = e;
+	owner_cache_count++;
+}
+
+/*
+** Resolves user (group = 0) or group name to id.
+** Returns 0, or -1 with errno set (ENOENT if unknown).
+*/
+int efs_owner_id(int group, const char *name, long *id)
+{
+	double now = _owner_now();
+	pthread_mutex_lock(&owner_cache_mutex);
+	efs_owner_entry *e = _owner_find(group, 1, name, 0, now);
+	if (e != NULL) {
+		owner_cache_hits++;
+		int found = e->found;
+		*id = e->id;
+		pthread_mutex_unlock(&owner_cache_mutex);
+		if (!found) {
+			errno = ENOENT;
+			return -1;
+		}
+		return 0;
+	}
+	owner_cache_misses++;
+	pthread_mutex_unlock(&owner_cache_mutex);
+
+	char *resolved = NULL;
+	int res = _owner_query(group, name, id, &resolved);
+	int err = errno;
+	if (res == 0 || err == ENOENT) {
+		pthread_mutex_lock(&owner_cache_mutex);
+		_owner_store(group, 1, name, res == 0 ? *id : -1, resolved,
+			     res == 0, now);
+		pthread_mutex_unlock(&owner_cache_mutex);
+	}
+	free(resolved);
+	errno = err;
+	return res;
+}
+
+/*
+** Resolves user (group = 0) or group id to name copied into buf.
+** Returns 0, or -1 with errno set (ENOENT if unknown, ERANGE if buf is
+** too small).
+*/
+int efs_owner_name(int group, long id, char *buf, size_t size)
+{
+	double now = _owner_now();
+	char *resolved = NULL;
+	int res = 0;
+	pthread_mutex_lock(&owner_cache_mutex);
+	efs_owner_entry *e = _owner_find(group, 0, NULL, id, now);
+	if (e != NULL) {
+		owner_cache_hits++;
+		if (!e->found) {
+			res = -1;
+			errno = ENOENT;
+		} else if (strlen(e->name) >= size) {
+			res = -1;
+			errno = ERANGE;
+		} else {
+			strcpy(buf, e->name);
+		}
+		pthread_mutex_unlock(&owner_cache_mutex);
+		return res;
+	}
+	owner_cache_misses++;
+	pthread_mutex_unlock(&owner_cache_mutex);
+
+	long resolved_id = id;
+	res = _owner_query(group, NULL, &resolved_id, &resolved);
+	int err = errno;
+	if (res == 0 || err == ENOENT) {
+		pthread_mutex_lock(&owner_cache_mutex);
+		_owner_store(group, 0, NULL, id, resolved, res == 0, now);
+		pthread_mutex_unlock(&owner_cache_mutex);
+	}
+	if (res == 0 && strlen(resolved) >= size) {
+		res = -1;
+		err = ERANGE;
+	} else if (res == 0) {
+		strcpy(buf, resolved);
+	}
+	free(resolved);
+	errno = err;
+	return res;
+}
+
+#endif
+
 int eli_getuid(lua_State *L)
 {
 #ifdef _WIN32
@@ -100,11 +357,11 @@ int eli_getuid(lua_State *L)
 	return push_result(L, -1, "getuid is not supported on Windows");
 #else
 	const char *user = luaL_checkstring(L, 1);
-	struct passwd *p;
-	if ((p = getpwnam(user)) == NULL) {
+	long uid;
+	if (efs_owner_id(0, user, &uid) == -1) {
 		return push_error(L, NULL);
 	}
-	lua_pushinteger(L, p->pw_uid);
+	lua_pushinteger(L, uid);
 	return 1;
 #endif
 }
@@ -116,11 +373,478 @@ int eli_getgid(lua_State *L)
 	return push_result(L, -1, "getgid is not supported on Windows");
 #else
 	const char *group = luaL_checkstring(L, 1);
-	struct group *g;
-	if ((g = getgrnam(group)) == NULL) {
+	long gid;
+	if (efs_owner_id(1, group, &gid) == -1) {
+		return push_error(L, NULL);
+	}
+	lua_pushinteger(L, gid);
+	return 1;
+#endif
+}
+
+/*
+** Returns user name of uid.
+** @param #1 User id.
+*/
+int eli_user_name(lua_State *L)
+{
+#ifdef _WIN32
+	errno = ENOSYS; /* = "Function not implemented" */
+	return push_result(L, -1, "user_name is not supported on Windows");
+#else
+	long uid = (long)luaL_checkinteger(L, 1);
+	char name[EFS_OWNER_NAME_MAX];
+	if (efs_owner_name(0, uid, name, sizeof(name)) == -1) {
+		return push_error(L, NULL);
+	}
+	lua_pushstring(L, name);
+	return 1;
+#endif
+}
+
+/*
+** Returns group name of gid.
+** @param #1 Group id.
+*/
+int eli_group_name(lua_State *L)
+{
+#ifdef _WIN32
+	errno = ENOSYS; /* = "Function not implemented" */
+	return push_result(L, -1, "group_name is not supported on Windows");
+#else
+	long gid = (long)luaL_checkinteger(L, 1);
+	char name[EFS_OWNER_NAME_MAX];
+	if (efs_owner_name(1, gid, name, sizeof(name)) == -1) {
 		return push_error(L, NULL);
 	}
-	lua_pushinteger(L, g->gr_gid);
+	lua_pushstring(L, name);
 	return 1;
 #endif
-}
\ No newline at end of file
+}
+
+#ifndef _WIN32
+static void _resolve_field(lua_State *L, int idx, int group, const char *from,
+			   const char *to)
+{
+	char name[EFS_OWNER_NAME_MAX];
+	lua_getfield(L, idx, from);
+	int isnum;
+	lua_Integer id = lua_tointegerx(L, -1, &isnum);
+	lua_pop(L, 1);
+	if (isnum && efs_owner_name(group, (long)id, name, sizeof(name)) == 0) {
+		lua_pushstring(L, name);
+		lua_setfield(L, idx, to);
+	}
+}
+#endif
+
+/*
+** Sets user and group names on list of tables carrying uid and gid
+** (e.g. file_info results). Unknown ids are left without a name.
+** @param #1 List of tables.
+** Returns the list.
+*/
+int eli_resolve_owners(lua_State *L)
+{
+#ifdef _WIN32
+	errno = ENOSYS; /* = "Function not implemented" */
+	return push_result(L, -1, "resolve_owners is not supported on Windows");
+#else
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_Integer n = luaL_len(L, 1);
+	for (lua_Integer i = 1; i <= n; i++) {
+		if (lua_geti(L, 1, i) == LUA_TTABLE) {
+			int idx = lua_gettop(L);
+			_resolve_field(L, idx, 0, "uid", "user");
+			_resolve_field(L, idx, 1, "gid", "group");
+		}
+		lua_pop(L, 1);
+	}
+	lua_settop(L, 1);
+	return 1;
+#endif
+}
+
+/*
+** Configures owner name cache and returns its state
+** { entries, hits, misses, ttl }.
+** @param #1 Options table { ttl = seconds (0 disables caching),
+**           clear = false } (optional).
+*/
+int eli_owner_cache(lua_State *L)
+{
+#ifdef _WIN32
+	errno = ENOSYS; /* = "Function not implemented" */
+	return push_result(L, -1, "owner_cache is not supported on Windows");
+#else
+	long ttl = -1;
+	int clear = 0;
+	if (lua_istable(L, 1)) {
+		lua_getfield(L, 1, "ttl");
+		ttl = (long)luaL_optinteger(L, -1, -1);
+		lua_getfield(L, 1, "clear");
+		clear = lua_toboolean(L, -1);
+		lua_pop(L, 2);
+	}
+	pthread_mutex_lock(&owner_cache_mutex);
+	if (ttl >= 0) {
+		owner_cache_ttl = ttl;
+	}
+	if (clear || ttl >= 0) {
+		_owner_cache_clear();
+	}
+	unsigned long entries = owner_cache_count, hits = owner_cache_hits,
+		      misses = owner_cache_misses;
+	ttl = owner_cache_ttl;
+	pthread_mutex_unlock(&owner_cache_mutex);
+	lua_createtable(L, 0, 4);
+	lua_pushinteger(L, (lua_Integer)entries);
+	lua_setfield(L, -2, "entries");
+	lua_pushinteger(L, (lua_Integer)hits);
+	lua_setfield(L, -2, "hits");
+	lua_pushinteger(L, (lua_Integer)misses);
+	lua_setfield(L, -2, "misses");
+	lua_pushinteger(L, ttl);
+	lua_setfield(L, -2, "ttl");
+	return 1;
+#endif
+}
+
+#ifndef _WIN32
+
+/*
+** Parsed mode, either absolute or a list of chmod(1) style clauses
+** applied to the current mode.
+*/
+#define MODE_CLAUSES_MAX 16
+
+typedef struct efs_mode_clause {
+	mode_t who;
+	char op; /* '+', '-' or '=' */
+	mode_t perm;
+	int cond_exec; /* X - execute only for directories or if already executable */
+	char copy; /* 'u', 'g', 'o' to copy permissions of that class */
+} efs_mode_clause;
+
+typedef struct efs_mode_spec {
+	int absolute;
+	mode_t mode;
+	int count;
+	efs_mode_clause clauses[MODE_CLAUSES_MAX];
+} efs_mode_spec;
+
+static int _parse_ls_mode(const char *str, size_t len, mode_t *mode)
+{
+	static const mode_t bits[9] = { S_IRUSR, S_IWUSR, S_IXUSR,
+					S_IRGRP, S_IWGRP, S_IXGRP,
+					S_IROTH, S_IWOTH, S_IXOTH };
+	if (len != 9) {
+		return -1;
+	}
+	*mode = 0;
+	for (int i = 0; i < 9; i++) {
+		char expected = "rwx"[i % 3];
+		if (str[i] == expected) {
+			*mode |= bits[i];
+		} else if (str[i] != '-') {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+** Parses number like "0755", "rwxr-xr-x" or symbolic "u+rwX,go-w".
+** Who defaults to "a" when omitted.
+*/
+static int _parse_mode(const char *str, size_t len, efs_mode_spec *spec)
+{
+	memset(spec, 0, sizeof(efs_mode_spec));
+	if (len > 0 && str[0] >= '0' && str[0] <= '7') {
+		char *end;
+		long value = strtol(str, &end, 8);
+		if (*end != '\0' || value > 07777) {
+			return -1;
+		}
+		spec->absolute = 1;
+		spec->mode = (mode_t)value;
+		return 0;
+	}
+	if (_parse_ls_mode(str, len, &spec->mode) == 0) {
+		spec->absolute = 1;
+		return 0;
+	}
+	const char *p = str;
+	for (;;) {
+		mode_t who = 0;
+		for (; *p == 'u' || *p == 'g' || *p == 'o' || *p == 'a'; p++) {
+			who |= *p == 'u' ? S_ISUID | S_IRWXU :
+			       *p == 'g' ? S_ISGID | S_IRWXG :
+			       *p == 'o' ? S_IRWXO :
+					   07777;
+		}
+		if (who == 0) {
+			who = 07777;
+		}
+		if (*p != '+' && *p != '-' && *p != '=') {
+			return -1;
+		}
+		while (*p == '+' || *p == '-' || *p == '=') {
+			if (spec->count == MODE_CLAUSES_MAX) {
+				return -1;
+			}
+			efs_mode_clause *c = &spec->clauses[spec->count++];
+			c->who = who;
+			c->op = *p++;
+			if (*p == 'u' || *p == 'g' || *p == 'o') {
+				c->copy = *p++;
+				continue;
+			}
+			for (; *p != '\0' && strchr("rwxXst", *p) != NULL; p++) {
+				switch (*p) {
+				case 'r':
+					c->perm |= S_IRUSR | S_IRGRP | S_IROTH;
+					break;
+				case 'w':
+					c->perm |= S_IWUSR | S_IWGRP | S_IWOTH;
+					break;
+				case 'x':
+					c->perm |= S_IXUSR | S_IXGRP | S_IXOTH;
+					break;
+				case 'X':
+					c->cond_exec = 1;
+					break;
+				case 's':
+					c->perm |= S_ISUID | S_ISGID;
+					break;
+				case 't':
+					c->perm |= S_ISVTX;
+					break;
+				}
+			}
+		}
+		if (*p == '\0') {
+			return 0;
+		}
+		if (*p++ != ',') {
+			return -1;
+		}
+	}
+}
+
+static mode_t _apply_mode(const efs_mode_spec *spec, mode_t old, int is_dir)
+{
+	if (spec->absolute) {
+		return spec->mode;
+	}
+	mode_t mode = old & 07777;
+	for (int i = 0; i < spec->count; i++) {
+		const efs_mode_clause *c = &spec->clauses[i];
+		mode_t perm = c->perm;
+		if (c->copy) {
+			mode_t bits = c->copy == 'u' ? (mode & S_IRWXU) >> 6 :
+				      c->copy == 'g' ? (mode & S_IRWXG) >> 3 :
+						       mode & S_IRWXO;
+			perm = bits << 6 | bits << 3 | bits;
+		}
+		if (c->cond_exec && (is_dir || (old & (S_IXUSR | S_IXGRP | S_IXOTH)))) {
+			perm |= S_IXUSR | S_IXGRP | S_IXOTH;
+		}
+		perm &= c->who;
+		switch (c->op) {
+		case '+':
+			mode |= perm;
+			break;
+		case '-':
+			mode &= ~perm;
+			break;
+		default:
+			/* = keeps setuid/setgid of directories as chmod(1) does */
+			mode = (mode & ~(c->who & (is_dir ? 01777 : 07777))) | perm;
+			break;
+		}
+	}
+	return mode;
+}
+
+typedef struct efs_perm_walk {
+	efs_mode_spec spec;
+	uid_t uid;
+	gid_t gid;
+	int files;
+	int dirs;
+	unsigned long visited;
+	unsigned long changed;
+	unsigned long errors;
+} efs_perm_walk;
+
+static int _chmod_entry(efs_walk_entry *entry, void *ud)
+{
+	efs_perm_walk *walk = (efs_perm_walk *)ud;
+	const struct stat *st = entry->st;
+	int is_dir = S_ISDIR(st->st_mode);
+	__atomic_add_fetch(&walk->visited, 1, __ATOMIC_RELAXED);
+	if (S_ISLNK(st->st_mode) || (is_dir ? !walk->dirs : !walk->files)) {
+		return EFS_WALK_CONTINUE;
+	}
+	mode_t mode = _apply_mode(&walk->spec, st->st_mode, is_dir);
+	if (mode == (st->st_mode & 07777)) {
+		return EFS_WALK_CONTINUE;
+	}
+	if (fchmodat(entry->dirfd, entry->name, mode, 0) == -1) {
+		__atomic_add_fetch(&walk->errors, 1, __ATOMIC_RELAXED);
+	} else {
+		__atomic_add_fetch(&walk->changed, 1, __ATOMIC_RELAXED);
+	}
+	return EFS_WALK_CONTINUE;
+}
+
+static int _chown_entry(efs_walk_entry *entry, void *ud)
+{
+	efs_perm_walk *walk = (efs_perm_walk *)ud;
+	const struct stat *st = entry->st;
+	int is_dir = S_ISDIR(st->st_mode);
+	__atomic_add_fetch(&walk->visited, 1, __ATOMIC_RELAXED);
+	if (is_dir ? !walk->dirs : !walk->files) {
+		return EFS_WALK_CONTINUE;
+	}
+	if ((walk->uid == (uid_t)-1 || walk->uid == st->st_uid) &&
+	    (walk->gid == (gid_t)-1 || walk->gid == st->st_gid)) {
+		return EFS_WALK_CONTINUE;
+	}
+	if (fchownat(entry->dirfd, entry->name, walk->uid, walk->gid,
+		     AT_SYMLINK_NOFOLLOW) == -1) {
+		__atomic_add_fetch(&walk->errors, 1, __ATOMIC_RELAXED);
+	} else {
+		__atomic_add_fetch(&walk->changed, 1, __ATOMIC_RELAXED);
+	}
+	return EFS_WALK_CONTINUE;
+}
+
+static int _check_perm_walk_opts(lua_State *L, int idx, efs_perm_walk *walk)
+{
+	int flags = 0;
+	walk->files = walk->dirs = 1;
+	if (lua_istable(L, idx)) {
+		lua_getfield(L, idx, "files");
+		walk->files = lua_isnil(L, -1) || lua_toboolean(L, -1);
+		lua_getfield(L, idx, "dirs");
+		walk->dirs = lua_isnil(L, -1) || lua_toboolean(L, -1);
+		lua_getfield(L, idx, "one_file_system");
+		flags |= lua_toboolean(L, -1) ? EFS_WALK_XDEV : 0;
+		lua_pop(L, 3);
+	}
+	return flags;
+}
+
+/*
+** Runs tree walk with visit applied to root and everything below it.
+** Returns { visited, changed, errors }.
+*/
+static int _perm_tree(lua_State *L, const char *path, efs_perm_walk *walk,
+		      int flags, efs_walk_fn visit)
+{
+	struct stat st;
+	if (lstat(path, &st) == -1) {
+		return push_error(L, path);
+	}
+	efs_walk_entry root = { AT_FDCWD, path, path, 0, &st, 0, 0 };
+	visit(&root, walk);
+	if (S_ISDIR(st.st_mode)) {
+		efs_walker walker = { visit, NULL, walk, flags, 0, 0 };
+		if (efs_walk_parallel(&walker, path) == -1) {
+			return push_error(L, path);
+		}
+		walk->errors += (unsigned long)walker.errors;
+	}
+	lua_createtable(L, 0, 3);
+	lua_pushinteger(L, (lua_Integer)walk->visited);
+	lua_setfield(L, -2, "visited");
+	lua_pushinteger(L, (lua_Integer)walk->changed);
+	lua_setfield(L, -2, "changed");
+	lua_pushinteger(L, (lua_Integer)walk->errors);
+	lua_setfield(L, -2, "errors");
+	return 1;
+}
+
+#endif
+
+/*
+** Changes mode of path and everything below it. Entries that already
+** have the requested mode are only stat'ed. Symlinks are skipped.
+** @param #1 Path.
+** @param #2 Mode as number, octal string, "rwxr-xr-x" or symbolic
+**           "u+rwX,go-w".
+** @param #3 Options table { files = true, dirs = true,
+**           one_file_system = false } (optional).
+*/
+int eli_chmod_tree(lua_State *L)
+{
+#ifdef _WIN32
+	errno = ENOSYS; /* = "Function not implemented" */
+	return push_result(L, -1, "chmod_tree is not supported on Windows");
+#else
+	const char *path = luaL_checkstring(L, 1);
+	efs_perm_walk walk;
+	memset(&walk, 0, sizeof(walk));
+	if (lua_type(L, 2) == LUA_TNUMBER) {
+		walk.spec.absolute = 1;
+		walk.spec.mode = (mode_t)luaL_checkinteger(L, 2) & 07777;
+	} else {
+		size_t len;
+		const char *smode = luaL_checklstring(L, 2, &len);
+		luaL_argcheck(L, _parse_mode(smode, len, &walk.spec) == 0, 2,
+			      "invalid mode");
+	}
+	int flags = _check_perm_walk_opts(L, 3, &walk);
+	return _perm_tree(L, path, &walk, flags, _chmod_entry);
+#endif
+}
+
+#ifndef _WIN32
+static int _check_owner_id(lua_State *L, int idx, int user, long *id)
+{
+	if (lua_isnoneornil(L, idx)) {
+		*id = -1;
+		return 0;
+	}
+	if (lua_type(L, idx) == LUA_TNUMBER) {
+		*id = (long)luaL_checkinteger(L, idx);
+		return 0;
+	}
+	return efs_owner_id(user ? 0 : 1, luaL_checkstring(L, idx), id);
+}
+#endif
+
+/*
+** Changes owner of path and everything below it. Entries that already
+** have the requested owner are only stat'ed. Symlinks are changed
+** themselves, not followed.
+** @param #1 Path.
+** @param #2 User id or name (nil keeps user).
+** @param #3 Group id or name (nil keeps group).
+** @param #4 Options table { files = true, dirs = true,
+**           one_file_system = false } (optional).
+*/
+int eli_chown_tree(lua_State *L)
+{
+#ifdef _WIN32
+	errno = ENOSYS; /* = "Function not implemented" */
+	return push_result(L, -1, "chown_tree is not supported on Windows");
+#else
+	const char *path = luaL_checkstring(L, 1);
+	efs_perm_walk walk;
+	memset(&walk, 0, sizeof(walk));
+	long uid, gid;
+	if (_check_owner_id(L, 2, 1, &uid) == -1) {
+		return push_error(L, lua_tostring(L, 2));
+	}
+	if (_check_owner_id(L, 3, 0, &gid) == -1) {
+		return push_error(L, lua_tostring(L, 3));
+	}
+	walk.uid = (uid_t)uid;
+	walk.gid = (gid_t)gid;
+	int flags = _check_perm_walk_opts(L, 4, &walk);
+	return _perm_tree(L, path, &walk, flags, _chown_entry);
+#endif
+}
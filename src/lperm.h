@@ -7,5 +7,22 @@ int eli_chmod(lua_State *L);
 int eli_chown(lua_State *L);
 int eli_getuid(lua_State *L);
 int eli_getgid(lua_State *L);
+int eli_chmod_tree(lua_State *L);
+int eli_chown_tree(lua_State *L);
+int eli_user_name(lua_State *L);
+int eli_group_name(lua_State *L);
+int eli_resolve_owners(lua_State *L);
+int eli_owner_cache(lua_State *L);
+
+#ifndef _WIN32
+
+#include <stddef.h>
+
+#define EFS_OWNER_NAME_MAX 256
+
+int efs_owner_id(int group, const char *name, long *id);
+int efs_owner_name(int group, long id, char *buf, size_t size);
+
+#endif
 
 #endif /* ELI_EXTRA_FS_PERM_H__ */
\ No newline at end of file
@@ -0,0 +1,215 @@
+#include "lpool.h"
+
+#ifndef _WIN32
+
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define POOL_MIN_THREADS 2
+#define POOL_MAX_THREADS 32
+
+/*
+** Process-wide worker pool. Threads are started on first use and live
+** until the process exits, every Lua state in the process shares them.
+*/
+typedef struct efs_task {
+	efs_task_fn fn;
+	void *arg;
+	efs_task_group *group;
+	struct efs_task *next;
+} efs_task;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_wakeup = PTHREAD_COND_INITIALIZER;
+static efs_task *queue_head = NULL;
+static efs_task *queue_tail = NULL;
+static int queue_length = 0;
+static int pool_threads = 0;
+
+static void _run_task(efs_task *task)
+{
+	task->fn(task->arg);
+	if (task->group != NULL) {
+		efs_task_group *group = task->group;
+		pthread_mutex_lock(&group->lock);
+		if (--group->pending == 0) {
+			pthread_cond_broadcast(&group->done);
+		}
+		pthread_mutex_unlock(&group->lock);
+	}
+	free(task);
+}
+
+static void *_pool_worker(void *arg)
+{
+	(void)arg;
+	for (;;) {
+		pthread_mutex_lock(&pool_lock);
+		while (queue_head == NULL) {
+			pthread_cond_wait(&pool_wakeup, &pool_lock);
+		}
+		efs_task *task = queue_head;
+		queue_head = task->next;
+		if (queue_head == NULL) {
+			queue_tail = NULL;
+		}
+		__atomic_sub_fetch(&queue_length, 1, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&pool_lock);
+		_run_task(task);
+	}
+	return NULL;
+}
+
+/* expects pool_lock to be held */
+static int _pool_start(void)
+{
+	if (pool_threads > 0) {
+		return 0;
+	}
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int count = cpus < POOL_MIN_THREADS ? POOL_MIN_THREADS :
+		    cpus > POOL_MAX_THREADS ? POOL_MAX_THREADS :
+					      (int)cpus;
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for (int i = 0; i < count; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, &attr, _pool_worker, NULL) != 0) {
+			break;
+		}
+		pool_threads++;
+	}
+	pthread_attr_destroy(&attr);
+	if (pool_threads == 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+	return 0;
+}
+
+int efs_pool_size(void)
+{
+	pthread_mutex_lock(&pool_lock);
+	_pool_start();
+	int size = pool_threads;
+	pthread_mutex_unlock(&pool_lock);
+	return size;
+}
+
+static int _pool_push(efs_task_fn fn, void *arg, efs_task_group *group)
+{
+	efs_task *task = malloc(sizeof(efs_task));
+	if (task == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	task->fn = fn;
+	task->arg = arg;
+	task->group = group;
+	task->next = NULL;
+
+	pthread_mutex_lock(&pool_lock);
+	if (_pool_start() == -1) {
+		pthread_mutex_unlock(&pool_lock);
+		free(task);
+		return -1;
+	}
+	if (queue_tail != NULL) {
+		queue_tail->next = task;
+	} else {
+		queue_head = task;
+	}
+	queue_tail = task;
+	__atomic_add_fetch(&queue_length, 1, __ATOMIC_RELAXED);
+	pthread_cond_signal(&pool_wakeup);
+	pthread_mutex_unlock(&pool_lock);
+	return 0;
+}
+
+/*
+** Number of tasks waiting for a worker. Read without the pool lock, so
+** it is only a hint for deciding whether to split work further.
+*/
+int efs_pool_queued(void)
+{
+	return __atomic_load_n(&queue_length, __ATOMIC_RELAXED);
+}
+
+int efs_pool_submit(efs_task_fn fn, void *arg)
+{
+	return _pool_push(fn, arg, NULL);
+}
+
+void efs_group_init(efs_task_group *group)
+{
+	pthread_mutex_init(&group->lock, NULL);
+	pthread_cond_init(&group->done, NULL);
+	group->pending = 0;
+}
+
+/*
+** Submits task into group. If the pool can not take it the task runs
+** inline, so callers never have to handle a partial submission; the
+** task has run (or will run) either way and 0 is always returned.
+*/
+int efs_group_submit(efs_task_group *group, efs_task_fn fn, void *arg)
+{
+	pthread_mutex_lock(&group->lock);
+	group->pending++;
+	pthread_mutex_unlock(&group->lock);
+	if (_pool_push(fn, arg, group) == -1) {
+		fn(arg);
+		pthread_mutex_lock(&group->lock);
+		group->pending--;
+		pthread_mutex_unlock(&group->lock);
+	}
+	return 0;
+}
+
+/* takes first queued task belonging to group */
+static efs_task *_pool_steal(efs_task_group *group)
+{
+	efs_task *prev = NULL;
+	pthread_mutex_lock(&pool_lock);
+	efs_task *task = queue_head;
+	while (task != NULL && task->group != group) {
+		prev = task;
+		task = task->next;
+	}
+	if (task != NULL) {
+		if (prev != NULL) {
+			prev->next = task->next;
+		} else {
+			queue_head = task->next;
+		}
+		if (queue_tail == task) {
+			queue_tail = prev;
+		}
+		__atomic_sub_fetch(&queue_length, 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&pool_lock);
+	return task;
+}
+
+void efs_group_wait(efs_task_group *group)
+{
+	efs_task *task;
+	while ((task = _pool_steal(group)) != NULL) {
+		_run_task(task);
+	}
+	pthread_mutex_lock(&group->lock);
+	while (group->pending > 0) {
+		pthread_cond_wait(&group->done, &group->lock);
+	}
+	pthread_mutex_unlock(&group->lock);
+}
+
+void efs_group_destroy(efs_task_group *group)
+{
+	pthread_mutex_destroy(&group->lock);
+	pthread_cond_destroy(&group->done);
+}
+
+#endif
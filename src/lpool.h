@@ -0,0 +1,32 @@
+#ifndef ELI_EXTRA_FS_POOL_H__
+#define ELI_EXTRA_FS_POOL_H__
+
+#ifndef _WIN32
+
+#include <pthread.h>
+
+typedef void (*efs_task_fn)(void *arg);
+
+/*
+** Set of tasks submitted to the shared pool that can be waited on as
+** a whole. The waiting thread runs queued tasks of its own group
+** instead of sleeping, so nested groups can not starve the pool.
+*/
+typedef struct efs_task_group {
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+	int pending;
+} efs_task_group;
+
+int efs_pool_size(void);
+int efs_pool_queued(void);
+int efs_pool_submit(efs_task_fn fn, void *arg);
+
+void efs_group_init(efs_task_group *group);
+int efs_group_submit(efs_task_group *group, efs_task_fn fn, void *arg);
+void efs_group_wait(efs_task_group *group);
+void efs_group_destroy(efs_task_group *group);
+
+#endif
+
+#endif /* ELI_EXTRA_FS_POOL_H__ */
@@ -0,0 +1,446 @@
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "lerror.h"
+#include "lresolve.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RESOLVE_CACHE_METATABLE "ELI_RESOLVE_CACHE"
+
+#ifdef _WIN32
+
+int eli_resolve_path(lua_State *L)
+{
+	errno = ENOSYS; /* = "Function not implemented" */
+	return push_result(L, -1, "resolve_path is not supported on Windows");
+}
+
+int resolve_create_meta(lua_State *L)
+{
+	return 0;
+}
+
+#else
+
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define RESOLVE_CACHE_BUCKETS 512
+#define RESOLVE_CACHE_MAX 4096
+#define RESOLVE_MAX_LINKS 40
+
+/*
+** Symlink targets keyed by absolute link path. An entry is only used
+** while the link still has the same device, inode and ctime, which
+** changes whenever the link is replaced or retargeted. Every component
+** is lstat'ed anyway, so validation costs nothing extra and readlink is
+** skipped for cached links.
+*/
+typedef struct efs_link_entry {
+	struct efs_link_entry *next;
+	dev_t dev;
+	ino_t ino;
+	struct timespec ctime;
+	char *target;
+	char path[];
+} efs_link_entry;
+
+typedef struct efs_resolve_cache {
+	efs_link_entry *buckets[RESOLVE_CACHE_BUCKETS];
+	size_t count;
+} efs_resolve_cache;
+
+typedef struct efs_resolve_buf {
+	char *data;
+	size_t len;
+	size_t cap;
+} efs_resolve_buf;
+
+static const char resolve_cache_key = 0;
+
+#ifdef __APPLE__
+#define ST_CTIM(st) ((st)->st_ctimespec)
+#else
+#define ST_CTIM(st) ((st)->st_ctim)
+#endif
+
+static size_t _link_bucket(const char *path)
+{
+	size_t h = 2166136261u;
+	for (; *path; path++) {
+		h = (h ^ (unsigned char)*path) * 16777619u;
+	}
+	return h % RESOLVE_CACHE_BUCKETS;
+}
+
+static void _cache_clear(efs_resolve_cache *cache)
+{
+	for (int i = 0; i < RESOLVE_CACHE_BUCKETS; i++) {
+		while (cache->buckets[i] != NULL) {
+			efs_link_entry *e = cache->buckets[i];
+			cache->buckets[i] = e->next;
+			free(e->target);
+			free(e);
+		}
+	}
+	cache->count = 0;
+}
+
+static const char *_cache_get(efs_resolve_cache *cache, const char *path,
+			      const struct stat *st)
+{
+	for (efs_link_entry *e = cache->buckets[_link_bucket(path)]; e != NULL;
+	     e = e->next) {
+		if (strcmp(e->path, path) == 0) {
+			if (e->dev == st->st_dev && e->ino == st->st_ino &&
+			    e->ctime.tv_sec == ST_CTIM(st).tv_sec &&
+			    e->ctime.tv_nsec == ST_CTIM(st).tv_nsec) {
+				return e->target;
+			}
+			return NULL;
+		}
+	}
+	return NULL;
+}
+
+static void _cache_put(efs_resolve_cache *cache, const char *path,
+		       const struct stat *st, const char *target)
+{
+	size_t b = _link_bucket(path);
+	efs_link_entry **slot = &cache->buckets[b];
+	for (; *slot != NULL; slot = &(*slot)->next) {
+		if (strcmp((*slot)->path, path) == 0) {
+			/* stale */
+			efs_link_entry *e = *slot;
+			*slot = e->next;
+			free(e->target);
+			free(e);
+			cache->count--;
+			break;
+		}
+	}
+	if (cache->count >= RESOLVE_CACHE_MAX) {
+		_cache_clear(cache);
+	}
+	size_t len = strlen(path);
+	efs_link_entry *e = malloc(sizeof(efs_link_entry) + len + 1);
+	if (e == NULL || (e->target = strdup(target)) == NULL) {
+		free(e);
+		return;
+	}
+	memcpy(e->path, path, len + 1);
+	e->dev = st->st_dev;
+	e->ino = st->st_ino;
+	e->ctime = ST_CTIM(st);
+	e->next = cache->buckets[b];
+	cache->buckets[b] = e;
+	cache->count++;
+}
+
+static int _buf_reserve(efs_resolve_buf *buf, size_t len)
+{
+	if (len + 1 <= buf->cap) {
+		return 0;
+	}
+	size_t cap = buf->cap ? buf->cap : 256;
+	while (cap < len + 1) {
+		cap *= 2;
+	}
+	char *data = realloc(buf->data, cap);
+	if (data == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	buf->data = data;
+	buf->cap = cap;
+	return 0;
+}
+
+/*
+** Reads link target into malloc'ed string. Buffer is sized from lstat,
+** links reporting no size (procfs) start at PATH_MAX.
+*/
+static char *_read_link(const char *path, const struct stat *st)
+{
+	size_t size = st->st_size > 0 ? (size_t)st->st_size + 1 : PATH_MAX;
+	for (;;) {
+		char *target = malloc(size);
+		if (target == NULL) {
+			errno = ENOMEM;
+			return NULL;
+		}
+		ssize_t len = readlink(path, target, size);
+		if (len == -1) {
+			free(target);
+			return NULL;
+		}
+		if ((size_t)len < size) {
+			target[len] = '\0';
+			return target;
+		}
+		/* link grew since lstat */
+		free(target);
+		size *= 2;
+	}
+}
+
+/*
+** Canonicalizes path into out like realpath(3). With strict unset,
+** missing trailing components are kept as they are (realpath -m).
+** Returns 0 or -1 with errno set.
+*/
+static int _resolve(efs_resolve_cache *cache, const char *path, int strict,
+		    efs_resolve_buf *out)
+{
+	efs_resolve_buf rest = { NULL, 0, 0 }; /* components to process */
+	size_t path_len = strlen(path);
+	if (path_len == 0) {
+		errno = ENOENT;
+		return -1;
+	}
+	out->len = 0;
+	if (path[0] != '/') {
+		char cwd[PATH_MAX];
+		if (getcwd(cwd, sizeof(cwd)) == NULL) {
+			return -1;
+		}
+		size_t cwd_len = strlen(cwd);
+		if (_buf_reserve(out, cwd_len) == -1) {
+			return -1;
+		}
+		memcpy(out->data, cwd, cwd_len);
+		out->len = cwd_len == 1 ? 0 : cwd_len;
+	}
+	if (_buf_reserve(&rest, path_len) == -1) {
+		return -1;
+	}
+	memcpy(rest.data, path, path_len + 1);
+	rest.len = path_len;
+
+	size_t pos = 0;
+	int links = 0, missing = 0, res = 0;
+	while (pos < rest.len) {
+		while (pos < rest.len && rest.data[pos] == '/') {
+			pos++;
+		}
+		size_t start = pos;
+		while (pos < rest.len && rest.data[pos] != '/') {
+			pos++;
+		}
+		size_t len = pos - start;
+		if (len == 0 || (len == 1 && rest.data[start] == '.')) {
+			continue;
+		}
+		if (len == 2 && rest.data[start] == '.' &&
+		    rest.data[start + 1] == '.') {
+			while (out->len > 0 && out->data[--out->len] != '/')
+				;
+			continue;
+		}
+		if (_buf_reserve(out, out->len + len + 1) == -1) {
+			res = -1;
+			break;
+		}
+		size_t parent_len = out->len;
+		out->data[out->len++] = '/';
+		memcpy(out->data + out->len, rest.data + start, len);
+		out->len += len;
+		out->data[out->len] = '\0';
+		if (missing) {
+			continue;
+		}
+
+		struct stat st;
+		if (lstat(out->data, &st) == -1) {
+			if (errno == ENOENT && !strict) {
+				missing = 1;
+				continue;
+			}
+			res = -1;
+			break;
+		}
+		if (S_ISLNK(st.st_mode)) {
+			if (++links > RESOLVE_MAX_LINKS) {
+				errno = ELOOP;
+				res = -1;
+				break;
+			}
+			const char *target = _cache_get(cache, out->data, &st);
+			char *read = NULL;
+			if (target == NULL) {
+				if ((read = _read_link(out->data, &st)) == NULL) {
+					res = -1;
+					break;
+				}
+				_cache_put(cache, out->data, &st, read);
+				target = read;
+			}
+			/* rest becomes target followed by what is left */
+			size_t target_len = strlen(target);
+			size_t tail = rest.len - pos;
+			efs_resolve_buf next = { NULL, 0, 0 };
+			if (_buf_reserve(&next, target_len + tail) == -1) {
+				free(read);
+				res = -1;
+				break;
+			}
+			memcpy(next.data, target, target_len);
+			memcpy(next.data + target_len, rest.data + pos, tail + 1);
+			next.len = target_len + tail;
+			free(read);
+			free(rest.data);
+			rest = next;
+			pos = 0;
+			out->len = next.data[0] == '/' ? 0 : parent_len;
+			continue;
+		}
+		if (!S_ISDIR(st.st_mode) && pos < rest.len) {
+			/* only separators may follow a non-directory */
+			size_t i = pos;
+			while (i < rest.len && rest.data[i] == '/') {
+				i++;
+			}
+			if (i < rest.len || strict) {
+				errno = ENOTDIR;
+				res = -1;
+				break;
+			}
+		}
+	}
+	free(rest.data);
+	if (res == 0 && out->len == 0) {
+		if (_buf_reserve(out, 1) == -1) {
+			return -1;
+		}
+		out->data[out->len++] = '/';
+	}
+	if (res == 0) {
+		out->data[out->len] = '\0';
+	}
+	return res;
+}
+
+static efs_resolve_cache *_get_cache(lua_State *L)
+{
+	if (lua_rawgetp(L, LUA_REGISTRYINDEX, &resolve_cache_key) ==
+	    LUA_TUSERDATA) {
+		efs_resolve_cache *cache = (efs_resolve_cache *)lua_touserdata(L, -1);
+		lua_pop(L, 1);
+		return cache;
+	}
+	lua_pop(L, 1);
+	efs_resolve_cache *cache = (efs_resolve_cache *)lua_newuserdata(
+		L, sizeof(efs_resolve_cache));
+	memset(cache, 0, sizeof(efs_resolve_cache));
+	luaL_getmetatable(L, RESOLVE_CACHE_METATABLE);
+	lua_setmetatable(L, -2);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, &resolve_cache_key);
+	return cache;
+}
+
+/*
+** Returns canonical absolute path with all symlinks, "." and ".."
+** resolved. Symlink targets are cached per Lua state and revalidated by
+** ctime on every use.
+** @param #1 Path or list of paths.
+** @param #2 Options table (optional):
+**   strict = true - fail on missing components, when false missing
+**                   trailing components are kept (like realpath -m),
+**   cache = true - use and update the symlink cache, false clears it.
+** For a list returns list of results with false for paths which could
+** not be resolved, followed by table of error messages by index.
+*/
+int eli_resolve_path(lua_State *L)
+{
+	int strict = 1, use_cache = 1;
+	if (lua_istable(L, 2)) {
+		lua_getfield(L, 2, "strict");
+		strict = lua_isnil(L, -1) || lua_toboolean(L, -1);
+		lua_getfield(L, 2, "cache");
+		use_cache = lua_isnil(L, -1) || lua_toboolean(L, -1);
+		lua_pop(L, 2);
+	}
+	efs_resolve_cache *cache = _get_cache(L);
+	efs_resolve_cache scratch;
+	if (!use_cache) {
+		_cache_clear(cache);
+		memset(&scratch, 0, sizeof(scratch));
+		cache = &scratch;
+	}
+	efs_resolve_buf out = { NULL, 0, 0 };
+	if (!lua_istable(L, 1)) {
+		const char *path = luaL_checkstring(L, 1);
+		int res = _resolve(cache, path, strict, &out);
+		int err = errno;
+		if (res == 0) {
+			lua_pushlstring(L, out.data, out.len);
+		}
+		free(out.data);
+		if (!use_cache) {
+			_cache_clear(&scratch);
+		}
+		if (res == -1) {
+			errno = err;
+			return push_error(L, path);
+		}
+		return 1;
+	}
+
+	lua_Integer n = luaL_len(L, 1);
+	lua_createtable(L, (int)n, 0);
+	int results = lua_gettop(L);
+	lua_newtable(L);
+	int errors = lua_gettop(L);
+	for (lua_Integer i = 1; i <= n; i++) {
+		lua_geti(L, 1, i);
+		const char *path = lua_tostring(L, -1);
+		int res = -1;
+		if (path == NULL) {
+			errno = EINVAL;
+		} else {
+			res = _resolve(cache, path, strict, &out);
+		}
+		if (res == 0) {
+			lua_pushlstring(L, out.data, out.len);
+		} else {
+			lua_pushfstring(L, "%s: %s", path ? path : "?",
+					strerror(errno));
+			lua_seti(L, errors, i);
+			lua_pushboolean(L, 0);
+		}
+		lua_seti(L, results, i);
+		lua_pop(L, 1);
+	}
+	free(out.data);
+	if (!use_cache) {
+		_cache_clear(&scratch);
+	}
+	return 2;
+}
+
+static int resolve_cache_gc(lua_State *L)
+{
+	efs_resolve_cache *cache = (efs_resolve_cache *)luaL_checkudata(
+		L, 1, RESOLVE_CACHE_METATABLE);
+	_cache_clear(cache);
+	return 0;
+}
+
+/*
+** Creates metatable of the per state symlink cache.
+*/
+int resolve_create_meta(lua_State *L)
+{
+	luaL_newmetatable(L, RESOLVE_CACHE_METATABLE);
+	lua_pushstring(L, RESOLVE_CACHE_METATABLE);
+	lua_setfield(L, -2, "__type");
+	lua_pushcfunction(L, resolve_cache_gc);
+	lua_setfield(L, -2, "__gc");
+	return 1;
+}
+
+#endif
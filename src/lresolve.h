@@ -0,0 +1,10 @@
+#ifndef ELI_EXTRA_FS_RESOLVE_H__
+#define ELI_EXTRA_FS_RESOLVE_H__
+
+#include "lua.h"
+
+int eli_resolve_path(lua_State *L);
+
+int resolve_create_meta(lua_State *L);
+
+#endif /* ELI_EXTRA_FS_RESOLVE_H__ */
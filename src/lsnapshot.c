@@ -0,0 +1,742 @@
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "lerror.h"
+#include "lsnapshot.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SNAPSHOT_METATABLE "ELI_SNAPSHOT"
+#define SNAPSHOT_MAGIC "EFSSNAP1"
+#define SNAPSHOT_MAGIC_LEN 8
+
+#ifdef _WIN32
+
+int eli_snapshot(lua_State *L)
+{
+	errno = ENOSYS; /* = "Function not implemented" */
+	return push_result(L, -1, "snapshot is not supported on Windows");
+}
+
+int eli_load_snapshot(lua_State *L)
+{
+	errno = ENOSYS; /* = "Function not implemented" */
+	return push_result(L, -1, "snapshot is not supported on Windows");
+}
+
+int eli_snapshot_diff(lua_State *L)
+{
+	errno = ENOSYS; /* = "Function not implemented" */
+	return push_result(L, -1, "snapshot is not supported on Windows");
+}
+
+int snapshot_create_meta(lua_State *L)
+{
+	return 0;
+}
+
+#else
+
+#include "lwalk.h"
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+/*
+** Snapshot layout:
+**   magic "EFSSNAP1", varint entry count, then entries sorted by path:
+**   varint shared prefix length (with previous path), varint suffix
+**   length, suffix bytes, varint ino, varint size, zigzag varint
+**   mtime in ns, varint st_mode.
+*/
+typedef struct efs_snapshot {
+	unsigned char *data;
+	size_t len;
+	uint64_t count;
+} efs_snapshot;
+
+typedef struct efs_snap_entry {
+	char *path;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime_ns;
+	uint64_t mode;
+} efs_snap_entry;
+
+typedef struct efs_bytes {
+	unsigned char *data;
+	size_t len;
+	size_t cap;
+} efs_bytes;
+
+static int _bytes_reserve(efs_bytes *b, size_t extra)
+{
+	if (b->len + extra <= b->cap) {
+		return 0;
+	}
+	size_t cap = b->cap ? b->cap : 4096;
+	while (cap < b->len + extra) {
+		cap *= 2;
+	}
+	unsigned char *data = realloc(b->data, cap);
+	if (data == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	b->data = data;
+	b->cap = cap;
+	return 0;
+}
+
+static int _put_varint(efs_bytes *b, uint64_t value)
+{
+	if (_bytes_reserve(b, 10) == -1) {
+		return -1;
+	}
+	while (value >= 0x80) {
+		b->data[b->len++] = (unsigned char)(value | 0x80);
+		value >>= 7;
+	}
+	b->data[b->len++] = (unsigned char)value;
+	return 0;
+}
+
+static int _put_bytes(efs_bytes *b, const void *data, size_t len)
+{
+	if (_bytes_reserve(b, len) == -1) {
+		return -1;
+	}
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+	return 0;
+}
+
+static int _get_varint(const unsigned char **p, const unsigned char *end,
+		       uint64_t *value)
+{
+	uint64_t result = 0;
+	for (int shift = 0; shift < 64 && *p < end; shift += 7) {
+		unsigned char byte = *(*p)++;
+		result |= (uint64_t)(byte & 0x7f) << shift;
+		if (!(byte & 0x80)) {
+			*value = result;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/*
+** Sequential reader over snapshot data. The current path is kept in a
+** growing buffer because every entry only stores what differs from the
+** previous one.
+*/
+typedef struct efs_snap_reader {
+	const unsigned char *p;
+	const unsigned char *end;
+	uint64_t remaining;
+	char *path;
+	size_t path_len;
+	size_t path_cap;
+	efs_snap_entry entry;
+} efs_snap_reader;
+
+static int _reader_init(efs_snap_reader *r, const unsigned char *data,
+			size_t len)
+{
+	memset(r, 0, sizeof(efs_snap_reader));
+	if (len < SNAPSHOT_MAGIC_LEN ||
+	    memcmp(data, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN) != 0) {
+		return -1;
+	}
+	r->p = data + SNAPSHOT_MAGIC_LEN;
+	r->end = data + len;
+	return _get_varint(&r->p, r->end, &r->remaining);
+}
+
+/* returns 1 if entry was read, 0 at the end, -1 on corrupted data */
+static int _reader_next(efs_snap_reader *r)
+{
+	if (r->remaining == 0) {
+		return 0;
+	}
+	uint64_t prefix, suffix, mtime;
+	if (_get_varint(&r->p, r->end, &prefix) == -1 ||
+	    _get_varint(&r->p, r->end, &suffix) == -1 ||
+	    prefix > r->path_len || suffix > (uint64_t)(r->end - r->p)) {
+		return -1;
+	}
+	if (prefix + suffix + 1 > r->path_cap) {
+		size_t cap = r->path_cap ? r->path_cap : 256;
+		while (cap < prefix + suffix + 1) {
+			cap *= 2;
+		}
+		char *path = realloc(r->path, cap);
+		if (path == NULL) {
+			return -1;
+		}
+		r->path = path;
+		r->path_cap = cap;
+	}
+	memcpy(r->path + prefix, r->p, suffix);
+	r->p += suffix;
+	r->path_len = prefix + suffix;
+	r->path[r->path_len] = '\0';
+	if (_get_varint(&r->p, r->end, &r->entry.ino) == -1 ||
+	    _get_varint(&r->p, r->end, &r->entry.size) == -1 ||
+	    _get_varint(&r->p, r->end, &mtime) == -1 ||
+	    _get_varint(&r->p, r->end, &r->entry.mode) == -1) {
+		return -1;
+	}
+	r->entry.mtime_ns = (int64_t)(mtime >> 1) ^ -(int64_t)(mtime & 1);
+	r->entry.path = r->path;
+	r->remaining--;
+	return 1;
+}
+
+static void _reader_free(efs_snap_reader *r)
+{
+	free(r->path);
+	r->path = NULL;
+}
+
+typedef struct efs_snap_builder {
+	efs_snap_entry *entries;
+	size_t count;
+	size_t cap;
+	int failed;
+	int unreadable; /* errno of the first directory that failed */
+	char *unreadable_path;
+} efs_snap_builder;
+
+static int _collect_entry(efs_walk_entry *entry, void *ud)
+{
+	efs_snap_builder *builder = (efs_snap_builder *)ud;
+	if (builder->count == builder->cap) {
+		size_t cap = builder->cap ? builder->cap * 2 : 1024;
+		efs_snap_entry *entries =
+			realloc(builder->entries, cap * sizeof(efs_snap_entry));
+		if (entries == NULL) {
+			builder->failed = ENOMEM;
+			return EFS_WALK_STOP;
+		}
+		builder->entries = entries;
+		builder->cap = cap;
+	}
+	const struct stat *st = entry->st;
+	efs_snap_entry *e = &builder->entries[builder->count];
+	e->path = strdup(entry->path + entry->rel_offset);
+	if (e->path == NULL) {
+		builder->failed = ENOMEM;
+		return EFS_WALK_STOP;
+	}
+	e->ino = (uint64_t)st->st_ino;
+	e->size = (uint64_t)st->st_size;
+#ifdef __APPLE__
+	e->mtime_ns = (int64_t)st->st_mtimespec.tv_sec * 1000000000 +
+		      st->st_mtimespec.tv_nsec;
+#else
+	e->mtime_ns = (int64_t)st->st_mtim.tv_sec * 1000000000 +
+		      st->st_mtim.tv_nsec;
+#endif
+	e->mode = (uint64_t)st->st_mode;
+	builder->count++;
+	return EFS_WALK_CONTINUE;
+}
+
+static int _collect_leave(efs_walk_entry *entry, void *ud)
+{
+	efs_snap_builder *builder = (efs_snap_builder *)ud;
+	if (entry->error == 0) {
+		return EFS_WALK_CONTINUE;
+	}
+	/* diff would report everything below it as removed */
+	builder->unreadable = entry->error;
+	builder->unreadable_path = strdup(entry->path);
+	return EFS_WALK_STOP;
+}
+
+static int _compare_entries(const void *a, const void *b)
+{
+	return strcmp(((const efs_snap_entry *)a)->path,
+		      ((const efs_snap_entry *)b)->path);
+}
+
+static int _encode(efs_snap_builder *builder, efs_bytes *out)
+{
+	if (_put_bytes(out, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN) == -1 ||
+	    _put_varint(out, builder->count) == -1) {
+		return -1;
+	}
+	const char *prev = "";
+	for (size_t i = 0; i < builder->count; i++) {
+		efs_snap_entry *e = &builder->entries[i];
+		size_t prefix = 0;
+		while (prev[prefix] != '\0' && prev[prefix] == e->path[prefix]) {
+			prefix++;
+		}
+		size_t suffix = strlen(e->path + prefix);
+		uint64_t mtime = ((uint64_t)e->mtime_ns << 1) ^
+				 (uint64_t)(e->mtime_ns >> 63);
+		if (_put_varint(out, prefix) == -1 ||
+		    _put_varint(out, suffix) == -1 ||
+		    _put_bytes(out, e->path + prefix, suffix) == -1 ||
+		    _put_varint(out, e->ino) == -1 ||
+		    _put_varint(out, e->size) == -1 ||
+		    _put_varint(out, mtime) == -1 ||
+		    _put_varint(out, e->mode) == -1) {
+			return -1;
+		}
+		prev = e->path;
+	}
+	return 0;
+}
+
+static efs_snapshot *_new_snapshot(lua_State *L)
+{
+	efs_snapshot *snap =
+		(efs_snapshot *)lua_newuserdata(L, sizeof(efs_snapshot));
+	snap->data = NULL;
+	snap->len = 0;
+	snap->count = 0;
+	luaL_getmetatable(L, SNAPSHOT_METATABLE);
+	lua_setmetatable(L, -2);
+	return snap;
+}
+
+/*
+** Captures (path, ino, size, mtime_ns, mode) of every entry below path.
+** Fails if a directory below path can not be read.
+** @param #1 Directory path.
+** @param #2 Options table { one_file_system = false } (optional).
+*/
+int eli_snapshot(lua_State *L)
+{
+	const char *path = luaL_checkstring(L, 1);
+	int flags = 0;
+	if (lua_istable(L, 2)) {
+		lua_getfield(L, 2, "one_file_system");
+		if (lua_toboolean(L, -1)) {
+			flags |= EFS_WALK_XDEV;
+		}
+		lua_pop(L, 1);
+	}
+
+	efs_snapshot *snap = _new_snapshot(L);
+	efs_snap_builder builder = { NULL, 0, 0, 0, 0, NULL };
+	efs_walker walker = { _collect_entry, _collect_leave, &builder, flags,
+			      0, 0 };
+	int res = efs_walk(&walker, path);
+	if (res == 0 && builder.failed) {
+		errno = builder.failed;
+		res = -1;
+	} else if (res == 0 && walker.errors > 0) {
+		errno = builder.unreadable ? builder.unreadable : EIO;
+		if (builder.unreadable_path != NULL) {
+			path = lua_pushstring(L, builder.unreadable_path);
+		}
+		res = -1;
+	}
+	free(builder.unreadable_path);
+	efs_bytes out = { NULL, 0, 0 };
+	if (res == 0) {
+		qsort(builder.entries, builder.count, sizeof(efs_snap_entry),
+		      _compare_entries);
+		res = _encode(&builder, &out);
+	}
+	int err = errno;
+	for (size_t i = 0; i < builder.count; i++) {
+		free(builder.entries[i].path);
+	}
+	free(builder.entries);
+	if (res == -1) {
+		free(out.data);
+		errno = err;
+		return push_error(L, path);
+	}
+	snap->data = out.data;
+	snap->len = out.len;
+	snap->count = builder.count;
+	return 1;
+}
+
+static int _load_data(efs_snapshot *snap, const unsigned char *data, size_t len)
+{
+	efs_snap_reader r;
+	if (_reader_init(&r, data, len) == -1) {
+		errno = EINVAL;
+		return -1;
+	}
+	snap->data = malloc(len);
+	if (snap->data == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	memcpy(snap->data, data, len);
+	snap->len = len;
+	snap->count = r.remaining;
+	return 0;
+}
+
+/*
+** Loads snapshot saved by snapshot:save().
+** @param #1 File path.
+*/
+int eli_load_snapshot(lua_State *L)
+{
+	const char *path = luaL_checkstring(L, 1);
+	FILE *f = fopen(path, "rb");
+	if (f == NULL) {
+		return push_error(L, path);
+	}
+	efs_bytes buf = { NULL, 0, 0 };
+	for (;;) {
+		if (_bytes_reserve(&buf, 64 * 1024) == -1) {
+			break;
+		}
+		size_t n = fread(buf.data + buf.len, 1, buf.cap - buf.len, f);
+		buf.len += n;
+		if (n == 0) {
+			break;
+		}
+	}
+	int failed = ferror(f) || buf.data == NULL;
+	fclose(f);
+	efs_snapshot *snap = _new_snapshot(L);
+	if (failed || _load_data(snap, buf.data, buf.len) == -1) {
+		if (!failed) {
+			errno = EINVAL;
+		}
+		free(buf.data);
+		return push_error(L, path);
+	}
+	free(buf.data);
+	return 1;
+}
+
+static efs_snapshot *_check_snapshot(lua_State *L, int idx)
+{
+	efs_snapshot *snap =
+		(efs_snapshot *)luaL_checkudata(L, idx, SNAPSHOT_METATABLE);
+	luaL_argcheck(L, snap->data != NULL, idx,
+		      "released " SNAPSHOT_METATABLE);
+	return snap;
+}
+
+/*
+** Takes snapshot userdata or its serialized form (snapshot:data()).
+*/
+static void _snapshot_arg(lua_State *L, int idx, const unsigned char **data,
+			  size_t *len)
+{
+	if (lua_type(L, idx) == LUA_TSTRING) {
+		*data = (const unsigned char *)lua_tolstring(L, idx, len);
+		return;
+	}
+	efs_snapshot *snap = _check_snapshot(L, idx);
+	*data = snap->data;
+	*len = snap->len;
+}
+
+typedef struct efs_diff_item {
+	char *path;
+	efs_snap_entry entry;
+	int matched;
+} efs_diff_item;
+
+typedef struct efs_diff_list {
+	efs_diff_item *items;
+	size_t count;
+	size_t cap;
+} efs_diff_list;
+
+static int _list_push(efs_diff_list *list, efs_snap_reader *r)
+{
+	if (list->count == list->cap) {
+		size_t cap = list->cap ? list->cap * 2 : 64;
+		efs_diff_item *items =
+			realloc(list->items, cap * sizeof(efs_diff_item));
+		if (items == NULL) {
+			return -1;
+		}
+		list->items = items;
+		list->cap = cap;
+	}
+	efs_diff_item *item = &list->items[list->count];
+	if ((item->path = strdup(r->path)) == NULL) {
+		return -1;
+	}
+	item->entry = r->entry;
+	item->entry.path = item->path;
+	item->matched = 0;
+	list->count++;
+	return 0;
+}
+
+static void _list_free(efs_diff_list *list)
+{
+	for (size_t i = 0; i < list->count; i++) {
+		free(list->items[i].path);
+	}
+	free(list->items);
+}
+
+static void _push_list(lua_State *L, efs_diff_list *list, const char *name)
+{
+	lua_newtable(L);
+	int n = 0;
+	for (size_t i = 0; i < list->count; i++) {
+		if (!list->items[i].matched) {
+			lua_pushstring(L, list->items[i].path);
+			lua_rawseti(L, -2, ++n);
+		}
+	}
+	lua_setfield(L, -2, name);
+}
+
+/*
+** Pairs removed and added entries sharing an inode into renames.
+** Inodes get reused, so size, mtime and mode have to match as well;
+** rename keeps all of them. Open addressing over removed inodes.
+*/
+static int _match_renames(lua_State *L, efs_diff_list *removed,
+			  efs_diff_list *added)
+{
+	lua_newtable(L);
+	if (removed->count == 0 || added->count == 0) {
+		return 0;
+	}
+	size_t cap = 16;
+	while (cap < removed->count * 2) {
+		cap *= 2;
+	}
+	size_t *slots = malloc(cap * sizeof(size_t));
+	if (slots == NULL) {
+		return -1;
+	}
+	for (size_t i = 0; i < cap; i++) {
+		slots[i] = SIZE_MAX;
+	}
+	for (size_t i = 0; i < removed->count; i++) {
+		size_t h = (size_t)(removed->items[i].entry.ino *
+				    0x9E3779B97F4A7C15ull) &
+			   (cap - 1);
+		while (slots[h] != SIZE_MAX) {
+			h = (h + 1) & (cap - 1);
+		}
+		slots[h] = i;
+	}
+	int n = 0;
+	for (size_t i = 0; i < added->count; i++) {
+		efs_snap_entry *to = &added->items[i].entry;
+		size_t h = (size_t)(to->ino * 0x9E3779B97F4A7C15ull) & (cap - 1);
+		while (slots[h] != SIZE_MAX) {
+			efs_diff_item *from = &removed->items[slots[h]];
+			if (!from->matched && from->entry.ino == to->ino &&
+			    from->entry.size == to->size &&
+			    from->entry.mtime_ns == to->mtime_ns &&
+			    from->entry.mode == to->mode) {
+				from->matched = 1;
+				added->items[i].matched = 1;
+				lua_createtable(L, 0, 2);
+				lua_pushstring(L, from->path);
+				lua_setfield(L, -2, "from");
+				lua_pushstring(L, added->items[i].path);
+				lua_setfield(L, -2, "to");
+				lua_rawseti(L, -2, ++n);
+				break;
+			}
+			h = (h + 1) & (cap - 1);
+		}
+	}
+	free(slots);
+	return 0;
+}
+
+/*
+** Compares two snapshots of the same tree.
+** Returns table { added, removed, modified, renamed }; renamed holds
+** { from, to } pairs matched by inode.
+*/
+int eli_snapshot_diff(lua_State *L)
+{
+	const unsigned char *a_data, *b_data;
+	size_t a_len, b_len;
+	_snapshot_arg(L, 1, &a_data, &a_len);
+	_snapshot_arg(L, 2, &b_data, &b_len);
+
+	efs_snap_reader a, b;
+	if (_reader_init(&a, a_data, a_len) == -1 ||
+	    _reader_init(&b, b_data, b_len) == -1) {
+		return luaL_error(L, "diff: invalid snapshot data");
+	}
+	efs_diff_list added = { NULL, 0, 0 };
+	efs_diff_list removed = { NULL, 0, 0 };
+	lua_newtable(L); /* result */
+	lua_newtable(L); /* modified */
+	int modified = 0;
+	int failed = 0;
+	int ha = _reader_next(&a);
+	int hb = _reader_next(&b);
+	while (ha == 1 || hb == 1) {
+		int cmp = ha != 1 ? 1 : hb != 1 ? -1 : strcmp(a.path, b.path);
+		if (cmp < 0) {
+			failed = _list_push(&removed, &a);
+			ha = _reader_next(&a);
+		} else if (cmp > 0) {
+			failed = _list_push(&added, &b);
+			hb = _reader_next(&b);
+		} else {
+			if (a.entry.ino != b.entry.ino ||
+			    a.entry.size != b.entry.size ||
+			    a.entry.mtime_ns != b.entry.mtime_ns ||
+			    a.entry.mode != b.entry.mode) {
+				lua_pushstring(L, b.path);
+				lua_rawseti(L, -2, ++modified);
+			}
+			ha = _reader_next(&a);
+			hb = _reader_next(&b);
+		}
+		if (failed) {
+			break;
+		}
+	}
+	_reader_free(&a);
+	_reader_free(&b);
+	if (ha == -1 || hb == -1 || failed) {
+		_list_free(&added);
+		_list_free(&removed);
+		return luaL_error(L, failed ? "diff: out of memory" :
+					      "diff: corrupted snapshot data");
+	}
+	lua_setfield(L, -2, "modified");
+	failed = _match_renames(L, &removed, &added);
+	lua_setfield(L, -2, "renamed");
+	_push_list(L, &added, "added");
+	_push_list(L, &removed, "removed");
+	_list_free(&added);
+	_list_free(&removed);
+	if (failed) {
+		return luaL_error(L, "diff: out of memory");
+	}
+	return 1;
+}
+
+/*
+** Writes snapshot to file, replacing it atomically.
+*/
+static int snapshot_save(lua_State *L)
+{
+	efs_snapshot *snap = _check_snapshot(L, 1);
+	const char *path = luaL_checkstring(L, 2);
+	lua_pushfstring(L, "%s.tmp", path);
+	const char *tmp = lua_tostring(L, -1);
+	FILE *f = fopen(tmp, "wb");
+	if (f == NULL) {
+		return push_error(L, tmp);
+	}
+	int failed = fwrite(snap->data, 1, snap->len, f) != snap->len;
+	failed |= fflush(f) != 0 || fsync(fileno(f)) != 0;
+	int err = errno;
+	failed |= fclose(f) != 0;
+	if (failed || rename(tmp, path) != 0) {
+		err = failed ? err : errno;
+		unlink(tmp);
+		errno = err;
+		return push_error(L, path);
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int snapshot_data(lua_State *L)
+{
+	efs_snapshot *snap = _check_snapshot(L, 1);
+	lua_pushlstring(L, (const char *)snap->data, snap->len);
+	return 1;
+}
+
+static int snapshot_count(lua_State *L)
+{
+	efs_snapshot *snap = _check_snapshot(L, 1);
+	lua_pushinteger(L, (lua_Integer)snap->count);
+	return 1;
+}
+
+/*
+** Decodes snapshot into array of { path, ino, size, mtime_ns, mode }.
+*/
+static int snapshot_entries(lua_State *L)
+{
+	efs_snapshot *snap = _check_snapshot(L, 1);
+	efs_snap_reader r;
+	if (_reader_init(&r, snap->data, snap->len) == -1) {
+		return luaL_error(L, "entries: invalid snapshot data");
+	}
+	lua_createtable(L, (int)r.remaining, 0);
+	int res, i = 0;
+	while ((res = _reader_next(&r)) == 1) {
+		lua_createtable(L, 0, 5);
+		lua_pushstring(L, r.path);
+		lua_setfield(L, -2, "path");
+		lua_pushinteger(L, (lua_Integer)r.entry.ino);
+		lua_setfield(L, -2, "ino");
+		lua_pushinteger(L, (lua_Integer)r.entry.size);
+		lua_setfield(L, -2, "size");
+		lua_pushinteger(L, (lua_Integer)r.entry.mtime_ns);
+		lua_setfield(L, -2, "mtime_ns");
+		lua_pushinteger(L, (lua_Integer)r.entry.mode);
+		lua_setfield(L, -2, "mode");
+		lua_rawseti(L, -2, ++i);
+	}
+	_reader_free(&r);
+	if (res == -1) {
+		return luaL_error(L, "entries: corrupted snapshot data");
+	}
+	return 1;
+}
+
+static int snapshot_release(lua_State *L)
+{
+	efs_snapshot *snap =
+		(efs_snapshot *)luaL_checkudata(L, 1, SNAPSHOT_METATABLE);
+	free(snap->data);
+	snap->data = NULL;
+	snap->len = 0;
+	return 0;
+}
+
+/*
+** Creates snapshot metatable.
+*/
+int snapshot_create_meta(lua_State *L)
+{
+	luaL_newmetatable(L, SNAPSHOT_METATABLE);
+	/* Method table */
+	lua_newtable(L);
+	lua_pushcfunction(L, snapshot_save);
+	lua_setfield(L, -2, "save");
+	lua_pushcfunction(L, snapshot_data);
+	lua_setfield(L, -2, "data");
+	lua_pushcfunction(L, snapshot_count);
+	lua_setfield(L, -2, "count");
+	lua_pushcfunction(L, snapshot_entries);
+	lua_setfield(L, -2, "entries");
+	lua_pushcfunction(L, eli_snapshot_diff);
+	lua_setfield(L, -2, "diff");
+	/* type */
+	lua_pushstring(L, SNAPSHOT_METATABLE);
+	lua_setfield(L, -2, "__type");
+
+	/* Metamethods */
+	lua_setfield(L, -2, "__index");
+	lua_pushcfunction(L, snapshot_release);
+	lua_setfield(L, -2, "__gc");
+	return 1;
+}
+
+#endif
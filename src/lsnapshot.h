@@ -0,0 +1,12 @@
+#ifndef ELI_EXTRA_FS_SNAPSHOT_H__
+#define ELI_EXTRA_FS_SNAPSHOT_H__
+
+#include "lua.h"
+
+int eli_snapshot(lua_State *L);
+int eli_load_snapshot(lua_State *L);
+int eli_snapshot_diff(lua_State *L);
+
+int snapshot_create_meta(lua_State *L);
+
+#endif /* ELI_EXTRA_FS_SNAPSHOT_H__ */
\ No newline at end of file
@@ -0,0 +1,482 @@
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "lerror.h"
+#include "lstats.h"
+
+#include <errno.h>
+#include <string.h>
+
+#ifndef ELI_FS_EXTRA_NO_STATS
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+/*
+** Counters of one registered function. Kept per Lua state (a state is
+** only ever used by one thread at a time), so updates need no atomics;
+** stats() merges nothing but reads this state's counters.
+*/
+typedef struct efs_op_stat {
+	const char *name;
+	unsigned long long calls;
+	unsigned long long errors;
+	unsigned long long total_ns;
+	unsigned long long max_ns;
+	unsigned long long alloc_bytes; /* Lua heap growth during calls */
+} efs_op_stat;
+
+typedef struct efs_stats {
+	int count;
+	efs_op_stat ops[];
+} efs_stats;
+
+static const char stats_key = 0;
+
+static unsigned long long _now_ns(void)
+{
+#ifdef _WIN32
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+	if (freq.QuadPart == 0) {
+		QueryPerformanceFrequency(&freq);
+	}
+	QueryPerformanceCounter(&now);
+	return (unsigned long long)(now.QuadPart / freq.QuadPart * 1000000000 +
+				    now.QuadPart % freq.QuadPart * 1000000000 /
+					    freq.QuadPart);
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL +
+	       (unsigned long long)ts.tv_nsec;
+#endif
+}
+
+#ifndef _WIN32
+
+/*
+** Calls slower than the threshold are recorded in a process wide ring
+** shared by all states and threads. Writers claim a slot with one
+** atomic increment and publish it with a per slot sequence (odd while
+** being written), readers copy a slot and keep it only if the sequence
+** did not change meanwhile. Old entries are overwritten when nobody
+** drains. With the threshold at 0 (default) only the comparison is
+** paid.
+*/
+#define SLOW_OPS_SIZE 256
+#define SLOW_OP_PATH_MAX 120
+
+typedef struct efs_slow_op {
+	unsigned long long seq; /* 2n+1 while written, 2n+2 once published */
+	const char *name;
+	unsigned long long duration_ns;
+	double time; /* seconds since epoch */
+	int err;
+	char path[SLOW_OP_PATH_MAX];
+} efs_slow_op;
+
+static efs_slow_op slow_ops[SLOW_OPS_SIZE];
+static unsigned long long slow_head; /* next sequence to write */
+static unsigned long long slow_tail; /* next sequence to drain */
+static unsigned long long slow_threshold_ns;
+
+/*
+** File the slow calls are appended to. Writers hold a reference for
+** the duration of their write, so reconfiguring never closes an fd
+** that is still being written to (and possibly reused by then).
+*/
+typedef struct efs_slow_sink {
+	int fd;
+	int refs; /* one for being configured plus one per writer */
+} efs_slow_sink;
+
+static efs_slow_sink *slow_sink;
+static pthread_mutex_t slow_sink_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static efs_slow_sink *_sink_acquire(void)
+{
+	pthread_mutex_lock(&slow_sink_lock);
+	efs_slow_sink *sink = slow_sink;
+	if (sink != NULL) {
+		__atomic_add_fetch(&sink->refs, 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&slow_sink_lock);
+	return sink;
+}
+
+static void _sink_release(efs_slow_sink *sink)
+{
+	if (__atomic_sub_fetch(&sink->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		close(sink->fd);
+		free(sink);
+	}
+}
+
+static void _slow_sink(const efs_slow_op *op)
+{
+	char line[SLOW_OP_PATH_MAX * 6 + 160];
+	char path[SLOW_OP_PATH_MAX * 6];
+	size_t len = 0;
+	for (const char *p = op->path; *p && len + 7 < sizeof(path); p++) {
+		unsigned char c = (unsigned char)*p;
+		if (c == '"' || c == '\\') {
+			path[len++] = '\\';
+			path[len++] = (char)c;
+		} else if (c < 0x20) {
+			len += (size_t)snprintf(path + len, sizeof(path) - len,
+						"\\u%04x", c);
+		} else {
+			path[len++] = (char)c;
+		}
+	}
+	path[len] = '\0';
+	int n = snprintf(line, sizeof(line),
+			 "{\"op\":\"%s\",\"path\":\"%s\",\"duration_ms\":%.3f,"
+			 "\"errno\":%d,\"time\":%.6f}\n",
+			 op->name, path, (double)op->duration_ns / 1e6, op->err,
+			 op->time);
+	efs_slow_sink *sink = n > 0 ? _sink_acquire() : NULL;
+	if (sink != NULL) {
+		/* single O_APPEND write keeps lines of concurrent writers whole */
+		ssize_t res = write(sink->fd, line, (size_t)n < sizeof(line) ?
+							      (size_t)n :
+							      sizeof(line) - 1);
+		(void)res;
+		_sink_release(sink);
+	}
+}
+
+static void _record_slow(const char *name, const char *path,
+			 unsigned long long duration_ns, int err)
+{
+	efs_slow_op rec;
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	rec.name = name;
+	rec.duration_ns = duration_ns;
+	rec.time = (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+	rec.err = err;
+	size_t len = path ? strlen(path) : 0;
+	if (len >= SLOW_OP_PATH_MAX) {
+		/* keep the end, it tells more than the mount point */
+		path += len - (SLOW_OP_PATH_MAX - 1);
+		len = SLOW_OP_PATH_MAX - 1;
+	}
+	memcpy(rec.path, path ? path : "", len);
+	rec.path[len] = '\0';
+
+	unsigned long long n =
+		__atomic_fetch_add(&slow_head, 1, __ATOMIC_RELAXED);
+	efs_slow_op *op = &slow_ops[n % SLOW_OPS_SIZE];
+	__atomic_store_n(&op->seq, 2 * n + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	rec.seq = 2 * n + 1;
+	memcpy(op, &rec, sizeof(efs_slow_op));
+	__atomic_store_n(&op->seq, 2 * n + 2, __ATOMIC_RELEASE);
+	if (__atomic_load_n(&slow_sink, __ATOMIC_RELAXED) != NULL) {
+		_slow_sink(&rec);
+	}
+}
+
+#endif
+
+static size_t _heap_bytes(lua_State *L)
+{
+	return (size_t)lua_gc(L, LUA_GCCOUNT, 0) * 1024 +
+	       (size_t)lua_gc(L, LUA_GCCOUNTB, 0);
+}
+
+/*
+** Calls the wrapped function and records it. Failures are calls
+** returning nil followed by a message (see push_error); raised Lua
+** errors are counted as calls only.
+*/
+static int _instrumented(lua_State *L)
+{
+	efs_op_stat *op = (efs_op_stat *)lua_touserdata(L, lua_upvalueindex(1));
+	lua_CFunction fn = lua_tocfunction(L, lua_upvalueindex(2));
+	op->calls++;
+	size_t heap = _heap_bytes(L);
+	unsigned long long started = _now_ns();
+	int n = fn(L);
+	unsigned long long elapsed = _now_ns() - started;
+	size_t heap_after = _heap_bytes(L);
+	op->total_ns += elapsed;
+	if (elapsed > op->max_ns) {
+		op->max_ns = elapsed;
+	}
+	if (heap_after > heap) {
+		op->alloc_bytes += heap_after - heap;
+	}
+	int failed = n >= 2 && lua_isnil(L, -n) &&
+		     lua_type(L, -n + 1) == LUA_TSTRING;
+	if (failed) {
+		op->errors++;
+	}
+#ifndef _WIN32
+	unsigned long long threshold =
+		__atomic_load_n(&slow_threshold_ns, __ATOMIC_RELAXED);
+	if (threshold > 0 && elapsed >= threshold) {
+		/* first argument, if the function left it in place */
+		const char *path = lua_gettop(L) > n &&
+						   lua_type(L, 1) == LUA_TSTRING ?
+					   lua_tostring(L, 1) :
+					   NULL;
+		int err = failed && n >= 3 ? (int)lua_tointeger(L, -n + 2) : 0;
+		_record_slow(op->name, path, elapsed, err);
+	}
+#endif
+	return n;
+}
+
+static efs_stats *_get_stats(lua_State *L)
+{
+	lua_rawgetp(L, LUA_REGISTRYINDEX, &stats_key);
+	efs_stats *stats = (efs_stats *)lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	return stats;
+}
+
+/*
+** Sets funcs into table on top of the stack, each wrapped by the
+** instrumentation. Counters live in a userdata anchored in the
+** registry, wrappers point straight at their slot. Opening the module
+** again reuses the counters, so wrappers handed out before stay valid
+** and keep counting into the same stats.
+*/
+void stats_setfuncs(lua_State *L, const luaL_Reg *funcs)
+{
+	int count = 0;
+	while (funcs[count].name != NULL) {
+		count++;
+	}
+	efs_stats *stats = _get_stats(L);
+	if (stats == NULL || stats->count != count) {
+		lua_rawgetp(L, LUA_REGISTRYINDEX, &stats_key);
+		stats = (efs_stats *)lua_newuserdatauv(
+			L,
+			sizeof(efs_stats) + (size_t)count * sizeof(efs_op_stat),
+			1);
+		memset(stats, 0,
+		       sizeof(efs_stats) +
+			       (size_t)count * sizeof(efs_op_stat));
+		stats->count = count;
+		/* keeps earlier counters alive for their wrappers */
+		lua_insert(L, -2);
+		lua_setiuservalue(L, -2, 1);
+		lua_rawsetp(L, LUA_REGISTRYINDEX, &stats_key);
+	}
+	for (int i = 0; i < count; i++) {
+		stats->ops[i].name = funcs[i].name;
+		lua_pushlightuserdata(L, &stats->ops[i]);
+		lua_pushcfunction(L, funcs[i].func);
+		lua_pushcclosure(L, _instrumented, 2);
+		lua_setfield(L, -2, funcs[i].name);
+	}
+}
+
+/*
+** Returns table of called functions by name:
+** { calls, errors, total_ms, max_ms, alloc_bytes }.
+*/
+int eli_stats(lua_State *L)
+{
+	efs_stats *stats = _get_stats(L);
+	lua_newtable(L);
+	for (int i = 0; stats != NULL && i < stats->count; i++) {
+		efs_op_stat *op = &stats->ops[i];
+		if (op->calls == 0) {
+			continue;
+		}
+		lua_createtable(L, 0, 5);
+		lua_pushinteger(L, (lua_Integer)op->calls);
+		lua_setfield(L, -2, "calls");
+		lua_pushinteger(L, (lua_Integer)op->errors);
+		lua_setfield(L, -2, "errors");
+		lua_pushnumber(L, (lua_Number)op->total_ns / 1e6);
+		lua_setfield(L, -2, "total_ms");
+		lua_pushnumber(L, (lua_Number)op->max_ns / 1e6);
+		lua_setfield(L, -2, "max_ms");
+		lua_pushinteger(L, (lua_Integer)op->alloc_bytes);
+		lua_setfield(L, -2, "alloc_bytes");
+		lua_setfield(L, -2, op->name);
+	}
+	return 1;
+}
+
+int eli_reset_stats(lua_State *L)
+{
+	efs_stats *stats = _get_stats(L);
+	for (int i = 0; stats != NULL && i < stats->count; i++) {
+		const char *name = stats->ops[i].name;
+		memset(&stats->ops[i], 0, sizeof(efs_op_stat));
+		stats->ops[i].name = name;
+	}
+	return 0;
+}
+
+#ifndef _WIN32
+
+/*
+** Configures slow operation tracing.
+** @param #1 Options table:
+**   threshold_ms - record calls taking at least this long, 0 disables,
+**   sink - path of file to append JSON lines to, false closes it.
+*/
+int eli_trace_slow_ops(lua_State *L)
+{
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_getfield(L, 1, "threshold_ms");
+	if (!lua_isnil(L, -1)) {
+		lua_Number ms = luaL_checknumber(L, -1);
+		luaL_argcheck(L, ms >= 0, 1, "threshold_ms must not be negative");
+		__atomic_store_n(&slow_threshold_ns,
+				 (unsigned long long)(ms * 1e6), __ATOMIC_RELAXED);
+	}
+	lua_getfield(L, 1, "sink");
+	if (!lua_isnil(L, -1)) {
+		efs_slow_sink *sink = NULL;
+		if (lua_toboolean(L, -1)) {
+			const char *path = luaL_checkstring(L, -1);
+			int fd = open(path,
+				      O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+				      0644);
+			if (fd == -1) {
+				return push_error(L, path);
+			}
+			if ((sink = malloc(sizeof(efs_slow_sink))) == NULL) {
+				close(fd);
+				errno = ENOMEM;
+				return push_error(L, path);
+			}
+			sink->fd = fd;
+			sink->refs = 1;
+		}
+		pthread_mutex_lock(&slow_sink_lock);
+		efs_slow_sink *old = slow_sink;
+		__atomic_store_n(&slow_sink, sink, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&slow_sink_lock);
+		if (old != NULL) {
+			/* closed once the last writer is done with it */
+			_sink_release(old);
+		}
+	}
+	lua_pop(L, 2);
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+** Returns recorded slow operations not drained yet as list of
+** { op, path, duration_ms, errno, time } followed by the number of
+** entries lost to overwriting.
+*/
+int eli_drain_slow_ops(lua_State *L)
+{
+	efs_slow_op copies[SLOW_OPS_SIZE];
+	int count;
+	unsigned long long lost;
+	for (;;) {
+		unsigned long long tail =
+			__atomic_load_n(&slow_tail, __ATOMIC_ACQUIRE);
+		unsigned long long head =
+			__atomic_load_n(&slow_head, __ATOMIC_ACQUIRE);
+		unsigned long long from = tail;
+		if (head - from > SLOW_OPS_SIZE) {
+			from = head - SLOW_OPS_SIZE;
+		}
+		lost = from - tail;
+		count = 0;
+		unsigned long long i = from;
+		for (; i < head; i++) {
+			efs_slow_op *op = &slow_ops[i % SLOW_OPS_SIZE];
+			unsigned long long seq =
+				__atomic_load_n(&op->seq, __ATOMIC_ACQUIRE);
+			if (seq == 2 * i + 1 || seq < 2 * i + 1) {
+				break; /* still being written, next drain gets it */
+			}
+			memcpy(&copies[count], op, sizeof(efs_slow_op));
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (seq != 2 * i + 2 ||
+			    __atomic_load_n(&op->seq, __ATOMIC_RELAXED) != seq) {
+				lost++; /* overwritten while copying */
+				continue;
+			}
+			count++;
+		}
+		if (__atomic_compare_exchange_n(&slow_tail, &tail, i, 0,
+						__ATOMIC_ACQ_REL,
+						__ATOMIC_ACQUIRE)) {
+			break;
+		}
+	}
+	lua_createtable(L, count, 0);
+	for (int i = 0; i < count; i++) {
+		lua_createtable(L, 0, 5);
+		lua_pushstring(L, copies[i].name);
+		lua_setfield(L, -2, "op");
+		copies[i].path[SLOW_OP_PATH_MAX - 1] = '\0';
+		lua_pushstring(L, copies[i].path);
+		lua_setfield(L, -2, "path");
+		lua_pushnumber(L, (lua_Number)copies[i].duration_ns / 1e6);
+		lua_setfield(L, -2, "duration_ms");
+		lua_pushinteger(L, copies[i].err);
+		lua_setfield(L, -2, "errno");
+		lua_pushnumber(L, copies[i].time);
+		lua_setfield(L, -2, "time");
+		lua_rawseti(L, -2, i + 1);
+	}
+	lua_pushinteger(L, (lua_Integer)lost);
+	return 2;
+}
+
+#endif
+
+#endif
+
+#if defined(ELI_FS_EXTRA_NO_STATS) || defined(_WIN32)
+
+int eli_trace_slow_ops(lua_State *L)
+{
+	errno = ENOSYS; /* = "Function not implemented" */
+	return push_result(L, -1, "trace_slow_ops is not supported in this build");
+}
+
+int eli_drain_slow_ops(lua_State *L)
+{
+	lua_newtable(L);
+	lua_pushinteger(L, 0);
+	return 2;
+}
+
+#endif
+
+#ifdef ELI_FS_EXTRA_NO_STATS
+
+void stats_setfuncs(lua_State *L, const luaL_Reg *funcs)
+{
+	luaL_setfuncs(L, funcs, 0);
+}
+
+int eli_stats(lua_State *L)
+{
+	lua_newtable(L);
+	return 1;
+}
+
+int eli_reset_stats(lua_State *L)
+{
+	(void)L;
+	return 0;
+}
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef ELI_EXTRA_FS_STATS_H__
+#define ELI_EXTRA_FS_STATS_H__
+
+#include "lua.h"
+#include "lauxlib.h"
+
+/*
+** Define ELI_FS_EXTRA_NO_STATS to register functions without the
+** instrumentation wrapper, stats() then always returns an empty table
+** and slow operations are not traced.
+*/
+void stats_setfuncs(lua_State *L, const luaL_Reg *funcs);
+
+int eli_stats(lua_State *L);
+int eli_reset_stats(lua_State *L);
+int eli_trace_slow_ops(lua_State *L);
+int eli_drain_slow_ops(lua_State *L);
+
+#endif /* ELI_EXTRA_FS_STATS_H__ */
@@ -0,0 +1,1763 @@
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "lerror.h"
+#include "lfsutil.h"
+#include "ltar.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+
+int eli_tar_pack(lua_State *L)
+{
+	errno = ENOSYS; /* = "Function not implemented" */
+	return push_result(L, -1, "tar_pack is not supported on Windows");
+}
+
+int eli_tar_unpack(lua_State *L)
+{
+	errno = ENOSYS; /* = "Function not implemented" */
+	return push_result(L, -1, "tar_unpack is not supported on Windows");
+}
+
+#else
+
+#include "lperm.h"
+#include "lpool.h"
+#include "lwalk.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#endif
+
+#define TAR_BLOCK 512
+#define TAR_RECORD (20 * TAR_BLOCK) /* archives are padded to records */
+#define TAR_META_MAX (1 << 20) /* longest pax or GNU long name payload */
+#define TAR_BATCH 16 /* files per pool task when unpacking */
+#define TAR_BUF_SIZE (128 * 1024)
+/* largest member size, anything bigger can't be skipped with lseek */
+#define TAR_SIZE_MAX \
+	((unsigned long long)(((uintmax_t)1 << (sizeof(off_t) * 8 - 1)) - 1))
+
+/*
+** POSIX ustar header. Fields which do not fit are carried by a pax
+** extended header ('x') in front of the member.
+*/
+typedef struct efs_tar_header {
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char chksum[8];
+	char typeflag;
+	char linkname[100];
+	char magic[6];
+	char version[2];
+	char uname[32];
+	char gname[32];
+	char devmajor[8];
+	char devminor[8];
+	char prefix[155];
+	char pad[12];
+} efs_tar_header;
+
+static const char zero_block[TAR_BLOCK];
+
+static size_t _padding(unsigned long long size)
+{
+	return (size_t)((TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK);
+}
+
+static int _write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = (const char *)buf;
+	while (len > 0) {
+		ssize_t n = write(fd, p, len);
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		p += n;
+		len -= (size_t)n;
+	}
+	return 0;
+}
+
+static int _write_zeros(int fd, unsigned long long len)
+{
+	while (len > 0) {
+		size_t n = len < TAR_BLOCK ? (size_t)len : TAR_BLOCK;
+		if (_write_all(fd, zero_block, n) == -1) {
+			return -1;
+		}
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+** Reads up to len bytes, less only at end of file.
+*/
+static ssize_t _read_full(int fd, void *buf, size_t len)
+{
+	size_t done = 0;
+	while (done < len) {
+		ssize_t n = read(fd, (char *)buf + done, len - done);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n == -1) {
+			return -1;
+		}
+		if (n == 0) {
+			break;
+		}
+		done += (size_t)n;
+	}
+	return (ssize_t)done;
+}
+
+static int _put_octal(char *field, size_t size, unsigned long long value)
+{
+	char tmp[32];
+	int len = snprintf(tmp, sizeof(tmp), "%0*llo", (int)(size - 1), value);
+	if (len < 0 || (size_t)len > size - 1) {
+		return -1;
+	}
+	memcpy(field, tmp, (size_t)len + 1);
+	return 0;
+}
+
+/*
+** Parses octal field, or GNU base-256 if its high bit is set. Negative
+** or overflowing base-256 values give ULLONG_MAX.
+*/
+static unsigned long long _get_number(const char *field, size_t size)
+{
+	const unsigned char *p = (const unsigned char *)field;
+	unsigned long long value = 0;
+	if (p[0] & 0x80) {
+		if (p[0] & 0x40) {
+			return ULLONG_MAX;
+		}
+		value = p[0] & 0x3f;
+		for (size_t i = 1; i < size; i++) {
+			if (value > ULLONG_MAX >> 8) {
+				return ULLONG_MAX;
+			}
+			value = value << 8 | p[i];
+		}
+		return value;
+	}
+	size_t i = 0;
+	while (i < size && p[i] == ' ') {
+		i++;
+	}
+	for (; i < size && p[i] >= '0' && p[i] <= '7'; i++) {
+		value = value << 3 | (unsigned)(p[i] - '0');
+	}
+	return value;
+}
+
+static void _set_checksum(efs_tar_header *h)
+{
+	memset(h->chksum, ' ', sizeof(h->chksum));
+	const unsigned char *p = (const unsigned char *)h;
+	unsigned sum = 0;
+	for (size_t i = 0; i < sizeof(efs_tar_header); i++) {
+		sum += p[i];
+	}
+	snprintf(h->chksum, sizeof(h->chksum), "%06o", sum);
+	h->chksum[7] = ' ';
+}
+
+/* accepts sums of unsigned and signed bytes, old writers used both */
+static int _checksum_ok(const efs_tar_header *h)
+{
+	unsigned long long stored = _get_number(h->chksum, sizeof(h->chksum));
+	const unsigned char *p = (const unsigned char *)h;
+	unsigned long long usum = 0;
+	long long ssum = 0;
+	for (size_t i = 0; i < sizeof(efs_tar_header); i++) {
+		int in_chksum = i >= offsetof(efs_tar_header, chksum) &&
+				i < offsetof(efs_tar_header, typeflag);
+		unsigned char c = in_chksum ? ' ' : p[i];
+		usum += c;
+		ssum += (signed char)c;
+	}
+	return stored == usum || (long long)stored == ssum;
+}
+
+static int _is_zero_block(const efs_tar_header *h)
+{
+	return memcmp(h, zero_block, TAR_BLOCK) == 0;
+}
+
+/*
+** Packing
+*/
+typedef struct efs_tar_link {
+	dev_t dev;
+	ino_t ino;
+	char *name;
+} efs_tar_link;
+
+typedef struct efs_tar_writer {
+	int fd;
+	int out_regular; /* archive may lie inside the packed tree */
+	dev_t out_dev;
+	ino_t out_ino;
+	const char *prefix;
+	int numeric_owner;
+	efs_tar_link *links; /* open addressing by inode */
+	size_t links_count;
+	size_t links_cap;
+	unsigned long long bytes;
+	unsigned long long files;
+	unsigned long long dirs;
+	unsigned long long symlinks;
+	unsigned long long hardlinks;
+	unsigned long long skipped;
+	int err;
+	char *err_path;
+} efs_tar_writer;
+
+static size_t _link_slot(efs_tar_link *links, size_t cap, dev_t dev, ino_t ino)
+{
+	size_t i = (size_t)(((uint64_t)ino * 0x9e3779b97f4a7c15ULL) ^
+			    (uint64_t)dev) &
+		   (cap - 1);
+	while (links[i].name != NULL &&
+	       (links[i].dev != dev || links[i].ino != ino)) {
+		i = (i + 1) & (cap - 1);
+	}
+	return i;
+}
+
+/*
+** Looks up earlier member sharing the inode of st, remembers name as
+** that member if there is none. Returns 0 with *first set (NULL when
+** new) or -1 if out of memory.
+*/
+static int _link_lookup(efs_tar_writer *w, const struct stat *st,
+			const char *name, const char **first)
+{
+	*first = NULL;
+	if (w->links_count * 2 >= w->links_cap) {
+		size_t cap = w->links_cap ? w->links_cap * 2 : 256;
+		efs_tar_link *links = calloc(cap, sizeof(efs_tar_link));
+		if (links == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+		for (size_t i = 0; i < w->links_cap; i++) {
+			efs_tar_link *l = &w->links[i];
+			if (l->name != NULL) {
+				size_t slot =
+					_link_slot(links, cap, l->dev, l->ino);
+				links[slot] = *l;
+			}
+		}
+		free(w->links);
+		w->links = links;
+		w->links_cap = cap;
+	}
+	efs_tar_link *l =
+		&w->links[_link_slot(w->links, w->links_cap, st->st_dev,
+				     st->st_ino)];
+	if (l->name != NULL) {
+		*first = l->name;
+		return 0;
+	}
+	if ((l->name = strdup(name)) == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	l->dev = st->st_dev;
+	l->ino = st->st_ino;
+	w->links_count++;
+	return 0;
+}
+
+/*
+** Appends "<len> key=value\n" record, len counts the whole record.
+*/
+static int _pax_add(char **buf, size_t *len, size_t *cap, const char *key,
+		    const char *value)
+{
+	size_t body = 1 + strlen(key) + 1 + strlen(value) + 1;
+	size_t total = body + 1;
+	for (;;) {
+		char digits[24];
+		size_t d = (size_t)snprintf(digits, sizeof(digits), "%zu",
+					    total);
+		if (body + d == total) {
+			break;
+		}
+		total = body + d;
+	}
+	if (*len + total + 1 > *cap) {
+		size_t ncap = *cap ? *cap * 2 : 512;
+		while (ncap < *len + total + 1) {
+			ncap *= 2;
+		}
+		char *nbuf = realloc(*buf, ncap);
+		if (nbuf == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+		*buf = nbuf;
+		*cap = ncap;
+	}
+	snprintf(*buf + *len, *cap - *len, "%zu %s=%s\n", total, key, value);
+	*len += total;
+	return 0;
+}
+
+static int _pax_add_number(char **buf, size_t *len, size_t *cap,
+			   const char *key, long long value)
+{
+	char tmp[24];
+	snprintf(tmp, sizeof(tmp), "%lld", value);
+	return _pax_add(buf, len, cap, key, tmp);
+}
+
+static int _emit_block(efs_tar_writer *w, efs_tar_header *h)
+{
+	_set_checksum(h);
+	if (_write_all(w->fd, h, TAR_BLOCK) == -1) {
+		return -1;
+	}
+	w->bytes += TAR_BLOCK;
+	return 0;
+}
+
+static void _init_header(efs_tar_header *h, const struct stat *st, char type)
+{
+	memset(h, 0, sizeof(efs_tar_header));
+	h->typeflag = type;
+	memcpy(h->magic, "ustar", 6);
+	memcpy(h->version, "00", 2);
+	_put_octal(h->mode, sizeof(h->mode), st->st_mode & 07777);
+}
+
+/*
+** Writes header(s) of member. Uses the ustar name prefix for long names
+** and a pax header for anything ustar can not hold.
+*/
+static int _emit_header(efs_tar_writer *w, const char *name,
+			const struct stat *st, char type, const char *linkname,
+			unsigned long long size)
+{
+	efs_tar_header h;
+	_init_header(&h, st, type);
+	char *pax = NULL;
+	size_t pax_len = 0, pax_cap = 0;
+	int res = 0;
+
+	size_t len = strlen(name);
+	if (len <= sizeof(h.name)) {
+		memcpy(h.name, name, len);
+	} else {
+		size_t split = 0;
+		/* name part after the split holds at most 100 bytes */
+		size_t from = len > sizeof(h.name) + 1 ?
+				      len - sizeof(h.name) - 1 :
+				      1;
+		for (size_t i = from; i + 1 < len && i <= sizeof(h.prefix);
+		     i++) {
+			if (name[i] == '/') {
+				split = i;
+				break;
+			}
+		}
+		if (split > 0) {
+			memcpy(h.prefix, name, split);
+			memcpy(h.name, name + split + 1, len - split - 1);
+		} else {
+			memcpy(h.name, name, sizeof(h.name));
+			res |= _pax_add(&pax, &pax_len, &pax_cap, "path", name);
+		}
+	}
+	if (linkname != NULL) {
+		size_t link_len = strlen(linkname);
+		memcpy(h.linkname, linkname,
+		       link_len < sizeof(h.linkname) ? link_len :
+						       sizeof(h.linkname));
+		if (link_len > sizeof(h.linkname)) {
+			res |= _pax_add(&pax, &pax_len, &pax_cap, "linkpath",
+					linkname);
+		}
+	}
+	if (_put_octal(h.size, sizeof(h.size), size) == -1) {
+		_put_octal(h.size, sizeof(h.size), 0);
+		res |= _pax_add_number(&pax, &pax_len, &pax_cap, "size",
+				       (long long)size);
+	}
+	if (st->st_mtime < 0 ||
+	    _put_octal(h.mtime, sizeof(h.mtime),
+		       (unsigned long long)st->st_mtime) == -1) {
+		_put_octal(h.mtime, sizeof(h.mtime), 0);
+		res |= _pax_add_number(&pax, &pax_len, &pax_cap, "mtime",
+				       (long long)st->st_mtime);
+	}
+	if (_put_octal(h.uid, sizeof(h.uid), st->st_uid) == -1) {
+		_put_octal(h.uid, sizeof(h.uid), 0);
+		res |= _pax_add_number(&pax, &pax_len, &pax_cap, "uid",
+				       (long long)st->st_uid);
+	}
+	if (_put_octal(h.gid, sizeof(h.gid), st->st_gid) == -1) {
+		_put_octal(h.gid, sizeof(h.gid), 0);
+		res |= _pax_add_number(&pax, &pax_len, &pax_cap, "gid",
+				       (long long)st->st_gid);
+	}
+	if (!w->numeric_owner) {
+		char owner[EFS_OWNER_NAME_MAX];
+		if (efs_owner_name(0, (long)st->st_uid, owner, sizeof(owner)) ==
+			    0 &&
+		    strlen(owner) < sizeof(h.uname)) {
+			strcpy(h.uname, owner);
+		}
+		if (efs_owner_name(1, (long)st->st_gid, owner, sizeof(owner)) ==
+			    0 &&
+		    strlen(owner) < sizeof(h.gname)) {
+			strcpy(h.gname, owner);
+		}
+	}
+	if (res != 0) {
+		free(pax);
+		errno = ENOMEM;
+		return -1;
+	}
+	if (pax_len > 0) {
+		efs_tar_header x;
+		struct stat xst = *st;
+		xst.st_mode = 0644;
+		_init_header(&x, &xst, 'x');
+		const char *base = strrchr(name, '/');
+		base = base != NULL && base[1] != '\0' ? base + 1 : name;
+		snprintf(x.name, sizeof(x.name), "PaxHeaders/%.88s", base);
+		_put_octal(x.size, sizeof(x.size), pax_len);
+		memcpy(x.mtime, h.mtime, sizeof(x.mtime));
+		res = 0;
+		if (_emit_block(w, &x) == -1 ||
+		    _write_all(w->fd, pax, pax_len) == -1 ||
+		    _write_zeros(w->fd, _padding(pax_len)) == -1) {
+			res = -1;
+		}
+		w->bytes += pax_len + _padding(pax_len);
+		free(pax);
+		if (res == -1) {
+			return -1;
+		}
+	}
+	return _emit_block(w, &h);
+}
+
+/*
+** Moves exactly size bytes of in into the archive followed by padding.
+** sendfile keeps the data in the kernel for file and pipe archives
+** alike. Files shrunk meanwhile are padded with zeros, growth is cut.
+*/
+static int _emit_payload(efs_tar_writer *w, int in, unsigned long long size)
+{
+	unsigned long long done = 0;
+#ifdef __linux__
+	while (done < size) {
+		unsigned long long left = size - done;
+		ssize_t n = sendfile(w->fd, in, NULL,
+				     left > (1ULL << 30) ? (size_t)1 << 30 :
+							   (size_t)left);
+		if (n > 0) {
+			done += (unsigned long long)n;
+			continue;
+		}
+		if (n == 0) {
+			break;
+		}
+		if (errno == EINTR) {
+			continue;
+		}
+		if (done == 0 && (errno == EINVAL || errno == ENOSYS)) {
+			break; /* e.g. archive opened with O_APPEND */
+		}
+		return -1;
+	}
+#endif
+	if (done < size) {
+		char *buf = malloc(TAR_BUF_SIZE);
+		if (buf == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+		while (done < size) {
+			unsigned long long left = size - done;
+			ssize_t n = read(in, buf,
+					 left < TAR_BUF_SIZE ? (size_t)left :
+							       TAR_BUF_SIZE);
+			if (n == -1 && errno == EINTR) {
+				continue;
+			}
+			if (n <= 0 || _write_all(w->fd, buf, (size_t)n) == -1) {
+				int err = errno;
+				free(buf);
+				if (n == 0) {
+					break;
+				}
+				errno = err;
+				return -1;
+			}
+			done += (unsigned long long)n;
+		}
+		free(buf);
+	}
+	if (_write_zeros(w->fd, size - done + _padding(size)) == -1) {
+		return -1;
+	}
+	w->bytes += size + _padding(size);
+	return 0;
+}
+
+static char *_read_target(int dirfd, const char *name, const struct stat *st)
+{
+	size_t size = st->st_size > 0 ? (size_t)st->st_size + 1 : 256;
+	char *target = malloc(size);
+	if (target == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	ssize_t len = readlinkat(dirfd, name, target, size);
+	if (len == -1 || (size_t)len == size) {
+		free(target);
+		if (len != -1) {
+			errno = ENAMETOOLONG;
+		}
+		return NULL;
+	}
+	target[len] = '\0';
+	return target;
+}
+
+static int _pack_entry(efs_tar_writer *w, int dirfd, const char *fname,
+		       const struct stat *st, const char *member)
+{
+	if (S_ISDIR(st->st_mode)) {
+		w->dirs++;
+		return _emit_header(w, member, st, '5', NULL, 0);
+	}
+	if (S_ISLNK(st->st_mode)) {
+		char *target = _read_target(dirfd, fname, st);
+		if (target == NULL) {
+			return -1;
+		}
+		int res = _emit_header(w, member, st, '2', target, 0);
+		free(target);
+		w->symlinks++;
+		return res;
+	}
+	if (!S_ISREG(st->st_mode)) {
+		w->skipped++; /* devices, fifos and sockets */
+		return 0;
+	}
+	if (w->out_regular && st->st_dev == w->out_dev &&
+	    st->st_ino == w->out_ino) {
+		w->skipped++; /* the archive itself */
+		return 0;
+	}
+	if (st->st_nlink > 1) {
+		const char *first;
+		if (_link_lookup(w, st, member, &first) == -1) {
+			return -1;
+		}
+		if (first != NULL) {
+			w->hardlinks++;
+			return _emit_header(w, member, st, '1', first, 0);
+		}
+	}
+	int in = openat(dirfd, fname, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (in == -1) {
+		return -1;
+	}
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+	unsigned long long size = (unsigned long long)st->st_size;
+	int res = _emit_header(w, member, st, '0', NULL, size) == -1 ||
+				  _emit_payload(w, in, size) == -1 ?
+			  -1 :
+			  0;
+	int err = errno;
+	close(in);
+	errno = err;
+	w->files += res == 0;
+	return res;
+}
+
+/* prefix/rel, with a trailing slash for directories */
+static char *_member_name(efs_tar_writer *w, const char *rel, int dir)
+{
+	size_t prefix_len = w->prefix != NULL ? strlen(w->prefix) : 0;
+	size_t len = prefix_len + 1 + strlen(rel) + 2;
+	char *name = malloc(len);
+	if (name == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	snprintf(name, len, "%s%s%s%s", prefix_len ? w->prefix : "",
+		 prefix_len && *rel ? "/" : "", rel, dir ? "/" : "");
+	return name;
+}
+
+static int _pack_enter(efs_walk_entry *entry, void *ud)
+{
+	efs_tar_writer *w = (efs_tar_writer *)ud;
+	char *member = _member_name(w, entry->path + entry->rel_offset,
+				    S_ISDIR(entry->st->st_mode));
+	if (member == NULL ||
+	    _pack_entry(w, entry->dirfd, entry->name, entry->st, member) ==
+		    -1) {
+		w->err = errno;
+		w->err_path = strdup(entry->path);
+		free(member);
+		return EFS_WALK_STOP;
+	}
+	free(member);
+	return EFS_WALK_CONTINUE;
+}
+
+static void _free_writer(efs_tar_writer *w)
+{
+	for (size_t i = 0; i < w->links_cap; i++) {
+		free(w->links[i].name);
+	}
+	free(w->links);
+	free(w->err_path);
+}
+
+static void _set_count(lua_State *L, const char *name,
+		       unsigned long long value)
+{
+	lua_pushinteger(L, (lua_Integer)value);
+	lua_setfield(L, -2, name);
+}
+
+/*
+** Packs file or directory tree into tar archive (POSIX ustar with pax
+** extended headers where needed). File contents are moved by sendfile.
+** Symlinks and hardlinks are kept, devices, fifos and sockets skipped.
+** @param #1 Source file or directory, directory members are named
+**           relative to it.
+** @param #2 Archive path or open file (written at its position).
+** @param #3 Options table (optional):
+**   prefix = nil - directory to put members into,
+**   numeric_owner = false - leave owner names out,
+**   one_file_system = false.
+** Returns { files, dirs, symlinks, hardlinks, skipped, bytes }, bytes
+** is the archive size.
+*/
+int eli_tar_pack(lua_State *L)
+{
+	const char *src = luaL_checkstring(L, 1);
+	efs_tar_writer w;
+	memset(&w, 0, sizeof(w));
+	int flags = 0;
+	if (lua_istable(L, 3)) {
+		lua_getfield(L, 3, "prefix");
+		w.prefix = luaL_optstring(L, -1, NULL);
+		lua_getfield(L, 3, "numeric_owner");
+		w.numeric_owner = lua_toboolean(L, -1);
+		lua_getfield(L, 3, "one_file_system");
+		flags |= lua_toboolean(L, -1) ? EFS_WALK_XDEV : 0;
+		lua_pop(L, 3);
+	}
+	const char *dst = NULL;
+	if (lua_type(L, 2) == LUA_TSTRING) {
+		dst = lua_tostring(L, 2);
+	} else {
+		FILE *f = check_file(L, 2, "tar_pack");
+		fflush(f);
+		w.fd = fileno(f);
+	}
+
+	struct stat st;
+	if (stat(src, &st) == -1) {
+		return push_error(L, src);
+	}
+	if (dst != NULL) {
+		w.fd = open(dst, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+			    0644);
+		if (w.fd == -1) {
+			return push_error(L, dst);
+		}
+	}
+	struct stat out;
+	if (fstat(w.fd, &out) == 0 && S_ISREG(out.st_mode)) {
+		w.out_regular = 1;
+		w.out_dev = out.st_dev;
+		w.out_ino = out.st_ino;
+	}
+
+	int res = 0;
+	if (S_ISDIR(st.st_mode)) {
+		if (w.prefix != NULL && *w.prefix != '\0') {
+			char *member = _member_name(&w, "", 1);
+			if (member == NULL ||
+			    _pack_entry(&w, AT_FDCWD, src, &st, member) == -1) {
+				res = -1;
+			}
+			free(member);
+		}
+		efs_walker walker = { _pack_enter, NULL, &w, flags, 0, 0 };
+		if (res == 0 && efs_walk(&walker, src) == -1) {
+			res = -1;
+		}
+		if (res == 0 && w.err != 0) {
+			res = -1;
+			errno = w.err;
+		}
+	} else {
+		const char *base = strrchr(src, '/');
+		char *member = _member_name(&w, base != NULL ? base + 1 : src,
+					    0);
+		if (member == NULL ||
+		    _pack_entry(&w, AT_FDCWD, src, &st, member) == -1) {
+			res = -1;
+		}
+		free(member);
+	}
+	if (res == 0) {
+		/* end of archive: two zero blocks, then fill the record */
+		unsigned long long end = w.bytes + 2 * TAR_BLOCK;
+		unsigned long long record_pad =
+			(TAR_RECORD - end % TAR_RECORD) % TAR_RECORD;
+		res = _write_zeros(w.fd, 2 * TAR_BLOCK + record_pad);
+		w.bytes = end + record_pad;
+	}
+	int err = errno;
+	if (dst != NULL) {
+		if (close(w.fd) == -1 && res == 0) {
+			res = -1;
+			err = errno;
+		}
+		if (res == -1) {
+			unlink(dst);
+		}
+	}
+	if (res == -1) {
+		lua_pushstring(L, w.err_path != NULL ? w.err_path :
+				  dst != NULL && w.err == 0 ? dst :
+							      src);
+		_free_writer(&w);
+		errno = err;
+		return push_error(L, lua_tostring(L, -1));
+	}
+	_free_writer(&w);
+	lua_createtable(L, 0, 6);
+	_set_count(L, "files", w.files);
+	_set_count(L, "dirs", w.dirs);
+	_set_count(L, "symlinks", w.symlinks);
+	_set_count(L, "hardlinks", w.hardlinks);
+	_set_count(L, "skipped", w.skipped);
+	_set_count(L, "bytes", w.bytes);
+	return 1;
+}
+
+/*
+** Unpacking
+*/
+typedef struct efs_tar_member {
+	char type;
+	char *path;
+	char *link;
+	mode_t mode;
+	long long mtime;
+	long uid;
+	long gid;
+	off_t offset; /* of the payload in the archive */
+	unsigned long long size;
+	int dropped; /* a later member has the same path */
+	int replace; /* an earlier member was written to the same path */
+} efs_tar_member;
+
+typedef struct efs_tar_list {
+	efs_tar_member *items;
+	size_t count;
+	size_t cap;
+} efs_tar_list;
+
+/* last member unpacked to path, list is NULL once it was written */
+typedef struct efs_tar_seen {
+	char *path;
+	efs_tar_list *list;
+	size_t index;
+} efs_tar_seen;
+
+/* values of pax or GNU headers applying to the next member */
+typedef struct efs_tar_pending {
+	char *path;
+	char *link;
+	unsigned long long size;
+	long long mtime;
+	long uid;
+	long gid;
+	int has_size;
+	int has_mtime;
+	int has_uid;
+	int has_gid;
+} efs_tar_pending;
+
+typedef struct efs_tar_reader {
+	int fd;
+	int seekable; /* payloads extracted in parallel by offset */
+	off_t offset;
+	int dst_fd;
+	int same_owner;
+	int overwrite;
+	char *last_parent;
+	efs_tar_list files; /* extracted in parallel */
+	efs_tar_list later; /* directories and links, done at the end */
+	efs_tar_seen *seen; /* open addressing by path */
+	size_t seen_count;
+	size_t seen_cap;
+	unsigned long long regular;
+	unsigned long long bytes;
+	unsigned long long skipped;
+	pthread_mutex_t lock;
+	int err;
+	char *err_path;
+} efs_tar_reader;
+
+typedef struct efs_tar_task {
+	efs_tar_reader *r;
+	efs_tar_member *files;
+	size_t count;
+} efs_tar_task;
+
+static void _reader_fail(efs_tar_reader *r, int err, const char *path)
+{
+	pthread_mutex_lock(&r->lock);
+	if (r->err == 0) {
+		r->err = err;
+		r->err_path = path != NULL ? strdup(path) : NULL;
+	}
+	pthread_mutex_unlock(&r->lock);
+}
+
+static int _reader_failed(efs_tar_reader *r)
+{
+	pthread_mutex_lock(&r->lock);
+	int failed = r->err != 0;
+	pthread_mutex_unlock(&r->lock);
+	return failed;
+}
+
+static efs_tar_member *_list_add(efs_tar_list *list)
+{
+	if (list->count == list->cap) {
+		size_t cap = list->cap ? list->cap * 2 : 256;
+		efs_tar_member *items =
+			realloc(list->items, cap * sizeof(efs_tar_member));
+		if (items == NULL) {
+			errno = ENOMEM;
+			return NULL;
+		}
+		list->items = items;
+		list->cap = cap;
+	}
+	return &list->items[list->count++];
+}
+
+static void _list_free(efs_tar_list *list)
+{
+	for (size_t i = 0; i < list->count; i++) {
+		free(list->items[i].path);
+		free(list->items[i].link);
+	}
+	free(list->items);
+}
+
+static size_t _seen_slot(efs_tar_seen *seen, size_t cap, const char *path)
+{
+	uint64_t h = 14695981039346656037ULL;
+	for (const char *c = path; *c != '\0'; c++) {
+		h = (h ^ (unsigned char)*c) * 1099511628211ULL;
+	}
+	size_t i = (size_t)h & (cap - 1);
+	while (seen[i].path != NULL && strcmp(seen[i].path, path) != 0) {
+		i = (i + 1) & (cap - 1);
+	}
+	return i;
+}
+
+/*
+** Finds the entry of an earlier member unpacked to path, *found tells
+** whether there was one, else it is added with list NULL. Returns NULL
+** if out of memory.
+*/
+static efs_tar_seen *_seen_lookup(efs_tar_reader *r, const char *path,
+				  int *found)
+{
+	if (r->seen_count * 2 >= r->seen_cap) {
+		size_t cap = r->seen_cap ? r->seen_cap * 2 : 256;
+		efs_tar_seen *seen = calloc(cap, sizeof(efs_tar_seen));
+		if (seen == NULL) {
+			errno = ENOMEM;
+			return NULL;
+		}
+		for (size_t i = 0; i < r->seen_cap; i++) {
+			efs_tar_seen *e = &r->seen[i];
+			if (e->path != NULL) {
+				seen[_seen_slot(seen, cap, e->path)] = *e;
+			}
+		}
+		free(r->seen);
+		r->seen = seen;
+		r->seen_cap = cap;
+	}
+	efs_tar_seen *e = &r->seen[_seen_slot(r->seen, r->seen_cap, path)];
+	*found = e->path != NULL;
+	if (!*found) {
+		if ((e->path = strdup(path)) == NULL) {
+			errno = ENOMEM;
+			return NULL;
+		}
+		e->list = NULL;
+		r->seen_count++;
+	}
+	return e;
+}
+
+static void _seen_free(efs_tar_reader *r)
+{
+	for (size_t i = 0; i < r->seen_cap; i++) {
+		free(r->seen[i].path);
+	}
+	free(r->seen);
+}
+
+static int _is_regular(char type)
+{
+	return type == '0' || type == '\0' || type == '7';
+}
+
+static void _pending_clear(efs_tar_pending *p)
+{
+	free(p->path);
+	free(p->link);
+	memset(p, 0, sizeof(efs_tar_pending));
+}
+
+static int _skip(efs_tar_reader *r, unsigned long long len)
+{
+	if (len > TAR_SIZE_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (r->seekable) {
+		if (lseek(r->fd, (off_t)len, SEEK_CUR) == -1) {
+			return -1;
+		}
+		r->offset += (off_t)len;
+		return 0;
+	}
+	char buf[4096];
+	while (len > 0) {
+		ssize_t n = _read_full(r->fd, buf,
+				       len < sizeof(buf) ? (size_t)len :
+							   sizeof(buf));
+		if (n <= 0) {
+			if (n == 0) {
+				errno = EIO; /* truncated archive */
+			}
+			return -1;
+		}
+		len -= (unsigned long long)n;
+		r->offset += n;
+	}
+	return 0;
+}
+
+static char *_read_meta(efs_tar_reader *r, unsigned long long size)
+{
+	if (size > TAR_META_MAX) {
+		errno = EINVAL;
+		return NULL;
+	}
+	char *buf = malloc((size_t)size + 1);
+	if (buf == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	ssize_t n = _read_full(r->fd, buf, (size_t)size);
+	if (n != (ssize_t)size || _skip(r, _padding(size)) == -1) {
+		if (n >= 0 && n != (ssize_t)size) {
+			errno = EIO;
+		}
+		free(buf);
+		return NULL;
+	}
+	r->offset += (off_t)size;
+	buf[size] = '\0';
+	return buf;
+}
+
+/*
+** Parses unsigned decimal not above max. Signs, blanks and overflow are
+** refused with EINVAL, so are trailing characters unless end is given.
+*/
+static int _get_decimal(const char *str, char **end, unsigned long long max,
+			unsigned long long *value)
+{
+	if (*str < '0' || *str > '9') {
+		errno = EINVAL;
+		return -1;
+	}
+	unsigned long long v = 0;
+	for (; *str >= '0' && *str <= '9'; str++) {
+		unsigned digit = (unsigned)(*str - '0');
+		if (v > (max - digit) / 10) {
+			errno = EINVAL;
+			return -1;
+		}
+		v = v * 10 + digit;
+	}
+	if (end != NULL) {
+		*end = (char *)str;
+	} else if (*str != '\0') {
+		errno = EINVAL;
+		return -1;
+	}
+	*value = v;
+	return 0;
+}
+
+static int _pax_parse(char *buf, size_t len, efs_tar_pending *p)
+{
+	size_t pos = 0;
+	while (pos < len) {
+		char *end;
+		unsigned long long rec;
+		if (_get_decimal(buf + pos, &end, len, &rec) == -1 || rec == 0 ||
+		    rec > len - pos || *end != ' ' ||
+		    (size_t)(end - (buf + pos)) >= rec - 1 ||
+		    buf[pos + rec - 1] != '\n') {
+			errno = EINVAL;
+			return -1;
+		}
+		char *key = end + 1;
+		buf[pos + rec - 1] = '\0';
+		char *eq = strchr(key, '=');
+		if (eq != NULL) {
+			*eq = '\0';
+			char *value = eq + 1;
+			char **str = strcmp(key, "path") == 0	  ? &p->path :
+				     strcmp(key, "linkpath") == 0 ? &p->link :
+								    NULL;
+			if (str != NULL) {
+				free(*str);
+				if ((*str = strdup(value)) == NULL) {
+					errno = ENOMEM;
+					return -1;
+				}
+			} else if (strcmp(key, "size") == 0) {
+				if (_get_decimal(value, NULL, TAR_SIZE_MAX,
+						 &p->size) == -1) {
+					return -1;
+				}
+				p->has_size = 1;
+			} else if (strcmp(key, "mtime") == 0) {
+				p->mtime = strtoll(value, NULL, 10);
+				p->has_mtime = 1;
+			} else if (strcmp(key, "uid") == 0) {
+				p->uid = strtol(value, NULL, 10);
+				p->has_uid = 1;
+			} else if (strcmp(key, "gid") == 0) {
+				p->gid = strtol(value, NULL, 10);
+				p->has_gid = 1;
+			}
+		}
+		pos += rec;
+	}
+	return 0;
+}
+
+/*
+** Makes archive path relative to the destination: strips leading
+** slashes and "./", returns NULL if it climbs out through "..".
+*/
+static char *_safe_path(char *path)
+{
+	for (char *p = path; *p != '\0';) {
+		size_t len = strcspn(p, "/");
+		if (len == 2 && p[0] == '.' && p[1] == '.') {
+			return NULL;
+		}
+		p += len;
+		while (*p == '/') {
+			p++;
+		}
+	}
+	for (;;) {
+		while (*path == '/') {
+			path++;
+		}
+		if (path[0] == '.' && (path[1] == '/' || path[1] == '\0')) {
+			path++;
+			continue;
+		}
+		break;
+	}
+	size_t len = strlen(path);
+	while (len > 0 && path[len - 1] == '/') {
+		path[--len] = '\0';
+	}
+	return path;
+}
+
+/* creates missing parent directories of path below the destination */
+static int _make_parents(efs_tar_reader *r, const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	if (slash == NULL) {
+		return 0;
+	}
+	size_t len = (size_t)(slash - path);
+	if (r->last_parent != NULL && strlen(r->last_parent) == len &&
+	    strncmp(r->last_parent, path, len) == 0) {
+		return 0;
+	}
+	char *parent = strndup(path, len);
+	if (parent == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	int fd = efs_open_dirs(r->dst_fd, parent, 1);
+	if (fd == -1) {
+		int err = errno;
+		free(parent);
+		errno = err;
+		return -1;
+	}
+	efs_close_parent(r->dst_fd, fd);
+	free(r->last_parent);
+	r->last_parent = parent;
+	return 0;
+}
+
+static mode_t _perms(efs_tar_reader *r, mode_t mode)
+{
+	/* set-id bits only make sense with the archived owners */
+	return mode & (r->same_owner ? 07777 : 0777);
+}
+
+static void _finish_file(efs_tar_reader *r, int out, efs_tar_member *m)
+{
+	struct timespec times[2] = { { 0, UTIME_OMIT }, { m->mtime, 0 } };
+	if (r->same_owner) {
+		(void)!fchown(out, (uid_t)m->uid, (gid_t)m->gid);
+	}
+	fchmod(out, _perms(r, m->mode));
+	futimens(out, times);
+}
+
+static int _open_member(efs_tar_reader *r, efs_tar_member *m)
+{
+	int out = efs_open_beneath(r->dst_fd, m->path,
+				O_WRONLY | O_CREAT |
+					(r->overwrite || m->replace ? O_TRUNC :
+								      O_EXCL),
+				0600);
+	if (out == -1 && errno == EISDIR) {
+		errno = EEXIST;
+	}
+	return out;
+}
+
+/*
+** Extracts payload at its archive offset, so files can be written
+** concurrently. copy_file_range keeps the data in the kernel.
+*/
+static int _extract_at(efs_tar_reader *r, efs_tar_member *m, char **buf)
+{
+	int out = _open_member(r, m);
+	if (out == -1) {
+		return -1;
+	}
+	unsigned long long done = 0;
+	int res = 0;
+#if defined(__linux__) && defined(SYS_copy_file_range)
+	loff_t off = (loff_t)m->offset;
+	while (done < m->size) {
+		unsigned long long left = m->size - done;
+		ssize_t n = syscall(SYS_copy_file_range, r->fd, &off, out, NULL,
+				    left > (1ULL << 30) ? (size_t)1 << 30 :
+							  (size_t)left,
+				    0);
+		if (n > 0) {
+			done += (unsigned long long)n;
+			continue;
+		}
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n == 0 || done > 0 ||
+		    (errno != EXDEV && errno != EINVAL && errno != ENOSYS &&
+		     errno != EOPNOTSUPP)) {
+			res = -1;
+			if (n == 0) {
+				errno = EIO;
+			}
+		}
+		break;
+	}
+#endif
+	while (res == 0 && done < m->size) {
+		if (*buf == NULL && (*buf = malloc(TAR_BUF_SIZE)) == NULL) {
+			errno = ENOMEM;
+			res = -1;
+			break;
+		}
+		unsigned long long left = m->size - done;
+		ssize_t n = pread(r->fd, *buf,
+				  left < TAR_BUF_SIZE ? (size_t)left :
+							TAR_BUF_SIZE,
+				  m->offset + (off_t)done);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0 || _write_all(out, *buf, (size_t)n) == -1) {
+			if (n == 0) {
+				errno = EIO;
+			}
+			res = -1;
+			break;
+		}
+		done += (unsigned long long)n;
+	}
+	if (res == 0) {
+		_finish_file(r, out, m);
+	}
+	int err = errno;
+	if (close(out) == -1 && res == 0) {
+		res = -1;
+		err = errno;
+	}
+	errno = err;
+	return res;
+}
+
+/*
+** Extracts payload following the header on a stream, splice moves it
+** from pipes without copying through userspace.
+*/
+static int _extract_stream(efs_tar_reader *r, efs_tar_member *m)
+{
+	int out = _open_member(r, m);
+	if (out == -1) {
+		return -1;
+	}
+	unsigned long long done = 0;
+	int res = 0;
+#ifdef __linux__
+	while (done < m->size) {
+		unsigned long long left = m->size - done;
+		ssize_t n = splice(r->fd, NULL, out, NULL,
+				   left > (1ULL << 30) ? (size_t)1 << 30 :
+							 (size_t)left,
+				   SPLICE_F_MOVE);
+		if (n > 0) {
+			done += (unsigned long long)n;
+			continue;
+		}
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n == 0 || done > 0 || errno != EINVAL) {
+			res = -1;
+			if (n == 0) {
+				errno = EIO;
+			}
+		}
+		break; /* EINVAL: not a pipe */
+	}
+#endif
+	char buf[16384];
+	while (res == 0 && done < m->size) {
+		unsigned long long left = m->size - done;
+		size_t chunk = left < sizeof(buf) ? (size_t)left : sizeof(buf);
+		ssize_t n = read(r->fd, buf, chunk);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0 || _write_all(out, buf, (size_t)n) == -1) {
+			if (n == 0) {
+				errno = EIO;
+			}
+			res = -1;
+			break;
+		}
+		done += (unsigned long long)n;
+	}
+	r->offset += (off_t)done;
+	if (res == 0) {
+		_finish_file(r, out, m);
+		res = _skip(r, _padding(m->size));
+	}
+	int err = errno;
+	if (close(out) == -1 && res == 0) {
+		res = -1;
+		err = errno;
+	}
+	errno = err;
+	return res;
+}
+
+static void _extract_task(void *arg)
+{
+	efs_tar_task *task = (efs_tar_task *)arg;
+	char *buf = NULL;
+	for (size_t i = 0; i < task->count && !_reader_failed(task->r); i++) {
+		efs_tar_member *m = &task->files[i];
+		if (!m->dropped && _extract_at(task->r, m, &buf) == -1) {
+			_reader_fail(task->r, errno, m->path);
+		}
+	}
+	free(buf);
+	free(task);
+}
+
+static void _extract_files(efs_tar_reader *r)
+{
+	efs_task_group group;
+	efs_group_init(&group);
+	for (size_t i = 0; i < r->files.count; i += TAR_BATCH) {
+		efs_tar_task *task = malloc(sizeof(efs_tar_task));
+		if (task == NULL) {
+			_reader_fail(r, ENOMEM, NULL);
+			break;
+		}
+		task->r = r;
+		task->files = r->files.items + i;
+		task->count = r->files.count - i < TAR_BATCH ?
+				      r->files.count - i :
+				      TAR_BATCH;
+		efs_group_submit(&group, _extract_task, task);
+	}
+	efs_group_wait(&group);
+	efs_group_destroy(&group);
+}
+
+static long _owner(int group, const char *field, size_t size, long id)
+{
+	char name[33];
+	long resolved;
+	memcpy(name, field, size);
+	name[size] = '\0';
+	if (name[0] != '\0' && efs_owner_id(group, name, &resolved) == 0) {
+		return resolved;
+	}
+	return id;
+}
+
+/*
+** Reads headers until end of archive. Directories are created right
+** away, regular files queued (seekable archive) or extracted from the
+** stream, links queued until all files exist.
+*/
+static int _read_archive(efs_tar_reader *r)
+{
+	efs_tar_header h;
+	efs_tar_pending pending;
+	memset(&pending, 0, sizeof(pending));
+	for (;;) {
+		ssize_t n = _read_full(r->fd, &h, TAR_BLOCK);
+		if (n == -1) {
+			_reader_fail(r, errno, NULL);
+			break;
+		}
+		if (n == 0 || _is_zero_block(&h)) {
+			break; /* some writers omit the end blocks */
+		}
+		r->offset += n;
+		if (n < TAR_BLOCK || !_checksum_ok(&h)) {
+			_reader_fail(r, n < TAR_BLOCK ? EIO : EINVAL,
+				     "invalid tar header");
+			break;
+		}
+		unsigned long long size = _get_number(h.size, sizeof(h.size));
+		if (h.typeflag == 'x' || h.typeflag == 'L' ||
+		    h.typeflag == 'K') {
+			char *meta = _read_meta(r, size);
+			if (meta == NULL) {
+				_reader_fail(r, errno, "invalid tar header");
+				break;
+			}
+			if (h.typeflag == 'x') {
+				int res = _pax_parse(meta, (size_t)size,
+						     &pending);
+				free(meta);
+				if (res == -1) {
+					_reader_fail(r, errno,
+						     "invalid pax header");
+					break;
+				}
+			} else if (h.typeflag == 'L') {
+				free(pending.path);
+				pending.path = meta;
+			} else {
+				free(pending.link);
+				pending.link = meta;
+			}
+			continue;
+		}
+
+		if (pending.has_size) {
+			size = pending.size;
+		}
+		if (size > TAR_SIZE_MAX) {
+			_reader_fail(r, EINVAL, "invalid tar header");
+			break;
+		}
+		efs_tar_member m;
+		memset(&m, 0, sizeof(m));
+		m.type = h.typeflag;
+		m.size = size;
+		m.mode = (mode_t)_get_number(h.mode, sizeof(h.mode));
+		m.mtime = pending.has_mtime ?
+				  pending.mtime :
+				  (long long)_get_number(h.mtime,
+							 sizeof(h.mtime));
+		m.uid = pending.has_uid ?
+				pending.uid :
+				(long)_get_number(h.uid, sizeof(h.uid));
+		m.gid = pending.has_gid ?
+				pending.gid :
+				(long)_get_number(h.gid, sizeof(h.gid));
+		if (r->same_owner) {
+			m.uid = _owner(0, h.uname, sizeof(h.uname), m.uid);
+			m.gid = _owner(1, h.gname, sizeof(h.gname), m.gid);
+		}
+		char name[sizeof(h.prefix) + 1 + sizeof(h.name) + 1];
+		if (pending.path == NULL) {
+			int ustar = memcmp(h.magic, "ustar", 5) == 0;
+			snprintf(name, sizeof(name), "%.*s%s%.*s",
+				 ustar ? (int)strnlen(h.prefix,
+						      sizeof(h.prefix)) :
+					 0,
+				 h.prefix,
+				 ustar && h.prefix[0] != '\0' ? "/" : "",
+				 (int)strnlen(h.name, sizeof(h.name)), h.name);
+		}
+		char *path = _safe_path(pending.path != NULL ? pending.path :
+							       name);
+		if (path == NULL) {
+			_reader_fail(r, EINVAL, pending.path != NULL ?
+							pending.path :
+							name);
+			break;
+		}
+		int regular = _is_regular(m.type);
+		int known = regular || m.type == '1' || m.type == '2' ||
+			    m.type == '5';
+		if (*path == '\0' || !known) {
+			/* the destination itself, devices, fifos, ... */
+			r->skipped += *path != '\0';
+			_pending_clear(&pending);
+			if (_skip(r, size + _padding(size)) == -1) {
+				_reader_fail(r, errno, NULL);
+				break;
+			}
+			continue;
+		}
+		if ((m.path = strdup(path)) == NULL) {
+			_reader_fail(r, ENOMEM, NULL);
+			break;
+		}
+		if (m.type == '1' || m.type == '2') {
+			char link[sizeof(h.linkname) + 1];
+			snprintf(link, sizeof(link), "%.*s",
+				 (int)strnlen(h.linkname, sizeof(h.linkname)),
+				 h.linkname);
+			const char *target = pending.link != NULL ?
+						     pending.link :
+						     link;
+			char *copy = strdup(target);
+			char *safe = copy;
+			if (copy != NULL && m.type == '1' &&
+			    (safe = _safe_path(copy)) == NULL) {
+				/* hardlinks name a member of the archive */
+				free(copy);
+				free(m.path);
+				_reader_fail(r, EINVAL, target);
+				break;
+			}
+			if (copy == NULL) {
+				free(m.path);
+				_reader_fail(r, ENOMEM, NULL);
+				break;
+			}
+			memmove(copy, safe, strlen(safe) + 1);
+			m.link = copy;
+			m.size = 0; /* no payload */
+		}
+		_pending_clear(&pending);
+
+		int res = _make_parents(r, m.path);
+		/* the last member of a path wins, as with any tar */
+		int found = 0;
+		efs_tar_seen *seen = NULL;
+		if (res == 0 && (seen = _seen_lookup(r, m.path, &found)) == NULL) {
+			res = -1;
+		}
+		if (found && seen->list != NULL) {
+			efs_tar_member *earlier = &seen->list->items[seen->index];
+			earlier->dropped = 1;
+			if (_is_regular(earlier->type)) {
+				r->regular--;
+				r->bytes -= earlier->size;
+			}
+		} else if (found) {
+			m.replace = 1;
+		}
+		if (res == 0 && m.type == '5' &&
+		    mkdirat(r->dst_fd, m.path, (m.mode & 0777) | S_IRWXU) ==
+			    -1 &&
+		    errno != EEXIST) {
+			res = -1;
+		}
+		efs_tar_member *item = NULL;
+		if (res == 0 && (!regular || r->seekable)) {
+			efs_tar_list *list = regular ? &r->files : &r->later;
+			if ((item = _list_add(list)) == NULL) {
+				res = -1;
+			} else {
+				seen->list = list;
+				seen->index = list->count - 1;
+			}
+		} else if (res == 0) {
+			seen->list = NULL; /* written right away */
+		}
+		if (res == 0 && regular) {
+			r->regular++;
+			r->bytes += m.size;
+			if (r->seekable) {
+				m.offset = r->offset;
+				res = _skip(r, m.size + _padding(m.size));
+			} else {
+				res = _extract_stream(r, &m);
+			}
+		}
+		if (res == -1) {
+			_reader_fail(r, errno, m.path);
+			free(m.path);
+			free(m.link);
+			break;
+		}
+		if (item != NULL) {
+			*item = m;
+		} else {
+			free(m.path);
+		}
+	}
+	_pending_clear(&pending);
+	return r->err != 0 ? -1 : 0;
+}
+
+/*
+** Creates link member m with both its path and, for hard links, its
+** target resolved below the destination without following symlinks.
+*/
+static int _make_link(efs_tar_reader *r, efs_tar_member *m)
+{
+	const char *name;
+	int dir = efs_open_parent(r->dst_fd, m->path, &name);
+	if (dir == -1) {
+		return -1;
+	}
+	if (r->overwrite || m->replace) {
+		unlinkat(dir, name, 0);
+	}
+	int res;
+	if (m->type == '1') {
+		const char *target;
+		int tdir = efs_open_parent(r->dst_fd, m->link, &target);
+		res = tdir == -1 ? -1 : linkat(tdir, target, dir, name, 0);
+		efs_close_parent(r->dst_fd, tdir);
+	} else {
+		res = symlinkat(m->link, dir, name);
+		if (res == 0) {
+			struct timespec times[2] = { { 0, UTIME_OMIT },
+						     { m->mtime, 0 } };
+			utimensat(dir, name, times, AT_SYMLINK_NOFOLLOW);
+			if (r->same_owner) {
+				(void)!fchownat(dir, name, (uid_t)m->uid,
+						(gid_t)m->gid,
+						AT_SYMLINK_NOFOLLOW);
+			}
+		}
+	}
+	efs_close_parent(r->dst_fd, dir);
+	return res;
+}
+
+/*
+** Creates links in archive order once all files exist. Link paths and
+** hard link targets never resolve through symlinks, so links of the
+** archive can't redirect later ones. Then fixes directories deepest
+** first, as their modes may forbid writing and writing changes mtime.
+*/
+static void _finish_later(efs_tar_reader *r, unsigned long long *counts)
+{
+	for (size_t i = 0; i < r->later.count && r->err == 0; i++) {
+		efs_tar_member *m = &r->later.items[i];
+		if (m->dropped || m->type == '5') {
+			continue;
+		}
+		if (_make_link(r, m) == -1) {
+			_reader_fail(r, errno, m->path);
+		} else {
+			counts[m->type == '1' ? 3 : 2]++;
+		}
+	}
+	for (size_t i = r->later.count; i > 0 && r->err == 0; i--) {
+		efs_tar_member *m = &r->later.items[i - 1];
+		if (m->dropped || m->type != '5') {
+			continue;
+		}
+		int fd = efs_open_beneath(r->dst_fd, m->path,
+				       O_RDONLY | O_DIRECTORY, 0);
+		if (fd == -1) {
+			continue;
+		}
+		struct timespec times[2] = { { 0, UTIME_OMIT },
+					     { m->mtime, 0 } };
+		if (r->same_owner) {
+			(void)!fchown(fd, (uid_t)m->uid, (gid_t)m->gid);
+		}
+		fchmod(fd, _perms(r, m->mode));
+		futimens(fd, times);
+		close(fd);
+		counts[1]++;
+	}
+}
+
+/*
+** Unpacks tar archive (ustar, pax and GNU long names). Files of
+** seekable archives are extracted in parallel with copy_file_range,
+** streams are spliced in order. Links are created after all files,
+** modes and mtimes are restored, owners only with same_owner. Members
+** escaping dst through ".." or through symlinks are refused. A later
+** member replaces an earlier one of the same path, files which existed
+** before fail with EEXIST unless overwrite is set.
+** @param #1 Archive path or open file (read from its position).
+** @param #2 Destination directory, created if missing.
+** @param #3 Options table (optional):
+**   same_owner = false - restore owners, by name where known.
+**   overwrite = false - replace existing files and links.
+** Returns { files, dirs, symlinks, hardlinks, skipped, bytes }.
+*/
+int eli_tar_unpack(lua_State *L)
+{
+	const char *dst = luaL_checkstring(L, 2);
+	efs_tar_reader r;
+	memset(&r, 0, sizeof(r));
+	if (lua_istable(L, 3)) {
+		lua_getfield(L, 3, "same_owner");
+		r.same_owner = lua_toboolean(L, -1);
+		lua_getfield(L, 3, "overwrite");
+		r.overwrite = lua_toboolean(L, -1);
+		lua_pop(L, 2);
+	}
+	const char *src = NULL;
+	if (lua_type(L, 1) == LUA_TSTRING) {
+		src = lua_tostring(L, 1);
+		r.fd = open(src, O_RDONLY | O_CLOEXEC);
+		if (r.fd == -1) {
+			return push_error(L, src);
+		}
+	} else {
+		FILE *f = check_file(L, 1, "tar_unpack");
+		r.fd = fileno(f);
+		off_t pos = ftello(f); /* skips what stdio buffered */
+		if (pos != -1) {
+			lseek(r.fd, pos, SEEK_SET);
+		}
+	}
+	struct stat st;
+	r.offset = lseek(r.fd, 0, SEEK_CUR);
+	r.seekable = r.offset != -1 && fstat(r.fd, &st) == 0 &&
+		     S_ISREG(st.st_mode);
+	if (!r.seekable) {
+		r.offset = 0;
+	}
+	if (mkdir(dst, 0755) == -1 && errno != EEXIST) {
+		int err = errno;
+		if (src != NULL) {
+			close(r.fd);
+		}
+		errno = err;
+		return push_error(L, dst);
+	}
+	r.dst_fd = open(dst, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (r.dst_fd == -1) {
+		int err = errno;
+		if (src != NULL) {
+			close(r.fd);
+		}
+		errno = err;
+		return push_error(L, dst);
+	}
+	pthread_mutex_init(&r.lock, NULL);
+
+	unsigned long long counts[4] = { 0, 0, 0, 0 };
+	if (_read_archive(&r) == 0) {
+		_extract_files(&r);
+		counts[0] = r.regular;
+		_finish_later(&r, counts);
+	}
+	if (src != NULL) {
+		close(r.fd);
+	}
+	close(r.dst_fd);
+	free(r.last_parent);
+	_list_free(&r.files);
+	_list_free(&r.later);
+	_seen_free(&r);
+	pthread_mutex_destroy(&r.lock);
+	if (r.err != 0) {
+		lua_pushstring(L, r.err_path != NULL ? r.err_path :
+				  src != NULL	      ? src :
+							"tar_unpack");
+		free(r.err_path);
+		errno = r.err;
+		return push_error(L, lua_tostring(L, -1));
+	}
+	lua_createtable(L, 0, 6);
+	_set_count(L, "files", counts[0]);
+	_set_count(L, "dirs", counts[1]);
+	_set_count(L, "symlinks", counts[2]);
+	_set_count(L, "hardlinks", counts[3]);
+	_set_count(L, "skipped", r.skipped);
+	_set_count(L, "bytes", r.bytes);
+	return 1;
+}
+
+#endif
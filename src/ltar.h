@@ -0,0 +1,9 @@
+#ifndef ELI_EXTRA_FS_TAR_H__
+#define ELI_EXTRA_FS_TAR_H__
+
+#include "lua.h"
+
+int eli_tar_pack(lua_State *L);
+int eli_tar_unpack(lua_State *L);
+
+#endif /* ELI_EXTRA_FS_TAR_H__ */
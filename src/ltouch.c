@@ -0,0 +1,396 @@
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "lerror.h"
+#include "ltouch.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+
+int eli_touch_many(lua_State *L)
+{
+	errno = ENOSYS; /* = "Function not implemented" */
+	return push_result(L, -1, "touch_many is not supported on Windows");
+}
+
+#else
+
+#include "lpool.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/* paths handled by one pool task */
+#define TOUCH_TASK_PATHS 256
+
+typedef struct efs_touch_path {
+	char *parent; /* NULL for current directory */
+	const char *name; /* points into parent allocation or dir listing */
+} efs_touch_path;
+
+typedef struct efs_touch {
+	struct timespec times[2];
+	int create;
+	int flags; /* utimensat flags */
+	unsigned long touched;
+	unsigned long created;
+	unsigned long missing;
+	unsigned long errors;
+} efs_touch;
+
+typedef struct efs_touch_task {
+	efs_touch *touch;
+	efs_touch_path *paths;
+	size_t count;
+} efs_touch_task;
+
+static void _count(unsigned long *counter)
+{
+	__atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+}
+
+static void _touch_at(efs_touch *touch, int dirfd, const char *name)
+{
+	if (utimensat(dirfd, name, touch->times, touch->flags) == 0) {
+		_count(&touch->touched);
+		return;
+	}
+	if (errno != ENOENT) {
+		_count(&touch->errors);
+		return;
+	}
+	if (!touch->create) {
+		_count(&touch->missing);
+		return;
+	}
+	int fd = openat(dirfd, name,
+			O_WRONLY | O_CREAT | O_NOCTTY | O_NONBLOCK | O_CLOEXEC,
+			0666);
+	if (fd == -1) {
+		_count(&touch->errors);
+		return;
+	}
+	int res = futimens(fd, touch->times);
+	close(fd);
+	_count(res == 0 ? &touch->created : &touch->errors);
+}
+
+/*
+** Touches run of paths, opening every parent directory once. Paths are
+** sorted by parent so each parent forms one contiguous group.
+*/
+static void _touch_task(void *arg)
+{
+	efs_touch_task *task = (efs_touch_task *)arg;
+	efs_touch *touch = task->touch;
+	size_t i = 0;
+	while (i < task->count) {
+		const char *parent = task->paths[i].parent;
+		size_t end = i + 1;
+		while (end < task->count &&
+		       (parent == task->paths[end].parent ||
+			(parent != NULL && task->paths[end].parent != NULL &&
+			 strcmp(parent, task->paths[end].parent) == 0))) {
+			end++;
+		}
+		int dirfd = AT_FDCWD;
+		if (parent != NULL) {
+			dirfd = open(parent, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		}
+		if (dirfd == -1) {
+			for (; i < end; i++) {
+				_count(errno == ENOENT ? &touch->missing :
+							 &touch->errors);
+			}
+			continue;
+		}
+		for (; i < end; i++) {
+			_touch_at(touch, dirfd, task->paths[i].name);
+		}
+		if (dirfd != AT_FDCWD) {
+			close(dirfd);
+		}
+	}
+}
+
+static int _compare_parent(const void *a, const void *b)
+{
+	const efs_touch_path *pa = (const efs_touch_path *)a;
+	const efs_touch_path *pb = (const efs_touch_path *)b;
+	if (pa->parent == NULL || pb->parent == NULL) {
+		return (pa->parent != NULL) - (pb->parent != NULL);
+	}
+	return strcmp(pa->parent, pb->parent);
+}
+
+/*
+** Splits path into parent and name stored in one allocation.
+*/
+static int _split_path(const char *path, efs_touch_path *out)
+{
+	size_t len = strlen(path);
+	while (len > 1 && path[len - 1] == '/') {
+		len--;
+	}
+	size_t slash = len;
+	while (slash > 0 && path[slash - 1] != '/') {
+		slash--;
+	}
+	char *copy = malloc(len + 3);
+	if (copy == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	if (slash == 0) {
+		memcpy(copy, path, len);
+		copy[len] = '\0';
+		out->parent = copy; /* caller keeps it and sets parent NULL */
+		out->name = copy;
+		return 1;
+	}
+	/* "/x" has parent "/", otherwise drop the separator */
+	size_t parent_len = slash > 1 ? slash - 1 : 1;
+	memcpy(copy, path, parent_len);
+	copy[parent_len] = '\0';
+	char *name = copy + parent_len + 1;
+	memcpy(name, path + slash, len - slash);
+	name[len - slash] = '\0';
+	if (len == slash) {
+		strcpy(name, "."); /* root itself */
+	}
+	out->parent = copy;
+	out->name = name;
+	return 0;
+}
+
+static void _free_paths(efs_touch_path *paths, char **owned,
+			size_t owned_count)
+{
+	for (size_t i = 0; i < owned_count; i++) {
+		free(owned[i]);
+	}
+	free(owned);
+	free(paths);
+}
+
+/*
+** Reads time at idx in seconds, "now", or nil/false which yields def.
+*/
+static void _check_time(lua_State *L, int idx, long def, struct timespec *ts)
+{
+	if (!lua_toboolean(L, idx)) {
+		ts->tv_sec = 0;
+		ts->tv_nsec = def;
+	} else if (lua_type(L, idx) == LUA_TSTRING &&
+		   strcmp(lua_tostring(L, idx), "now") == 0) {
+		ts->tv_sec = 0;
+		ts->tv_nsec = UTIME_NOW;
+	} else {
+		lua_Number t = luaL_checknumber(L, idx);
+		lua_Number sec = floor(t);
+		ts->tv_sec = (time_t)sec;
+		ts->tv_nsec = (long)((t - sec) * 1e9);
+	}
+}
+
+static void _check_times(lua_State *L, int idx, struct timespec times[2])
+{
+	if (!lua_istable(L, idx)) {
+		_check_time(L, idx, UTIME_NOW, &times[0]);
+		times[1] = times[0];
+		return;
+	}
+	static const char *const fields[2] = { "atime", "mtime" };
+	static const char *const ns_fields[2] = { "atime_ns", "mtime_ns" };
+	for (int i = 0; i < 2; i++) {
+		lua_getfield(L, idx, fields[i]);
+		_check_time(L, -1, UTIME_OMIT, &times[i]);
+		lua_pop(L, 1);
+		/* exact nanosecond timestamps */
+		lua_getfield(L, idx, ns_fields[i]);
+		if (!lua_isnil(L, -1)) {
+			lua_Integer ns = luaL_checkinteger(L, -1);
+			times[i].tv_sec = (time_t)(ns / 1000000000);
+			times[i].tv_nsec = (long)(ns % 1000000000);
+			if (times[i].tv_nsec < 0) {
+				times[i].tv_sec--;
+				times[i].tv_nsec += 1000000000;
+			}
+		}
+		lua_pop(L, 1);
+	}
+}
+
+/*
+** Sets access and modification times of many files. Paths are grouped
+** by parent directory, every parent is opened once and its files are
+** updated with utimensat relative to it. Groups are spread over the
+** thread pool.
+** @param #1 List of paths, or a directory whose entries are touched.
+** @param #2 Times (optional): seconds (fractions allowed) for both,
+**           "now", or table { atime, mtime, atime_ns, mtime_ns } where
+**           missing or false atime/mtime are left unchanged. Defaults
+**           to now.
+** @param #3 Options table (optional):
+**   create = false - create missing files,
+**   follow = true - when false symlinks themselves are touched.
+** Returns { touched, created, missing, errors }.
+*/
+int eli_touch_many(lua_State *L)
+{
+	efs_touch touch;
+	memset(&touch, 0, sizeof(touch));
+	if (!lua_istable(L, 1)) {
+		luaL_checkstring(L, 1);
+	}
+	_check_times(L, 2, touch.times);
+	if (lua_istable(L, 3)) {
+		lua_getfield(L, 3, "create");
+		touch.create = lua_toboolean(L, -1);
+		lua_getfield(L, 3, "follow");
+		if (!lua_isnil(L, -1) && !lua_toboolean(L, -1)) {
+			touch.flags = AT_SYMLINK_NOFOLLOW;
+		}
+		lua_pop(L, 2);
+	}
+
+	efs_touch_path *paths = NULL;
+	char **owned = NULL;
+	size_t count = 0, owned_count = 0;
+	if (lua_istable(L, 1)) {
+		size_t n = (size_t)luaL_len(L, 1);
+		paths = calloc(n ? n : 1, sizeof(efs_touch_path));
+		owned = calloc(n ? n : 1, sizeof(char *));
+		if (paths == NULL || owned == NULL) {
+			_free_paths(paths, owned, 0);
+			errno = ENOMEM;
+			return push_error(L, NULL);
+		}
+		for (size_t i = 1; i <= n; i++) {
+			lua_geti(L, 1, (lua_Integer)i);
+			const char *path = lua_tostring(L, -1);
+			if (path == NULL) {
+				lua_pop(L, 1);
+				_free_paths(paths, owned, owned_count);
+				return luaL_error(L, "path #%d is not a string",
+						  (int)i);
+			}
+			int res = _split_path(path, &paths[count]);
+			lua_pop(L, 1);
+			if (res == -1) {
+				_free_paths(paths, owned, owned_count);
+				return push_error(L, NULL);
+			}
+			owned[owned_count++] = paths[count].parent;
+			if (res == 1) {
+				paths[count].parent = NULL;
+			}
+			count++;
+		}
+	} else {
+		const char *dir = lua_tostring(L, 1);
+		DIR *d = opendir(dir);
+		if (d == NULL) {
+			return push_error(L, dir);
+		}
+		size_t cap = 64;
+		char *parent = strdup(dir);
+		paths = malloc(cap * sizeof(efs_touch_path));
+		owned = malloc(cap * sizeof(char *));
+		if (parent == NULL || paths == NULL || owned == NULL) {
+			closedir(d);
+			free(parent);
+			_free_paths(paths, owned, 0);
+			errno = ENOMEM;
+			return push_error(L, NULL);
+		}
+		owned[owned_count++] = parent;
+		struct dirent *e;
+		while ((e = readdir(d)) != NULL) {
+			const char *name = e->d_name;
+			if (name[0] == '.' &&
+			    (name[1] == '\0' ||
+			     (name[1] == '.' && name[2] == '\0'))) {
+				continue;
+			}
+			if (count + 1 >= cap) {
+				cap *= 2;
+				efs_touch_path *p =
+					realloc(paths, cap * sizeof(efs_touch_path));
+				char **o = p ? realloc(owned, cap * sizeof(char *)) :
+					       NULL;
+				if (p != NULL) {
+					paths = p;
+				}
+				if (o != NULL) {
+					owned = o;
+				}
+				if (p == NULL || o == NULL) {
+					closedir(d);
+					_free_paths(paths, owned, owned_count);
+					errno = ENOMEM;
+					return push_error(L, NULL);
+				}
+			}
+			char *name_copy = strdup(name);
+			if (name_copy == NULL) {
+				closedir(d);
+				_free_paths(paths, owned, owned_count);
+				errno = ENOMEM;
+				return push_error(L, NULL);
+			}
+			owned[owned_count++] = name_copy;
+			paths[count].parent = parent;
+			paths[count].name = name_copy;
+			count++;
+		}
+		closedir(d);
+	}
+
+	qsort(paths, count, sizeof(efs_touch_path), _compare_parent);
+	size_t tasks = (count + TOUCH_TASK_PATHS - 1) / TOUCH_TASK_PATHS;
+	efs_touch_task *list = calloc(tasks ? tasks : 1, sizeof(efs_touch_task));
+	if (list == NULL) {
+		_free_paths(paths, owned, owned_count);
+		errno = ENOMEM;
+		return push_error(L, NULL);
+	}
+	for (size_t t = 0; t < tasks; t++) {
+		list[t].touch = &touch;
+		list[t].paths = paths + t * TOUCH_TASK_PATHS;
+		list[t].count = t + 1 < tasks ? TOUCH_TASK_PATHS :
+						count - t * TOUCH_TASK_PATHS;
+	}
+	if (tasks == 1) {
+		_touch_task(&list[0]);
+	} else if (tasks > 1) {
+		efs_task_group group;
+		efs_group_init(&group);
+		for (size_t t = 0; t < tasks; t++) {
+			efs_group_submit(&group, _touch_task, &list[t]);
+		}
+		efs_group_wait(&group);
+		efs_group_destroy(&group);
+	}
+	free(list);
+	_free_paths(paths, owned, owned_count);
+
+	lua_createtable(L, 0, 4);
+	lua_pushinteger(L, (lua_Integer)touch.touched);
+	lua_setfield(L, -2, "touched");
+	lua_pushinteger(L, (lua_Integer)touch.created);
+	lua_setfield(L, -2, "created");
+	lua_pushinteger(L, (lua_Integer)touch.missing);
+	lua_setfield(L, -2, "missing");
+	lua_pushinteger(L, (lua_Integer)touch.errors);
+	lua_setfield(L, -2, "errors");
+	return 1;
+}
+
+#endif
@@ -0,0 +1,8 @@
+#ifndef ELI_EXTRA_FS_TOUCH_H__
+#define ELI_EXTRA_FS_TOUCH_H__
+
+#include "lua.h"
+
+int eli_touch_many(lua_State *L);
+
+#endif /* ELI_EXTRA_FS_TOUCH_H__ */
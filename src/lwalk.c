@@ -0,0 +1,411 @@
+#include "lwalk.h"
+
+#ifndef _WIN32
+
+#include "lpool.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef struct efs_path_buf {
+	char *data;
+	size_t len;
+	size_t cap;
+} efs_path_buf;
+
+static int _buf_reserve(efs_path_buf *buf, size_t len)
+{
+	if (len + 1 <= buf->cap) {
+		return 0;
+	}
+	size_t cap = buf->cap ? buf->cap : 256;
+	while (cap < len + 1) {
+		cap *= 2;
+	}
+	char *data = realloc(buf->data, cap);
+	if (data == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	buf->data = data;
+	buf->cap = cap;
+	return 0;
+}
+
+static int _buf_set(efs_path_buf *buf, const char *str, size_t len)
+{
+	if (_buf_reserve(buf, len) == -1) {
+		return -1;
+	}
+	memcpy(buf->data, str, len);
+	buf->data[len] = '\0';
+	buf->len = len;
+	return 0;
+}
+
+static int _buf_push(efs_path_buf *buf, const char *name)
+{
+	size_t name_len = strlen(name);
+	int sep = buf->len > 0 && buf->data[buf->len - 1] != '/';
+	if (_buf_reserve(buf, buf->len + sep + name_len) == -1) {
+		return -1;
+	}
+	if (sep) {
+		buf->data[buf->len++] = '/';
+	}
+	memcpy(buf->data + buf->len, name, name_len + 1);
+	buf->len += name_len;
+	return 0;
+}
+
+static int _is_stopped(efs_walker *walker)
+{
+	return __atomic_load_n(&walker->stopped, __ATOMIC_RELAXED);
+}
+
+static int _open_subdir(efs_walker *walker, int dirfd, const char *name)
+{
+	int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+	if (!(walker->flags & EFS_WALK_FOLLOW)) {
+		flags |= O_NOFOLLOW;
+	}
+	return openat(dirfd, name, flags);
+}
+
+static void _walk_dir(efs_walker *walker, int fd, efs_path_buf *buf,
+		      size_t rel_offset, int depth, dev_t dev);
+
+/*
+** Descends into directory described by entry and calls leave for it
+** once its children are done.
+*/
+static void _walk_subdir(efs_walker *walker, efs_walk_entry *entry,
+			 efs_path_buf *buf, dev_t dev)
+{
+	int subfd = _open_subdir(walker, entry->dirfd, entry->name);
+	if (subfd == -1) {
+		entry->error = errno;
+		__atomic_add_fetch(&walker->errors, 1, __ATOMIC_RELAXED);
+	} else {
+		_walk_dir(walker, subfd, buf, entry->rel_offset,
+			  entry->depth + 1, dev);
+		entry->path = buf->data; /* buffer may have moved */
+	}
+	if (walker->leave != NULL && !_is_stopped(walker) &&
+	    walker->leave(entry, walker->ud) == EFS_WALK_STOP) {
+		__atomic_store_n(&walker->stopped, 1, __ATOMIC_RELAXED);
+	}
+}
+
+static int _visit(efs_walker *walker, int dirfd, const char *name,
+		  efs_path_buf *buf, size_t rel_offset, int depth,
+		  struct stat *st, efs_walk_entry *entry)
+{
+	int flags = walker->flags & EFS_WALK_FOLLOW ? 0 : AT_SYMLINK_NOFOLLOW;
+	if (fstatat(dirfd, name, st, flags) == -1) {
+		/* removed while we were looking */
+		return EFS_WALK_SKIP;
+	}
+	entry->dirfd = dirfd;
+	entry->name = name;
+	entry->path = buf->data;
+	entry->rel_offset = rel_offset;
+	entry->st = st;
+	entry->depth = depth;
+	entry->error = 0;
+	if (walker->enter == NULL) {
+		return EFS_WALK_CONTINUE;
+	}
+	int res = walker->enter(entry, walker->ud);
+	if (res == EFS_WALK_STOP) {
+		__atomic_store_n(&walker->stopped, 1, __ATOMIC_RELAXED);
+	}
+	return res;
+}
+
+static void _walk_dir(efs_walker *walker, int fd, efs_path_buf *buf,
+		      size_t rel_offset, int depth, dev_t dev)
+{
+	DIR *dir = fdopendir(fd);
+	if (dir == NULL) {
+		close(fd);
+		__atomic_add_fetch(&walker->errors, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	size_t base_len = buf->len;
+	struct dirent *d;
+	while (!_is_stopped(walker) && (d = readdir(dir)) != NULL) {
+		const char *name = d->d_name;
+		if (name[0] == '.' &&
+		    (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+			continue;
+		}
+		if (_buf_push(buf, name) == -1) {
+			__atomic_add_fetch(&walker->errors, 1, __ATOMIC_RELAXED);
+			break;
+		}
+		struct stat st;
+		efs_walk_entry entry;
+		int res = _visit(walker, dirfd(dir), name, buf, rel_offset,
+				 depth, &st, &entry);
+		if (res == EFS_WALK_CONTINUE && S_ISDIR(st.st_mode) &&
+		    (!(walker->flags & EFS_WALK_XDEV) || st.st_dev == dev)) {
+			_walk_subdir(walker, &entry, buf, dev);
+		}
+		buf->len = base_len;
+		buf->data[base_len] = '\0';
+	}
+	closedir(dir);
+}
+
+static int _open_root(efs_walker *walker, const char *root, efs_path_buf *buf,
+		      size_t *rel_offset, dev_t *dev)
+{
+	int fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1) {
+		return -1;
+	}
+	struct stat st;
+	if (fstat(fd, &st) == -1 || _buf_set(buf, root, strlen(root)) == -1) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	*dev = st.st_dev;
+	*rel_offset = buf->len;
+	if (buf->len == 0 || buf->data[buf->len - 1] != '/') {
+		*rel_offset += 1;
+	}
+	walker->errors = 0;
+	walker->stopped = 0;
+	return fd;
+}
+
+/*
+** Walks tree below root on the calling thread.
+** Returns -1 (with errno set) if root could not be opened.
+*/
+int efs_walk(efs_walker *walker, const char *root)
+{
+	efs_path_buf buf = { NULL, 0, 0 };
+	size_t rel_offset;
+	dev_t dev;
+	int fd = _open_root(walker, root, &buf, &rel_offset, &dev);
+	if (fd == -1) {
+		free(buf.data);
+		return -1;
+	}
+	_walk_dir(walker, fd, &buf, rel_offset, 1, dev);
+	free(buf.data);
+	return 0;
+}
+
+/*
+** Directory of a parallel walk. A node holds one reference for its own
+** readdir loop and one for every child directory still being walked,
+** wherever that happens. Whoever drops the last reference calls leave
+** and releases the parent, so leave still runs after the whole subtree
+** even when parts of it were walked on other threads. The directory
+** stays open until then, children use it as their dirfd.
+*/
+typedef struct efs_walk_node {
+	efs_walker *walker;
+	efs_task_group *group;
+	struct efs_walk_node *parent;
+	int refs;
+	DIR *dir;
+	struct stat st;
+	dev_t dev;
+	size_t rel_offset;
+	int depth;
+	int error;
+	size_t name_offset; /* name is path + name_offset */
+	size_t path_len;
+	char path[];
+} efs_walk_node;
+
+static efs_walk_node *_node_new(efs_walk_node *parent, const char *path,
+				size_t path_len, size_t name_offset,
+				const struct stat *st)
+{
+	efs_walk_node *node = malloc(sizeof(efs_walk_node) + path_len + 1);
+	if (node == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	node->walker = parent->walker;
+	node->group = parent->group;
+	node->parent = parent;
+	node->refs = 1;
+	node->dir = NULL;
+	node->st = *st;
+	node->dev = parent->dev;
+	node->rel_offset = parent->rel_offset;
+	node->depth = parent->depth + 1;
+	node->error = 0;
+	node->name_offset = name_offset;
+	node->path_len = path_len;
+	memcpy(node->path, path, path_len + 1);
+	__atomic_add_fetch(&parent->refs, 1, __ATOMIC_RELAXED);
+	return node;
+}
+
+static void _node_release(efs_walk_node *node)
+{
+	while (node != NULL &&
+	       __atomic_sub_fetch(&node->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		efs_walker *walker = node->walker;
+		efs_walk_node *parent = node->parent;
+		if (parent != NULL && walker->leave != NULL &&
+		    !_is_stopped(walker)) {
+			efs_walk_entry entry;
+			entry.dirfd = dirfd(parent->dir);
+			entry.name = node->path + node->name_offset;
+			entry.path = node->path;
+			entry.rel_offset = node->rel_offset;
+			entry.st = &node->st;
+			entry.depth = node->depth;
+			entry.error = node->error;
+			if (walker->leave(&entry, walker->ud) == EFS_WALK_STOP) {
+				__atomic_store_n(&walker->stopped, 1,
+						 __ATOMIC_RELAXED);
+			}
+		}
+		if (node->dir != NULL) {
+			closedir(node->dir);
+		}
+		if (parent != NULL) {
+			free(node);
+		} else {
+			node->dir = NULL; /* root is freed by its walk */
+		}
+		node = parent;
+	}
+}
+
+static void _node_walk(efs_walk_node *node);
+
+static void _node_task(void *arg)
+{
+	_node_walk((efs_walk_node *)arg);
+}
+
+/*
+** Reads directory of node. Child directories go to the pool while it
+** has fewer queued tasks than workers, so a tree that is mostly one
+** deep subdirectory still spreads out. Otherwise they are walked on
+** this thread.
+*/
+static void _node_walk(efs_walk_node *node)
+{
+	efs_walker *walker = node->walker;
+	if (node->dir == NULL && !_is_stopped(walker)) {
+		const char *name = node->path + node->name_offset;
+		int fd = _open_subdir(walker, dirfd(node->parent->dir), name);
+		if (fd != -1 && (node->dir = fdopendir(fd)) == NULL) {
+			close(fd);
+		}
+		if (node->dir == NULL) {
+			node->error = errno;
+			__atomic_add_fetch(&walker->errors, 1, __ATOMIC_RELAXED);
+		}
+	}
+	efs_path_buf buf = { NULL, 0, 0 };
+	if (node->dir != NULL &&
+	    _buf_set(&buf, node->path, node->path_len) == -1) {
+		__atomic_add_fetch(&walker->errors, 1, __ATOMIC_RELAXED);
+	}
+	int workers = efs_pool_size();
+	size_t base_len = buf.len;
+	struct dirent *d;
+	while (buf.data != NULL && !_is_stopped(walker) &&
+	       (d = readdir(node->dir)) != NULL) {
+		const char *name = d->d_name;
+		if (name[0] == '.' &&
+		    (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+			continue;
+		}
+		if (_buf_push(&buf, name) == -1) {
+			__atomic_add_fetch(&walker->errors, 1, __ATOMIC_RELAXED);
+			break;
+		}
+		struct stat st;
+		efs_walk_entry entry;
+		int res = _visit(walker, dirfd(node->dir), name, &buf,
+				 node->rel_offset, node->depth + 1, &st,
+				 &entry);
+		if (res == EFS_WALK_CONTINUE && S_ISDIR(st.st_mode) &&
+		    (!(walker->flags & EFS_WALK_XDEV) || st.st_dev == node->dev)) {
+			efs_walk_node *child = _node_new(
+				node, buf.data, buf.len, buf.len - strlen(name),
+				&st);
+			if (child == NULL) {
+				__atomic_add_fetch(&walker->errors, 1,
+						   __ATOMIC_RELAXED);
+			} else if (efs_pool_queued() < workers) {
+				efs_group_submit(node->group, _node_task, child);
+			} else {
+				_node_walk(child);
+			}
+		}
+		buf.len = base_len;
+		buf.data[base_len] = '\0';
+	}
+	free(buf.data);
+	_node_release(node);
+}
+
+/*
+** Walks tree below root on the shared pool. Any subdirectory may be
+** handed to another worker, leave is called once a directory and
+** everything below it are done.
+*/
+int efs_walk_parallel(efs_walker *walker, const char *root)
+{
+	efs_path_buf buf = { NULL, 0, 0 };
+	size_t rel_offset;
+	dev_t dev;
+	int fd = _open_root(walker, root, &buf, &rel_offset, &dev);
+	if (fd == -1) {
+		free(buf.data);
+		return -1;
+	}
+	efs_walk_node *node = malloc(sizeof(efs_walk_node) + buf.len + 1);
+	DIR *dir = node != NULL ? fdopendir(fd) : NULL;
+	if (dir == NULL) {
+		int err = node != NULL ? errno : ENOMEM;
+		close(fd);
+		free(node);
+		free(buf.data);
+		errno = err;
+		return -1;
+	}
+
+	efs_task_group group;
+	efs_group_init(&group);
+	node->walker = walker;
+	node->group = &group;
+	node->parent = NULL;
+	node->refs = 1;
+	node->dir = dir;
+	node->dev = dev;
+	node->rel_offset = rel_offset;
+	node->depth = 0;
+	node->error = 0;
+	node->name_offset = buf.len;
+	node->path_len = buf.len;
+	memcpy(node->path, buf.data, buf.len + 1);
+	free(buf.data);
+	_node_walk(node);
+	efs_group_wait(&group);
+	efs_group_destroy(&group);
+	free(node);
+	return 0;
+}
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef ELI_EXTRA_FS_WALK_H__
+#define ELI_EXTRA_FS_WALK_H__
+
+#ifndef _WIN32
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+#define EFS_WALK_CONTINUE 0
+#define EFS_WALK_SKIP 1 /* do not descend into this directory */
+#define EFS_WALK_STOP 2
+
+#define EFS_WALK_XDEV 1 /* stay on the filesystem of the root */
+#define EFS_WALK_FOLLOW 2 /* stat through symlinks */
+
+typedef struct efs_walk_entry {
+	int dirfd; /* parent directory, valid during the callback only */
+	const char *name;
+	const char *path; /* root joined with relative path */
+	size_t rel_offset; /* path + rel_offset is the relative path */
+	const struct stat *st;
+	int depth; /* children of root have depth 1 */
+	int error; /* errno if directory could not be read (leave only) */
+} efs_walk_entry;
+
+typedef int (*efs_walk_fn)(efs_walk_entry *entry, void *ud);
+
+/*
+** `enter` is called for every entry below root before descending into
+** it, `leave` for every directory after its children. Either may be
+** NULL. In parallel walks callbacks run on pool threads.
+*/
+typedef struct efs_walker {
+	efs_walk_fn enter;
+	efs_walk_fn leave;
+	void *ud;
+	int flags;
+	int errors; /* directories that could not be read */
+	int stopped;
+} efs_walker;
+
+int efs_walk(efs_walker *walker, const char *root);
+int efs_walk_parallel(efs_walker *walker, const char *root);
+
+#endif
+
+#endif /* ELI_EXTRA_FS_WALK_H__ */
@@ -0,0 +1,695 @@
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "lerror.h"
+#include "lwatch.h"
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+
+#ifndef __linux__
+
+int eli_watch(lua_State *L)
+{
+	errno = ENOSYS; /* = "Function not implemented" */
+	return push_result(L, -1, "watch is supported on Linux only");
+}
+
+int watcher_create_meta(lua_State *L)
+{
+	return 0;
+}
+
+#else
+
+#include "lwalk.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#define WATCHER_METATABLE "ELI_WATCHER"
+
+#define WATCH_DEFAULT_DEBOUNCE_MS 50
+#define WATCH_DEFAULT_MAX_LATENCY_MS 1000
+#define WATCH_BUCKETS 1024
+#define WATCH_MASK                                                 \
+	(IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_MOVED_FROM | \
+	 IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+/*
+** Pending (coalesced) change of a single path. Raw inotify events for
+** the same path are folded into one until the path stays quiet for the
+** debounce window, or for at most max latency while it keeps changing.
+*/
+typedef struct efs_watch_event {
+	char *path;
+	const char *type;
+	int is_dir;
+	int count;
+	uint64_t first_ns;
+	uint64_t last_ns;
+	unsigned hash;
+	struct efs_watch_event *next; /* insertion order */
+	struct efs_watch_event *prev;
+	struct efs_watch_event *hnext; /* bucket chain */
+} efs_watch_event;
+
+typedef struct efs_watcher {
+	int fd;
+	int recursive;
+	uint64_t debounce_ns;
+	uint64_t max_latency_ns;
+	char **wd_paths; /* indexed by watch descriptor */
+	int wd_cap;
+	char **roots;
+	int root_count;
+	int overflowed;
+	int watch_error; /* errno of the first subtree left unwatched */
+	char *watch_error_path;
+	size_t pending;
+	efs_watch_event *head;
+	efs_watch_event *tail;
+	efs_watch_event *buckets[WATCH_BUCKETS];
+} efs_watcher;
+
+static uint64_t _now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static unsigned _hash_path(const char *path)
+{
+	unsigned hash = 2166136261u;
+	for (; *path; path++) {
+		hash = (hash ^ (unsigned char)*path) * 16777619u;
+	}
+	return hash;
+}
+
+static efs_watch_event *_find_event(efs_watcher *w, const char *path,
+				    unsigned hash)
+{
+	efs_watch_event *ev = w->buckets[hash % WATCH_BUCKETS];
+	while (ev != NULL && (ev->hash != hash || strcmp(ev->path, path) != 0)) {
+		ev = ev->hnext;
+	}
+	return ev;
+}
+
+static void _unlink_event(efs_watcher *w, efs_watch_event *ev)
+{
+	efs_watch_event **slot = &w->buckets[ev->hash % WATCH_BUCKETS];
+	while (*slot != ev) {
+		slot = &(*slot)->hnext;
+	}
+	*slot = ev->hnext;
+	if (ev->prev != NULL) {
+		ev->prev->next = ev->next;
+	} else {
+		w->head = ev->next;
+	}
+	if (ev->next != NULL) {
+		ev->next->prev = ev->prev;
+	} else {
+		w->tail = ev->prev;
+	}
+	w->pending--;
+}
+
+static void _free_event(efs_watch_event *ev)
+{
+	free(ev->path);
+	free(ev);
+}
+
+/*
+** Folds raw event into pending change for path:
+**   create + ... + delete  -> dropped, path never existed for the reader
+**   delete + ... + create  -> modify (path was replaced)
+**   create + modify        -> create
+**   modify/attrib repeated -> single event
+*/
+static void _fold_event(efs_watcher *w, const char *path, const char *type,
+			int is_dir, uint64_t now)
+{
+	unsigned hash = _hash_path(path);
+	efs_watch_event *ev = _find_event(w, path, hash);
+	if (ev == NULL) {
+		ev = calloc(1, sizeof(efs_watch_event));
+		if (ev == NULL || (ev->path = strdup(path)) == NULL) {
+			free(ev);
+			w->overflowed = 1; /* lost an event, make reader rescan */
+			return;
+		}
+		ev->type = type;
+		ev->hash = hash;
+		ev->first_ns = now;
+		ev->hnext = w->buckets[hash % WATCH_BUCKETS];
+		w->buckets[hash % WATCH_BUCKETS] = ev;
+		ev->prev = w->tail;
+		if (w->tail != NULL) {
+			w->tail->next = ev;
+		} else {
+			w->head = ev;
+		}
+		w->tail = ev;
+		w->pending++;
+	} else {
+		int appeared = strcmp(ev->type, "create") == 0 ||
+			       strcmp(ev->type, "move_to") == 0;
+		int vanished = strcmp(ev->type, "delete") == 0 ||
+			       strcmp(ev->type, "move_from") == 0;
+		int removing = strcmp(type, "delete") == 0 ||
+			       strcmp(type, "move_from") == 0;
+		int adding = strcmp(type, "create") == 0 ||
+			     strcmp(type, "move_to") == 0;
+		if (removing && appeared) {
+			_unlink_event(w, ev);
+			_free_event(ev);
+			return;
+		}
+		if (adding && vanished) {
+			ev->type = "modify";
+		} else if (removing || adding) {
+			ev->type = type;
+		} else if (strcmp(type, "modify") == 0 &&
+			   strcmp(ev->type, "attrib") == 0) {
+			ev->type = type;
+		}
+	}
+	ev->is_dir = is_dir;
+	ev->count++;
+	ev->last_ns = now;
+}
+
+static int _set_wd_path(efs_watcher *w, int wd, const char *path)
+{
+	if (wd >= w->wd_cap) {
+		int cap = w->wd_cap ? w->wd_cap : 64;
+		while (cap <= wd) {
+			cap *= 2;
+		}
+		char **paths = realloc(w->wd_paths, cap * sizeof(char *));
+		if (paths == NULL) {
+			return -1;
+		}
+		memset(paths + w->wd_cap, 0, (cap - w->wd_cap) * sizeof(char *));
+		w->wd_paths = paths;
+		w->wd_cap = cap;
+	}
+	char *copy = strdup(path);
+	if (copy == NULL) {
+		return -1;
+	}
+	free(w->wd_paths[wd]);
+	w->wd_paths[wd] = copy;
+	return 0;
+}
+
+static int _add_watch(efs_watcher *w, const char *path)
+{
+	int wd = inotify_add_watch(w->fd, path, WATCH_MASK | IN_DONT_FOLLOW);
+	if (wd == -1) {
+		return -1;
+	}
+	return _set_wd_path(w, wd, path);
+}
+
+/*
+** Remembers the first directory that could not be watched until read()
+** reports it. Directories removed before their watch was added are not
+** an error, their parent reports the removal.
+*/
+static void _watch_failed(efs_watcher *w, const char *path, int err)
+{
+	if (err == ENOENT || err == ENOTDIR || w->watch_error != 0) {
+		return;
+	}
+	w->watch_error = err;
+	w->watch_error_path = strdup(path);
+}
+
+typedef struct efs_watch_scan {
+	efs_watcher *watcher;
+	int report; /* fold create events for everything found */
+	uint64_t now;
+	int error; /* errno of the first failed watch */
+} efs_watch_scan;
+
+static int _scan_enter(efs_walk_entry *entry, void *ud)
+{
+	efs_watch_scan *scan = (efs_watch_scan *)ud;
+	int is_dir = S_ISDIR(entry->st->st_mode);
+	if (scan->report) {
+		_fold_event(scan->watcher, entry->path, "create", is_dir,
+			    scan->now);
+	}
+	if (is_dir && _add_watch(scan->watcher, entry->path) == -1) {
+		if (errno == ENOENT || errno == ENOTDIR) {
+			return EFS_WALK_SKIP;
+		}
+		if (scan->error == 0) {
+			scan->error = errno;
+			_watch_failed(scan->watcher, entry->path, errno);
+		}
+		/* ENOSPC (max_user_watches) fails for the rest as well */
+		return scan->report ? EFS_WALK_SKIP : EFS_WALK_STOP;
+	}
+	return EFS_WALK_CONTINUE;
+}
+
+/*
+** Adds watches for path and (in recursive mode) every directory below.
+** With report set, entries found below path are reported as created,
+** they may have appeared before their directory got its watch.
+** Returns -1 if path or any directory below it could not be watched.
+*/
+static int _watch_tree(efs_watcher *w, const char *path, int report)
+{
+	if (_add_watch(w, path) == -1) {
+		return -1;
+	}
+	if (!w->recursive) {
+		return 0;
+	}
+	struct stat st;
+	if (lstat(path, &st) == -1 || !S_ISDIR(st.st_mode)) {
+		return 0;
+	}
+	efs_watch_scan scan = { w, report, _now_ns(), 0 };
+	efs_walker walker = { _scan_enter, NULL, &scan, 0, 0, 0 };
+	efs_walk(&walker, path);
+	if (scan.error != 0) {
+		errno = scan.error;
+		return -1;
+	}
+	return 0;
+}
+
+static void _rescan(efs_watcher *w)
+{
+	for (int i = 0; i < w->root_count; i++) {
+		if (_watch_tree(w, w->roots[i], 0) == -1) {
+			_watch_failed(w, w->roots[i], errno);
+		}
+	}
+}
+
+static void _handle_raw(efs_watcher *w, struct inotify_event *ie, uint64_t now)
+{
+	if (ie->mask & IN_Q_OVERFLOW) {
+		w->overflowed = 1;
+		return;
+	}
+	if (ie->wd < 0 || ie->wd >= w->wd_cap || w->wd_paths[ie->wd] == NULL) {
+		return;
+	}
+	const char *base = w->wd_paths[ie->wd];
+	if (ie->mask & IN_IGNORED) {
+		free(w->wd_paths[ie->wd]);
+		w->wd_paths[ie->wd] = NULL;
+		return;
+	}
+	char *path;
+	char stack_path[512];
+	size_t len = ie->len > 0 ? strlen(base) + 1 + strlen(ie->name) :
+				   strlen(base);
+	path = len < sizeof(stack_path) ? stack_path : malloc(len + 1);
+	if (path == NULL) {
+		w->overflowed = 1;
+		return;
+	}
+	if (ie->len > 0) {
+		snprintf(path, len + 1, "%s/%s", base, ie->name);
+	} else {
+		memcpy(path, base, len + 1);
+	}
+
+	int is_dir = (ie->mask & IN_ISDIR) != 0;
+	const char *type = NULL;
+	if (ie->mask & IN_CREATE) {
+		type = "create";
+	} else if (ie->mask & IN_MOVED_TO) {
+		type = "move_to";
+	} else if (ie->mask & IN_DELETE) {
+		type = "delete";
+	} else if (ie->mask & IN_MOVED_FROM) {
+		type = "move_from";
+	} else if (ie->mask & IN_MODIFY) {
+		type = "modify";
+	} else if (ie->mask & IN_ATTRIB) {
+		type = "attrib";
+	} else if (ie->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+		/* the parent reports these unless this is a root */
+		for (int i = 0; i < w->root_count; i++) {
+			if (strcmp(w->roots[i], path) == 0) {
+				type = ie->mask & IN_DELETE_SELF ? "delete" :
+								   "move_from";
+				break;
+			}
+		}
+	}
+	if (type != NULL) {
+		_fold_event(w, path, type, is_dir, now);
+		if (is_dir && w->recursive &&
+		    (ie->mask & (IN_CREATE | IN_MOVED_TO)) &&
+		    _watch_tree(w, path, 1) == -1) {
+			_watch_failed(w, path, errno);
+		}
+	}
+	if (path != stack_path) {
+		free(path);
+	}
+}
+
+/* reads everything the kernel has queued right now */
+static int _drain(efs_watcher *w)
+{
+	char buf[64 * 1024]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	for (;;) {
+		ssize_t n = read(w->fd, buf, sizeof(buf));
+		if (n == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
+			}
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		uint64_t now = _now_ns();
+		for (char *p = buf; p < buf + n;) {
+			struct inotify_event *ie = (struct inotify_event *)p;
+			_handle_raw(w, ie, now);
+			p += sizeof(struct inotify_event) + ie->len;
+		}
+	}
+}
+
+static efs_watcher *_check_watcher(lua_State *L, int idx)
+{
+	efs_watcher *w = (efs_watcher *)luaL_checkudata(L, idx, WATCHER_METATABLE);
+	luaL_argcheck(L, w->fd != -1, idx, "closed " WATCHER_METATABLE);
+	return w;
+}
+
+static void _push_event(lua_State *L, const char *type, const char *path,
+			int is_dir, int count)
+{
+	lua_createtable(L, 0, 4);
+	lua_pushstring(L, type);
+	lua_setfield(L, -2, "type");
+	if (path != NULL) {
+		lua_pushstring(L, path);
+		lua_setfield(L, -2, "path");
+	}
+	lua_pushboolean(L, is_dir);
+	lua_setfield(L, -2, "dir");
+	lua_pushinteger(L, count);
+	lua_setfield(L, -2, "count");
+}
+
+/*
+** Returns batch of coalesced events which stayed quiet for the debounce
+** window, or were first seen max_latency_ms ago. Waits up to timeout for at least one event. A directory that
+** could not be watched (ENOSPC once max_user_watches is reached) is
+** reported as an "error" event with `error` and `errno` fields.
+** @param #1 Watcher.
+** @param #2 Timeout in milliseconds, 0 (default) does not block,
+**           negative blocks until events are available.
+*/
+static int watcher_read(lua_State *L)
+{
+	efs_watcher *w = _check_watcher(L, 1);
+	lua_Integer timeout = luaL_optinteger(L, 2, 0);
+	uint64_t deadline = timeout >= 0 ?
+				    _now_ns() + (uint64_t)timeout * 1000000ull :
+				    UINT64_MAX;
+	lua_newtable(L);
+	int count = 0;
+	for (;;) {
+		if (_drain(w) == -1) {
+			return push_error(L, NULL);
+		}
+		uint64_t now = _now_ns();
+		if (w->overflowed) {
+			/* events were lost, readers have to rescan roots */
+			w->overflowed = 0;
+			_rescan(w);
+			_push_event(L, "overflow", NULL, 0, 1);
+			lua_rawseti(L, -2, ++count);
+			for (int i = 0; i < w->root_count; i++) {
+				_push_event(L, "rescan", w->roots[i], 1, 1);
+				lua_rawseti(L, -2, ++count);
+			}
+		}
+		if (w->watch_error != 0) {
+			/* changes below path are no longer seen */
+			_push_event(L, "error", w->watch_error_path, 1, 1);
+			lua_pushstring(L, strerror(w->watch_error));
+			lua_setfield(L, -2, "error");
+			lua_pushinteger(L, w->watch_error);
+			lua_setfield(L, -2, "errno");
+			lua_rawseti(L, -2, ++count);
+			free(w->watch_error_path);
+			w->watch_error_path = NULL;
+			w->watch_error = 0;
+		}
+		uint64_t next_due = UINT64_MAX;
+		efs_watch_event *ev = w->head;
+		while (ev != NULL) {
+			efs_watch_event *next = ev->next;
+			uint64_t due = ev->last_ns + w->debounce_ns;
+			if (ev->first_ns + w->max_latency_ns < due) {
+				/* a path changing all the time still shows */
+				due = ev->first_ns + w->max_latency_ns;
+			}
+			if (due <= now) {
+				_push_event(L, ev->type, ev->path, ev->is_dir,
+					    ev->count);
+				lua_rawseti(L, -2, ++count);
+				_unlink_event(w, ev);
+				_free_event(ev);
+			} else if (due < next_due) {
+				next_due = due;
+			}
+			ev = next;
+		}
+		if (count > 0 || now >= deadline) {
+			return 1;
+		}
+		uint64_t wake = next_due < deadline ? next_due : deadline;
+		int wait_ms = wake == UINT64_MAX ?
+				      -1 :
+				      (int)((wake - now + 999999) / 1000000);
+		struct pollfd pfd = { .fd = w->fd, .events = POLLIN };
+		if (poll(&pfd, 1, wait_ms) == -1 && errno != EINTR) {
+			return push_error(L, NULL);
+		}
+	}
+}
+
+static int _add_root(efs_watcher *w, const char *path)
+{
+	char **roots = realloc(w->roots, (w->root_count + 1) * sizeof(char *));
+	if (roots == NULL) {
+		return -1;
+	}
+	w->roots = roots;
+	size_t len = strlen(path);
+	while (len > 1 && path[len - 1] == '/') {
+		len--;
+	}
+	if ((w->roots[w->root_count] = strndup(path, len)) == NULL) {
+		return -1;
+	}
+	if (_watch_tree(w, w->roots[w->root_count], 0) == -1) {
+		int err = errno;
+		free(w->roots[w->root_count]);
+		/* reported to the caller instead of through read() */
+		free(w->watch_error_path);
+		w->watch_error_path = NULL;
+		w->watch_error = 0;
+		errno = err;
+		return -1;
+	}
+	w->root_count++;
+	return 0;
+}
+
+/*
+** Adds another path (and its subdirectories in recursive mode).
+*/
+static int watcher_add(lua_State *L)
+{
+	efs_watcher *w = _check_watcher(L, 1);
+	const char *path = luaL_checkstring(L, 2);
+	if (_add_root(w, path) == -1) {
+		return push_error(L, NULL);
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int watcher_fd(lua_State *L)
+{
+	efs_watcher *w = _check_watcher(L, 1);
+	lua_pushinteger(L, w->fd);
+	return 1;
+}
+
+static int watcher_pending(lua_State *L)
+{
+	efs_watcher *w = _check_watcher(L, 1);
+	lua_pushinteger(L, (lua_Integer)w->pending);
+	return 1;
+}
+
+static void _close_watcher(efs_watcher *w)
+{
+	if (w->fd == -1) {
+		return;
+	}
+	close(w->fd);
+	w->fd = -1;
+	for (int i = 0; i < w->wd_cap; i++) {
+		free(w->wd_paths[i]);
+	}
+	free(w->wd_paths);
+	w->wd_paths = NULL;
+	w->wd_cap = 0;
+	for (int i = 0; i < w->root_count; i++) {
+		free(w->roots[i]);
+	}
+	free(w->roots);
+	w->roots = NULL;
+	w->root_count = 0;
+	free(w->watch_error_path);
+	w->watch_error_path = NULL;
+	efs_watch_event *ev = w->head;
+	while (ev != NULL) {
+		efs_watch_event *next = ev->next;
+		_free_event(ev);
+		ev = next;
+	}
+	w->head = w->tail = NULL;
+}
+
+static int watcher_close(lua_State *L)
+{
+	efs_watcher *w = (efs_watcher *)luaL_checkudata(L, 1, WATCHER_METATABLE);
+	_close_watcher(w);
+	return 0;
+}
+
+/*
+** Watches paths for changes. Fails if any directory below the paths
+** can not be watched.
+** @param #1 Path or table of paths.
+** @param #2 Options table (optional):
+**   recursive = true,
+**   debounce_ms = 50 - quiet time before a change is reported,
+**   max_latency_ms = 1000 - longest a change is held back while its
+**                           path keeps changing.
+*/
+int eli_watch(lua_State *L)
+{
+	int paths_type = lua_type(L, 1);
+	luaL_argexpected(L, paths_type == LUA_TSTRING || paths_type == LUA_TTABLE,
+			 1, "string or table");
+	int recursive = 1;
+	lua_Integer debounce = WATCH_DEFAULT_DEBOUNCE_MS;
+	lua_Integer max_latency = WATCH_DEFAULT_MAX_LATENCY_MS;
+	if (lua_istable(L, 2)) {
+		lua_getfield(L, 2, "recursive");
+		if (!lua_isnil(L, -1)) {
+			recursive = lua_toboolean(L, -1);
+		}
+		lua_getfield(L, 2, "debounce_ms");
+		debounce = luaL_optinteger(L, -1, debounce);
+		lua_getfield(L, 2, "max_latency_ms");
+		max_latency = luaL_optinteger(L, -1, max_latency);
+		lua_pop(L, 3);
+	}
+
+	efs_watcher *w = (efs_watcher *)lua_newuserdata(L, sizeof(efs_watcher));
+	memset(w, 0, sizeof(efs_watcher));
+	w->fd = -1;
+	luaL_getmetatable(L, WATCHER_METATABLE);
+	lua_setmetatable(L, -2);
+	w->recursive = recursive;
+	w->debounce_ns = debounce > 0 ? (uint64_t)debounce * 1000000ull : 0;
+	w->max_latency_ns = max_latency > 0 ?
+				    (uint64_t)max_latency * 1000000ull :
+				    0;
+	w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (w->fd == -1) {
+		return push_error(L, NULL);
+	}
+
+	if (paths_type == LUA_TSTRING) {
+		if (_add_root(w, lua_tostring(L, 1)) == -1) {
+			/* give the watches back now, not at collection */
+			int err = errno;
+			_close_watcher(w);
+			errno = err;
+			return push_error(L, lua_tostring(L, 1));
+		}
+	} else {
+		lua_Integer n = luaL_len(L, 1);
+		for (lua_Integer i = 1; i <= n; i++) {
+			lua_geti(L, 1, i);
+			const char *path = lua_tostring(L, -1);
+			if (path == NULL || _add_root(w, path) == -1) {
+				int err = errno;
+				_close_watcher(w);
+				errno = err;
+				return push_error(L, path);
+			}
+			lua_pop(L, 1);
+		}
+	}
+	return 1;
+}
+
+/*
+** Creates watcher metatable.
+*/
+int watcher_create_meta(lua_State *L)
+{
+	luaL_newmetatable(L, WATCHER_METATABLE);
+	/* Method table */
+	lua_newtable(L);
+	lua_pushcfunction(L, watcher_read);
+	lua_setfield(L, -2, "read");
+	lua_pushcfunction(L, watcher_add);
+	lua_setfield(L, -2, "add");
+	lua_pushcfunction(L, watcher_fd);
+	lua_setfield(L, -2, "fd");
+	lua_pushcfunction(L, watcher_pending);
+	lua_setfield(L, -2, "pending");
+	lua_pushcfunction(L, watcher_close);
+	lua_setfield(L, -2, "close");
+	/* type */
+	lua_pushstring(L, WATCHER_METATABLE);
+	lua_setfield(L, -2, "__type");
+
+	/* Metamethods */
+	lua_setfield(L, -2, "__index");
+	lua_pushcfunction(L, watcher_close);
+	lua_setfield(L, -2, "__gc");
+	lua_pushcfunction(L, watcher_close);
+	lua_setfield(L, -2, "__close");
+	return 1;
+}
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef ELI_EXTRA_FS_WATCH_H__
+#define ELI_EXTRA_FS_WATCH_H__
+
+#include "lua.h"
+
+int eli_watch(lua_State *L);
+
+int watcher_create_meta(lua_State *L);
+
+#endif /* ELI_EXTRA_FS_WATCH_H__ */
\ No newline at end of file
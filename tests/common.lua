@@ -0,0 +1,51 @@
+-- Helpers shared by the regression tests: scratch directories, file
+-- contents and a runner reporting failures through the exit status.
+-- Run tests through eli_fs_extra_bench, ctest does so for tests/test_*.lua.
+local fs = require "eli.fs.extra"
+
+local common = {}
+
+local function quote(path)
+	return "'" .. path:gsub("'", "'\\''") .. "'"
+end
+
+function common.remove_tree(dir)
+	os.execute("chmod -R u+rwx " .. quote(dir) .. " 2>/dev/null; rm -rf " .. quote(dir))
+end
+
+-- fresh directory below $TMPDIR, removed by common.run
+function common.scratch(name)
+	local base = os.getenv("TMPDIR") or "/tmp"
+	local dir = string.format("%s/eli_fs_extra_test.%s.%d.%d", base, name, os.time(), math.random(1 << 30))
+	assert(fs.mkdir(dir))
+	return dir
+end
+
+function common.write(path, data)
+	local f = assert(io.open(path, "wb"))
+	f:write(data)
+	f:close()
+end
+
+function common.read(path)
+	local f = io.open(path, "rb")
+	if f == nil then return nil end
+	local data = f:read("a")
+	f:close()
+	return data
+end
+
+-- runs cases in order on a scratch directory each, raises on the first failure
+function common.run(name, cases)
+	for _, case in ipairs(cases) do
+		local dir = common.scratch(name)
+		local ok, err = pcall(case[2], dir)
+		common.remove_tree(dir)
+		if not ok then
+			error(string.format("%s: %s: %s", name, case[1], err), 0)
+		end
+		print("ok - " .. case[1])
+	end
+end
+
+return common
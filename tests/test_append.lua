@@ -0,0 +1,35 @@
+-- Append log batches failing halfway.
+local common = require "common"
+local fs = require "eli.fs.extra"
+
+local function quote(path)
+	return "'" .. path:gsub("'", "'\\''") .. "'"
+end
+
+-- child: writes through a file size limit of one block, prints what it saw
+if arg[1] == "child" then
+	local log = assert(fs.open_append_log(arg[2], { flush_bytes = 1000 }))
+	local ok, err = log:write(string.rep("a", 3000))
+	local stats = log:stats()
+	print(tostring(ok), tostring(err), log:buffered(), stats.short_writes)
+	assert(log:close())
+	os.exit(0)
+end
+
+common.run("append", {
+	{ "short write drops the rest of the batch", function(dir)
+		local path = dir .. "/log"
+		-- the shell's parent is this host, SIGXFSZ ignored turns the limit into EFBIG
+		local cmd = string.format("trap '' XFSZ; ulimit -f 1; exec /proc/$PPID/exe %s child %s >%s",
+			quote(arg[0]), quote(path), quote(dir .. "/out"))
+		assert(os.execute(cmd))
+		local out = common.read(dir .. "/out")
+		local ok, err, buffered, short = out:match("^(%S+)\t(.-)\t(%d+)\t(%d+)\n")
+		assert(ok == "nil", "child: " .. out)
+		local data = common.read(path)
+		assert(#data > 0 and #data < 3000 and data == string.rep("a", #data),
+			"log holds " .. #data .. " bytes")
+		assert(err:find(#data .. " of 3001 bytes written", 1, true), err)
+		assert(buffered == "0" and short == "1", out)
+	end },
+})
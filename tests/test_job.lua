@@ -0,0 +1,65 @@
+-- start_job("copy") with destinations inside the source or reached
+-- through symlinks.
+local fs = require "eli.fs.extra"
+local common = require "common"
+
+local function copy(src, dst)
+	local job = assert(fs.start_job("copy", { src = src, dst = dst }))
+	assert(job:wait())
+	return job:result()
+end
+
+common.run("job", {
+	{ "destination inside the source", function(dir)
+		local src = dir .. "/src"
+		assert(fs.mkdir(src))
+		assert(fs.mkdir(src .. "/sub"))
+		common.write(src .. "/f", "f")
+		common.write(src .. "/sub/g", "g")
+		local res = assert(copy(src, src .. "/out"))
+		assert(res.errors == 0, res.errors)
+		assert(res.files == 2 and res.dirs == 1, res.files .. " " .. res.dirs)
+		assert(common.read(src .. "/out/f") == "f")
+		assert(common.read(src .. "/out/sub/g") == "g")
+		assert(fs.link_info(src .. "/out/out") == nil, "copied into itself")
+	end },
+	{ "destination equal to the source", function(dir)
+		assert(fs.mkdir(dir .. "/src"))
+		common.write(dir .. "/src/f", "f")
+		local res, err = copy(dir .. "/src", dir .. "/src/.")
+		assert(res == nil and err:find("Invalid argument"), err)
+		res, err = copy(dir .. "/src/f", dir .. "/src/./f")
+		assert(res == nil and err:find("Invalid argument"), err)
+		assert(common.read(dir .. "/src/f") == "f")
+	end },
+	{ "symlinks already in the destination", function(dir)
+		local src, dst, outside = dir .. "/src", dir .. "/dst", dir .. "/outside"
+		for _, d in ipairs({ src, src .. "/sub", dst, outside }) do assert(fs.mkdir(d)) end
+		common.write(src .. "/sub/passwd", "copied")
+		common.write(src .. "/f", "new")
+		common.write(outside .. "/passwd", "outside")
+		common.write(outside .. "/f", "outside")
+		assert(os.execute("ln -s '" .. outside .. "' '" .. dst .. "/sub'"))
+		assert(os.execute("ln -s '" .. outside .. "/f' '" .. dst .. "/f'"))
+		local res = assert(copy(src, dst))
+		assert(res.errors > 0, "copied through dst/sub")
+		assert(common.read(outside .. "/passwd") == "outside")
+		-- a symlink in place of a file is replaced, not written through
+		assert(common.read(outside .. "/f") == "outside")
+		assert(fs.link_info(dst .. "/f").mode == "file")
+		assert(common.read(dst .. "/f") == "new")
+	end },
+	{ "existing entries are replaced by symlinks", function(dir)
+		local src, dst = dir .. "/src", dir .. "/dst"
+		assert(fs.mkdir(src))
+		assert(fs.mkdir(dst))
+		common.write(src .. "/f", "f")
+		assert(os.execute("ln -s f '" .. src .. "/l'"))
+		common.write(dst .. "/l", "old")
+		local res = assert(copy(src, dst))
+		assert(res.errors == 0, res.errors)
+		assert(fs.link_info(dst .. "/l").target == "f")
+		res = assert(copy(src, dst))
+		assert(res.errors == 0, res.errors)
+	end },
+})
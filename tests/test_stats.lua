@@ -0,0 +1,20 @@
+-- stats() counters across reopening the module.
+local common = require "common"
+
+common.run("stats", {
+	{ "functions of an earlier open keep counting", function(dir)
+		local old = require "eli.fs.extra"
+		old.reset_stats()
+		package.loaded["eli.fs.extra"] = nil
+		local fs = require "eli.fs.extra"
+		assert(fs ~= old)
+		old = { link_info = old.link_info }
+		collectgarbage()
+		collectgarbage()
+		for _ = 1, 3 do old.link_info(dir) end
+		fs.link_info(dir)
+		local stats = fs.stats()
+		assert(stats.link_info and stats.link_info.calls == 4,
+			"calls " .. tostring(stats.link_info and stats.link_info.calls))
+	end },
+})
@@ -0,0 +1,152 @@
+-- tar_unpack against crafted archives, which must be refused promptly
+-- without reading outside its buffers, and against archives repeating
+-- paths or linking through their own symlinks.
+local fs = require "eli.fs.extra"
+local common = require "common"
+
+local function octal(value, size)
+	return string.format("%0" .. (size - 1) .. "o", value) .. "\0"
+end
+
+-- ustar header block, size may be given as a raw 12 byte field
+local function header(name, typeflag, size, linkname)
+	linkname = linkname or ""
+	local size_field = type(size) == "string" and size or octal(size, 12)
+	local fields = {
+		name .. string.rep("\0", 100 - #name),
+		octal(420, 8), octal(0, 8), octal(0, 8),
+		size_field,
+		octal(0, 12),
+		"        ", -- checksum counted as spaces
+		typeflag,
+		linkname .. string.rep("\0", 100 - #linkname),
+		"ustar\0", "00",
+		string.rep("\0", 32), string.rep("\0", 32),
+		string.rep("\0", 8), string.rep("\0", 8),
+		string.rep("\0", 155), string.rep("\0", 12),
+	}
+	local block = table.concat(fields)
+	assert(#block == 512)
+	local sum = 0
+	for i = 1, #block do sum = sum + block:byte(i) end
+	return block:sub(1, 148) .. string.format("%06o\0 ", sum) .. block:sub(157)
+end
+
+local function padded(data)
+	return data .. string.rep("\0", (512 - #data % 512) % 512)
+end
+
+-- "<length> key=value\n" with the length counting its own digits
+local function record(keyvalue)
+	local len = #keyvalue + 2
+	while #tostring(len) + #keyvalue + 2 ~= len do len = len + 1 end
+	return len .. " " .. keyvalue .. "\n"
+end
+
+local function pax(records)
+	return header("PaxHeader", "x", #records) .. padded(records)
+end
+
+-- a member following the crafted part, so looping back is noticed
+local function archive(dir, crafted)
+	local path = dir .. "/crafted.tar"
+	common.write(path, crafted .. header("after", "0", 5) .. padded("after") .. string.rep("\0", 1024))
+	return path
+end
+
+local function file(name, data)
+	return header(name, "0", #data) .. padded(data)
+end
+
+local function finished(members)
+	return members .. string.rep("\0", 1024)
+end
+
+-- unpacks path through a fifo, so it is read as a stream
+local function unpack_stream(path, dst, opts)
+	local fifo = path .. ".fifo"
+	assert(os.execute("mkfifo '" .. fifo .. "'"))
+	assert(os.execute("cat '" .. path .. "' > '" .. fifo .. "' &"))
+	local f = assert(io.open(fifo, "rb"))
+	local res, err = fs.tar_unpack(f, dst, opts)
+	f:close()
+	os.remove(fifo)
+	return res, err
+end
+
+local function refused(path, dir)
+	local res, err = fs.tar_unpack(path, dir .. "/out")
+	assert(res == nil, "archive was accepted")
+	assert(err:find("Invalid argument"), err)
+	assert(common.read(dir .. "/out/after") == nil, "member after the crafted header was extracted")
+end
+
+common.run("tar", {
+	{ "negative pax record length", function(dir)
+		-- -offset wraps pos + rec around to 0
+		local first = record("path=abcdefgh")
+		refused(archive(dir, pax(first .. "-" .. #first .. " x\n")), dir)
+		refused(archive(dir, pax("-10 path=x\n")), dir)
+	end },
+	{ "pax record length with sign or blanks", function(dir)
+		refused(archive(dir, pax("+13 path=abc\n")), dir)
+		refused(archive(dir, pax(" 13 path=abc\n")), dir)
+	end },
+	{ "pax record longer than header", function(dir)
+		refused(archive(dir, pax("99999999999999999999999 path=x\n")), dir)
+	end },
+	{ "negative pax size", function(dir)
+		refused(archive(dir, pax(record("size=-1536")) .. header("a", "0", 0)), dir)
+	end },
+	{ "pax size above off_t", function(dir)
+		refused(archive(dir, pax(record("size=99999999999999999999999")) .. header("a", "0", 0)), dir)
+	end },
+	{ "negative base-256 size", function(dir)
+		refused(archive(dir, header("a", "0", "\xff" .. string.rep("\xff", 8) .. "\xfa\x00\x00")), dir)
+	end },
+	{ "oversized base-256 size", function(dir)
+		refused(archive(dir, header("a", "0", "\x80" .. string.rep("\xff", 11))), dir)
+	end },
+	{ "later member of a path wins", function(dir)
+		local path = dir .. "/dup.tar"
+		common.write(path, finished(file("a", "first") .. file("b", "kept") .. file("a", "second")
+			.. header("l", "2", 0, "a") .. header("l", "2", 0, "b")))
+		for _, unpack in ipairs({ fs.tar_unpack, unpack_stream }) do
+			local out = dir .. "/out" .. _
+			local res = assert(unpack(path, out))
+			assert(common.read(out .. "/a") == "second")
+			assert(common.read(out .. "/l") == "kept")
+			assert(res.symlinks == 1, res.symlinks)
+			-- files existing before still need overwrite
+			local _, err = unpack(path, out)
+			assert(err:find("File exists"), err)
+			assert(unpack(path, out, { overwrite = true }))
+			assert(common.read(out .. "/a") == "second")
+		end
+	end },
+	{ "hard link to an archived symlink", function(dir)
+		local path = dir .. "/links.tar"
+		common.write(path, finished(file("f", "data") .. header("s", "2", 0, "f") .. header("h", "1", 0, "s")))
+		local res = assert(fs.tar_unpack(path, dir .. "/out"))
+		assert(res.symlinks == 1 and res.hardlinks == 1)
+		assert(fs.link_info(dir .. "/out/h").mode == "link")
+		assert(common.read(dir .. "/out/h") == "data")
+	end },
+	{ "links through an archived symlink", function(dir)
+		local outside = dir .. "/outside"
+		assert(fs.mkdir(outside))
+		common.write(outside .. "/secret", "secret")
+		local path = dir .. "/escape.tar"
+		common.write(path, finished(header("s", "2", 0, outside) .. header("x", "1", 0, "s/secret")))
+		local res, err = fs.tar_unpack(path, dir .. "/out")
+		assert(res == nil, "hard link through a symlink was created")
+		assert(fs.link_info(dir .. "/out/x") == nil, err)
+	end },
+	{ "plain archive still unpacks", function(dir)
+		local res = assert(fs.tar_unpack(archive(dir, pax(record("path=named")) .. header("x", "0", 2) .. padded("hi")),
+			dir .. "/out"))
+		assert(res.files == 2, res.files)
+		assert(common.read(dir .. "/out/named") == "hi")
+		assert(common.read(dir .. "/out/after") == "after")
+	end },
+})
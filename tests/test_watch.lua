@@ -0,0 +1,23 @@
+-- watch() reporting paths which keep changing within the debounce window.
+local fs = require "eli.fs.extra"
+local common = require "common"
+
+common.run("watch", {
+	{ "busy path is reported within max latency", function(dir)
+		local w = assert(fs.watch(dir, { debounce_ms = 100, max_latency_ms = 200 }))
+		local path = dir .. "/busy"
+		common.write(path, "")
+		local seen = 0
+		-- a write every 20 ms for about 600 ms, read() doubles as the sleep
+		for i = 1, 30 do
+			local f = assert(io.open(path, "ab"))
+			f:write(i)
+			f:close()
+			for _, ev in ipairs(assert(w:read(20))) do
+				if ev.path == path then seen = seen + 1 end
+			end
+		end
+		w:close()
+		assert(seen >= 2, "events while the path kept changing: " .. seen)
+	end },
+})